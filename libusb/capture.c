@@ -0,0 +1,511 @@
+/*
+ * Transfer capture for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "libusbi.h"
+
+/**
+ * @defgroup capture Transfer capture
+ *
+ * libusbx can record the transfers of a context to a capture file, much like
+ * usbmon does for a whole bus on Linux, but without requiring any privilege
+ * and without capturing the traffic of other processes.
+ *
+ * Each submission and each completion of a transfer is recorded with its
+ * setup packet, endpoint, status and lengths, along with the first bytes of
+ * the data it carries. The file uses the pcap format with the Linux usbmon
+ * link type, and can be opened with Wireshark or tcpdump.
+ *
+ * Records are built in memory by the threads submitting and completing
+ * transfers, and written to the file by a background thread, so that
+ * capturing can be left running on a busy context. If the records are
+ * produced faster than they can be written, the excess is dropped, and the
+ * number of records dropped is reported when the capture is stopped.
+ *
+ * The isochronous packet descriptors are not recorded; the data of an
+ * isochronous transfer is captured as one contiguous block.
+ */
+
+/* the capture buffer is a ring of chunks. the chunk at head is filled by the
+ * threads recording transfers, the chunks from tail up to head are full and
+ * waiting for the capture thread to write them */
+#define USBI_CAPTURE_CHUNKS		8
+#define USBI_CAPTURE_CHUNK_SIZE		(128 * 1024)
+
+/* a chunk that is not full is written after this many seconds anyway */
+#define USBI_CAPTURE_FLUSH_INTERVAL	1
+
+/* pcap link type of the usbmon binary format with a 64 byte header */
+#define PCAP_LINKTYPE_USB_LINUX_MMAPPED	220
+
+/* usbmon transfer types */
+#define USBMON_ISO		0
+#define USBMON_INTERRUPT	1
+#define USBMON_CONTROL		2
+#define USBMON_BULK		3
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record_header {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+/* struct usbmon_packet of the Linux kernel, in host order */
+struct usbmon_header {
+	uint64_t id;
+	uint8_t type;
+	uint8_t xfer_type;
+	uint8_t epnum;
+	uint8_t devnum;
+	uint16_t busnum;
+	int8_t flag_setup;
+	int8_t flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	union {
+		uint8_t setup[8];
+		struct {
+			int32_t error_count;
+			int32_t numdesc;
+		} iso;
+	} s;
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;
+};
+
+#define CAPTURE_RECORD_HEADER_SIZE \
+	(sizeof(struct pcap_record_header) + sizeof(struct usbmon_header))
+
+/* largest amount of data captured per transfer */
+#define USBI_CAPTURE_MAX_SNAPLEN \
+	(USBI_CAPTURE_CHUNK_SIZE - CAPTURE_RECORD_HEADER_SIZE)
+
+struct usbi_capture {
+	FILE *file;
+	unsigned int snaplen;
+	unsigned char *chunks;
+	size_t fill[USBI_CAPTURE_CHUNKS];
+	int head;
+	int tail;
+	int stop;
+	unsigned long dropped;
+	usbi_cond_t cond;
+	usbi_thread_t thread;
+};
+
+#define CAPTURE_CHUNK(capture, i) \
+	((capture)->chunks + (size_t)(i) * USBI_CAPTURE_CHUNK_SIZE)
+#define CAPTURE_NEXT(i)	(((i) + 1) % USBI_CAPTURE_CHUNKS)
+
+/* the negative errno values that usbmon reports, which are the same on all
+ * platforms as far as the capture file is concerned */
+static int32_t usbmon_status(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return -110;	/* ETIMEDOUT */
+	case LIBUSB_TRANSFER_CANCELLED:
+		return -2;	/* ENOENT */
+	case LIBUSB_TRANSFER_STALL:
+		return -32;	/* EPIPE */
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return -19;	/* ENODEV */
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return -75;	/* EOVERFLOW */
+	default:
+		return -71;	/* EPROTO */
+	}
+}
+
+static uint8_t usbmon_xfer_type(uint8_t type)
+{
+	switch (type) {
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		return USBMON_ISO;
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		return USBMON_INTERRUPT;
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		return USBMON_CONTROL;
+	default:
+		return USBMON_BULK;
+	}
+}
+
+/* builds the record of a transfer event into buf, which has room for the
+ * headers and snaplen bytes of data. returns the size of the record */
+static size_t build_record(unsigned char *buf, unsigned int snaplen,
+	struct libusb_transfer *transfer, char type, int32_t status)
+{
+	struct pcap_record_header *rec = (struct pcap_record_header *) buf;
+	struct usbmon_header *hdr =
+		(struct usbmon_header *) (buf + sizeof(*rec));
+	struct libusb_device *dev = transfer->dev_handle->dev;
+	unsigned char *data = transfer->buffer;
+	int in = (transfer->endpoint & LIBUSB_ENDPOINT_IN) != 0;
+	struct timeval now;
+	uint32_t length;
+	uint32_t captured = 0;
+	int i;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->id = (uint64_t)(uintptr_t) transfer;
+	hdr->type = (uint8_t) type;
+	hdr->xfer_type = usbmon_xfer_type(transfer->type);
+	hdr->epnum = transfer->endpoint;
+	hdr->devnum = dev->device_address;
+	hdr->busnum = dev->bus_number;
+	hdr->status = status;
+	hdr->flag_setup = '-';
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		struct libusb_control_setup *setup = (struct libusb_control_setup *) data;
+
+		/* the direction of a control transfer is in its setup packet */
+		in = (setup->bmRequestType & LIBUSB_ENDPOINT_IN) != 0;
+		hdr->epnum = in ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT;
+		if (type == 'S') {
+			memcpy(hdr->s.setup, data, LIBUSB_CONTROL_SETUP_SIZE);
+			hdr->flag_setup = 0;
+		}
+		data += LIBUSB_CONTROL_SETUP_SIZE;
+	} else if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		hdr->s.iso.numdesc = transfer->num_iso_packets;
+		if (type == 'C')
+			for (i = 0; i < transfer->num_iso_packets; i++)
+				if (transfer->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED)
+					hdr->s.iso.error_count++;
+	}
+
+	if (type == 'S') {
+		length = transfer->length;
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			length -= LIBUSB_CONTROL_SETUP_SIZE;
+	} else if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		length = 0;
+		for (i = 0; i < transfer->num_iso_packets; i++)
+			length += transfer->iso_packet_desc[i].actual_length;
+	} else {
+		length = type == 'C' ? transfer->actual_length : 0;
+	}
+	hdr->length = length;
+
+	/* like usbmon, the data goes out with the submission and comes in with
+	 * the completion */
+	if (length && in == (type == 'C')) {
+		captured = length < snaplen ? length : snaplen;
+		memcpy(buf + CAPTURE_RECORD_HEADER_SIZE, data, captured);
+		hdr->flag_data = 0;
+	} else {
+		hdr->flag_data = in ? '<' : '>';
+	}
+	hdr->len_cap = captured;
+
+	usbi_gettimeofday(&now, NULL);
+	hdr->ts_sec = now.tv_sec;
+	hdr->ts_usec = now.tv_usec;
+	rec->ts_sec = (uint32_t) now.tv_sec;
+	rec->ts_usec = (uint32_t) now.tv_usec;
+	rec->incl_len = sizeof(*hdr) + captured;
+	rec->orig_len = sizeof(*hdr) + length;
+
+	return CAPTURE_RECORD_HEADER_SIZE + captured;
+}
+
+/* record a transfer event. type is 'S' for a submission, 'C' for a
+ * completion and 'E' for a submission that failed */
+static void capture_transfer(struct libusb_context *ctx,
+	struct libusb_transfer *transfer, char type, int32_t status)
+{
+	struct usbi_capture *capture;
+	size_t need;
+
+	usbi_mutex_lock(&ctx->capture_lock);
+	capture = ctx->capture;
+	if (!capture || capture->stop)
+		goto out;
+
+	need = CAPTURE_RECORD_HEADER_SIZE + capture->snaplen;
+	if (capture->fill[capture->head] + need > USBI_CAPTURE_CHUNK_SIZE) {
+		if (CAPTURE_NEXT(capture->head) == capture->tail) {
+			capture->dropped++;
+			goto out;
+		}
+		capture->head = CAPTURE_NEXT(capture->head);
+		capture->fill[capture->head] = 0;
+		usbi_cond_signal(&capture->cond);
+	}
+
+	capture->fill[capture->head] += build_record(
+		CAPTURE_CHUNK(capture, capture->head) + capture->fill[capture->head],
+		capture->snaplen, transfer, type, status);
+
+out:
+	usbi_mutex_unlock(&ctx->capture_lock);
+}
+
+void usbi_capture_submit(struct libusb_context *ctx,
+	struct libusb_transfer *transfer)
+{
+	capture_transfer(ctx, transfer, 'S', -115);	/* EINPROGRESS */
+}
+
+void usbi_capture_submit_error(struct libusb_context *ctx,
+	struct libusb_transfer *transfer, int error)
+{
+	int32_t status;
+
+	switch (error) {
+	case LIBUSB_ERROR_NO_DEVICE:
+		status = -19;	/* ENODEV */
+		break;
+	case LIBUSB_ERROR_BUSY:
+		status = -16;	/* EBUSY */
+		break;
+	case LIBUSB_ERROR_INVALID_PARAM:
+		status = -22;	/* EINVAL */
+		break;
+	case LIBUSB_ERROR_NO_MEM:
+		status = -12;	/* ENOMEM */
+		break;
+	default:
+		status = -71;	/* EPROTO */
+		break;
+	}
+	capture_transfer(ctx, transfer, 'E', status);
+}
+
+void usbi_capture_completion(struct libusb_context *ctx,
+	struct libusb_transfer *transfer)
+{
+	capture_transfer(ctx, transfer, 'C', usbmon_status(transfer->status));
+}
+
+static void *capture_thread_main(void *arg)
+{
+	struct libusb_context *ctx = arg;
+	struct usbi_capture *capture = ctx->capture;
+	struct timespec deadline;
+	int timed_out = 0;
+	int chunk;
+
+	usbi_mutex_lock(&ctx->capture_lock);
+	while (1) {
+		if (capture->tail == capture->head) {
+			if ((capture->stop || timed_out) && capture->fill[capture->head]) {
+				/* write out the chunk being filled */
+				capture->head = CAPTURE_NEXT(capture->head);
+				capture->fill[capture->head] = 0;
+			} else if (capture->stop) {
+				break;
+			} else {
+				usbi_backend->clock_gettime(USBI_CLOCK_REALTIME, &deadline);
+				deadline.tv_sec += USBI_CAPTURE_FLUSH_INTERVAL;
+				timed_out = usbi_cond_timedwait(&capture->cond,
+					&ctx->capture_lock, &deadline) == ETIMEDOUT;
+				continue;
+			}
+		}
+
+		/* the chunk at tail is left alone by the recording threads until
+		 * tail moves, so it is written without the lock */
+		chunk = capture->tail;
+		usbi_mutex_unlock(&ctx->capture_lock);
+		if (fwrite(CAPTURE_CHUNK(capture, chunk), 1, capture->fill[chunk],
+				capture->file) != capture->fill[chunk]
+				|| fflush(capture->file) != 0)
+			usbi_err(ctx, "failed to write capture file, error %d", errno);
+		usbi_mutex_lock(&ctx->capture_lock);
+		capture->tail = CAPTURE_NEXT(chunk);
+		timed_out = 0;
+	}
+	usbi_mutex_unlock(&ctx->capture_lock);
+
+	return NULL;
+}
+
+static void free_capture(struct usbi_capture *capture)
+{
+	if (capture->file)
+		fclose(capture->file);
+	free(capture->chunks);
+	free(capture);
+}
+
+/** \ingroup capture
+ * Start recording the transfers of a context to a capture file. The file is
+ * truncated if it exists.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param path the path of the capture file
+ * \param snaplen the number of data bytes to record per transfer event, at
+ * most. 0 only records the headers. Larger values are reduced to what the
+ * capture buffer can hold, about 128 kB.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if a capture is already running on the context
+ * \returns LIBUSB_ERROR_IO if the file could not be created
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_OTHER if the capture thread could not be started
+ * \see libusb_stop_capture()
+ */
+int API_EXPORTED libusb_start_capture(libusb_context *ctx, const char *path,
+	unsigned int snaplen)
+{
+	struct pcap_file_header header;
+	struct usbi_capture *capture;
+	int r;
+
+	USBI_GET_CONTEXT(ctx);
+
+	if (snaplen > USBI_CAPTURE_MAX_SNAPLEN)
+		snaplen = USBI_CAPTURE_MAX_SNAPLEN;
+
+	/* reserve the context's capture before touching the file, which may
+	 * be the one a running capture writes to */
+	usbi_mutex_lock(&ctx->capture_lock);
+	if (ctx->capture || ctx->capture_starting) {
+		usbi_mutex_unlock(&ctx->capture_lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+	ctx->capture_starting = 1;
+	usbi_mutex_unlock(&ctx->capture_lock);
+
+	capture = calloc(1, sizeof(*capture));
+	if (!capture) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto err_unreserve;
+	}
+	capture->snaplen = snaplen;
+	capture->chunks = malloc((size_t) USBI_CAPTURE_CHUNKS * USBI_CAPTURE_CHUNK_SIZE);
+	if (!capture->chunks) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto err_free_capture;
+	}
+
+	capture->file = fopen(path, "wb");
+	if (!capture->file) {
+		usbi_err(ctx, "failed to create capture file %s, error %d", path, errno);
+		r = LIBUSB_ERROR_IO;
+		goto err_free_capture;
+	}
+
+	header.magic = 0xa1b2c3d4;
+	header.version_major = 2;
+	header.version_minor = 4;
+	header.thiszone = 0;
+	header.sigfigs = 0;
+	header.snaplen = sizeof(struct usbmon_header) + snaplen;
+	header.linktype = PCAP_LINKTYPE_USB_LINUX_MMAPPED;
+	if (fwrite(&header, sizeof(header), 1, capture->file) != 1) {
+		usbi_err(ctx, "failed to write capture file %s, error %d", path, errno);
+		r = LIBUSB_ERROR_IO;
+		goto err_free_capture;
+	}
+
+	usbi_cond_init(&capture->cond, NULL);
+
+	usbi_mutex_lock(&ctx->capture_lock);
+	ctx->capture = capture;
+	r = usbi_thread_create(&capture->thread, capture_thread_main, ctx);
+	if (r != 0)
+		ctx->capture = NULL;
+	ctx->capture_starting = 0;
+	usbi_mutex_unlock(&ctx->capture_lock);
+
+	if (r != 0) {
+		usbi_err(ctx, "failed to start capture thread, error %d", r);
+		usbi_cond_destroy(&capture->cond);
+		free_capture(capture);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	usbi_dbg("capturing to %s, snaplen %u", path, snaplen);
+	return 0;
+
+err_free_capture:
+	free_capture(capture);
+err_unreserve:
+	usbi_mutex_lock(&ctx->capture_lock);
+	ctx->capture_starting = 0;
+	usbi_mutex_unlock(&ctx->capture_lock);
+	return r;
+}
+
+/** \ingroup capture
+ * Stop recording transfers, write out what was recorded so far and close
+ * the capture file. Does nothing if no capture is running on the context.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \see libusb_start_capture()
+ */
+void API_EXPORTED libusb_stop_capture(libusb_context *ctx)
+{
+	struct usbi_capture *capture;
+	usbi_thread_t thread;
+
+	USBI_GET_CONTEXT(ctx);
+
+	usbi_mutex_lock(&ctx->capture_lock);
+	capture = ctx->capture;
+	if (!capture || capture->stop) {
+		usbi_mutex_unlock(&ctx->capture_lock);
+		return;
+	}
+	capture->stop = 1;
+	thread = capture->thread;
+	usbi_cond_signal(&capture->cond);
+	usbi_mutex_unlock(&ctx->capture_lock);
+
+	usbi_thread_join(thread);
+
+	/* the thread has written everything recorded before it stopped */
+	usbi_mutex_lock(&ctx->capture_lock);
+	ctx->capture = NULL;
+	usbi_mutex_unlock(&ctx->capture_lock);
+
+	if (capture->dropped)
+		usbi_warn(ctx, "%lu capture records dropped", capture->dropped);
+	usbi_cond_destroy(&capture->cond);
+	free_capture(capture);
+}
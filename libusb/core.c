@@ -33,6 +33,10 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#if !defined(OS_WINDOWS) && !defined(OS_WINCE)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #ifdef __ANDROID__
 #include <android/log.h>
@@ -41,7 +45,9 @@
 #include "libusbi.h"
 #include "hotplug.h"
 
-#if defined(OS_LINUX)
+#if defined(OS_NULL)
+const struct usbi_os_backend * const usbi_backend = &null_backend;
+#elif defined(OS_LINUX)
 const struct usbi_os_backend * const usbi_backend = &linux_usbfs_backend;
 #elif defined(OS_DARWIN)
 const struct usbi_os_backend * const usbi_backend = &darwin_backend;
@@ -63,6 +69,8 @@ static int default_context_refcnt = 0;
 static usbi_mutex_static_t default_context_lock = USBI_MUTEX_INITIALIZER;
 static struct timeval timestamp_origin = { 0, 0 };
 
+static void log_ring_stop(struct libusb_context *ctx);
+
 usbi_mutex_static_t active_contexts_lock = USBI_MUTEX_INITIALIZER;
 struct list_head active_contexts_list;
 
@@ -312,6 +320,20 @@ if (cfg != desired)
  * reference count goes from 0 to 1, and is deinitialized and destroyed when
  * its reference count goes from 1 to 0.
  *
+ * A context normally deals with every device of the system. Applications
+ * which split their devices over several contexts, for example to handle
+ * the events of each group of devices on its own thread, can create them
+ * with libusb_init_scoped() so that each context only enumerates and
+ * tracks the devices on a given bus, port subtree or with a given vendor
+ * and product ID. A scope can also leave out every device, for applications
+ * which are handed the device they use and pass it to libusb_wrap_fd() or
+ * libusb_open_path(), so that creating the context costs the same however
+ * many devices are attached.
+ *
+ * Short-lived programs which may not use a device at all can create their
+ * context with libusb_init_with_flags() and \ref LIBUSB_INIT_LAZY, so that
+ * the devices are only enumerated once something asks for them.
+ *
  * You may be wondering why only a subset of libusbx functions require a
  * context pointer in their function definition. Internally, libusbx stores
  * context pointers in other objects (e.g. libusb_device instances) and hence
@@ -538,6 +560,9 @@ void usbi_connect_device(struct libusb_device *dev)
 
 	usbi_mutex_lock(&dev->ctx->usb_devs_lock);
 	list_add(&dev->list, &dev->ctx->usb_devs);
+	list_add(&dev->hash_list,
+		&dev->ctx->usb_devs_hash[USBI_DEVICE_HASH(dev->session_data)]);
+	dev->ctx->device_generation++;
 	usbi_mutex_unlock(&dev->ctx->usb_devs_lock);
 
 	/* Signal that an event has occurred for this device if we support hotplug AND
@@ -577,6 +602,8 @@ void usbi_disconnect_device(struct libusb_device *dev)
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_del(&dev->list);
+	list_del(&dev->hash_list);
+	ctx->device_generation++;
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
 }
 
@@ -603,6 +630,68 @@ int usbi_sanitize_device(struct libusb_device *dev)
 	return 0;
 }
 
+/* Check whether a device at the given location can be in the scope of a
+ * context, before anything else is known about it. Devices at or below the
+ * port path of the scope match, and so do the hubs above it, which are kept
+ * so that the topology of the subtree remains complete. Returns 1 on a
+ * match. */
+int usbi_scope_match_location(struct libusb_context *ctx, uint8_t bus_number,
+	const uint8_t *port_numbers, int num_port_numbers)
+{
+	const struct usbi_context_scope *scope = &ctx->scope;
+	int i;
+
+	if (!ctx->scoped)
+		return 1;
+	if (scope->no_scan)
+		return 0;
+	if (scope->bus_number >= 0 && bus_number != scope->bus_number)
+		return 0;
+	for (i = 0; i < num_port_numbers && i < scope->num_port_numbers; i++) {
+		if (port_numbers[i] != scope->port_numbers[i])
+			return 0;
+	}
+	return 1;
+}
+
+/* Check whether a device is in the scope of its context, once its location
+ * in the topology and its device descriptor are known. Returns 1 on a
+ * match. */
+int usbi_scope_match_device(struct libusb_device *dev)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+	const struct usbi_context_scope *scope = &ctx->scope;
+	uint8_t port_numbers[USBI_MAX_PORT_DEPTH] = { 0 };
+	int num_port_numbers = 0;
+
+	if (!ctx->scoped)
+		return 1;
+	if (scope->no_scan)
+		return 0;
+
+	if (scope->num_port_numbers) {
+		num_port_numbers = libusb_get_port_numbers(dev, port_numbers,
+			sizeof(port_numbers));
+		if (num_port_numbers < 0)
+			return 0;
+	}
+	if (!usbi_scope_match_location(ctx, dev->bus_number, port_numbers,
+			num_port_numbers))
+		return 0;
+
+	/* a hub leading to the subtree */
+	if (num_port_numbers < scope->num_port_numbers)
+		return 1;
+
+	if (scope->vendor_id >= 0
+			&& dev->device_descriptor.idVendor != scope->vendor_id)
+		return 0;
+	if (scope->product_id >= 0
+			&& dev->device_descriptor.idProduct != scope->product_id)
+		return 0;
+	return 1;
+}
+
 /* Examine libusbx's internal list of known devices, looking for one with
  * a specific session ID. Returns the matching device if it was found, and
  * NULL otherwise. */
@@ -613,7 +702,8 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	struct libusb_device *ret = NULL;
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
-	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device)
+	list_for_each_entry(dev, &ctx->usb_devs_hash[USBI_DEVICE_HASH(session_id)],
+			hash_list, struct libusb_device)
 		if (dev->session_data == session_id) {
 			ret = dev;
 			break;
@@ -623,6 +713,51 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	return ret;
 }
 
+/* initialize the backend of a context created with LIBUSB_INIT_LAZY, if
+ * it was not yet. called by everything which needs devices */
+int usbi_init_backend(struct libusb_context *ctx)
+{
+	int r = 0;
+
+	if (!ctx->lazy_init)
+		return 0;
+
+	usbi_mutex_lock(&ctx->backend_lock);
+	if (ctx->backend_pending) {
+		usbi_dbg("initializing backend");
+		if (usbi_backend->init)
+			r = usbi_backend->init(ctx);
+		if (r == 0)
+			ctx->backend_pending = 0;
+	}
+	usbi_mutex_unlock(&ctx->backend_lock);
+	return r;
+}
+
+/* have a backend without hotplug support list the devices, and drop those
+ * outside of the scope of the context */
+static int get_backend_device_list(struct libusb_context *ctx,
+	struct discovered_devs **discdevs)
+{
+	struct discovered_devs *devs;
+	size_t i, len = 0;
+	int r;
+
+	r = usbi_backend->get_device_list(ctx, discdevs);
+	if (r < 0 || !ctx->scoped)
+		return r;
+
+	devs = *discdevs;
+	for (i = 0; i < devs->len; i++) {
+		if (usbi_scope_match_device(devs->devices[i]))
+			devs->devices[len++] = devs->devices[i];
+		else
+			libusb_unref_device(devs->devices[i]);
+	}
+	devs->len = len;
+	return r;
+}
+
 /** @ingroup dev
  * Returns a list of USB devices currently attached to the system. This is
  * your entry point into finding a USB device to operate.
@@ -656,6 +791,12 @@ ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
 	if (!discdevs)
 		return LIBUSB_ERROR_NO_MEM;
 
+	r = usbi_init_backend(ctx);
+	if (r < 0) {
+		len = r;
+		goto out;
+	}
+
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 		/* backend provides hotplug support */
 		struct libusb_device *dev;
@@ -675,7 +816,7 @@ ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
 		usbi_mutex_unlock(&ctx->usb_devs_lock);
 	} else {
 		/* backend does not provide hotplug support */
-		r = usbi_backend->get_device_list(ctx, &discdevs);
+		r = get_backend_device_list(ctx, &discdevs);
 	}
 
 	if (r < 0) {
@@ -703,6 +844,241 @@ out:
 	return len;
 }
 
+/* a read-only device list, see libusb_get_device_snapshot() */
+struct libusb_device_snapshot {
+	struct libusb_context *ctx;
+	/* protected by the context's usb_devs_lock */
+	int refcnt;
+	uint32_t generation;
+	ssize_t len;
+	/* NULL-terminated, with a reference to each device */
+	struct libusb_device *devices
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
+	[] /* valid C99 code */
+#else
+	[0] /* non-standard, but usually working code */
+#endif
+	;
+};
+
+static struct libusb_device_snapshot *alloc_snapshot(
+	struct libusb_context *ctx, size_t len)
+{
+	struct libusb_device_snapshot *snapshot =
+		malloc(sizeof(*snapshot) + (len + 1) * sizeof(struct libusb_device *));
+
+	if (!snapshot)
+		return NULL;
+	snapshot->ctx = ctx;
+	snapshot->refcnt = 1;
+	snapshot->len = 0;
+	snapshot->devices[0] = NULL;
+	return snapshot;
+}
+
+/** \ingroup dev
+ * Returns the generation of a context's device list. The generation changes
+ * whenever a device is added to or removed from the list, so comparing it
+ * with a previously returned value is a cheap way of finding out whether
+ * libusb_get_device_list() would return something different.
+ *
+ * On platforms without hotplug support (see \ref LIBUSB_CAP_HAS_HOTPLUG),
+ * devices are only discovered while a device list is being built, so the
+ * generation does not change in between.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns the current generation of the device list
+ */
+uint32_t API_EXPORTED libusb_get_device_generation(libusb_context *ctx)
+{
+	uint32_t generation;
+
+	USBI_GET_CONTEXT(ctx);
+	if (usbi_init_backend(ctx) < 0)
+		usbi_warn(ctx, "backend initialization failed");
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)
+			&& usbi_backend->hotplug_poll)
+		usbi_backend->hotplug_poll();
+
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	generation = ctx->device_generation;
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+	return generation;
+}
+
+/** \ingroup dev
+ * Obtain a read-only snapshot of the devices currently attached to the
+ * system. This is an alternative to libusb_get_device_list() for
+ * applications which look at the device list often.
+ *
+ * A snapshot holds one reference to each of its devices, which stays valid
+ * for as long as the snapshot is referenced. Snapshots are shared: as long
+ * as the device list has not changed, this function returns the snapshot it
+ * returned before, with its reference count incremented, so getting it
+ * does not allocate anything nor touch each device. The snapshot can also
+ * be passed to other threads with libusb_ref_device_snapshot().
+ *
+ * Release the snapshot with libusb_unref_device_snapshot() when done. Use
+ * libusb_ref_device() on devices you want to keep beyond that.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param snapshot output location for the snapshot
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code on other failure
+ * \see libusb_get_snapshot_devices()
+ */
+int API_EXPORTED libusb_get_device_snapshot(libusb_context *ctx,
+	libusb_device_snapshot **snapshot)
+{
+	struct libusb_device_snapshot *ret;
+	struct libusb_device_snapshot *old = NULL;
+	struct libusb_device *dev;
+	size_t len = 0;
+	int r;
+
+	USBI_GET_CONTEXT(ctx);
+
+	r = usbi_init_backend(ctx);
+	if (r < 0)
+		return r;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		/* the list has to be built by the backend every time */
+		struct discovered_devs *discdevs = discovered_devs_alloc();
+		size_t i;
+
+		if (!discdevs)
+			return LIBUSB_ERROR_NO_MEM;
+		r = get_backend_device_list(ctx, &discdevs);
+		if (r < 0) {
+			discovered_devs_free(discdevs);
+			return r;
+		}
+
+		ret = alloc_snapshot(ctx, discdevs->len);
+		if (!ret) {
+			discovered_devs_free(discdevs);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		for (i = 0; i < discdevs->len; i++)
+			ret->devices[i] = libusb_ref_device(discdevs->devices[i]);
+		ret->devices[i] = NULL;
+		ret->len = (ssize_t)discdevs->len;
+		discovered_devs_free(discdevs);
+
+		usbi_mutex_lock(&ctx->usb_devs_lock);
+		ret->generation = ctx->device_generation;
+		usbi_mutex_unlock(&ctx->usb_devs_lock);
+		*snapshot = ret;
+		return 0;
+	}
+
+	if (usbi_backend->hotplug_poll)
+		usbi_backend->hotplug_poll();
+
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	ret = ctx->device_snapshot;
+	if (ret && ret->generation == ctx->device_generation) {
+		ret->refcnt++;
+		usbi_mutex_unlock(&ctx->usb_devs_lock);
+		*snapshot = ret;
+		return 0;
+	}
+
+	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device)
+		len++;
+	ret = alloc_snapshot(ctx, len);
+	if (!ret) {
+		usbi_mutex_unlock(&ctx->usb_devs_lock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device)
+		ret->devices[ret->len++] = libusb_ref_device(dev);
+	ret->devices[ret->len] = NULL;
+	ret->generation = ctx->device_generation;
+
+	/* one reference for the cache, one for the caller */
+	ret->refcnt = 2;
+	old = ctx->device_snapshot;
+	ctx->device_snapshot = ret;
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+
+	/* unreferencing devices may need usb_devs_lock */
+	libusb_unref_device_snapshot(old);
+	*snapshot = ret;
+	return 0;
+}
+
+/** \ingroup dev
+ * Get the devices of a snapshot obtained with libusb_get_device_snapshot().
+ * The array belongs to the snapshot and is NULL-terminated.
+ *
+ * \param snapshot the snapshot
+ * \param devices output location for the array of devices
+ * \returns the number of devices in the snapshot
+ */
+ssize_t API_EXPORTED libusb_get_snapshot_devices(
+	libusb_device_snapshot *snapshot, libusb_device * const **devices)
+{
+	*devices = snapshot->devices;
+	return snapshot->len;
+}
+
+/** \ingroup dev
+ * Get the device list generation a snapshot was taken at, to compare with
+ * the result of libusb_get_device_generation().
+ *
+ * \param snapshot the snapshot
+ * \returns the generation of the snapshot
+ */
+uint32_t API_EXPORTED libusb_get_snapshot_generation(
+	libusb_device_snapshot *snapshot)
+{
+	return snapshot->generation;
+}
+
+/** \ingroup dev
+ * Increment the reference count of a device snapshot.
+ * \param snapshot the snapshot to reference
+ * \returns the same snapshot
+ */
+DEFAULT_VISIBILITY
+libusb_device_snapshot * LIBUSB_CALL libusb_ref_device_snapshot(
+	libusb_device_snapshot *snapshot)
+{
+	usbi_mutex_lock(&snapshot->ctx->usb_devs_lock);
+	snapshot->refcnt++;
+	usbi_mutex_unlock(&snapshot->ctx->usb_devs_lock);
+	return snapshot;
+}
+
+/** \ingroup dev
+ * Decrement the reference count of a device snapshot. When it reaches 0,
+ * the snapshot is freed and the reference it held to each of its devices is
+ * released.
+ * \param snapshot the snapshot to unreference, may be NULL
+ */
+void API_EXPORTED libusb_unref_device_snapshot(
+	libusb_device_snapshot *snapshot)
+{
+	int refcnt;
+	ssize_t i;
+
+	if (!snapshot)
+		return;
+
+	usbi_mutex_lock(&snapshot->ctx->usb_devs_lock);
+	refcnt = --snapshot->refcnt;
+	usbi_mutex_unlock(&snapshot->ctx->usb_devs_lock);
+	if (refcnt)
+		return;
+
+	for (i = 0; i < snapshot->len; i++)
+		libusb_unref_device(snapshot->devices[i]);
+	free(snapshot);
+}
+
 /** \ingroup dev
  * Frees a list of devices previously discovered using
  * libusb_get_device_list(). If the unref_devices parameter is set, the
@@ -863,6 +1239,111 @@ static const struct libusb_endpoint_descriptor *find_endpoint(
 	return NULL;
 }
 
+/* record a change of the alternate settings of a device, interface_number
+ * being -1 when all interfaces are back to alternate setting 0. the endpoint
+ * tables of all its handles will be rebuilt on next use. callers may hold
+ * the lock of a handle of the device */
+static void update_altsetting(struct libusb_device *dev, int interface_number,
+	int alternate_setting)
+{
+	usbi_mutex_lock(&dev->lock);
+	if (interface_number < 0)
+		memset(dev->altsetting, 0, sizeof(dev->altsetting));
+	else
+		dev->altsetting[interface_number] = (uint8_t)alternate_setting;
+	usbi_mutex_unlock(&dev->lock);
+	usbi_atomic_add(&dev->ep_info_gen, 1);
+}
+
+/* add the endpoints of an alternate setting to an endpoint table, leaving
+ * the entries that are already filled alone */
+static void add_endpoint_info(struct usbi_endpoint_info *table,
+	const struct libusb_interface_descriptor *altsetting)
+{
+	int i;
+
+	for (i = 0; i < altsetting->bNumEndpoints; i++) {
+		const struct libusb_endpoint_descriptor *ep = &altsetting->endpoint[i];
+		struct usbi_endpoint_info *entry =
+			&table[USBI_EP_INDEX(ep->bEndpointAddress)];
+
+		if (entry->bEndpointAddress || !ep->bEndpointAddress)
+			continue;
+		entry->bEndpointAddress = ep->bEndpointAddress;
+		entry->bmAttributes = ep->bmAttributes;
+		entry->wMaxPacketSize = ep->wMaxPacketSize;
+	}
+}
+
+/* look up an endpoint of the active configuration in the endpoint table of a
+ * handle, building the table first if needed. returns 0 if the endpoint was
+ * found, LIBUSB_ERROR_NOT_FOUND if it does not exist, or another
+ * LIBUSB_ERROR code if the configuration could not be retrieved */
+int usbi_get_endpoint_info(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct usbi_endpoint_info *info)
+{
+	struct libusb_device *dev = dev_handle->dev;
+	struct usbi_endpoint_info table[USBI_MAX_ENDPOINTS];
+	uint8_t current[USB_MAXINTERFACES];
+	struct libusb_config_descriptor *config;
+	int idx = USBI_EP_INDEX(endpoint);
+	long gen;
+	int i, j, r;
+
+	/* read before the alternate settings, so that a table built from
+	 * settings that changed meanwhile is never taken as current */
+	gen = usbi_atomic_load(&dev->ep_info_gen);
+	usbi_mutex_lock(&dev_handle->lock);
+	if (dev_handle->ep_info_valid && dev_handle->ep_info_gen == gen) {
+		*info = dev_handle->ep_info[idx];
+		usbi_mutex_unlock(&dev_handle->lock);
+		return info->bEndpointAddress == endpoint ? 0 : LIBUSB_ERROR_NOT_FOUND;
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	usbi_mutex_lock(&dev->lock);
+	memcpy(current, dev->altsetting, sizeof(current));
+	usbi_mutex_unlock(&dev->lock);
+
+	r = libusb_get_active_config_descriptor(dev, &config);
+	if (r < 0)
+		return r;
+
+	/* the current alternate settings come first. endpoints that only exist
+	 * in other alternate settings are then added, the first match winning
+	 * as in find_endpoint() */
+	memset(table, 0, sizeof(table));
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+
+		for (j = 0; j < iface->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *altsetting =
+				&iface->altsetting[j];
+
+			if (altsetting->bInterfaceNumber < USB_MAXINTERFACES
+					&& altsetting->bAlternateSetting ==
+					current[altsetting->bInterfaceNumber])
+				add_endpoint_info(table, altsetting);
+		}
+	}
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+
+		for (j = 0; j < iface->num_altsetting; j++)
+			add_endpoint_info(table, &iface->altsetting[j]);
+	}
+	libusb_free_config_descriptor(config);
+
+	usbi_mutex_lock(&dev_handle->lock);
+	memcpy(dev_handle->ep_info, table, sizeof(table));
+	dev_handle->ep_info_valid = 1;
+	dev_handle->ep_info_gen = gen;
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	*info = table[idx];
+	return info->bEndpointAddress == endpoint ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
 /** \ingroup dev
  * Convenience function to retrieve the wMaxPacketSize value for a particular
  * endpoint in the active device configuration.
@@ -894,8 +1375,10 @@ int API_EXPORTED libusb_get_max_packet_size(libusb_device *dev,
 	}
 
 	ep = find_endpoint(config, endpoint);
-	if (!ep)
+	if (!ep) {
+		libusb_free_config_descriptor(config);
 		return LIBUSB_ERROR_NOT_FOUND;
+	}
 
 	r = ep->wMaxPacketSize;
 	libusb_free_config_descriptor(config);
@@ -945,8 +1428,10 @@ int API_EXPORTED libusb_get_max_iso_packet_size(libusb_device *dev,
 	}
 
 	ep = find_endpoint(config, endpoint);
-	if (!ep)
+	if (!ep) {
+		libusb_free_config_descriptor(config);
 		return LIBUSB_ERROR_NOT_FOUND;
+	}
 
 	val = ep->wMaxPacketSize;
 	ep_type = (enum libusb_transfer_type) (ep->bmAttributes & 0x3);
@@ -993,6 +1478,7 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 		usbi_dbg("destroy device %d.%d", dev->bus_number, dev->device_address);
 
 		libusb_unref_device(dev->parent_dev);
+		usbi_free_config_cache(dev);
 
 		if (usbi_backend->destroy_device)
 			usbi_backend->destroy_device(dev);
@@ -1010,67 +1496,26 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 /*
  * Interrupt the iteration of the event handling thread, so that it picks
  * up the new fd.
+ *
+ * This neither waits for the event handler nor takes the events lock: the
+ * event handler rebuilds its poll set every time it is woken, and with epoll
+ * the interest set is updated in place when the fd is added, so there is
+ * nothing to wake up for at all.
  */
 void usbi_fd_notification(struct libusb_context *ctx)
 {
-	unsigned char dummy = 1;
-	ssize_t r;
-
 	if (ctx == NULL)
 		return;
 
-	/* record that we are messing with poll fds */
-	usbi_mutex_lock(&ctx->pollfd_modify_lock);
-	ctx->pollfd_modify++;
-	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
-
-	/* write some data on control pipe to interrupt event handlers */
-	r = usbi_write(ctx->ctrl_pipe[1], &dummy, sizeof(dummy));
-	if (r <= 0) {
-		usbi_warn(ctx, "internal signalling write failed");
-		usbi_mutex_lock(&ctx->pollfd_modify_lock);
-		ctx->pollfd_modify--;
-		usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	if (usbi_using_epoll(ctx))
 		return;
-	}
-
-	/* take event handling lock */
-	libusb_lock_events(ctx);
-
-	/* read the dummy data */
-	r = usbi_read(ctx->ctrl_pipe[0], &dummy, sizeof(dummy));
-	if (r <= 0)
-		usbi_warn(ctx, "internal signalling read failed");
-
-	/* we're done with modifying poll fds */
-	usbi_mutex_lock(&ctx->pollfd_modify_lock);
-	ctx->pollfd_modify--;
-	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
 
-	/* Release event handling lock and wake up event waiters */
-	libusb_unlock_events(ctx);
+	usbi_signal_event(ctx);
 }
 
-/** \ingroup dev
- * Open a device and obtain a device handle. A handle allows you to perform
- * I/O on the device in question.
- *
- * Internally, this function adds a reference to the device and makes it
- * available to you through libusb_get_device(). This reference is removed
- * during libusb_close().
- *
- * This is a non-blocking function; no requests are sent over the bus.
- *
- * \param dev the device to open
- * \param handle output location for the returned device handle pointer. Only
- * populated when the return code is 0.
- * \returns 0 on success
- * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
- * \returns LIBUSB_ERROR_ACCESS if the user has insufficient permissions
- * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns another LIBUSB_ERROR code on other failure
- */
-int API_EXPORTED libusb_open(libusb_device *dev,
+/* open a handle on dev. when fd is not -1 the backend takes it over instead
+ * of opening the device itself */
+static int open_device(struct libusb_device *dev, int fd,
 	libusb_device_handle **handle)
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
@@ -1092,16 +1537,44 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 		free(_handle);
 		return LIBUSB_ERROR_OTHER;
 	}
+	r = usbi_mutex_init(&_handle->shard_lock, NULL);
+	if (r) {
+		usbi_mutex_destroy(&_handle->lock);
+		free(_handle);
+		return LIBUSB_ERROR_OTHER;
+	}
+	r = usbi_mutex_init(&_handle->flying_lock, NULL);
+	if (r) {
+		usbi_mutex_destroy(&_handle->shard_lock);
+		usbi_mutex_destroy(&_handle->lock);
+		free(_handle);
+		return LIBUSB_ERROR_OTHER;
+	}
+	list_init(&_handle->flying_transfers);
 
 	_handle->dev = libusb_ref_device(dev);
 	_handle->auto_detach_kernel_driver = 0;
 	_handle->claimed_interfaces = 0;
+	_handle->latency = NULL;
+	_handle->shard_pollfd = NULL;
+	_handle->sync_transfer = NULL;
+	_handle->sync_buffer = NULL;
+	_handle->sync_buffer_size = 0;
+	_handle->ep_info_valid = 0;
+	_handle->ep_info_gen = 0;
+	_handle->string_cache = NULL;
+	_handle->bulk_window = 0;
 	memset(&_handle->os_priv, 0, priv_size);
 
-	r = usbi_backend->open(_handle);
+	if (fd < 0)
+		r = usbi_backend->open(_handle);
+	else
+		r = usbi_backend->open_fd(_handle, fd);
 	if (r < 0) {
 		usbi_dbg("open %d.%d returns %d", dev->bus_number, dev->device_address, r);
 		libusb_unref_device(dev);
+		usbi_mutex_destroy(&_handle->flying_lock);
+		usbi_mutex_destroy(&_handle->shard_lock);
 		usbi_mutex_destroy(&_handle->lock);
 		free(_handle);
 		return r;
@@ -1124,26 +1597,161 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 }
 
 /** \ingroup dev
- * Convenience function for finding a device with a particular
- * <tt>idVendor</tt>/<tt>idProduct</tt> combination. This function is intended
- * for those scenarios where you are using libusbx to knock up a quick test
- * application - it allows you to avoid calling libusb_get_device_list() and
- * worrying about traversing/freeing the list.
+ * Open a device and obtain a device handle. A handle allows you to perform
+ * I/O on the device in question.
  *
- * This function has limitations and is hence not intended for use in real
- * applications: if multiple devices have the same IDs it will only
- * give you the first one, etc.
+ * Internally, this function adds a reference to the device and makes it
+ * available to you through libusb_get_device(). This reference is removed
+ * during libusb_close().
  *
- * \param ctx the context to operate on, or NULL for the default context
- * \param vendor_id the idVendor value to search for
- * \param product_id the idProduct value to search for
- * \returns a handle for the first found device, or NULL on error or if the
- * device could not be found. */
-DEFAULT_VISIBILITY
-libusb_device_handle * LIBUSB_CALL libusb_open_device_with_vid_pid(
-	libusb_context *ctx, uint16_t vendor_id, uint16_t product_id)
-{
-	struct libusb_device **devs;
+ * This is a non-blocking function; no requests are sent over the bus.
+ *
+ * \param dev the device to open
+ * \param handle output location for the returned device handle pointer. Only
+ * populated when the return code is 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_ACCESS if the user has insufficient permissions
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_open(libusb_device *dev,
+	libusb_device_handle **handle)
+{
+	return open_device(dev, -1, handle);
+}
+
+/** \ingroup dev
+ * Obtain a device handle from a file descriptor the application already
+ * has open on a device, for instance one handed over by a privileged
+ * broker, or inherited from the service manager.
+ *
+ * The device is built from what the descriptor tells about it, without
+ * enumerating the system, so this works even where libusbx cannot see the
+ * other devices. It joins the context like a discovered device: it shows up
+ * in device lists and hotplug disconnect events are delivered for it. If
+ * the context already knows the device, that libusb_device is used.
+ * Combined with a context created by libusb_init_scoped() with
+ * libusb_context_scope::no_scan set, nothing but the given device is ever
+ * looked at.
+ *
+ * On success the handle takes over the file descriptor, which is closed by
+ * libusb_close(). On failure it is left open.
+ *
+ * On Linux, fd must be open read/write on a usbfs device node, as in
+ * /dev/bus/usb/BBB/DDD. The device then has no parent and no port numbers
+ * as far as libusbx is concerned, unless it was also enumerated.
+ *
+ * This is a non-blocking function; the only request sent over the bus is a
+ * GET_CONFIGURATION one if the active configuration is not known.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param fd the open file descriptor of the device
+ * \param handle output location for the returned device handle pointer. Only
+ * populated when the return code is 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if fd is not a USB device
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not support it
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_wrap_fd(libusb_context *ctx, int fd,
+	libusb_device_handle **handle)
+{
+	struct libusb_device *dev;
+	int r;
+	USBI_GET_CONTEXT(ctx);
+
+	if (!usbi_backend->device_from_fd)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	if (fd < 0 || !handle)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	r = usbi_init_backend(ctx);
+	if (r < 0)
+		return r;
+
+	r = usbi_backend->device_from_fd(ctx, fd, &dev);
+	if (r < 0)
+		return r;
+
+	r = open_device(dev, fd, handle);
+	libusb_unref_device(dev);
+	return r;
+}
+
+/** \ingroup dev
+ * Open the device node at the given path and obtain a device handle for it,
+ * without enumerating the system. This is libusb_wrap_fd() on a newly opened
+ * file descriptor, which libusb_close() closes.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param path the device node to open, e.g. /dev/bus/usb/001/004 on Linux
+ * \param handle output location for the returned device handle pointer. Only
+ * populated when the return code is 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_ACCESS if the user has insufficient permissions
+ * \returns LIBUSB_ERROR_NO_DEVICE if there is no such device
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not support it
+ * \returns another LIBUSB_ERROR code on other failure, as for
+ * libusb_wrap_fd()
+ */
+int API_EXPORTED libusb_open_path(libusb_context *ctx, const char *path,
+	libusb_device_handle **handle)
+{
+#if !defined(OS_WINDOWS) && !defined(OS_WINCE)
+	int fd, r;
+	USBI_GET_CONTEXT(ctx);
+
+	if (!usbi_backend->device_from_fd)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	if (!path || !handle)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		usbi_dbg("open %s failed errno=%d", path, errno);
+		if (errno == EACCES || errno == EPERM)
+			return LIBUSB_ERROR_ACCESS;
+		if (errno == ENOENT || errno == ENODEV || errno == ENXIO)
+			return LIBUSB_ERROR_NO_DEVICE;
+		return LIBUSB_ERROR_IO;
+	}
+
+	r = libusb_wrap_fd(ctx, fd, handle);
+	if (r < 0)
+		close(fd);
+	return r;
+#else
+	UNUSED(ctx);
+	UNUSED(path);
+	UNUSED(handle);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup dev
+ * Convenience function for finding a device with a particular
+ * <tt>idVendor</tt>/<tt>idProduct</tt> combination. This function is intended
+ * for those scenarios where you are using libusbx to knock up a quick test
+ * application - it allows you to avoid calling libusb_get_device_list() and
+ * worrying about traversing/freeing the list.
+ *
+ * This function has limitations and is hence not intended for use in real
+ * applications: if multiple devices have the same IDs it will only
+ * give you the first one, etc.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param vendor_id the idVendor value to search for
+ * \param product_id the idProduct value to search for
+ * \returns a handle for the first found device, or NULL on error or if the
+ * device could not be found. */
+DEFAULT_VISIBILITY
+libusb_device_handle * LIBUSB_CALL libusb_open_device_with_vid_pid(
+	libusb_context *ctx, uint16_t vendor_id, uint16_t product_id)
+{
+	struct libusb_device **devs;
 	struct libusb_device *found = NULL;
 	struct libusb_device *dev;
 	struct libusb_device_handle *handle = NULL;
@@ -1184,16 +1792,13 @@ static void do_close(struct libusb_context *ctx,
 	libusb_lock_events(ctx);
 
 	/* remove any transfers in flight that are for this device */
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&dev_handle->flying_lock);
 
 	/* safe iteration because transfers may be being deleted */
-	list_for_each_entry_safe(itransfer, tmp, &ctx->flying_transfers, list, struct usbi_transfer) {
+	list_for_each_entry_safe(itransfer, tmp, &dev_handle->flying_transfers, list, struct usbi_transfer) {
 		struct libusb_transfer *transfer =
 			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
-		if (transfer->dev_handle != dev_handle)
-			continue;
-
 		if (!(itransfer->flags & USBI_TRANSFER_DEVICE_DISAPPEARED)) {
 			usbi_err(ctx, "Device handle closed while transfer was still being processed, but the device is still connected as far as we know");
 
@@ -1208,7 +1813,7 @@ static void do_close(struct libusb_context *ctx,
 		 * (or that such accesses will be easily caught and identified as a crash)
 		 */
 		usbi_mutex_lock(&itransfer->lock);
-		list_del(&itransfer->list);
+		usbi_remove_from_flying_list(itransfer);
 		transfer->dev_handle = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 
@@ -1219,7 +1824,7 @@ static void do_close(struct libusb_context *ctx,
 		usbi_dbg("Removed transfer %p from the in-flight list because device handle %p closed",
 			 transfer, dev_handle);
 	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&dev_handle->flying_lock);
 
 	libusb_unlock_events(ctx);
 
@@ -1227,9 +1832,19 @@ static void do_close(struct libusb_context *ctx,
 	list_del(&dev_handle->list);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 
+	if (dev_handle->sync_transfer)
+		libusb_free_transfer(dev_handle->sync_transfer);
+	free(dev_handle->sync_buffer);
+	usbi_free_string_cache(dev_handle);
+
+	/* the backend removes the handle's fd from the context's poll set */
+	usbi_release_event_shard(dev_handle);
 	usbi_backend->close(dev_handle);
 	libusb_unref_device(dev_handle->dev);
+	usbi_mutex_destroy(&dev_handle->flying_lock);
+	usbi_mutex_destroy(&dev_handle->shard_lock);
 	usbi_mutex_destroy(&dev_handle->lock);
+	free(dev_handle->latency);
 	free(dev_handle);
 }
 
@@ -1247,8 +1862,6 @@ static void do_close(struct libusb_context *ctx,
 void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 {
 	struct libusb_context *ctx;
-	unsigned char dummy = 1;
-	ssize_t r;
 
 	if (!dev_handle)
 		return;
@@ -1256,6 +1869,9 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 
 	ctx = HANDLE_CTX(dev_handle);
 
+	/* completion workers may still have callbacks of the handle to run */
+	usbi_drain_handle_completions(dev_handle);
+
 	/* Similarly to libusb_open(), we want to interrupt all event handlers
 	 * at this point. More importantly, we want to perform the actual close of
 	 * the device while holding the event handling lock (preventing any other
@@ -1267,25 +1883,12 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 	ctx->pollfd_modify++;
 	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
 
-	/* write some data on control pipe to interrupt event handlers */
-	r = usbi_write(ctx->ctrl_pipe[1], &dummy, sizeof(dummy));
-	if (r <= 0) {
-		usbi_warn(ctx, "internal signalling write failed, closing anyway");
-		do_close(ctx, dev_handle);
-		usbi_mutex_lock(&ctx->pollfd_modify_lock);
-		ctx->pollfd_modify--;
-		usbi_mutex_unlock(&ctx->pollfd_modify_lock);
-		return;
-	}
+	/* interrupt event handlers so that one of them gives up the lock */
+	usbi_signal_event(ctx);
 
 	/* take event handling lock */
 	libusb_lock_events(ctx);
 
-	/* read the dummy data */
-	r = usbi_read(ctx->ctrl_pipe[0], &dummy, sizeof(dummy));
-	if (r <= 0)
-		usbi_warn(ctx, "internal signalling read failed, closing anyway");
-
 	/* Close the device */
 	do_close(ctx, dev_handle);
 
@@ -1411,8 +2014,16 @@ int API_EXPORTED libusb_get_configuration(libusb_device_handle *dev,
 int API_EXPORTED libusb_set_configuration(libusb_device_handle *dev,
 	int configuration)
 {
+	int r;
+
 	usbi_dbg("configuration %d", configuration);
-	return usbi_backend->set_configuration(dev, configuration);
+	r = usbi_backend->set_configuration(dev, configuration);
+	if (r == 0) {
+		/* the endpoints will be looked up again on next use */
+		usbi_invalidate_active_config(dev->dev);
+		update_altsetting(dev->dev, -1, 0);
+	}
+	return r;
 }
 
 /** \ingroup dev
@@ -1503,8 +2114,10 @@ int API_EXPORTED libusb_release_interface(libusb_device_handle *dev,
 	}
 
 	r = usbi_backend->release_interface(dev, interface_number);
-	if (r == 0)
+	if (r == 0) {
 		dev->claimed_interfaces &= ~(1 << interface_number);
+		update_altsetting(dev->dev, interface_number, 0);
+	}
 
 out:
 	usbi_mutex_unlock(&dev->lock);
@@ -1535,9 +2148,11 @@ out:
 int API_EXPORTED libusb_set_interface_alt_setting(libusb_device_handle *dev,
 	int interface_number, int alternate_setting)
 {
+	int r;
+
 	usbi_dbg("interface %d altsetting %d",
 		interface_number, alternate_setting);
-	if (interface_number >= USB_MAXINTERFACES)
+	if (interface_number < 0 || interface_number >= USB_MAXINTERFACES)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
 	usbi_mutex_lock(&dev->lock);
@@ -1552,8 +2167,11 @@ int API_EXPORTED libusb_set_interface_alt_setting(libusb_device_handle *dev,
 	}
 	usbi_mutex_unlock(&dev->lock);
 
-	return usbi_backend->set_interface_altsetting(dev, interface_number,
+	r = usbi_backend->set_interface_altsetting(dev, interface_number,
 		alternate_setting);
+	if (r == 0)
+		update_altsetting(dev->dev, interface_number, alternate_setting);
+	return r;
 }
 
 /** \ingroup dev
@@ -1603,11 +2221,164 @@ int API_EXPORTED libusb_clear_halt(libusb_device_handle *dev,
  */
 int API_EXPORTED libusb_reset_device(libusb_device_handle *dev)
 {
+	int r;
+
 	usbi_dbg("");
 	if (!dev->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	return usbi_backend->reset_device(dev);
+	r = usbi_backend->reset_device(dev);
+	if (r == 0)
+		update_altsetting(dev->dev, -1, 0);
+	return r;
+}
+
+/** \ingroup dev
+ * Allocate up to num_streams USB bulk streams on the specified endpoints. This
+ * function takes an array of endpoints rather than a single endpoint because
+ * some protocols require that endpoints are setup with similar stream ids.
+ * All endpoints passed in must belong to the same interface.
+ *
+ * Note this function may return less streams than requested. Also note that
+ * the same number of streams is allocated for each endpoint in the endpoint
+ * array.
+ *
+ * Stream id 0 is reserved, and should not be used to communicate with devices.
+ * If libusb_alloc_streams() returns with a value of N, you may use stream ids
+ * 1 to N. Transfers are routed to a stream with
+ * libusb_transfer_set_stream_id() on a transfer of type
+ * \ref libusb_transfer_type::LIBUSB_TRANSFER_TYPE_BULK_STREAM
+ * "LIBUSB_TRANSFER_TYPE_BULK_STREAM".
+ *
+ * This is a blocking function.
+ *
+ * \param dev a device handle
+ * \param num_streams number of streams to try to allocate
+ * \param endpoints array of endpoints to allocate streams on
+ * \param num_endpoints length of the endpoints array
+ * \returns number of streams allocated, or a LIBUSB_ERROR code on failure
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform or device does not
+ * support bulk streams
+ */
+int API_EXPORTED libusb_alloc_streams(libusb_device_handle *dev,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints)
+{
+	usbi_dbg("streams %u eps %d", (unsigned) num_streams, num_endpoints);
+
+	if (!dev->dev->attached)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	if (usbi_backend->alloc_streams)
+		return usbi_backend->alloc_streams(dev, num_streams, endpoints,
+						   num_endpoints);
+	else
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+/** \ingroup dev
+ * Free usb bulk streams allocated with libusb_alloc_streams().
+ *
+ * Note streams are automatically free-ed when releasing an interface.
+ *
+ * This is a blocking function.
+ *
+ * \param dev a device handle
+ * \param endpoints array of endpoints to free streams on
+ * \param num_endpoints length of the endpoints array
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_free_streams(libusb_device_handle *dev,
+	unsigned char *endpoints, int num_endpoints)
+{
+	usbi_dbg("eps %d", num_endpoints);
+
+	if (!dev->dev->attached)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	if (usbi_backend->free_streams)
+		return usbi_backend->free_streams(dev, endpoints,
+						  num_endpoints);
+	else
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+/** \ingroup dev
+ * Enable or disable raw I/O on a bulk or interrupt IN endpoint.
+ *
+ * With raw I/O, the driver does not buffer reads on the endpoint itself but
+ * hands them straight to the host controller, which sustains a much higher
+ * throughput when several transfers are kept in flight. In exchange, the
+ * length of every transfer submitted on the endpoint must be a multiple of
+ * its maximum packet size.
+ *
+ * Transfers that are larger than what the driver accepts in a single request
+ * are split by libusbx and queued as several requests. If a short packet ends
+ * one of these requests, any data read by the following ones is discarded.
+ *
+ * This is currently only supported for WinUSB on Windows. The setting is
+ * kept if the interface is released and claimed again.
+ *
+ * This is a blocking function.
+ *
+ * \param dev a device handle
+ * \param endpoint the IN endpoint address, on a claimed interface
+ * \param enable whether to enable or disable raw I/O
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint is not on a claimed interface
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform or driver does not
+ * support raw I/O
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_set_raw_io(libusb_device_handle *dev,
+	unsigned char endpoint, int enable)
+{
+	usbi_dbg("endpoint %02x %s", endpoint, enable ? "on" : "off");
+
+	if (!dev->dev->attached)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	if (!(endpoint & LIBUSB_ENDPOINT_IN))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (usbi_backend->set_raw_io)
+		return usbi_backend->set_raw_io(dev, endpoint, enable);
+	else
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+/** \ingroup dev
+ * Limit how many requests of a large bulk or interrupt transfer are in
+ * flight at once.
+ *
+ * Some platforms cannot hand a large transfer to the kernel in one piece
+ * and split it into smaller requests (on Linux, kernels without
+ * scatter-gather bulk support, which use 16kB requests). Only a window of
+ * these requests is submitted at first, and the remaining ones are
+ * submitted as the earlier ones complete. This bounds the amount of kernel
+ * memory tied up by a transfer and the number of requests to discard when
+ * it is cancelled, while keeping the endpoint busy.
+ *
+ * A deeper window sustains a higher throughput on a busy system, a
+ * shallower one uses less memory. The setting applies to transfers
+ * submitted afterwards and does nothing on platforms that do not split
+ * transfers.
+ *
+ * \param dev a device handle
+ * \param num_requests the most requests in flight per transfer, or 0 for the
+ * platform default (32 on Linux)
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if num_requests is negative
+ */
+int API_EXPORTED libusb_set_bulk_window(libusb_device_handle *dev,
+	int num_requests)
+{
+	usbi_dbg("%d requests", num_requests);
+
+	if (num_requests < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	dev->bulk_window = num_requests;
+	return LIBUSB_SUCCESS;
 }
 
 /** \ingroup dev
@@ -1774,26 +2545,15 @@ void API_EXPORTED libusb_set_debug(libusb_context *ctx, int level)
 		ctx->debug = level;
 }
 
-/** \ingroup lib
- * Initialize libusb. This function must be called before calling any other
- * libusbx function.
- *
- * If you do not provide an output location for a context pointer, a default
- * context will be created. If there was already a default context, it will
- * be reused (and nothing will be initialized/reinitialized).
- *
- * \param context Optional output location for context pointer.
- * Only valid on return code 0.
- * \returns 0 on success, or a LIBUSB_ERROR code on failure
- * \see contexts
- */
-int API_EXPORTED libusb_init(libusb_context **context)
+static int init_context(libusb_context **context,
+	const struct libusb_context_scope *scope, int flags)
 {
 	struct libusb_device *dev, *next;
 	char *dbg = getenv("LIBUSB_DEBUG");
 	struct libusb_context *ctx;
 	static int first_init = 1;
 	int r = 0;
+	int i;
 
 	usbi_mutex_static_lock(&default_context_lock);
 
@@ -1818,14 +2578,27 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	ctx->debug = LIBUSB_LOG_LEVEL_DEBUG;
 #endif
 
+	if (scope) {
+		ctx->scoped = 1;
+		ctx->scope.bus_number = scope->bus_number < 0 ? -1 : scope->bus_number;
+		ctx->scope.num_port_numbers = scope->num_port_numbers;
+		if (scope->num_port_numbers)
+			memcpy(ctx->scope.port_numbers, scope->port_numbers,
+				scope->num_port_numbers);
+		ctx->scope.vendor_id = scope->vendor_id < 0 ? -1 : scope->vendor_id;
+		ctx->scope.product_id = scope->product_id < 0 ? -1 : scope->product_id;
+		ctx->scope.no_scan = scope->no_scan;
+	}
+
 	if (dbg) {
 		ctx->debug = atoi(dbg);
 		if (ctx->debug)
 			ctx->debug_fixed = 1;
 	}
 
-	/* default context should be initialized before calling usbi_dbg */
-	if (!usbi_default_context) {
+	/* default context should be initialized before calling usbi_dbg. a
+	 * scoped context would hide devices from users of the default one */
+	if (!usbi_default_context && !scope) {
 		usbi_default_context = ctx;
 		default_context_refcnt++;
 		usbi_dbg("created default context");
@@ -1837,9 +2610,18 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	usbi_mutex_init(&ctx->usb_devs_lock, NULL);
 	usbi_mutex_init(&ctx->open_devs_lock, NULL);
 	usbi_mutex_init(&ctx->hotplug_cbs_lock, NULL);
+	usbi_mutex_init(&ctx->capture_lock, NULL);
+	usbi_mutex_init(&ctx->backend_lock, NULL);
 	list_init(&ctx->usb_devs);
+	for (i = 0; i < USBI_DEVICE_HASH_SIZE; i++)
+		list_init(&ctx->usb_devs_hash[i]);
 	list_init(&ctx->open_devs);
 	list_init(&ctx->hotplug_cbs);
+	for (i = 0; i < USBI_HOTPLUG_HASH_SIZE; i++) {
+		list_init(&ctx->hotplug_cbs_by_id[i]);
+		list_init(&ctx->hotplug_cbs_by_class[i]);
+	}
+	list_init(&ctx->hotplug_cbs_any);
 
 	usbi_mutex_static_lock(&active_contexts_lock);
 	if (first_init) {
@@ -1849,7 +2631,12 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	list_add (&ctx->list, &active_contexts_list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
 
-	if (usbi_backend->init) {
+	ctx->lazy_init = (flags & LIBUSB_INIT_LAZY)
+		&& (usbi_backend->caps & USBI_CAP_LAZY_INIT);
+	if (ctx->lazy_init) {
+		usbi_dbg("deferring backend initialization");
+		ctx->backend_pending = 1;
+	} else if (usbi_backend->init) {
 		r = usbi_backend->init(ctx);
 		if (r)
 			goto err_free_ctx;
@@ -1867,7 +2654,7 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	return 0;
 
 err_backend_exit:
-	if (usbi_backend->exit)
+	if (usbi_backend->exit && !ctx->backend_pending)
 		usbi_backend->exit();
 err_free_ctx:
 	if (ctx == usbi_default_context)
@@ -1876,6 +2663,8 @@ err_free_ctx:
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 	usbi_mutex_destroy(&ctx->hotplug_cbs_lock);
+	usbi_mutex_destroy(&ctx->capture_lock);
+	usbi_mutex_destroy(&ctx->backend_lock);
 
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_del (&ctx->list);
@@ -1884,6 +2673,7 @@ err_free_ctx:
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_for_each_entry_safe(dev, next, &ctx->usb_devs, list, struct libusb_device) {
 		list_del(&dev->list);
+		list_del(&dev->hash_list);
 		libusb_unref_device(dev);
 	}
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
@@ -1894,6 +2684,99 @@ err_unlock:
 	return r;
 }
 
+/** \ingroup lib
+ * Initialize libusb. This function must be called before calling any other
+ * libusbx function.
+ *
+ * If you do not provide an output location for a context pointer, a default
+ * context will be created. If there was already a default context, it will
+ * be reused (and nothing will be initialized/reinitialized).
+ *
+ * \param context Optional output location for context pointer.
+ * Only valid on return code 0.
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ * \see contexts
+ */
+int API_EXPORTED libusb_init(libusb_context **context)
+{
+	return init_context(context, NULL, 0);
+}
+
+/** \ingroup lib
+ * Initialize a context which only deals with a subset of the devices.
+ *
+ * Devices outside of the scope are left out of device lists, do not
+ * generate hotplug events, and on backends with hotplug support, are not
+ * tracked by the context at all. On Linux, each context otherwise
+ * enumerates every device of the system when it is created and again on
+ * each hotplug event, so applications which spread devices over several
+ * contexts, for instance one context and event thread per CPU, should give
+ * each context a scope covering only its own devices.
+ *
+ * A device matches a bus or port subtree if the backend knows its location.
+ * On Linux this requires sysfs. Note that when the scope is a port subtree,
+ * libusb_get_parent() returns devices up to the root hub, since the hubs
+ * leading to the subtree are kept in the context, whatever vendor_id and
+ * product_id say.
+ *
+ * With libusb_context_scope::no_scan set, the backend does not enumerate
+ * the system when the context is created, and the context only ever holds
+ * the devices passed to libusb_wrap_fd() or libusb_open_path().
+ *
+ * The default context can't be scoped.
+ *
+ * \param context output location for context pointer. Only valid on return
+ * code 0.
+ * \param scope the devices the context deals with
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if context or scope is NULL, or the
+ * scope is invalid
+ * \returns another LIBUSB_ERROR code on failure
+ * \see contexts
+ */
+int API_EXPORTED libusb_init_scoped(libusb_context **context,
+	const struct libusb_context_scope *scope)
+{
+	if (!context || !scope)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (scope->num_port_numbers < 0
+			|| scope->num_port_numbers > USBI_MAX_PORT_DEPTH
+			|| (scope->num_port_numbers && (!scope->port_numbers
+				|| scope->bus_number < 0))
+			|| scope->bus_number > 0xff
+			|| scope->vendor_id > 0xffff || scope->product_id > 0xffff)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	return init_context(context, scope, 0);
+}
+
+/** \ingroup lib
+ * Initialize libusb like libusb_init() does, with flags from
+ * \ref libusb_init_flags.
+ *
+ * With \ref LIBUSB_INIT_LAZY, the backend is initialized by the first call
+ * which needs devices: libusb_get_device_list(), libusb_get_device_snapshot(),
+ * libusb_get_device_generation(), libusb_hotplug_register_callback() or
+ * libusb_wrap_fd(). On Linux this is what starts the hotplug monitor and
+ * enumerates the devices, so short-lived processes which may not touch a
+ * device at all don't pay for it. Errors the backend would have returned
+ * from libusb_init() are then returned by that first call. The probing of
+ * the kernel is done once per process in any case.
+ *
+ * The flags only apply when a context is created: when the default context
+ * already exists, it is reused as it is.
+ *
+ * \param context output location for context pointer, or NULL for the
+ * default context. Only valid on return code 0.
+ * \param flags bitwise or of \ref libusb_init_flags
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ * \see contexts
+ */
+int API_EXPORTED libusb_init_with_flags(libusb_context **context, int flags)
+{
+	return init_context(context, NULL, flags);
+}
+
 /** \ingroup lib
  * Deinitialize libusb. Should be called after closing all open devices and
  * before your application terminates.
@@ -1924,11 +2807,18 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 	list_del (&ctx->list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
 
+	libusb_stop_event_thread(ctx);
+
+	/* the cached snapshot holds a reference to every device */
+	libusb_unref_device_snapshot(ctx->device_snapshot);
+	ctx->device_snapshot = NULL;
+
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 		usbi_hotplug_deregister_all(ctx);
 		usbi_mutex_lock(&ctx->usb_devs_lock);
 		list_for_each_entry_safe(dev, next, &ctx->usb_devs, list, struct libusb_device) {
 			list_del(&dev->list);
+			list_del(&dev->hash_list);
 			libusb_unref_device(dev);
 		}
 		usbi_mutex_unlock(&ctx->usb_devs_lock);
@@ -1941,13 +2831,19 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 	if (!list_empty(&ctx->open_devs))
 		usbi_warn(ctx, "application left some devices open");
 
+	/* let the completion workers deliver what they still have queued */
+	libusb_set_completion_workers(ctx, 0);
+	libusb_stop_capture(ctx);
 	usbi_io_exit(ctx);
-	if (usbi_backend->exit)
+	if (usbi_backend->exit && !ctx->backend_pending)
 		usbi_backend->exit();
 
+	log_ring_stop(ctx);
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 	usbi_mutex_destroy(&ctx->hotplug_cbs_lock);
+	usbi_mutex_destroy(&ctx->capture_lock);
+	usbi_mutex_destroy(&ctx->backend_lock);
 	free(ctx);
 }
 
@@ -1974,6 +2870,24 @@ int API_EXPORTED libusb_has_capability(uint32_t capability)
 	return 0;
 }
 
+/** \ingroup misc
+ * Get a snapshot of the performance counters of a context.
+ *
+ * The counters are updated with atomic operations as transfers and events
+ * are processed, without taking any lock, and this function reads them
+ * without locking either. Counters which are updated while it runs may be
+ * slightly out of step with each other.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param stats output location for the counters
+ */
+void API_EXPORTED libusb_get_context_stats(libusb_context *ctx,
+	struct libusb_context_stats *stats)
+{
+	USBI_GET_CONTEXT(ctx);
+	memcpy(stats, (const void *)&ctx->stats, sizeof(*stats));
+}
+
 /* this is defined in libusbi.h if needed */
 #ifdef LIBUSB_GETTIMEOFDAY_WIN32
 /*
@@ -2026,10 +2940,239 @@ int usbi_gettimeofday(struct timeval *tp, void *tzp)
 }
 #endif
 
-static void usbi_log_str(struct libusb_context *ctx, const char * str)
+/* number of records in the asynchronous log ring, a power of 2 */
+#define USBI_LOG_RING_SIZE	128
+
+struct usbi_log_record {
+	/* pos when free, pos + 1 once written, for the pos it is claimed at */
+	volatile long seq;
+	enum libusb_log_level level;
+	char str[USBI_MAX_LOG_LEN];
+};
+
+/* bounded ring of log records, written by any number of threads without
+ * taking a lock and drained by a single background thread. a writer claims
+ * the record at head by moving head forward, and the seq of a record tells
+ * whether it is free, or written and ready to be drained. when the ring is
+ * full, messages are dropped and counted rather than waited for. */
+struct usbi_log_ring {
+	volatile long head;
+	long tail;		/* only used by the thread */
+	/* records written but not drained yet. the thread only sleeps while
+	 * it is 0, so the writer making it leave 0 wakes the thread up */
+	volatile long pending;
+	volatile long dropped;
+	int stop;
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	usbi_thread_t thread;
+	struct usbi_log_record records[USBI_LOG_RING_SIZE];
+};
+
+static void log_deliver(struct libusb_context *ctx,
+	enum libusb_log_level level, const char *str)
 {
-	UNUSED(ctx);
-	fputs(str, stderr);
+	libusb_log_callback_fn cb_fn = ctx ? ctx->log_cb : NULL;
+
+	if (cb_fn)
+		cb_fn(ctx, level, str);
+	else
+		fputs(str, stderr);
+}
+
+static void log_ring_push(struct usbi_log_ring *ring,
+	enum libusb_log_level level, const char *str)
+{
+	struct usbi_log_record *rec;
+	long pos, seq, diff;
+	size_t len;
+
+	pos = usbi_atomic_load(&ring->head);
+	while (1) {
+		rec = &ring->records[pos & (USBI_LOG_RING_SIZE - 1)];
+		seq = usbi_atomic_load(&rec->seq);
+		diff = (long)((unsigned long)seq - (unsigned long)pos);
+		if (diff == 0) {
+			seq = usbi_atomic_cas(&ring->head, pos, pos + 1);
+			if (seq == pos)
+				break;
+			pos = seq;
+		} else if (diff < 0) {
+			/* the record still holds a message from the previous
+			 * lap, the ring is full */
+			usbi_atomic_add(&ring->dropped, 1);
+			return;
+		} else {
+			pos = usbi_atomic_load(&ring->head);
+		}
+	}
+
+	len = strlen(str);
+	if (len >= sizeof(rec->str))
+		len = sizeof(rec->str) - 1;
+	memcpy(rec->str, str, len);
+	rec->str[len] = '\0';
+	rec->level = level;
+	usbi_atomic_store(&rec->seq, pos + 1);
+
+	if (usbi_atomic_add(&ring->pending, 1) == 0) {
+		usbi_mutex_lock(&ring->lock);
+		usbi_cond_signal(&ring->cond);
+		usbi_mutex_unlock(&ring->lock);
+	}
+}
+
+static void *log_thread_main(void *arg)
+{
+	struct libusb_context *ctx = arg;
+	struct usbi_log_ring *ring = ctx->log_ring;
+	struct usbi_log_record *rec;
+	char buf[64];
+	long drained, dropped;
+	int stop;
+
+	usbi_mutex_lock(&ring->lock);
+	do {
+		while (!usbi_atomic_load(&ring->pending) && !ring->stop)
+			usbi_cond_wait(&ring->cond, &ring->lock);
+		stop = ring->stop;
+		usbi_mutex_unlock(&ring->lock);
+
+		for (drained = 0; ; drained++) {
+			rec = &ring->records[ring->tail & (USBI_LOG_RING_SIZE - 1)];
+			if (usbi_atomic_load(&rec->seq) != ring->tail + 1)
+				break;
+			log_deliver(ctx, rec->level, rec->str);
+			usbi_atomic_store(&rec->seq, ring->tail + USBI_LOG_RING_SIZE);
+			ring->tail++;
+		}
+		usbi_atomic_add(&ring->pending, -drained);
+
+		dropped = usbi_atomic_load(&ring->dropped);
+		if (dropped) {
+			usbi_atomic_add(&ring->dropped, -dropped);
+			snprintf(buf, sizeof(buf), "libusbx: warning [%s] %ld messages dropped"
+				USBI_LOG_LINE_END, __FUNCTION__, dropped);
+			log_deliver(ctx, LIBUSB_LOG_LEVEL_WARNING, buf);
+		}
+
+		usbi_mutex_lock(&ring->lock);
+	} while (!stop);
+	usbi_mutex_unlock(&ring->lock);
+
+	return NULL;
+}
+
+static int log_ring_start(struct libusb_context *ctx)
+{
+	struct usbi_log_ring *ring = calloc(1, sizeof(*ring));
+	int i;
+
+	if (!ring)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < USBI_LOG_RING_SIZE; i++)
+		ring->records[i].seq = i;
+	usbi_mutex_init(&ring->lock, NULL);
+	usbi_cond_init(&ring->cond, NULL);
+
+	ctx->log_ring = ring;
+	if (usbi_thread_create(&ring->thread, log_thread_main, ctx) != 0) {
+		ctx->log_ring = NULL;
+		usbi_cond_destroy(&ring->cond);
+		usbi_mutex_destroy(&ring->lock);
+		free(ring);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+/* deliver what is left in the ring, then stop the thread */
+static void log_ring_stop(struct libusb_context *ctx)
+{
+	struct usbi_log_ring *ring = ctx->log_ring;
+
+	if (!ring)
+		return;
+
+	ctx->log_async = 0;
+	usbi_mutex_lock(&ring->lock);
+	ring->stop = 1;
+	usbi_cond_signal(&ring->cond);
+	usbi_mutex_unlock(&ring->lock);
+	usbi_thread_join(ring->thread);
+
+	ctx->log_ring = NULL;
+	usbi_cond_destroy(&ring->cond);
+	usbi_mutex_destroy(&ring->lock);
+	free(ring);
+}
+
+/** \ingroup lib
+ * Set where the log messages of a context go. By default they are written
+ * to stderr, from the thread logging them.
+ *
+ * With the LIBUSB_LOG_ASYNC flag, messages are formatted and queued by the
+ * thread logging them, then written or passed to the callback by a
+ * background thread. The thread handling events no longer waits on the
+ * output while it is processing transfers, which keeps the timing of a debug
+ * build much closer to a quiet one. If messages are logged faster than
+ * they are delivered, they are dropped rather than waited for, and the
+ * number of messages dropped is reported.
+ *
+ * Debug messages (LIBUSB_LOG_LEVEL_DEBUG) are not tied to the context that
+ * caused them: they are always logged on the default context, and go where
+ * its messages go. To receive them through a callback or asynchronously,
+ * set them up on the default context too, by passing NULL for ctx. While no
+ * default context exists, debug messages are written to stderr. Messages of
+ * the other levels are always logged on their own context.
+ *
+ * This function should be called before the context is used from other
+ * threads.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param cb_fn the function messages are passed to, or NULL for stderr
+ * \param flags bitwise or of \ref libusb_log_flags
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if flags holds an unknown flag
+ * \returns another LIBUSB_ERROR code if the background thread could not
+ * be started
+ */
+int API_EXPORTED libusb_set_log_callback(libusb_context *ctx,
+	libusb_log_callback_fn cb_fn, int flags)
+{
+	int r;
+
+	if (flags & ~LIBUSB_LOG_ASYNC)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	USBI_GET_CONTEXT(ctx);
+	ctx->log_cb = cb_fn;
+	if (!(flags & LIBUSB_LOG_ASYNC)) {
+		/* the thread keeps running until libusb_exit(), in case
+		 * messages are still queued */
+		ctx->log_async = 0;
+		return 0;
+	}
+
+	if (!ctx->log_ring) {
+		r = log_ring_start(ctx);
+		if (r < 0)
+			return r;
+	}
+	ctx->log_async = 1;
+	return 0;
+}
+
+static void usbi_log_str(struct libusb_context *ctx,
+	enum libusb_log_level level, const char * str)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (ctx && ctx->log_async)
+		log_ring_push(ctx->log_ring, level, str);
+	else
+		log_deliver(ctx, level, str);
 }
 
 void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
@@ -2084,8 +3227,8 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	usbi_gettimeofday(&now, NULL);
 	if ((global_debug) && (!has_debug_header_been_displayed)) {
 		has_debug_header_been_displayed = 1;
-		usbi_log_str(ctx, "[timestamp] [threadID] facility level [function call] <message>\n");
-		usbi_log_str(ctx, "--------------------------------------------------------------------------------\n");
+		usbi_log_str(ctx, LIBUSB_LOG_LEVEL_DEBUG, "[timestamp] [threadID] facility level [function call] <message>\n");
+		usbi_log_str(ctx, LIBUSB_LOG_LEVEL_DEBUG, "--------------------------------------------------------------------------------\n");
 	}
 	if (now.tv_usec < timestamp_origin.tv_usec) {
 		now.tv_sec--;
@@ -2143,7 +3286,7 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	}
 	strcpy(buf + header_len + text_len, USBI_LOG_LINE_END);
 
-	usbi_log_str(ctx, buf);
+	usbi_log_str(ctx, level, buf);
 #endif
 }
 
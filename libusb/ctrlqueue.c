@@ -0,0 +1,406 @@
+/*
+ * Pipelined control transfer functions for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusbi.h"
+
+/**
+ * @defgroup ctrlqueue Pipelined control transfers
+ *
+ * This page documents libusbx's control queue API, for applications that
+ * send long sequences of control requests to a device, such as register
+ * writes to configure an FPGA or to initialise a sensor.
+ *
+ * libusb_control_transfer() waits for each request to complete before the
+ * next one can be sent, so such sequences take one round trip per request.
+ * A libusb_control_queue instead keeps several requests of a batch in
+ * flight on the default control pipe. The host controller still executes
+ * them one after the other and in the order they were given, but a request
+ * no longer has to wait for the application to see the previous one
+ * complete:
+ *
+\code
+struct libusb_control_request reqs[1000];
+libusb_control_queue *queue;
+
+r = libusb_control_queue_open(handle, 8, 64, &queue);
+...
+for (i = 0; i < 1000; i++) {
+	reqs[i].bmRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR
+		| LIBUSB_RECIPIENT_DEVICE;
+	reqs[i].bRequest = WRITE_REGISTER;
+	reqs[i].wValue = regs[i].value;
+	reqs[i].wIndex = regs[i].address;
+	reqs[i].wLength = 0;
+	reqs[i].data = NULL;
+}
+r = libusb_control_queue_run(queue, reqs, 1000,
+	LIBUSB_CONTROL_QUEUE_STOP_ON_STALL, 1000);
+if (r < 1000)
+	fprintf(stderr, "register %d: %s\n", r,
+		libusb_error_name(reqs[r].status));
+libusb_control_queue_close(queue);
+\endcode
+ *
+ * The queue owns a fixed number of transfers, each with a buffer large
+ * enough for the setup packet and the longest data stage it accepts. They
+ * are allocated once when the queue is opened and reused for every request
+ * of every batch.
+ *
+ * libusb_control_queue_run() handles events itself until the batch is
+ * finished, in the same way as the \ref syncio "synchronous I/O functions",
+ * and the same restrictions apply: it must not be called from an event
+ * handling callback. Only one batch may run on a queue at a time, but
+ * several queues may be opened on the same device handle.
+ */
+
+struct ctrlq_slot {
+	struct libusb_control_queue *queue;
+	struct libusb_transfer *transfer;
+
+	/* index of the request in the current batch, or -1 if the slot's
+	 * transfer is not in flight */
+	int request;
+};
+
+struct libusb_control_queue {
+	struct libusb_device_handle *dev_handle;
+
+	/* the transfer buffers, carved into num_slots slots of slot_size bytes.
+	 * each holds a setup packet followed by up to max_length bytes of data.
+	 * buffer_dev_mem is set if they came from libusb_dev_mem_alloc() rather
+	 * than malloc() */
+	unsigned char *buffer;
+	size_t buffer_size;
+	int buffer_dev_mem;
+	int slot_size;
+	int max_length;
+
+	struct ctrlq_slot *slots;
+	int num_slots;
+
+	/* protects everything below this point, which is updated by both
+	 * libusb_control_queue_run() and the transfer callbacks */
+	usbi_mutex_t lock;
+
+	/* the batch being run, or NULL */
+	struct libusb_control_request *requests;
+	int num_requests;
+	int flags;
+	unsigned int timeout;
+
+	/* next request of the batch to submit */
+	int next;
+	int num_in_flight;
+
+	/* set once no more requests of the batch are to be submitted */
+	int stopping;
+
+	/* set once stopping and all transfers have come back */
+	int finished;
+};
+
+/* stop submitting requests of the current batch and cancel those in flight.
+ * Callers of this function must hold the queue lock. */
+static void stop_batch(struct libusb_control_queue *queue)
+{
+	int i;
+
+	queue->stopping = 1;
+	for (i = 0; i < queue->num_slots; i++) {
+		if (queue->slots[i].request >= 0)
+			libusb_cancel_transfer(queue->slots[i].transfer);
+	}
+}
+
+/* submit the next request of the batch on the transfer of a slot. a request
+ * that fails to submit gets the error as its status and stops the batch, as
+ * the requests after it could no longer be run in order.
+ * Callers of this function must hold the queue lock. */
+static void submit_next(struct libusb_control_queue *queue,
+	struct ctrlq_slot *slot)
+{
+	struct libusb_transfer *transfer = slot->transfer;
+	struct libusb_control_request *req;
+	int r;
+
+	slot->request = -1;
+	if (queue->stopping || queue->next == queue->num_requests)
+		return;
+
+	req = &queue->requests[queue->next];
+	libusb_fill_control_setup(transfer->buffer, req->bmRequestType,
+		req->bRequest, req->wValue, req->wIndex, req->wLength);
+	if (req->wLength && !(req->bmRequestType & LIBUSB_ENDPOINT_IN))
+		memcpy(transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, req->data,
+			req->wLength);
+	transfer->length = LIBUSB_CONTROL_SETUP_SIZE + req->wLength;
+	transfer->timeout = queue->timeout;
+
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		usbi_dbg("request %d failed to submit: %s", queue->next,
+			libusb_error_name(r));
+		req->status = r;
+		stop_batch(queue);
+		return;
+	}
+
+	slot->request = queue->next++;
+	queue->num_in_flight++;
+}
+
+static void LIBUSB_CALL ctrlq_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct ctrlq_slot *slot = transfer->user_data;
+	struct libusb_control_queue *queue = slot->queue;
+	struct libusb_control_request *req;
+
+	usbi_mutex_lock(&queue->lock);
+	req = &queue->requests[slot->request];
+	req->status = usbi_transfer_status_to_error(transfer->status);
+	req->actual_length = transfer->actual_length;
+	if ((req->bmRequestType & LIBUSB_ENDPOINT_IN) && transfer->actual_length)
+		memcpy(req->data, libusb_control_transfer_get_data(transfer),
+			transfer->actual_length);
+	queue->num_in_flight--;
+
+	if (req->status == LIBUSB_ERROR_PIPE && !queue->stopping
+			&& (queue->flags & LIBUSB_CONTROL_QUEUE_STOP_ON_STALL)) {
+		usbi_dbg("request %d stalled, stopping batch", slot->request);
+		slot->request = -1;
+		stop_batch(queue);
+	} else if (req->status == LIBUSB_ERROR_NO_DEVICE && !queue->stopping) {
+		slot->request = -1;
+		stop_batch(queue);
+	}
+
+	submit_next(queue, slot);
+	if (!queue->num_in_flight)
+		queue->finished = 1;
+	usbi_mutex_unlock(&queue->lock);
+}
+
+static void free_queue(struct libusb_control_queue *queue)
+{
+	int i;
+
+	for (i = 0; i < queue->num_slots; i++)
+		libusb_free_transfer(queue->slots[i].transfer);
+	free(queue->slots);
+	if (queue->buffer_dev_mem)
+		libusb_dev_mem_free(queue->dev_handle, queue->buffer,
+			queue->buffer_size);
+	else
+		free(queue->buffer);
+	usbi_mutex_destroy(&queue->lock);
+	free(queue);
+}
+
+/** \ingroup ctrlqueue
+ * Open a control queue on a device handle.
+ *
+ * This allocates depth transfers, each with a buffer for a setup packet
+ * followed by max_length bytes, which is DMA-capable memory on platforms
+ * that support it and comes from malloc() elsewhere. Nothing is submitted
+ * until a batch is run.
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param depth the maximum number of requests to keep in flight
+ * \param max_length the longest data stage, in bytes, of the requests
+ * that will be run through the queue
+ * \param queue output location for the new queue. Only populated if the
+ * return code is 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if depth is not positive or
+ * max_length is negative or larger than 65535
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_control_queue_open(libusb_device_handle *dev_handle,
+	int depth, int max_length, libusb_control_queue **queue)
+{
+	struct libusb_control_queue *_queue;
+	int i;
+
+	if (depth <= 0 || max_length < 0 || max_length > 0xffff)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_queue = calloc(1, sizeof(*_queue));
+	if (!_queue)
+		return LIBUSB_ERROR_NO_MEM;
+	usbi_mutex_init(&_queue->lock, NULL);
+	_queue->dev_handle = dev_handle;
+	_queue->max_length = max_length;
+	_queue->slot_size = LIBUSB_CONTROL_SETUP_SIZE + max_length;
+
+	_queue->slots = calloc(depth, sizeof(*_queue->slots));
+	if (!_queue->slots) {
+		free_queue(_queue);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	_queue->buffer_size = (size_t)depth * _queue->slot_size;
+	_queue->buffer = libusb_dev_mem_alloc(dev_handle, _queue->buffer_size);
+	if (_queue->buffer)
+		_queue->buffer_dev_mem = 1;
+	else
+		_queue->buffer = malloc(_queue->buffer_size);
+	if (!_queue->buffer) {
+		free_queue(_queue);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < depth; i++) {
+		struct ctrlq_slot *slot = &_queue->slots[i];
+
+		slot->transfer = libusb_alloc_transfer(0);
+		if (!slot->transfer) {
+			free_queue(_queue);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		_queue->num_slots++;
+		slot->queue = _queue;
+		slot->request = -1;
+		libusb_fill_control_transfer(slot->transfer, dev_handle,
+			_queue->buffer + (size_t)i * _queue->slot_size,
+			ctrlq_transfer_cb, slot, 0);
+	}
+
+	*queue = _queue;
+	return 0;
+}
+
+/** \ingroup ctrlqueue
+ * Run a batch of control requests through a queue, and wait for all of
+ * them to complete.
+ *
+ * Requests are submitted in the order of the array and up to the depth of
+ * the queue are kept in flight. The data stage of an OUT request is copied
+ * into the queue's buffers when it is submitted, and the data received for
+ * an IN request is copied to its data buffer when it completes, so the
+ * buffers of the batch only have to remain valid for the duration of the
+ * call.
+ *
+ * On return, the status field of each request holds 0 if it completed
+ * successfully or a LIBUSB_ERROR code if it failed, and actual_length holds
+ * the number of bytes transferred in its data stage. A stall is reported
+ * as LIBUSB_ERROR_PIPE, as with libusb_control_transfer().
+ *
+ * By default, a failed request does not prevent the following ones from
+ * being run. With \ref libusb_control_queue_flags::LIBUSB_CONTROL_QUEUE_STOP_ON_STALL
+ * "LIBUSB_CONTROL_QUEUE_STOP_ON_STALL", no more requests are submitted
+ * after the first stall and those already in flight behind it are
+ * cancelled. A batch always stops if the device is disconnected or a
+ * request cannot be submitted. Requests that were cancelled or never
+ * submitted because the batch stopped have status LIBUSB_ERROR_INTERRUPTED.
+ * Note that a cancelled request may or may not have reached the device.
+ *
+ * \param queue the queue to run the requests through
+ * \param requests the requests to run
+ * \param num_requests the number of requests in the array
+ * \param flags a bitwise OR of \ref libusb_control_queue_flags values
+ * \param timeout timeout (in milliseconds) for each request, counted from
+ * the time it is submitted. For an unlimited timeout, use value 0.
+ * \returns the number of requests, counted from the start of the batch,
+ * that completed successfully before the first one that failed. This is
+ * num_requests if the whole batch succeeded.
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a request has a data stage longer
+ * than the queue allows, or no data buffer for its data stage
+ * \returns LIBUSB_ERROR_BUSY if another batch is running on the queue
+ */
+int API_EXPORTED libusb_control_queue_run(libusb_control_queue *queue,
+	struct libusb_control_request *requests, int num_requests, int flags,
+	unsigned int timeout)
+{
+	struct libusb_context *ctx = HANDLE_CTX(queue->dev_handle);
+	int r;
+	int i;
+
+	if (num_requests < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	for (i = 0; i < num_requests; i++) {
+		if (requests[i].wLength > queue->max_length
+				|| (requests[i].wLength && !requests[i].data))
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	usbi_mutex_lock(&queue->lock);
+	if (queue->requests) {
+		usbi_mutex_unlock(&queue->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	for (i = 0; i < num_requests; i++) {
+		requests[i].status = LIBUSB_ERROR_INTERRUPTED;
+		requests[i].actual_length = 0;
+	}
+	queue->requests = requests;
+	queue->num_requests = num_requests;
+	queue->flags = flags;
+	queue->timeout = timeout;
+	queue->next = 0;
+	queue->stopping = 0;
+	queue->finished = 0;
+
+	for (i = 0; i < queue->num_slots; i++)
+		submit_next(queue, &queue->slots[i]);
+	if (!queue->num_in_flight)
+		queue->finished = 1;
+	usbi_mutex_unlock(&queue->lock);
+
+	while (!queue->finished) {
+		r = libusb_handle_events_completed(ctx, &queue->finished);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			usbi_err(ctx, "libusb_handle_events failed: %s, stopping batch",
+				libusb_error_name(r));
+			usbi_mutex_lock(&queue->lock);
+			if (!queue->stopping)
+				stop_batch(queue);
+			usbi_mutex_unlock(&queue->lock);
+		}
+	}
+
+	usbi_mutex_lock(&queue->lock);
+	queue->requests = NULL;
+	usbi_mutex_unlock(&queue->lock);
+
+	for (i = 0; i < num_requests; i++) {
+		if (requests[i].status)
+			break;
+	}
+	return i;
+}
+
+/** \ingroup ctrlqueue
+ * Free a control queue and its transfers. No batch may be running on the
+ * queue.
+ *
+ * \param queue the queue to free. If NULL, this function does nothing.
+ */
+void API_EXPORTED libusb_control_queue_close(libusb_control_queue *queue)
+{
+	if (!queue)
+		return;
+
+	free_queue(queue);
+}
@@ -20,6 +20,7 @@
  */
 
 #include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -90,6 +91,118 @@ int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 	return (int) (sp - source);
 }
 
+/* Fixed-layout decoders for the descriptors handled in this file. They do
+ * the same as usbi_parse_descriptor() with the matching format string, but
+ * with the offsets known at compile time rather than interpreted from the
+ * format for every field. w and d values are converted from little endian
+ * unless host_endian is set. */
+static inline uint16_t desc_word(const unsigned char *p, int host_endian)
+{
+	uint16_t w;
+
+	if (host_endian) {
+		memcpy(&w, p, 2);
+		return w;
+	}
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t desc_dword(const unsigned char *p, int host_endian)
+{
+	uint32_t d;
+
+	if (host_endian) {
+		memcpy(&d, p, 4);
+		return d;
+	}
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* "bb" */
+static inline void decode_header(const unsigned char *p,
+	struct usb_descriptor_header *header)
+{
+	header->bLength = p[0];
+	header->bDescriptorType = p[1];
+}
+
+/* "bbwbbbbb" */
+static inline void decode_config(const unsigned char *p,
+	struct libusb_config_descriptor *config, int host_endian)
+{
+	config->bLength = p[0];
+	config->bDescriptorType = p[1];
+	config->wTotalLength = desc_word(p + 2, host_endian);
+	config->bNumInterfaces = p[4];
+	config->bConfigurationValue = p[5];
+	config->iConfiguration = p[6];
+	config->bmAttributes = p[7];
+	config->MaxPower = p[8];
+}
+
+/* "bbbbbbbbb" */
+static inline void decode_interface(const unsigned char *p,
+	struct libusb_interface_descriptor *altsetting)
+{
+	altsetting->bLength = p[0];
+	altsetting->bDescriptorType = p[1];
+	altsetting->bInterfaceNumber = p[2];
+	altsetting->bAlternateSetting = p[3];
+	altsetting->bNumEndpoints = p[4];
+	altsetting->bInterfaceClass = p[5];
+	altsetting->bInterfaceSubClass = p[6];
+	altsetting->bInterfaceProtocol = p[7];
+	altsetting->iInterface = p[8];
+}
+
+/* "bbbbwb", plus "bb" for audio endpoints. bRefresh and bSynchAddress are
+ * left alone for other endpoints */
+static inline void decode_endpoint(const unsigned char *p,
+	struct libusb_endpoint_descriptor *endpoint, int audio, int host_endian)
+{
+	endpoint->bLength = p[0];
+	endpoint->bDescriptorType = p[1];
+	endpoint->bEndpointAddress = p[2];
+	endpoint->bmAttributes = p[3];
+	endpoint->wMaxPacketSize = desc_word(p + 4, host_endian);
+	endpoint->bInterval = p[6];
+	if (audio) {
+		endpoint->bRefresh = p[7];
+		endpoint->bSynchAddress = p[8];
+	}
+}
+
+/* "bbbbw" */
+static inline void decode_ss_ep_comp(const unsigned char *p,
+	struct libusb_ss_endpoint_companion_descriptor *ep_comp)
+{
+	ep_comp->bLength = p[0];
+	ep_comp->bDescriptorType = p[1];
+	ep_comp->bMaxBurst = p[2];
+	ep_comp->bmAttributes = p[3];
+	ep_comp->wBytesPerInterval = desc_word(p + 4, 0);
+}
+
+/* "bbwb" */
+static inline void decode_bos(const unsigned char *p,
+	struct libusb_bos_descriptor *bos, int host_endian)
+{
+	bos->bLength = p[0];
+	bos->bDescriptorType = p[1];
+	bos->wTotalLength = desc_word(p + 2, host_endian);
+	bos->bNumDeviceCaps = p[4];
+}
+
+/* "bbb" */
+static inline void decode_dev_cap(const unsigned char *p,
+	struct libusb_bos_dev_capability_descriptor *dev_cap)
+{
+	dev_cap->bLength = p[0];
+	dev_cap->bDescriptorType = p[1];
+	dev_cap->bDevCapabilityType = p[2];
+}
+
 static void clear_endpoint(struct libusb_endpoint_descriptor *endpoint)
 {
 	if (endpoint->extra)
@@ -112,7 +225,7 @@ static int parse_endpoint(struct libusb_context *ctx,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(buffer, "bb", &header, 0);
+	decode_header(buffer, &header);
 	if (header.bDescriptorType != LIBUSB_DT_ENDPOINT) {
 		usbi_err(ctx, "unexpected descriptor %x (expected %x)",
 			header.bDescriptorType, LIBUSB_DT_ENDPOINT);
@@ -124,9 +237,9 @@ static int parse_endpoint(struct libusb_context *ctx,
 		return parsed;
 	}
 	if (header.bLength >= ENDPOINT_AUDIO_DESC_LENGTH)
-		usbi_parse_descriptor(buffer, "bbbbwbbb", endpoint, host_endian);
+		decode_endpoint(buffer, endpoint, 1, host_endian);
 	else if (header.bLength >= ENDPOINT_DESC_LENGTH)
-		usbi_parse_descriptor(buffer, "bbbbwb", endpoint, host_endian);
+		decode_endpoint(buffer, endpoint, 0, host_endian);
 	else {
 		usbi_err(ctx, "invalid endpoint bLength (%d)", header.bLength);
 		return LIBUSB_ERROR_IO;
@@ -140,7 +253,7 @@ static int parse_endpoint(struct libusb_context *ctx,
 	/*  descriptors */
 	begin = buffer;
 	while (size >= DESC_HEADER_LENGTH) {
-		usbi_parse_descriptor(buffer, "bb", &header, 0);
+		decode_header(buffer, &header);
 		if (header.bLength < DESC_HEADER_LENGTH) {
 			usbi_err(ctx, "invalid extra ep desc len (%d)",
 				 header.bLength);
@@ -240,7 +353,7 @@ static int parse_interface(libusb_context *ctx,
 		usb_interface->altsetting = altsetting;
 
 		ifp = altsetting + usb_interface->num_altsetting;
-		usbi_parse_descriptor(buffer, "bbbbbbbbb", ifp, 0);
+		decode_interface(buffer, ifp);
 		if (ifp->bDescriptorType != LIBUSB_DT_INTERFACE) {
 			usbi_err(ctx, "unexpected descriptor %x (expected %x)",
 				 ifp->bDescriptorType, LIBUSB_DT_INTERFACE);
@@ -280,7 +393,7 @@ static int parse_interface(libusb_context *ctx,
 
 		/* Skip over any interface, class or vendor descriptors */
 		while (size >= DESC_HEADER_LENGTH) {
-			usbi_parse_descriptor(buffer, "bb", &header, 0);
+			decode_header(buffer, &header);
 			if (header.bLength < DESC_HEADER_LENGTH) {
 				usbi_err(ctx,
 					 "invalid extra intf desc len (%d)",
@@ -389,7 +502,7 @@ static int parse_configuration(struct libusb_context *ctx,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(buffer, "bbwbbbbb", config, host_endian);
+	decode_config(buffer, config, host_endian);
 	if (config->bDescriptorType != LIBUSB_DT_CONFIG) {
 		usbi_err(ctx, "unexpected descriptor %x (expected %x)",
 			 config->bDescriptorType, LIBUSB_DT_CONFIG);
@@ -430,7 +543,7 @@ static int parse_configuration(struct libusb_context *ctx,
 		/*  Specific descriptors */
 		begin = buffer;
 		while (size >= DESC_HEADER_LENGTH) {
-			usbi_parse_descriptor(buffer, "bb", &header, 0);
+			decode_header(buffer, &header);
 
 			if (header.bLength < DESC_HEADER_LENGTH) {
 				usbi_err(ctx,
@@ -494,29 +607,142 @@ err:
 	return r;
 }
 
+/* Configuration descriptors are parsed once and the resulting tree is
+ * shared: it is cached on the device, and every libusb_config_descriptor
+ * handed out to the application is a reference to a cached entry, which
+ * libusb_free_config_descriptor() releases. The trees are never modified
+ * once parsed. config_cache_lock protects the reference counts as well as
+ * the cache pointers of all devices. */
+struct usbi_cached_config {
+	int refcnt;
+	struct libusb_config_descriptor config;
+};
+
+static usbi_mutex_static_t config_cache_lock = USBI_MUTEX_INITIALIZER;
+
+#define CACHED_CONFIG(config) ((struct usbi_cached_config *) \
+	((uintptr_t)(config) - (uintptr_t)offsetof(struct usbi_cached_config, config)))
+
+static void release_cached_config(struct usbi_cached_config *cached)
+{
+	int refcnt;
+
+	if (!cached)
+		return;
+
+	usbi_mutex_static_lock(&config_cache_lock);
+	refcnt = --cached->refcnt;
+	usbi_mutex_static_unlock(&config_cache_lock);
+	if (refcnt)
+		return;
+
+	clear_configuration(&cached->config);
+	free(cached);
+}
+
 static int raw_desc_to_config(struct libusb_context *ctx,
 	unsigned char *buf, int size, int host_endian,
 	struct libusb_config_descriptor **config)
 {
-	struct libusb_config_descriptor *_config = malloc(sizeof(*_config));
+	struct usbi_cached_config *cached = malloc(sizeof(*cached));
 	int r;
 	
-	if (!_config)
+	if (!cached)
 		return LIBUSB_ERROR_NO_MEM;
 
-	r = parse_configuration(ctx, _config, buf, size, host_endian);
+	r = parse_configuration(ctx, &cached->config, buf, size, host_endian);
 	if (r < 0) {
 		usbi_err(ctx, "parse_configuration failed with error %d", r);
-		free(_config);
+		free(cached);
 		return r;
 	} else if (r > 0) {
 		usbi_warn(ctx, "still %d bytes of descriptor data left", r);
 	}
 	
-	*config = _config;
+	cached->refcnt = 1;
+	*config = &cached->config;
 	return LIBUSB_SUCCESS;
 }
 
+/* get a new reference to a cached configuration. config_index is the index
+ * of the configuration, or -1 for the active one */
+static struct libusb_config_descriptor *get_cached_config(
+	struct libusb_device *dev, int config_index)
+{
+	struct usbi_cached_config *cached;
+
+	usbi_mutex_static_lock(&config_cache_lock);
+	if (config_index < 0)
+		cached = dev->active_config_cache;
+	else if (dev->config_cache)
+		cached = dev->config_cache[config_index];
+	else
+		cached = NULL;
+	if (cached)
+		cached->refcnt++;
+	usbi_mutex_static_unlock(&config_cache_lock);
+
+	return cached ? &cached->config : NULL;
+}
+
+/* add a freshly parsed configuration to the cache of a device. for the
+ * active configuration, active_config_gen is the generation that was current
+ * before the descriptor was read; if the cache was invalidated in the
+ * meantime, the configuration is not cached */
+static void cache_config(struct libusb_device *dev, int config_index,
+	unsigned int active_config_gen, struct libusb_config_descriptor *config)
+{
+	struct usbi_cached_config *cached = CACHED_CONFIG(config);
+
+	usbi_mutex_static_lock(&config_cache_lock);
+	if (config_index < 0) {
+		if (!dev->active_config_cache
+				&& dev->active_config_gen == active_config_gen) {
+			dev->active_config_cache = cached;
+			cached->refcnt++;
+		}
+	} else {
+		if (!dev->config_cache)
+			dev->config_cache = calloc(dev->num_configurations,
+				sizeof(*dev->config_cache));
+		if (dev->config_cache && !dev->config_cache[config_index]) {
+			dev->config_cache[config_index] = cached;
+			cached->refcnt++;
+		}
+	}
+	usbi_mutex_static_unlock(&config_cache_lock);
+}
+
+/* forget the cached active configuration, as the device may now be in
+ * another one. references already handed out remain valid. */
+void usbi_invalidate_active_config(struct libusb_device *dev)
+{
+	struct usbi_cached_config *cached;
+
+	usbi_mutex_static_lock(&config_cache_lock);
+	cached = dev->active_config_cache;
+	dev->active_config_cache = NULL;
+	dev->active_config_gen++;
+	usbi_mutex_static_unlock(&config_cache_lock);
+
+	release_cached_config(cached);
+}
+
+/* drop all configurations cached on a device that is being destroyed */
+void usbi_free_config_cache(struct libusb_device *dev)
+{
+	uint8_t i;
+
+	usbi_invalidate_active_config(dev);
+	if (!dev->config_cache)
+		return;
+
+	for (i = 0; i < dev->num_configurations; i++)
+		release_cached_config(dev->config_cache[i]);
+	free(dev->config_cache);
+	dev->config_cache = NULL;
+}
+
 int usbi_device_cache_descriptor(libusb_device *dev)
 {
 	int r, host_endian = 0;
@@ -577,9 +803,18 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 	struct libusb_config_descriptor _config;
 	unsigned char tmp[LIBUSB_DT_CONFIG_SIZE];
 	unsigned char *buf = NULL;
+	unsigned int gen;
 	int host_endian = 0;
 	int r;
 
+	*config = get_cached_config(dev, -1);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
+	usbi_mutex_static_lock(&config_cache_lock);
+	gen = dev->active_config_gen;
+	usbi_mutex_static_unlock(&config_cache_lock);
+
 	r = usbi_backend->get_active_config_descriptor(dev, tmp,
 		LIBUSB_DT_CONFIG_SIZE, &host_endian);
 	if (r < 0)
@@ -590,7 +825,7 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(tmp, "bbw", &_config, host_endian);
+	_config.wTotalLength = desc_word(tmp + 2, host_endian);
 	buf = malloc(_config.wTotalLength);
 	if (!buf)
 		return LIBUSB_ERROR_NO_MEM;
@@ -599,6 +834,8 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 		_config.wTotalLength, &host_endian);
 	if (r >= 0)
 		r = raw_desc_to_config(dev->ctx, buf, r, host_endian, config);
+	if (r == LIBUSB_SUCCESS)
+		cache_config(dev, -1, gen, *config);
 
 	free(buf);
 	return r;
@@ -633,6 +870,10 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 	if (config_index >= dev->num_configurations)
 		return LIBUSB_ERROR_NOT_FOUND;
 
+	*config = get_cached_config(dev, config_index);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
 	r = usbi_backend->get_config_descriptor(dev, config_index, tmp,
 		LIBUSB_DT_CONFIG_SIZE, &host_endian);
 	if (r < 0)
@@ -643,7 +884,7 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(tmp, "bbw", &_config, host_endian);
+	_config.wTotalLength = desc_word(tmp + 2, host_endian);
 	buf = malloc(_config.wTotalLength);
 	if (!buf)
 		return LIBUSB_ERROR_NO_MEM;
@@ -652,6 +893,8 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 		_config.wTotalLength, &host_endian);
 	if (r >= 0)
 		r = raw_desc_to_config(dev->ctx, buf, r, host_endian, config);
+	if (r == LIBUSB_SUCCESS)
+		cache_config(dev, config_index, 0, *config);
 
 	free(buf);
 	return r;
@@ -707,6 +950,22 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
 {
 	int r, idx, host_endian;
 	unsigned char *buf = NULL;
+	uint8_t i;
+
+	/* look through the configurations parsed so far */
+	usbi_mutex_static_lock(&config_cache_lock);
+	for (i = 0; dev->config_cache && i < dev->num_configurations; i++) {
+		struct usbi_cached_config *cached = dev->config_cache[i];
+
+		if (cached && cached->config.bConfigurationValue
+				== bConfigurationValue) {
+			cached->refcnt++;
+			*config = &cached->config;
+			usbi_mutex_static_unlock(&config_cache_lock);
+			return LIBUSB_SUCCESS;
+		}
+	}
+	usbi_mutex_static_unlock(&config_cache_lock);
 
 	if (usbi_backend->get_config_descriptor_by_value) {
 		r = usbi_backend->get_config_descriptor_by_value(dev,
@@ -731,6 +990,9 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
  * It is safe to call this function with a NULL config parameter, in which
  * case the function simply returns.
  *
+ * Configuration descriptors are cached by libusbx and shared between
+ * callers, so they must not be modified.
+ *
  * \param config the configuration descriptor to free
  */
 void API_EXPORTED libusb_free_config_descriptor(
@@ -739,8 +1001,257 @@ void API_EXPORTED libusb_free_config_descriptor(
 	if (!config)
 		return;
 
-	clear_configuration(config);
-	free(config);
+	release_cached_config(CACHED_CONFIG(config));
+}
+
+/** \ingroup desc
+ * Get the raw bytes of the configuration descriptor of the active
+ * configuration, including all interface, endpoint and class-specific
+ * descriptors that follow it, in bus-endian format. Unlike
+ * libusb_get_active_config_descriptor(), nothing is parsed or allocated.
+ *
+ * If the buffer is shorter than the wTotalLength field of the configuration
+ * descriptor, only the beginning of the descriptors is returned. A buffer of
+ * \ref LIBUSB_DT_CONFIG_SIZE bytes is enough to read wTotalLength.
+ *
+ * \param dev a device
+ * \param data output buffer for the descriptors
+ * \param length size of the data buffer
+ * \returns the number of bytes returned in data
+ * \returns LIBUSB_ERROR_NOT_FOUND if the device is in unconfigured state
+ * \returns another LIBUSB_ERROR code on error
+ * \see libusb_init_descriptor_iterator()
+ */
+int API_EXPORTED libusb_get_raw_active_config_descriptor(libusb_device *dev,
+	unsigned char *data, int length)
+{
+	int host_endian = 0;
+
+	if (length < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	/* configuration descriptors are always returned in bus-endian
+	 * format; only device descriptors can come in host-endian format */
+	return usbi_backend->get_active_config_descriptor(dev, data,
+		(size_t) length, &host_endian);
+}
+
+/** \ingroup desc
+ * Get the raw bytes of a configuration descriptor based on its index. See
+ * libusb_get_raw_active_config_descriptor() for details.
+ *
+ * \param dev a device
+ * \param config_index the index of the configuration you wish to retrieve
+ * \param data output buffer for the descriptors
+ * \param length size of the data buffer
+ * \returns the number of bytes returned in data
+ * \returns LIBUSB_ERROR_NOT_FOUND if the configuration does not exist
+ * \returns another LIBUSB_ERROR code on error
+ */
+int API_EXPORTED libusb_get_raw_config_descriptor(libusb_device *dev,
+	uint8_t config_index, unsigned char *data, int length)
+{
+	int host_endian = 0;
+
+	if (length < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (config_index >= dev->num_configurations)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return usbi_backend->get_config_descriptor(dev, config_index, data,
+		(size_t) length, &host_endian);
+}
+
+/** \ingroup desc
+ * Initialize a descriptor iterator over a buffer of raw descriptors, such as
+ * the data returned by libusb_get_raw_config_descriptor(). The buffer must
+ * remain valid for as long as the iterator is used.
+ *
+ * \param iter the iterator to initialize
+ * \param buffer the descriptors
+ * \param length the length of the buffer
+ */
+void API_EXPORTED libusb_init_descriptor_iterator(
+	struct libusb_descriptor_iterator *iter, const unsigned char *buffer,
+	int length)
+{
+	iter->buffer = buffer;
+	iter->length = length;
+	iter->offset = -1;
+	iter->descriptor = NULL;
+	iter->interface_number = -1;
+	iter->altsetting = -1;
+}
+
+/** \ingroup desc
+ * Move a descriptor iterator to the next descriptor.
+ *
+ * As with the parsing done by libusb_get_config_descriptor(), a descriptor
+ * that does not fit in what is left of the buffer ends the iteration, while
+ * one with an invalid bLength is an error.
+ *
+ * \param iter the iterator
+ * \returns the bDescriptorType of the new current descriptor
+ * \returns 0 if there are no more descriptors
+ * \returns LIBUSB_ERROR_IO if the descriptors are malformed
+ */
+int API_EXPORTED libusb_next_descriptor(struct libusb_descriptor_iterator *iter)
+{
+	int offset;
+	int size;
+
+	if (iter->offset < 0)
+		offset = 0;
+	else if (iter->descriptor)
+		offset = iter->offset + iter->descriptor[0];
+	else
+		return 0;
+
+	iter->offset = offset;
+	iter->descriptor = NULL;
+	size = iter->length - offset;
+	if (size < DESC_HEADER_LENGTH)
+		return 0;
+	if (iter->buffer[offset] < DESC_HEADER_LENGTH) {
+		usbi_dbg("invalid descriptor length %d", iter->buffer[offset]);
+		return LIBUSB_ERROR_IO;
+	}
+	if (iter->buffer[offset] > size) {
+		usbi_dbg("short descriptor read %d/%d", size, iter->buffer[offset]);
+		return 0;
+	}
+
+	iter->descriptor = iter->buffer + offset;
+	if (iter->descriptor[1] == LIBUSB_DT_INTERFACE
+			&& iter->descriptor[0] >= INTERFACE_DESC_LENGTH) {
+		iter->interface_number = iter->descriptor[2];
+		iter->altsetting = iter->descriptor[3];
+	}
+	return iter->descriptor[1];
+}
+
+/* check that the current descriptor of an iterator has the given type and
+ * is at least min_length bytes long */
+static int check_iterator_descriptor(
+	const struct libusb_descriptor_iterator *iter, uint8_t type,
+	int min_length)
+{
+	if (!iter->descriptor || iter->descriptor[1] != type)
+		return LIBUSB_ERROR_NOT_FOUND;
+	if (iter->descriptor[0] < min_length) {
+		usbi_dbg("invalid descriptor %x bLength (%d)", type,
+			 iter->descriptor[0]);
+		return LIBUSB_ERROR_IO;
+	}
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup desc
+ * Decode the current descriptor of an iterator as a configuration
+ * descriptor. The interface and extra fields are left empty; keep iterating
+ * to get to the descriptors that follow.
+ *
+ * \param iter the iterator
+ * \param config output location for the configuration descriptor
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the current descriptor is not a
+ * configuration descriptor
+ * \returns LIBUSB_ERROR_IO if the descriptor is malformed
+ */
+int API_EXPORTED libusb_get_iterator_config_descriptor(
+	const struct libusb_descriptor_iterator *iter,
+	struct libusb_config_descriptor *config)
+{
+	int r = check_iterator_descriptor(iter, LIBUSB_DT_CONFIG,
+		CONFIG_DESC_LENGTH);
+
+	if (r < 0)
+		return r;
+	decode_config(iter->descriptor, config, 0);
+	config->interface = NULL;
+	config->extra = NULL;
+	config->extra_length = 0;
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup desc
+ * Decode the current descriptor of an iterator as an interface descriptor.
+ * The endpoint and extra fields are left empty.
+ *
+ * \param iter the iterator
+ * \param altsetting output location for the interface descriptor
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the current descriptor is not an
+ * interface descriptor
+ * \returns LIBUSB_ERROR_IO if the descriptor is malformed
+ */
+int API_EXPORTED libusb_get_iterator_interface_descriptor(
+	const struct libusb_descriptor_iterator *iter,
+	struct libusb_interface_descriptor *altsetting)
+{
+	int r = check_iterator_descriptor(iter, LIBUSB_DT_INTERFACE,
+		INTERFACE_DESC_LENGTH);
+
+	if (r < 0)
+		return r;
+	decode_interface(iter->descriptor, altsetting);
+	altsetting->endpoint = NULL;
+	altsetting->extra = NULL;
+	altsetting->extra_length = 0;
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup desc
+ * Decode the current descriptor of an iterator as an endpoint descriptor.
+ * The extra field is left empty. bRefresh and bSynchAddress are only set for
+ * audio endpoint descriptors, and are 0 otherwise.
+ *
+ * \param iter the iterator
+ * \param endpoint output location for the endpoint descriptor
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the current descriptor is not an
+ * endpoint descriptor
+ * \returns LIBUSB_ERROR_IO if the descriptor is malformed
+ */
+int API_EXPORTED libusb_get_iterator_endpoint_descriptor(
+	const struct libusb_descriptor_iterator *iter,
+	struct libusb_endpoint_descriptor *endpoint)
+{
+	int r = check_iterator_descriptor(iter, LIBUSB_DT_ENDPOINT,
+		ENDPOINT_DESC_LENGTH);
+
+	if (r < 0)
+		return r;
+	memset(endpoint, 0, sizeof(*endpoint));
+	decode_endpoint(iter->descriptor, endpoint,
+		iter->descriptor[0] >= ENDPOINT_AUDIO_DESC_LENGTH, 0);
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup desc
+ * Decode the current descriptor of an iterator as a superspeed endpoint
+ * companion descriptor.
+ *
+ * \param iter the iterator
+ * \param ep_comp output location for the superspeed endpoint companion
+ * descriptor
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the current descriptor is not a
+ * superspeed endpoint companion descriptor
+ * \returns LIBUSB_ERROR_IO if the descriptor is malformed
+ */
+int API_EXPORTED libusb_get_iterator_ss_endpoint_companion_descriptor(
+	const struct libusb_descriptor_iterator *iter,
+	struct libusb_ss_endpoint_companion_descriptor *ep_comp)
+{
+	int r = check_iterator_descriptor(iter,
+		LIBUSB_DT_SS_ENDPOINT_COMPANION,
+		LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE);
+
+	if (r < 0)
+		return r;
+	decode_ss_ep_comp(iter->descriptor, ep_comp);
+	return LIBUSB_SUCCESS;
 }
 
 /** \ingroup desc
@@ -768,7 +1279,7 @@ int API_EXPORTED libusb_get_ss_endpoint_companion_descriptor(
 	*ep_comp = NULL;
 
 	while (size >= DESC_HEADER_LENGTH) {
-		usbi_parse_descriptor(buffer, "bb", &header, 0);
+		decode_header(buffer, &header);
 		if (header.bLength < 2 || header.bLength > size) {
 			usbi_err(ctx, "invalid descriptor length %d",
 				 header.bLength);
@@ -787,7 +1298,7 @@ int API_EXPORTED libusb_get_ss_endpoint_companion_descriptor(
 		*ep_comp = malloc(sizeof(**ep_comp));
 		if (*ep_comp == NULL)
 			return LIBUSB_ERROR_NO_MEM;
-		usbi_parse_descriptor(buffer, "bbbbw", *ep_comp, 0);
+		decode_ss_ep_comp(buffer, *ep_comp);
 		return LIBUSB_SUCCESS;
 	}
 	return LIBUSB_ERROR_NOT_FOUND;
@@ -821,7 +1332,7 @@ static int parse_bos(struct libusb_context *ctx,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(buffer, "bbwb", &bos_header, host_endian);
+	decode_bos(buffer, &bos_header, host_endian);
 	if (bos_header.bDescriptorType != LIBUSB_DT_BOS) {
 		usbi_err(ctx, "unexpected descriptor %x (expected %x)",
 			 bos_header.bDescriptorType, LIBUSB_DT_BOS);
@@ -842,7 +1353,7 @@ static int parse_bos(struct libusb_context *ctx,
 	if (!_bos)
 		return LIBUSB_ERROR_NO_MEM;
 
-	usbi_parse_descriptor(buffer, "bbwb", _bos, host_endian);
+	decode_bos(buffer, _bos, host_endian);
 	buffer += bos_header.bLength;
 	size -= bos_header.bLength;
 
@@ -853,7 +1364,7 @@ static int parse_bos(struct libusb_context *ctx,
 				  size, LIBUSB_DT_DEVICE_CAPABILITY_SIZE);
 			break;
 		}
-		usbi_parse_descriptor(buffer, "bbb", &dev_cap, host_endian);
+		decode_dev_cap(buffer, &dev_cap);
 		if (dev_cap.bDescriptorType != LIBUSB_DT_DEVICE_CAPABILITY) {
 			usbi_warn(ctx, "unexpected descriptor %x (expected %x)",
 				  dev_cap.bDescriptorType, LIBUSB_DT_DEVICE_CAPABILITY);
@@ -921,7 +1432,7 @@ int API_EXPORTED libusb_get_bos_descriptor(libusb_device_handle *handle,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(bos_header, "bbwb", &_bos, host_endian);
+	decode_bos(bos_header, &_bos, host_endian);
 	usbi_dbg("found BOS descriptor: size %d bytes, %d capabilities",
 		 _bos.wTotalLength, _bos.bNumDeviceCaps);
 	bos_data = calloc(_bos.wTotalLength, 1);
@@ -995,8 +1506,11 @@ int API_EXPORTED libusb_get_usb_2_0_extension_descriptor(
 	if (!_usb_2_0_extension)
 		return LIBUSB_ERROR_NO_MEM;
 
-	usbi_parse_descriptor((unsigned char *)dev_cap, "bbbd",
-			      _usb_2_0_extension, host_endian);
+	_usb_2_0_extension->bLength = dev_cap->bLength;
+	_usb_2_0_extension->bDescriptorType = dev_cap->bDescriptorType;
+	_usb_2_0_extension->bDevCapabilityType = dev_cap->bDevCapabilityType;
+	_usb_2_0_extension->bmAttributes =
+		desc_dword(dev_cap->dev_capability_data, host_endian);
 
 	*usb_2_0_extension = _usb_2_0_extension;
 	return LIBUSB_SUCCESS;
@@ -1053,8 +1567,17 @@ int API_EXPORTED libusb_get_ss_usb_device_capability_descriptor(
 	if (!_ss_usb_device_cap)
 		return LIBUSB_ERROR_NO_MEM;
 
-	usbi_parse_descriptor((unsigned char *)dev_cap, "bbbbwbbw",
-			      _ss_usb_device_cap, host_endian);
+	_ss_usb_device_cap->bLength = dev_cap->bLength;
+	_ss_usb_device_cap->bDescriptorType = dev_cap->bDescriptorType;
+	_ss_usb_device_cap->bDevCapabilityType = dev_cap->bDevCapabilityType;
+	_ss_usb_device_cap->bmAttributes = dev_cap->dev_capability_data[0];
+	_ss_usb_device_cap->wSpeedSupported =
+		desc_word(dev_cap->dev_capability_data + 1, host_endian);
+	_ss_usb_device_cap->bFunctionalitySupport =
+		dev_cap->dev_capability_data[3];
+	_ss_usb_device_cap->bU1DevExitLat = dev_cap->dev_capability_data[4];
+	_ss_usb_device_cap->bU2DevExitLat =
+		desc_word(dev_cap->dev_capability_data + 5, host_endian);
 
 	*ss_usb_device_cap = _ss_usb_device_cap;
 	return LIBUSB_SUCCESS;
@@ -1092,7 +1615,6 @@ int API_EXPORTED libusb_get_container_id_descriptor(struct libusb_context *ctx,
 	struct libusb_container_id_descriptor **container_id)
 {
 	struct libusb_container_id_descriptor *_container_id;
-	const int host_endian = 0;
 
 	if (dev_cap->bDevCapabilityType != LIBUSB_BT_CONTAINER_ID) {
 		usbi_err(ctx, "unexpected bDevCapabilityType %x (expected %x)",
@@ -1110,8 +1632,11 @@ int API_EXPORTED libusb_get_container_id_descriptor(struct libusb_context *ctx,
 	if (!_container_id)
 		return LIBUSB_ERROR_NO_MEM;
 
-	usbi_parse_descriptor((unsigned char *)dev_cap, "bbbbu",
-			      _container_id, host_endian);
+	_container_id->bLength = dev_cap->bLength;
+	_container_id->bDescriptorType = dev_cap->bDescriptorType;
+	_container_id->bDevCapabilityType = dev_cap->bDevCapabilityType;
+	_container_id->bReserved = dev_cap->dev_capability_data[0];
+	memcpy(_container_id->ContainerID, dev_cap->dev_capability_data + 1, 16);
 
 	*container_id = _container_id;
 	return LIBUSB_SUCCESS;
@@ -1131,6 +1656,259 @@ void API_EXPORTED libusb_free_container_id_descriptor(
 	free(container_id);
 }
 
+/* The string descriptors of a handle, as cached when enabled with
+ * libusb_set_string_cache(). Only strings in the first language of the
+ * device are cached, which is what libusb_get_string_descriptor_ascii()
+ * reads. */
+struct usbi_string_cache {
+	/* string descriptor 0, listing the LANGIDs, and its length, 0 if it
+	 * was not read yet */
+	unsigned char langids[255];
+	int langids_len;
+
+	/* the string descriptors read so far, by index. each is a copy of
+	 * the descriptor as retrieved, bLength and bDescriptorType included */
+	unsigned char *strings[256];
+};
+
+void usbi_free_string_cache(struct libusb_device_handle *dev_handle)
+{
+	struct usbi_string_cache *cache = dev_handle->string_cache;
+	int i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < 256; i++)
+		free(cache->strings[i]);
+	free(cache);
+	dev_handle->string_cache = NULL;
+}
+
+/** \ingroup desc
+ * Enable or disable caching of string descriptors on a device handle.
+ *
+ * With the cache enabled, libusb_get_string_descriptor_ascii() reads the
+ * list of languages supported by the device and each string at most once
+ * for the lifetime of the handle, answering later requests from memory
+ * without any bus traffic. This is useful when the same strings are needed
+ * repeatedly. libusb_prefetch_string_descriptors() can fill the cache for
+ * several strings at once.
+ *
+ * Disabling the cache discards all the strings cached so far. The cache
+ * is disabled by default.
+ *
+ * \param dev a device handle
+ * \param enable whether to cache string descriptors
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_set_string_cache(libusb_device_handle *dev,
+	int enable)
+{
+	struct usbi_string_cache *cache = NULL;
+
+	if (enable) {
+		cache = calloc(1, sizeof(*cache));
+		if (!cache)
+			return LIBUSB_ERROR_NO_MEM;
+	}
+
+	usbi_mutex_lock(&dev->lock);
+	if (enable && dev->string_cache) {
+		/* already enabled, keep what was cached */
+		free(cache);
+	} else {
+		usbi_free_string_cache(dev);
+		dev->string_cache = cache;
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+/* get the first LANGID of a device, from the string cache if possible */
+static int get_first_langid(libusb_device_handle *dev, uint16_t *langid)
+{
+	unsigned char tbuf[255]; /* Some devices choke on size > 255 */
+	int r, cached = 0;
+
+	usbi_mutex_lock(&dev->lock);
+	if (dev->string_cache && dev->string_cache->langids_len) {
+		memcpy(tbuf, dev->string_cache->langids,
+			dev->string_cache->langids_len);
+		cached = 1;
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	if (!cached) {
+		r = libusb_get_string_descriptor(dev, 0, 0, tbuf, sizeof(tbuf));
+		if (r < 0)
+			return r;
+		if (r < 4)
+			return LIBUSB_ERROR_IO;
+
+		usbi_mutex_lock(&dev->lock);
+		if (dev->string_cache) {
+			memcpy(dev->string_cache->langids, tbuf, r);
+			dev->string_cache->langids_len = r;
+		}
+		usbi_mutex_unlock(&dev->lock);
+	}
+
+	*langid = tbuf[2] | (tbuf[3] << 8);
+	return LIBUSB_SUCCESS;
+}
+
+/* add a string descriptor that was just read to the cache, if enabled */
+static void cache_string(libusb_device_handle *dev, uint8_t desc_index,
+	const unsigned char *desc, int length)
+{
+	unsigned char *copy;
+
+	usbi_mutex_lock(&dev->lock);
+	if (dev->string_cache && !dev->string_cache->strings[desc_index]) {
+		copy = malloc(length);
+		if (copy) {
+			memcpy(copy, desc, length);
+			dev->string_cache->strings[desc_index] = copy;
+		}
+	}
+	usbi_mutex_unlock(&dev->lock);
+}
+
+/* convert a UTF-16LE string descriptor to ASCII */
+static int string_desc_to_ascii(const unsigned char *tbuf, int r,
+	unsigned char *data, int length)
+{
+	int si, di;
+
+	if (r < 2 || tbuf[1] != LIBUSB_DT_STRING)
+		return LIBUSB_ERROR_IO;
+
+	if (tbuf[0] > r)
+		return LIBUSB_ERROR_IO;
+
+	for (di = 0, si = 2; si + 1 < tbuf[0]; si += 2) {
+		if (di >= (length - 1))
+			break;
+
+		if ((tbuf[si] & 0x80) || (tbuf[si + 1])) /* non-ASCII */
+			data[di++] = '?';
+		else
+			data[di++] = tbuf[si];
+	}
+
+	data[di] = 0;
+	return di;
+}
+
+/** \ingroup desc
+ * Read several string descriptors into the string cache of a handle at
+ * once, so that later calls to libusb_get_string_descriptor_ascii() for
+ * these indices do not have to touch the bus.
+ *
+ * The control transfers for all the strings are submitted together
+ * instead of one after the other, which saves a round trip through the
+ * kernel and the event loop for each of them. The cache is enabled on the
+ * handle if it was not already, see libusb_set_string_cache(). Indices
+ * that are 0, already cached or that the device fails to return are
+ * skipped.
+ *
+ * This function blocks until all the transfers have completed.
+ *
+ * \param dev a device handle
+ * \param desc_indices the indices of the string descriptors to read
+ * \param num_indices the number of entries in desc_indices
+ * \returns the number of strings added to the cache
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code if the languages supported by the
+ * device cannot be read
+ */
+int API_EXPORTED libusb_prefetch_string_descriptors(libusb_device_handle *dev,
+	const uint8_t *desc_indices, int num_indices)
+{
+	struct libusb_transfer **transfers;
+	unsigned char *buffers;
+	int num_transfers = 0;
+	int num_cached = 0;
+	uint16_t langid;
+	int i, j, r;
+
+	if (num_indices < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	r = libusb_set_string_cache(dev, 1);
+	if (r < 0)
+		return r;
+	r = get_first_langid(dev, &langid);
+	if (r < 0)
+		return r;
+
+	transfers = calloc(num_indices ? num_indices : 1, sizeof(*transfers));
+	buffers = malloc((num_indices ? num_indices : 1)
+		* (LIBUSB_CONTROL_SETUP_SIZE + 255));
+	if (!transfers || !buffers) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+
+	for (i = 0; i < num_indices; i++) {
+		uint8_t desc_index = desc_indices[i];
+		unsigned char *buffer;
+		int skip = (desc_index == 0);
+
+		usbi_mutex_lock(&dev->lock);
+		if (dev->string_cache && dev->string_cache->strings[desc_index])
+			skip = 1;
+		usbi_mutex_unlock(&dev->lock);
+		for (j = 0; j < i && !skip; j++)
+			if (desc_indices[j] == desc_index)
+				skip = 1;
+		if (skip)
+			continue;
+
+		transfers[num_transfers] = libusb_alloc_transfer(0);
+		if (!transfers[num_transfers]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		buffer = buffers + num_transfers * (LIBUSB_CONTROL_SETUP_SIZE + 255);
+		libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_DESCRIPTOR,
+			(uint16_t) ((LIBUSB_DT_STRING << 8) | desc_index), langid, 255);
+		libusb_fill_control_transfer(transfers[num_transfers], dev, buffer,
+			NULL, NULL, 1000);
+		num_transfers++;
+	}
+
+	r = usbi_sync_transfer_batch(dev, transfers, num_transfers);
+	for (i = 0; i < r; i++) {
+		struct libusb_transfer *transfer = transfers[i];
+		unsigned char *desc = libusb_control_transfer_get_data(transfer);
+		struct libusb_control_setup *setup =
+			libusb_control_transfer_get_setup(transfer);
+
+		if (transfer->status != LIBUSB_TRANSFER_COMPLETED
+				|| transfer->actual_length < 2
+				|| desc[0] < 2 || desc[1] != LIBUSB_DT_STRING
+				|| desc[0] > transfer->actual_length)
+			continue;
+		cache_string(dev, (uint8_t) (libusb_le16_to_cpu(setup->wValue) & 0xff),
+			desc, desc[0]);
+		num_cached++;
+	}
+	r = num_cached;
+
+out:
+	if (transfers)
+		for (i = 0; i < num_transfers; i++)
+			libusb_free_transfer(transfers[i]);
+	free(transfers);
+	free(buffers);
+	return r;
+}
+
 /** \ingroup desc
  * Retrieve a string descriptor in C style ASCII.
  *
@@ -1147,7 +1925,7 @@ int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	uint8_t desc_index, unsigned char *data, int length)
 {
 	unsigned char tbuf[255]; /* Some devices choke on size > 255 */
-	int r, si, di;
+	int r = 0;
 	uint16_t langid;
 
 	/* Asking for the zero'th index is special - it returns a string
@@ -1162,36 +1940,26 @@ int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	if (desc_index == 0)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	r = libusb_get_string_descriptor(dev, 0, 0, tbuf, sizeof(tbuf));
+	usbi_mutex_lock(&dev->lock);
+	if (dev->string_cache && dev->string_cache->strings[desc_index]) {
+		r = dev->string_cache->strings[desc_index][0];
+		memcpy(tbuf, dev->string_cache->strings[desc_index], r);
+	}
+	usbi_mutex_unlock(&dev->lock);
+	if (r)
+		return string_desc_to_ascii(tbuf, r, data, length);
+
+	r = get_first_langid(dev, &langid);
 	if (r < 0)
 		return r;
 
-	if (r < 4)
-		return LIBUSB_ERROR_IO;
-
-	langid = tbuf[2] | (tbuf[3] << 8);
-
 	r = libusb_get_string_descriptor(dev, desc_index, langid, tbuf,
 		sizeof(tbuf));
 	if (r < 0)
 		return r;
 
-	if (tbuf[1] != LIBUSB_DT_STRING)
-		return LIBUSB_ERROR_IO;
-
-	if (tbuf[0] > r)
-		return LIBUSB_ERROR_IO;
-
-	for (di = 0, si = 2; si < tbuf[0]; si += 2) {
-		if (di >= (length - 1))
-			break;
-
-		if ((tbuf[si] & 0x80) || (tbuf[si + 1])) /* non-ASCII */
-			data[di++] = '?';
-		else
-			data[di++] = tbuf[si];
-	}
-
-	data[di] = 0;
-	return di;
+	r = string_desc_to_ascii(tbuf, r, data, length);
+	if (r >= 0 && tbuf[0] >= 2)
+		cache_string(dev, desc_index, tbuf, tbuf[0]);
+	return r;
 }
@@ -170,25 +170,89 @@ static int usbi_hotplug_match_cb (struct libusb_context *ctx,
 	return hotplug_cb->cb (ctx, dev, event, hotplug_cb->user_data);
 }
 
-void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
-	libusb_hotplug_event event)
+/* Besides ctx->hotplug_cbs, every callback is in exactly one index list,
+ * picked from the most specific thing it matches on:
+ *  - callbacks for a vendor ID are hashed by vendor and product ID, the
+ *    product ID being LIBUSB_HOTPLUG_MATCH_ANY if not given
+ *  - callbacks for a device class only are hashed by class
+ *  - all other callbacks are in hotplug_cbs_any
+ * so that an event only has to look at the few lists that can hold
+ * callbacks matching the device. Matching still checks all the filters. */
+#define HOTPLUG_ID_HASH(vendor_id, product_id) \
+	((((unsigned int)(vendor_id) * 31) + (unsigned int)(product_id)) \
+		% USBI_HOTPLUG_HASH_SIZE)
+#define HOTPLUG_CLASS_HASH(dev_class) \
+	((unsigned int)(dev_class) % USBI_HOTPLUG_HASH_SIZE)
+
+static struct list_head *hotplug_index_list(struct libusb_context *ctx,
+	struct libusb_hotplug_callback *hotplug_cb)
+{
+	if (LIBUSB_HOTPLUG_MATCH_ANY != hotplug_cb->vendor_id)
+		return &ctx->hotplug_cbs_by_id[HOTPLUG_ID_HASH(hotplug_cb->vendor_id,
+			hotplug_cb->product_id)];
+	if (LIBUSB_HOTPLUG_MATCH_ANY == hotplug_cb->product_id &&
+	    LIBUSB_HOTPLUG_MATCH_ANY != hotplug_cb->dev_class)
+		return &ctx->hotplug_cbs_by_class[HOTPLUG_CLASS_HASH(hotplug_cb->dev_class)];
+	return &ctx->hotplug_cbs_any;
+}
+
+static void hotplug_free_cb(struct libusb_hotplug_callback *hotplug_cb)
+{
+	list_del(&hotplug_cb->list);
+	list_del(&hotplug_cb->index_list);
+	free(hotplug_cb);
+}
+
+/* run the callbacks of an index list for an event. called with
+ * hotplug_cbs_lock held, which is dropped around each callback */
+static void hotplug_match_list(struct libusb_context *ctx,
+	struct libusb_device *dev, libusb_hotplug_event event,
+	struct list_head *cbs)
 {
 	struct libusb_hotplug_callback *hotplug_cb, *next;
 	int ret;
 
-	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
-
-	list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list, struct libusb_hotplug_callback) {
+	list_for_each_entry_safe(hotplug_cb, next, cbs, index_list, struct libusb_hotplug_callback) {
 		usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
 		ret = usbi_hotplug_match_cb (ctx, dev, event, hotplug_cb);
 		usbi_mutex_lock(&ctx->hotplug_cbs_lock);
 
-		if (ret) {
-			list_del(&hotplug_cb->list);
-			free(hotplug_cb);
+		if (ret)
+			hotplug_free_cb(hotplug_cb);
+	}
+}
+
+void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
+	libusb_hotplug_event event)
+{
+	struct libusb_hotplug_callback *hotplug_cb, *next;
+	struct list_head *by_id, *by_vendor;
+
+	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+
+	if (!dev) {
+		/* woken up by libusb_hotplug_deregister_callback(): free the
+		 * callbacks marked for deregistration, wherever they are */
+		list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list, struct libusb_hotplug_callback) {
+			if (hotplug_cb->needs_free)
+				hotplug_free_cb(hotplug_cb);
 		}
+		usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
+		return;
 	}
 
+	by_id = &ctx->hotplug_cbs_by_id[HOTPLUG_ID_HASH(
+		dev->device_descriptor.idVendor, dev->device_descriptor.idProduct)];
+	by_vendor = &ctx->hotplug_cbs_by_id[HOTPLUG_ID_HASH(
+		dev->device_descriptor.idVendor, LIBUSB_HOTPLUG_MATCH_ANY)];
+
+	hotplug_match_list(ctx, dev, event, by_id);
+	if (by_vendor != by_id)
+		hotplug_match_list(ctx, dev, event, by_vendor);
+	hotplug_match_list(ctx, dev, event, &ctx->hotplug_cbs_by_class[
+		HOTPLUG_CLASS_HASH(dev->device_descriptor.bDeviceClass)]);
+	hotplug_match_list(ctx, dev, event, &ctx->hotplug_cbs_any);
+
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
 
 	/* loop through and disconnect all open handles for this device */
@@ -213,6 +277,7 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 {
 	libusb_hotplug_callback *new_callback;
 	static int handle_id = 1;
+	int r;
 
 	/* check for hotplug support */
 	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
@@ -229,6 +294,11 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 
 	USBI_GET_CONTEXT(ctx);
 
+	/* the callback needs the backend to be watching for devices */
+	r = usbi_init_backend(ctx);
+	if (r < 0)
+		return r;
+
 	new_callback = (libusb_hotplug_callback *)calloc(1, sizeof (*new_callback));
 	if (!new_callback) {
 		return LIBUSB_ERROR_NO_MEM;
@@ -251,6 +321,7 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 	new_callback->handle = handle_id++;
 
 	list_add(&new_callback->list, &ctx->hotplug_cbs);
+	list_add(&new_callback->index_list, hotplug_index_list(ctx, new_callback));
 
 	if (flags & LIBUSB_HOTPLUG_ENUMERATE) {
 		struct libusb_device *dev;
@@ -305,14 +376,49 @@ void API_EXPORTED libusb_hotplug_deregister_callback (struct libusb_context *ctx
 	}
 }
 
+int API_EXPORTED libusb_hotplug_set_batch_callback(libusb_context *ctx,
+	libusb_hotplug_batch_callback_fn cb_fn, void *user_data)
+{
+	/* check for hotplug support */
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	USBI_GET_CONTEXT(ctx);
+
+	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+	ctx->hotplug_batch_cb = cb_fn;
+	ctx->hotplug_batch_user_data = user_data;
+	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+void usbi_hotplug_match_batch(struct libusb_context *ctx,
+	const libusb_hotplug_message *messages, int num_messages)
+{
+	libusb_hotplug_batch_callback_fn cb_fn;
+	void *user_data;
+
+	if (!num_messages)
+		return;
+
+	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+	cb_fn = ctx->hotplug_batch_cb;
+	user_data = ctx->hotplug_batch_user_data;
+	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
+
+	if (cb_fn)
+		cb_fn(ctx, messages, num_messages, user_data);
+}
+
 void usbi_hotplug_deregister_all(struct libusb_context *ctx) {
 	struct libusb_hotplug_callback *hotplug_cb, *next;
 
 	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
 	list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list,
 				 struct libusb_hotplug_callback) {
-		list_del(&hotplug_cb->list);
-		free(hotplug_cb);
+		hotplug_free_cb(hotplug_cb);
 	}
 
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
@@ -64,19 +64,22 @@ struct libusb_hotplug_callback {
 
 	/** List this callback is registered in (ctx->hotplug_cbs) */
 	struct list_head list;
+
+	/** Entry in the index list of the context this callback is found
+	 * through, see hotplug_index_list() */
+	struct list_head index_list;
 };
 
 typedef struct libusb_hotplug_callback libusb_hotplug_callback;
 
-struct libusb_hotplug_message {
-	libusb_hotplug_event event;
-	struct libusb_device *device;
-};
-
-typedef struct libusb_hotplug_message libusb_hotplug_message;
+/* messages written to the hotplug pipe have the layout of the events given
+ * to the batch callback, so that they can be passed on as they were read */
+typedef struct libusb_hotplug_batch_event libusb_hotplug_message;
 
 void usbi_hotplug_deregister_all(struct libusb_context *ctx);
 void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
 			libusb_hotplug_event event);
+void usbi_hotplug_match_batch(struct libusb_context *ctx,
+			const libusb_hotplug_message *messages, int num_messages);
 
 #endif
@@ -34,10 +34,22 @@
 #ifdef USBI_TIMERFD_AVAILABLE
 #include <sys/timerfd.h>
 #endif
+#ifdef USBI_EVENTFD_AVAILABLE
+#include <sys/eventfd.h>
+#endif
+#ifdef USBI_EPOLL_AVAILABLE
+#include <sys/epoll.h>
+#endif
 
 #include "libusbi.h"
 #include "hotplug.h"
 
+#ifdef USBI_EPOLL_AVAILABLE
+/* maximum number of ready fds reported by a single epoll_wait(). anything
+ * beyond this stays ready and is picked up on the next call */
+#define USBI_EPOLL_MAX_EVENTS	64
+#endif
+
 /**
  * \page io Synchronous and asynchronous device I/O
  *
@@ -311,6 +323,20 @@ if (r == 0 && actual_length == sizeof(data)) {
  * transfer, fill and submit it, and when it returns with results you just
  * resubmit it for the next interrupt.
  *
+ * \section asyncpool Transfer pools
+ *
+ * Applications that keep many transfers in flight and constantly replace
+ * them, rather than resubmitting the same ones, can allocate them from a
+ * pool instead. libusb_alloc_transfer_pool() allocates a number of transfers
+ * up front, libusb_pool_get_transfer() hands out an idle one, and
+ * libusb_free_transfer() (including the automatic free requested by
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+ * "LIBUSB_TRANSFER_FREE_TRANSFER") returns it to the pool rather than the
+ * system allocator. Transfers handed back to a pool are reset to the state of
+ * a newly allocated transfer, but keep any resources the OS backend attached
+ * to them, so that in the steady state neither allocating nor submitting
+ * a transfer involves the heap.
+ *
  * \section asynccancel Cancellation
  *
  * Another advantage of using the asynchronous interface is that you have
@@ -461,8 +487,10 @@ if (r == 0 && actual_length == sizeof(data)) {
  *
  * The data for each packet will be found at an offset into the buffer that
  * can be calculated as if each prior packet completed in full. The
- * libusb_get_iso_packet_buffer() and libusb_get_iso_packet_buffer_simple()
- * functions may help you here.
+ * libusb_get_iso_packet_data(), libusb_get_iso_packet_buffer() and
+ * libusb_get_iso_packet_buffer_simple() functions may help you here, and
+ * libusb_copy_iso_packets() gathers the received data into a contiguous
+ * buffer.
  *
  * \section asyncmem Memory caveats
  *
@@ -472,6 +500,11 @@ if (r == 0 && actual_length == sizeof(data)) {
  * the function returns it's stack gets destroyed. This is true for both
  * host-to-device and device-to-host transfers.
  *
+ * For bulk and isochronous streams at high data rates, consider allocating
+ * transfer buffers with libusb_dev_mem_alloc(). Where the OS supports it
+ * (Linux 4.6 and newer), this returns memory that the host controller can
+ * access directly, saving the kernel a copy of every transfer's data.
+ *
  * The only case in which it is safe to use stack memory is where you can
  * guarantee that the function owning the stack space for the buffer does not
  * return until after the transfer's callback function has completed. In every
@@ -577,6 +610,11 @@ void my_libusb_exit(void)
     libusb_exit(ctx);
 }
 \endcode
+ *
+ * Alternatively, libusb_start_event_thread() has libusbx run such a thread
+ * itself, and takes care of waking it up and stopping it in
+ * libusb_stop_event_thread() or libusb_exit(). It can also pin the thread to
+ * a set of CPUs and give it a real-time priority.
  */
 
 /**
@@ -741,6 +779,12 @@ while (user has not requested application exit) {
  * call libusb_get_pollfds(), you can set up notification functions for when
  * the file descriptor set changes using libusb_set_pollfd_notifiers().
  *
+ * Where the platform supports it, libusb_get_event_fd() offers a simpler
+ * alternative: a single file descriptor that stands for the whole set and
+ * stays valid for the life of the context. It becomes readable whenever one
+ * of the file descriptors in the set would, so your main loop only has to
+ * watch that one, and has nothing to update when devices come and go.
+ *
  * \subsection mtissues Multi-threaded considerations
  *
  * Unfortunately, the situation is complicated further when multiple threads
@@ -1108,17 +1152,52 @@ int usbi_io_init(struct libusb_context *ctx)
 {
 	int r;
 
-	usbi_mutex_init(&ctx->flying_transfers_lock, NULL);
+	usbi_mutex_init(&ctx->timeouts_lock, NULL);
 	usbi_mutex_init(&ctx->pollfds_lock, NULL);
 	usbi_mutex_init(&ctx->pollfd_modify_lock, NULL);
 	usbi_mutex_init_recursive(&ctx->events_lock, NULL);
 	usbi_mutex_init(&ctx->event_waiters_lock, NULL);
 	usbi_cond_init(&ctx->event_waiters_cond, NULL);
-	list_init(&ctx->flying_transfers);
+	usbi_mutex_init(&ctx->dispatch_lock, NULL);
+	usbi_cond_init(&ctx->dispatch_cond, NULL);
+	list_init(&ctx->running_callbacks);
+	list_init(&ctx->sync_waiters);
 	list_init(&ctx->pollfds);
 
-	/* FIXME should use an eventfd on kernels that support it */
+#ifdef USBI_EPOLL_AVAILABLE
+	/* the epoll set must exist before any pollfd is added, so that it picks
+	 * up the internal pipes as well */
+	ctx->epoll_fd = -1;
+	if (usbi_backend->handle_fd_event) {
+		ctx->epoll_events = malloc(USBI_EPOLL_MAX_EVENTS *
+			sizeof(*ctx->epoll_events));
+		if (ctx->epoll_events)
+			ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (ctx->epoll_fd >= 0) {
+			usbi_dbg("using epoll for event handling");
+		} else {
+			usbi_dbg("epoll not available (code %d error %d)", ctx->epoll_fd, errno);
+			free(ctx->epoll_events);
+			ctx->epoll_events = NULL;
+			ctx->epoll_fd = -1;
+		}
+	}
+#endif
+
+#ifdef USBI_EVENTFD_AVAILABLE
+	/* an eventfd does the job of the control pipe with a single fd */
+	ctx->ctrl_pipe[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ctx->ctrl_pipe[0] >= 0) {
+		usbi_dbg("using eventfd for internal signalling");
+		ctx->ctrl_pipe[1] = ctx->ctrl_pipe[0];
+		r = 0;
+	} else {
+		usbi_dbg("eventfd not available (code %d error %d)", ctx->ctrl_pipe[0], errno);
+		r = usbi_pipe(ctx->ctrl_pipe);
+	}
+#else
 	r = usbi_pipe(ctx->ctrl_pipe);
+#endif
 	if (r < 0) {
 		r = LIBUSB_ERROR_OTHER;
 		goto err;
@@ -1163,14 +1242,23 @@ err_close_hp_pipe:
 	usbi_close(ctx->hotplug_pipe[1]);
 err_close_pipe:
 	usbi_close(ctx->ctrl_pipe[0]);
-	usbi_close(ctx->ctrl_pipe[1]);
+	if (!usbi_using_eventfd(ctx))
+		usbi_close(ctx->ctrl_pipe[1]);
 err:
-	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx)) {
+		close(ctx->epoll_fd);
+		free(ctx->epoll_events);
+	}
+#endif
+	usbi_mutex_destroy(&ctx->timeouts_lock);
 	usbi_mutex_destroy(&ctx->pollfds_lock);
 	usbi_mutex_destroy(&ctx->pollfd_modify_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
+	usbi_cond_destroy(&ctx->dispatch_cond);
+	usbi_mutex_destroy(&ctx->dispatch_lock);
 	return r;
 }
 
@@ -1178,7 +1266,8 @@ void usbi_io_exit(struct libusb_context *ctx)
 {
 	usbi_remove_pollfd(ctx, ctx->ctrl_pipe[0]);
 	usbi_close(ctx->ctrl_pipe[0]);
-	usbi_close(ctx->ctrl_pipe[1]);
+	if (!usbi_using_eventfd(ctx))
+		usbi_close(ctx->ctrl_pipe[1]);
 	usbi_remove_pollfd(ctx, ctx->hotplug_pipe[0]);
 	usbi_close(ctx->hotplug_pipe[0]);
 	usbi_close(ctx->hotplug_pipe[1]);
@@ -1188,12 +1277,25 @@ void usbi_io_exit(struct libusb_context *ctx)
 		close(ctx->timerfd);
 	}
 #endif
-	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx)) {
+		close(ctx->epoll_fd);
+		free(ctx->epoll_events);
+	}
+#endif
+	free(ctx->poll_fds);
+	free(ctx->poll_handles);
+	free(ctx->timeout_heap);
+	free(ctx->batch_transfers);
+	free(ctx->batch_flags);
+	usbi_mutex_destroy(&ctx->timeouts_lock);
 	usbi_mutex_destroy(&ctx->pollfds_lock);
 	usbi_mutex_destroy(&ctx->pollfd_modify_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
+	usbi_cond_destroy(&ctx->dispatch_cond);
+	usbi_mutex_destroy(&ctx->dispatch_lock);
 }
 
 static int calculate_timeout(struct usbi_transfer *transfer)
@@ -1225,71 +1327,280 @@ static int calculate_timeout(struct usbi_transfer *transfer)
 	return 0;
 }
 
-/* add a transfer to the (timeout-sorted) active transfers list.
- * Callers of this function must hold the flying_transfers_lock.
- * This function *always* adds the transfer to the flying_transfers list,
- * it will return non 0 if it fails to update the timer, but even then the
- * transfer is added to the flying_transfers list. */
-static int add_to_flying_list(struct usbi_transfer *transfer)
+/* the timeout heap is a binary min-heap of the in-flight transfers that have
+ * a timeout for libusbx to enforce, ordered by expiry time. all of the
+ * functions below must be called with the timeouts_lock held. */
+
+static void timeout_heap_set(struct libusb_context *ctx, int idx,
+	struct usbi_transfer *transfer)
 {
-	struct usbi_transfer *cur;
-	struct timeval *timeout = &transfer->timeout;
-	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
-	int r = 0;
-	int first = 1;
+	ctx->timeout_heap[idx] = transfer;
+	transfer->timeout_heap_idx = idx;
+}
 
-	/* if we have no other flying transfers, start the list with this one */
-	if (list_empty(&ctx->flying_transfers)) {
-		list_add(&transfer->list, &ctx->flying_transfers);
-		goto out;
-	}
+static void timeout_heap_sift_up(struct libusb_context *ctx, int idx)
+{
+	struct usbi_transfer *transfer = ctx->timeout_heap[idx];
 
-	/* if we have infinite timeout, append to end of list */
-	if (!timerisset(timeout)) {
-		list_add_tail(&transfer->list, &ctx->flying_transfers);
-		/* first is irrelevant in this case */
-		goto out;
+	while (idx > 0) {
+		int parent = (idx - 1) / 2;
+		struct usbi_transfer *cur = ctx->timeout_heap[parent];
+
+		if (!timercmp(&transfer->timeout, &cur->timeout, <))
+			break;
+		timeout_heap_set(ctx, idx, cur);
+		idx = parent;
 	}
+	timeout_heap_set(ctx, idx, transfer);
+}
 
-	/* otherwise, find appropriate place in list */
-	list_for_each_entry(cur, &ctx->flying_transfers, list, struct usbi_transfer) {
-		/* find first timeout that occurs after the transfer in question */
-		struct timeval *cur_tv = &cur->timeout;
+static void timeout_heap_sift_down(struct libusb_context *ctx, int idx)
+{
+	struct usbi_transfer *transfer = ctx->timeout_heap[idx];
+	int len = ctx->timeout_heap_len;
 
-		if (!timerisset(cur_tv) || (cur_tv->tv_sec > timeout->tv_sec) ||
-				(cur_tv->tv_sec == timeout->tv_sec &&
-					cur_tv->tv_usec > timeout->tv_usec)) {
-			list_add_tail(&transfer->list, &cur->list);
-			goto out;
-		}
-		first = 0;
+	while (1) {
+		int child = 2 * idx + 1;
+		struct usbi_transfer *cur;
+
+		if (child >= len)
+			break;
+		if (child + 1 < len && timercmp(&ctx->timeout_heap[child + 1]->timeout,
+				&ctx->timeout_heap[child]->timeout, <))
+			child++;
+		cur = ctx->timeout_heap[child];
+		if (!timercmp(&cur->timeout, &transfer->timeout, <))
+			break;
+		timeout_heap_set(ctx, idx, cur);
+		idx = child;
 	}
-	/* first is 0 at this stage (list not empty) */
+	timeout_heap_set(ctx, idx, transfer);
+}
+
+static int timeout_heap_push(struct libusb_context *ctx,
+	struct usbi_transfer *transfer)
+{
+	if (ctx->timeout_heap_len == ctx->timeout_heap_size) {
+		int size = ctx->timeout_heap_size ? 2 * ctx->timeout_heap_size : 64;
+		struct usbi_transfer **heap = realloc(ctx->timeout_heap,
+			size * sizeof(*heap));
+		if (!heap)
+			return LIBUSB_ERROR_NO_MEM;
+		ctx->timeout_heap = heap;
+		ctx->timeout_heap_size = size;
+	}
+
+	ctx->timeout_heap[ctx->timeout_heap_len] = transfer;
+	timeout_heap_sift_up(ctx, ctx->timeout_heap_len++);
+	return 0;
+}
+
+static void timeout_heap_remove(struct libusb_context *ctx,
+	struct usbi_transfer *transfer)
+{
+	int idx = transfer->timeout_heap_idx;
+	struct usbi_transfer *last = ctx->timeout_heap[--ctx->timeout_heap_len];
+
+	transfer->timeout_heap_idx = -1;
+	if (idx == ctx->timeout_heap_len)
+		return;
+
+	/* move the last element into the hole and restore the heap order */
+	timeout_heap_set(ctx, idx, last);
+	if (idx > 0 && timercmp(&last->timeout,
+			&ctx->timeout_heap[(idx - 1) / 2]->timeout, <))
+		timeout_heap_sift_up(ctx, idx);
+	else
+		timeout_heap_sift_down(ctx, idx);
+}
 
-	/* otherwise we need to be inserted at the end */
-	list_add_tail(&transfer->list, &ctx->flying_transfers);
-out:
 #ifdef USBI_TIMERFD_AVAILABLE
-	if (first && usbi_using_timerfd(ctx) && timerisset(timeout)) {
-		/* if this transfer has the lowest timeout of all active transfers,
-		 * rearm the timerfd with this transfer's timeout */
-		const struct itimerspec it = { {0, 0},
-			{ timeout->tv_sec, timeout->tv_usec * 1000 } };
+static int disarm_timerfd(struct libusb_context *ctx)
+{
+	const struct itimerspec disarm_timer = { { 0, 0 }, { 0, 0 } };
+	int r;
+
+	usbi_dbg("");
+	r = timerfd_settime(ctx->timerfd, 0, &disarm_timer, NULL);
+	if (r < 0)
+		return LIBUSB_ERROR_OTHER;
+	else
+		return 0;
+}
+
+/* rearms the timerfd based on the next upcoming timeout, i.e. the root of
+ * the timeout heap, or disarms it if there is none.
+ * must be called with flying_list locked.
+ * returns 0 if there was no timeout to arm, 1 if the next timeout was armed,
+ * or a LIBUSB_ERROR code on failure.
+ */
+static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+{
+	struct usbi_transfer *transfer;
+	struct itimerspec it;
+	int r;
+
+	if (!usbi_using_timerfd(ctx))
+		return 0;
+
+	if (!ctx->timeout_heap_len)
+		return disarm_timerfd(ctx);
+
+	transfer = ctx->timeout_heap[0];
+	memset(&it, 0, sizeof(it));
+	it.it_value.tv_sec = transfer->timeout.tv_sec;
+	it.it_value.tv_nsec = transfer->timeout.tv_usec * 1000;
+	usbi_dbg("next timeout originally %dms", USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
+	r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
+	if (r < 0)
+		return LIBUSB_ERROR_OTHER;
+	return 1;
+}
+#else
+static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+{
+	(void)ctx;
+	return 0;
+}
+#endif
+
+/* start tracking the timeout of a transfer that was just submitted, unless
+ * it is infinite or handled by the OS, leaving the timerfd alone.
+ * Callers of this function must hold the timeouts_lock. */
+static int insert_timeout(struct usbi_transfer *transfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+
+	if (!timerisset(&transfer->timeout)
+			|| (transfer->flags & USBI_TRANSFER_OS_HANDLES_TIMEOUT))
+		return 0;
+
+	return timeout_heap_push(ctx, transfer);
+}
+
+/* start tracking the timeout of a transfer that was just submitted, and
+ * rearm the timerfd if it is now the first one due. */
+static int add_timeout(struct usbi_transfer *transfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	int r;
+
+	if (!timerisset(&transfer->timeout)
+			|| (transfer->flags & USBI_TRANSFER_OS_HANDLES_TIMEOUT))
+		return 0;
+
+	usbi_mutex_lock(&ctx->timeouts_lock);
+	r = insert_timeout(transfer);
+
+	/* only rearm if this transfer now has the lowest timeout of all
+	 * active transfers */
+	if (r == 0 && transfer->timeout_heap_idx == 0) {
 		usbi_dbg("arm timerfd for timeout in %dms (first in line)",
 			USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-		r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
-		if (r < 0) {
+		r = arm_timerfd_for_next_timeout(ctx);
+		if (r < 0)
 			usbi_warn(ctx, "failed to arm first timerfd (errno %d)", errno);
-			r = LIBUSB_ERROR_OTHER;
-		}
 	}
-#else
-	UNUSED(first);
-#endif
+	usbi_mutex_unlock(&ctx->timeouts_lock);
+	return r;
+}
+
+/* stop tracking a transfer's timeout, rearming the timerfd if that changes
+ * the earliest pending deadline. */
+static int remove_timeout(struct usbi_transfer *transfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	int was_first;
+	int r = 0;
+
+	/* a transfer never enters the heap once it is in flight, so there is
+	 * no need to take the global lock if it isn't in there now */
+	if (transfer->timeout_heap_idx < 0)
+		return 0;
 
+	usbi_mutex_lock(&ctx->timeouts_lock);
+	if (transfer->timeout_heap_idx >= 0) {
+		was_first = (transfer->timeout_heap_idx == 0);
+		timeout_heap_remove(ctx, transfer);
+		if (was_first)
+			r = arm_timerfd_for_next_timeout(ctx);
+	}
+	usbi_mutex_unlock(&ctx->timeouts_lock);
 	return r;
 }
 
+/* remove a transfer from the in-flight list of its device handle and from
+ * the timeout heap.
+ * Callers of this function must hold the flying_lock of the handle. */
+int usbi_remove_from_flying_list(struct usbi_transfer *transfer)
+{
+	list_del(&transfer->list);
+	return remove_timeout(transfer);
+}
+
+struct libusb_transfer_pool {
+	usbi_mutex_t lock;
+
+	/* idle transfers, linked through usbi_transfer.list */
+	struct list_head idle_transfers;
+
+	/* number of transfers that are currently handed out */
+	int outstanding;
+
+	int iso_packets;
+
+	/* set by libusb_free_transfer_pool() while transfers are outstanding.
+	 * the last one to come back frees the pool */
+	int destroyed;
+};
+
+/* the offset table of isochronous transfers follows the os_priv area, see
+ * libusb_get_iso_packet_data() */
+static size_t iso_offsets_pos(int iso_packets)
+{
+	size_t pos = sizeof(struct usbi_transfer)
+		+ sizeof(struct libusb_transfer)
+		+ (sizeof(struct libusb_iso_packet_descriptor) * iso_packets)
+		+ usbi_backend->transfer_priv_size
+		+ (usbi_backend->add_iso_packet_size * iso_packets);
+
+	return (pos + sizeof(unsigned int) - 1) & ~(sizeof(unsigned int) - 1);
+}
+
+static unsigned int *iso_offsets(struct usbi_transfer *itransfer)
+{
+	return (unsigned int *)((unsigned char *)itransfer
+		+ iso_offsets_pos(itransfer->num_iso_packets));
+}
+
+static struct usbi_transfer *alloc_transfer(int iso_packets)
+{
+	size_t alloc_size = iso_offsets_pos(iso_packets)
+		+ sizeof(unsigned int) * iso_packets;
+	struct usbi_transfer *itransfer = calloc(1, alloc_size);
+	if (!itransfer)
+		return NULL;
+
+	itransfer->num_iso_packets = iso_packets;
+	itransfer->timeout_heap_idx = -1;
+	usbi_mutex_init(&itransfer->lock, NULL);
+	return itransfer;
+}
+
+static void free_transfer(struct usbi_transfer *itransfer)
+{
+	if (usbi_backend->free_transfer_priv)
+		usbi_backend->free_transfer_priv(itransfer);
+	usbi_mutex_destroy(&itransfer->lock);
+	free(itransfer);
+}
+
+static void free_pool(struct libusb_transfer_pool *pool)
+{
+	usbi_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
 /** \ingroup asyncio
  * Allocate a libusbx transfer with a specified number of isochronous packet
  * descriptors. The returned transfer is pre-initialized for you. When the new
@@ -1317,18 +1628,9 @@ DEFAULT_VISIBILITY
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
 	int iso_packets)
 {
-	size_t os_alloc_size = usbi_backend->transfer_priv_size
-		+ (usbi_backend->add_iso_packet_size * iso_packets);
-	size_t alloc_size = sizeof(struct usbi_transfer)
-		+ sizeof(struct libusb_transfer)
-		+ (sizeof(struct libusb_iso_packet_descriptor) * iso_packets)
-		+ os_alloc_size;
-	struct usbi_transfer *itransfer = calloc(1, alloc_size);
+	struct usbi_transfer *itransfer = alloc_transfer(iso_packets);
 	if (!itransfer)
 		return NULL;
-
-	itransfer->num_iso_packets = iso_packets;
-	usbi_mutex_init(&itransfer->lock, NULL);
 	return USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 }
 
@@ -1341,6 +1643,9 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
  * non-NULL, this function will also free the transfer buffer using the
  * standard system memory allocator (e.g. free()).
  *
+ * If the transfer was obtained with libusb_pool_get_transfer(), it is handed
+ * back to its pool for reuse instead of being freed.
+ *
  * It is legal to call this function with a NULL transfer. In this case,
  * the function will simply return safely.
  *
@@ -1352,6 +1657,9 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
 void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 {
 	struct usbi_transfer *itransfer;
+	struct libusb_transfer_pool *pool;
+	int last;
+
 	if (!transfer)
 		return;
 
@@ -1359,160 +1667,1648 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 		free(transfer->buffer);
 
 	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	usbi_mutex_destroy(&itransfer->lock);
-	free(itransfer);
-}
+	pool = itransfer->pool;
+	if (!pool) {
+		free_transfer(itransfer);
+		return;
+	}
 
-#ifdef USBI_TIMERFD_AVAILABLE
-static int disarm_timerfd(struct libusb_context *ctx)
-{
-	const struct itimerspec disarm_timer = { { 0, 0 }, { 0, 0 } };
-	int r;
+	usbi_mutex_lock(&pool->lock);
+	last = (--pool->outstanding == 0);
+	if (pool->destroyed) {
+		usbi_mutex_unlock(&pool->lock);
+		free_transfer(itransfer);
+		if (last)
+			free_pool(pool);
+		return;
+	}
 
-	usbi_dbg("");
-	r = timerfd_settime(ctx->timerfd, 0, &disarm_timer, NULL);
-	if (r < 0)
-		return LIBUSB_ERROR_OTHER;
-	else
-		return 0;
+	/* make it look freshly allocated again, leaving the backend's private
+	 * data alone since that is what makes reuse worthwhile */
+	memset(transfer, 0, sizeof(*transfer)
+		+ sizeof(struct libusb_iso_packet_descriptor) * itransfer->num_iso_packets);
+	itransfer->flags = 0;
+	itransfer->iso_start_pending = 0;
+	itransfer->iso_offsets_valid = 0;
+	itransfer->inline_callback = 0;
+	itransfer->stream_id = 0;
+	list_add(&itransfer->list, &pool->idle_transfers);
+	usbi_mutex_unlock(&pool->lock);
 }
 
-/* iterates through the flying transfers, and rearms the timerfd based on the
- * next upcoming timeout.
- * must be called with flying_list locked.
- * returns 0 if there was no timeout to arm, 1 if the next timeout was armed,
- * or a LIBUSB_ERROR code on failure.
+/** \ingroup asyncio
+ * Allocate a pool of reusable transfers. The pool starts out with
+ * num_transfers idle transfers, each with iso_packets isochronous packet
+ * descriptors, and grows on demand if more are requested at once. See
+ * \ref asyncpool.
+ *
+ * \param num_transfers number of transfers to allocate up front
+ * \param iso_packets number of isochronous packet descriptors to allocate
+ * for each transfer of the pool
+ * \returns a new transfer pool, or NULL on error
  */
-static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+DEFAULT_VISIBILITY
+libusb_transfer_pool * LIBUSB_CALL libusb_alloc_transfer_pool(
+	int num_transfers, int iso_packets)
 {
-	struct usbi_transfer *transfer;
+	struct libusb_transfer_pool *pool;
+	int i;
 
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, then we have no
-		 * arming to do */
-		if (!timerisset(cur_tv))
-			goto disarm;
-
-		/* act on first transfer that is not already cancelled */
-		if (!(transfer->flags & USBI_TRANSFER_TIMED_OUT)) {
-			int r;
-			const struct itimerspec it = { {0, 0},
-				{ cur_tv->tv_sec, cur_tv->tv_usec * 1000 } };
-			usbi_dbg("next timeout originally %dms", USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-			r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
-			if (r < 0)
-				return LIBUSB_ERROR_OTHER;
-			return 1;
+	if (num_transfers < 0 || iso_packets < 0)
+		return NULL;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	usbi_mutex_init(&pool->lock, NULL);
+	list_init(&pool->idle_transfers);
+	pool->iso_packets = iso_packets;
+
+	for (i = 0; i < num_transfers; i++) {
+		struct usbi_transfer *itransfer = alloc_transfer(iso_packets);
+		if (!itransfer) {
+			libusb_free_transfer_pool(pool);
+			return NULL;
 		}
+		itransfer->pool = pool;
+		list_add(&itransfer->list, &pool->idle_transfers);
 	}
 
-disarm:
-	return disarm_timerfd(ctx);
+	return pool;
 }
-#else
-static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+
+/** \ingroup asyncio
+ * Take a transfer from a pool. The returned transfer is initialized just
+ * like one returned by libusb_alloc_transfer(), and must be handed back with
+ * libusb_free_transfer() once it is no longer needed.
+ *
+ * If the pool has no idle transfer left, a new one is allocated and becomes
+ * part of the pool.
+ *
+ * \param pool the pool to take the transfer from
+ * \returns a transfer, or NULL on error
+ */
+DEFAULT_VISIBILITY
+struct libusb_transfer * LIBUSB_CALL libusb_pool_get_transfer(
+	libusb_transfer_pool *pool)
 {
-	(void)ctx;
-	return 0;
+	struct usbi_transfer *itransfer;
+
+	usbi_mutex_lock(&pool->lock);
+	if (list_empty(&pool->idle_transfers)) {
+		itransfer = alloc_transfer(pool->iso_packets);
+		if (!itransfer) {
+			usbi_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		itransfer->pool = pool;
+	} else {
+		itransfer = list_entry(pool->idle_transfers.next, struct usbi_transfer,
+			list);
+		list_del(&itransfer->list);
+	}
+	pool->outstanding++;
+	usbi_mutex_unlock(&pool->lock);
+
+	return USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 }
-#endif
 
 /** \ingroup asyncio
- * Submit a transfer. This function will fire off the USB transfer and then
- * return immediately.
+ * Free a transfer pool and all of its idle transfers. Transfers of the pool
+ * that are still in use are freed when they are passed to
+ * libusb_free_transfer(), after which the pool itself goes away.
  *
- * \param transfer the transfer to submit
- * \returns 0 on success
- * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
- * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
- * by the operating system.
- * \returns another LIBUSB_ERROR code on other failure
+ * It is legal to call this function with a NULL pool.
+ *
+ * \param pool the pool to free
  */
-int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+void API_EXPORTED libusb_free_transfer_pool(libusb_transfer_pool *pool)
 {
-	struct libusb_context *ctx = TRANSFER_CTX(transfer);
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	int r;
-	int updated_fds;
+	struct usbi_transfer *itransfer, *tmp;
+	int outstanding;
 
-	usbi_mutex_lock(&itransfer->lock);
-	itransfer->transferred = 0;
-	itransfer->flags = 0;
-	r = calculate_timeout(itransfer);
-	if (r < 0) {
-		r = LIBUSB_ERROR_OTHER;
-		goto out;
-	}
+	if (!pool)
+		return;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	r = add_to_flying_list(itransfer);
-	if (r == LIBUSB_SUCCESS) {
-		r = usbi_backend->submit_transfer(itransfer);
-	}
-	if (r != LIBUSB_SUCCESS) {
+	usbi_mutex_lock(&pool->lock);
+	list_for_each_entry_safe(itransfer, tmp, &pool->idle_transfers, list,
+			struct usbi_transfer) {
 		list_del(&itransfer->list);
-		arm_timerfd_for_next_timeout(ctx);
+		free_transfer(itransfer);
 	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	outstanding = pool->outstanding;
+	pool->destroyed = 1;
+	usbi_mutex_unlock(&pool->lock);
 
-out:
-	updated_fds = (itransfer->flags & USBI_TRANSFER_UPDATED_FDS);
-	usbi_mutex_unlock(&itransfer->lock);
-	if (updated_fds)
-		usbi_fd_notification(ctx);
-	return r;
+	if (!outstanding)
+		free_pool(pool);
 }
 
 /** \ingroup asyncio
- * Asynchronously cancel a previously submitted transfer.
- * This function returns immediately, but this does not indicate cancellation
- * is complete. Your callback function will be invoked at some later time
- * with a transfer status of
+ * Allocate memory for transfer buffers that the OS can hand to the device
+ * without copying it. Buffers from here can be used for any transfer on the
+ * same device handle, and must be freed with libusb_dev_mem_free() before the
+ * handle is closed.
+ *
+ * On backends without such a facility this memory simply comes from the
+ * system allocator. On Linux, the memory is mapped from usbfs, and this
+ * function returns NULL if the running kernel cannot provide it; regular
+ * memory should be used for transfer buffers in that case.
+ *
+ * \param dev_handle the device handle the memory will be used with
+ * \param length size of the buffer in bytes
+ * \returns a pointer to the buffer, or NULL on error or if the OS does not
+ * support it
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(
+	libusb_device_handle *dev_handle, size_t length)
+{
+	if (!usbi_backend->dev_mem_alloc)
+		return malloc(length);
+
+	return usbi_backend->dev_mem_alloc(dev_handle, length);
+}
+
+/** \ingroup asyncio
+ * Free memory obtained from libusb_dev_mem_alloc(). No transfers using the
+ * buffer may be in flight.
+ *
+ * \param dev_handle the device handle the memory was allocated for
+ * \param buffer the buffer to free
+ * \param length the size the buffer was allocated with
+ * \returns 0 on success
+ * \returns another LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_dev_mem_free(libusb_device_handle *dev_handle,
+	unsigned char *buffer, size_t length)
+{
+	if (!buffer)
+		return LIBUSB_SUCCESS;
+
+	if (!usbi_backend->dev_mem_free) {
+		free(buffer);
+		return LIBUSB_SUCCESS;
+	}
+
+	return usbi_backend->dev_mem_free(dev_handle, buffer, length);
+}
+
+/* the monotonic clock in nanoseconds, for latency tracking. 0 on failure,
+ * which means there is nothing to record */
+static uint64_t monotonic_time_ns(void)
+{
+	struct timespec ts;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* transfers with LIBUSB_TRANSFER_AUTO_RESUBMIT stay in flight until they are
+ * cancelled, which only makes sense for IN endpoints polled without a
+ * timeout */
+static int check_auto_resubmit(struct libusb_transfer *transfer)
+{
+	if (!(transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT))
+		return 0;
+	if (!(usbi_backend->caps & USBI_CAP_AUTO_RESUBMIT))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	if ((transfer->type != LIBUSB_TRANSFER_TYPE_BULK
+			&& transfer->type != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+			|| !IS_XFERIN(transfer) || transfer->timeout)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	return 0;
+}
+
+static void fill_iso_offsets(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	unsigned int *offsets = iso_offsets(itransfer);
+	unsigned int offset = 0;
+	int i;
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		offsets[i] = offset;
+		offset += transfer->iso_packet_desc[i].length;
+	}
+	itransfer->iso_offsets_valid = 1;
+}
+
+/* reset the per-submission state of a transfer and compute its timeout.
+ * Callers of this function must hold the usbi_transfer lock. */
+static int prepare_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	itransfer->transferred = 0;
+	itransfer->flags = 0;
+	if (itransfer->iso_start_pending) {
+		itransfer->flags |= USBI_TRANSFER_ISO_SCHEDULED;
+		itransfer->iso_start_pending = 0;
+	}
+	if (usbi_latency_tracking(ITRANSFER_CTX(itransfer)))
+		itransfer->submit_time = monotonic_time_ns();
+	else
+		itransfer->submit_time = 0;
+	itransfer->reap_time = 0;
+	itransfer->iso_offsets_valid = 0;
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
+			&& transfer->num_iso_packets <= itransfer->num_iso_packets)
+		fill_iso_offsets(itransfer);
+	return calculate_timeout(itransfer);
+}
+
+/** \ingroup asyncio
+ * Submit a transfer. This function will fire off the USB transfer and then
+ * return immediately.
+ *
+ * \param transfer the transfer to submit
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
+ * by the operating system.
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+	struct libusb_device_handle *handle = transfer->dev_handle;
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int r;
+	int updated_fds;
+
+	usbi_mutex_lock(&itransfer->lock);
+	r = check_auto_resubmit(transfer);
+	if (r < 0)
+		goto out;
+	r = prepare_transfer(itransfer);
+	if (r < 0) {
+		r = LIBUSB_ERROR_OTHER;
+		goto out;
+	}
+
+	/* recorded ahead of the submission, so that it can't come after the
+	 * completion in the capture */
+	if (USBI_CAPTURING(ctx))
+		usbi_capture_submit(ctx, transfer);
+
+	/* the transfer can't complete before the handle's lock is released, so
+	 * its timeout only needs tracking once the backend accepted it */
+	usbi_mutex_lock(&handle->flying_lock);
+	itransfer->timeout_heap_idx = -1;
+	list_add_tail(&itransfer->list, &handle->flying_transfers);
+	r = usbi_backend->submit_transfer(itransfer);
+	if (r != LIBUSB_SUCCESS)
+		list_del(&itransfer->list);
+	else
+		add_timeout(itransfer);
+	usbi_mutex_unlock(&handle->flying_lock);
+	usbi_trace(submit, transfer, transfer->endpoint, transfer->length, r);
+	if (r != LIBUSB_SUCCESS && USBI_CAPTURING(ctx))
+		usbi_capture_submit_error(ctx, transfer, r);
+	if (r == LIBUSB_SUCCESS && transfer->type < LIBUSB_STATS_TRANSFER_TYPES)
+		usbi_stats_inc(ctx, transfers_submitted[transfer->type]);
+
+out:
+	updated_fds = (itransfer->flags & USBI_TRANSFER_UPDATED_FDS);
+	usbi_mutex_unlock(&itransfer->lock);
+	if (updated_fds)
+		usbi_fd_notification(ctx);
+	return r;
+}
+
+static int compare_transfer_ptrs(const void *a, const void *b)
+{
+	uintptr_t ta = (uintptr_t)*(struct libusb_transfer * const *)a;
+	uintptr_t tb = (uintptr_t)*(struct libusb_transfer * const *)b;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+/* check that no transfer is listed twice in a batch. small batches are
+ * checked pairwise, larger ones by sorting a copy of the array */
+static int check_duplicate_transfers(struct libusb_transfer **transfers,
+	int num_transfers)
+{
+	struct libusb_transfer **sorted;
+	int r = 0;
+	int i, j;
+
+	if (num_transfers <= 32) {
+		for (i = 1; i < num_transfers; i++)
+			for (j = 0; j < i; j++)
+				if (transfers[j] == transfers[i])
+					return LIBUSB_ERROR_INVALID_PARAM;
+		return 0;
+	}
+
+	sorted = malloc(num_transfers * sizeof(*sorted));
+	if (!sorted)
+		return LIBUSB_ERROR_NO_MEM;
+	memcpy(sorted, transfers, num_transfers * sizeof(*sorted));
+	qsort(sorted, num_transfers, sizeof(*sorted), compare_transfer_ptrs);
+	for (i = 1; i < num_transfers; i++) {
+		if (sorted[i] == sorted[i - 1]) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+			break;
+		}
+	}
+	free(sorted);
+
+	return r;
+}
+
+/** \ingroup asyncio
+ * Submit several transfers at once. This behaves like calling
+ * libusb_submit_transfer() on each transfer in turn, but locks the internal
+ * state of libusbx and updates its timeout tracking only once for the whole
+ * batch, which makes it cheaper to fill a deep queue of transfers.
+ *
+ * All transfers must be for the same device handle.
+ *
+ * Transfers are submitted in array order. If submitting one of them fails,
+ * the transfers before it remain submitted and will complete as usual, while
+ * neither it nor any of the transfers after it has been submitted. The
+ * number of transfers that were submitted is stored in num_submitted (if
+ * non-NULL) in every case.
+ *
+ * \param transfers array of transfers to submit
+ * \param num_transfers number of transfers in the array
+ * \param num_submitted output location for the number of transfers that were
+ * submitted, or NULL
+ * \returns 0 if all transfers were submitted
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the array holds a NULL entry, a
+ * transfer more than once, or transfers for different device handles; no
+ * transfer is submitted in this case
+ * \returns LIBUSB_ERROR_NO_MEM if a large batch could not be checked for
+ * duplicates; no transfer is submitted in this case
+ * \returns the error libusb_submit_transfer() would have returned for the
+ * first transfer that could not be submitted
+ */
+int API_EXPORTED libusb_submit_transfers(struct libusb_transfer **transfers,
+	int num_transfers, int *num_submitted)
+{
+	struct libusb_context *ctx;
+	struct libusb_device_handle *handle;
+	struct usbi_transfer *first;
+	int updated_fds = 0;
+	int submitted = 0;
+	int r = 0;
+	int i;
+
+	if (num_submitted)
+		*num_submitted = 0;
+	if (num_transfers <= 0)
+		return num_transfers < 0 ? LIBUSB_ERROR_INVALID_PARAM : 0;
+
+	/* a transfer listed twice would deadlock on its own lock below */
+	for (i = 0; i < num_transfers; i++)
+		if (!transfers[i]
+				|| transfers[i]->dev_handle != transfers[0]->dev_handle)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	r = check_duplicate_transfers(transfers, num_transfers);
+	if (r < 0)
+		return r;
+
+	ctx = TRANSFER_CTX(transfers[0]);
+	handle = transfers[0]->dev_handle;
+
+	/* same lock order as libusb_submit_transfer(): transfer locks first */
+	for (i = 0; i < num_transfers; i++)
+		usbi_mutex_lock(&LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i])->lock);
+
+	usbi_mutex_lock(&handle->flying_lock);
+	for (i = 0; i < num_transfers; i++) {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+		r = check_auto_resubmit(transfers[i]);
+		if (r < 0)
+			break;
+		r = prepare_transfer(itransfer);
+		if (r < 0) {
+			r = LIBUSB_ERROR_OTHER;
+			break;
+		}
+
+		if (USBI_CAPTURING(ctx))
+			usbi_capture_submit(ctx, transfers[i]);
+		itransfer->timeout_heap_idx = -1;
+		list_add_tail(&itransfer->list, &handle->flying_transfers);
+		r = usbi_backend->submit_transfer(itransfer);
+		usbi_trace(submit, transfers[i], transfers[i]->endpoint,
+			transfers[i]->length, r);
+		updated_fds |= (itransfer->flags & USBI_TRANSFER_UPDATED_FDS);
+		if (r != LIBUSB_SUCCESS) {
+			list_del(&itransfer->list);
+			if (USBI_CAPTURING(ctx))
+				usbi_capture_submit_error(ctx, transfers[i], r);
+			break;
+		}
+		if (transfers[i]->type < LIBUSB_STATS_TRANSFER_TYPES)
+			usbi_stats_inc(ctx, transfers_submitted[transfers[i]->type]);
+		submitted++;
+	}
+
+	/* none of the submitted transfers can complete while the handle's lock
+	 * is held, so their timeouts are tracked together, and the timer is
+	 * armed once for the whole batch if the earliest deadline moved */
+	usbi_mutex_lock(&ctx->timeouts_lock);
+	first = ctx->timeout_heap_len ? ctx->timeout_heap[0] : NULL;
+	for (i = 0; i < submitted; i++) {
+		if (insert_timeout(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i])) < 0)
+			usbi_warn(ctx, "failed to track timeout of transfer %p",
+				transfers[i]);
+	}
+	if ((ctx->timeout_heap_len ? ctx->timeout_heap[0] : NULL) != first) {
+		int ret = arm_timerfd_for_next_timeout(ctx);
+		if (ret < 0)
+			usbi_warn(ctx, "failed to arm timerfd (error %d)", ret);
+	}
+	usbi_mutex_unlock(&ctx->timeouts_lock);
+	usbi_mutex_unlock(&handle->flying_lock);
+
+	for (i = 0; i < num_transfers; i++)
+		usbi_mutex_unlock(&LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i])->lock);
+
+	if (updated_fds)
+		usbi_fd_notification(ctx);
+	if (num_submitted)
+		*num_submitted = submitted;
+	return r;
+}
+
+/** \ingroup asyncio
+ * Set a transfers bulk stream id. Note users are advised to use
+ * libusb_fill_bulk_stream_transfer() instead of calling this function
+ * directly.
+ *
+ * \param transfer the transfer to set the stream id for
+ * \param stream_id the stream id to set
+ * \see libusb_alloc_streams()
+ */
+void API_EXPORTED libusb_transfer_set_stream_id(
+	struct libusb_transfer *transfer, uint32_t stream_id)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->stream_id = stream_id;
+}
+
+/** \ingroup asyncio
+ * Get a transfers bulk stream id.
+ *
+ * \param transfer the transfer to get the stream id for
+ * \returns the stream id for the transfer
+ */
+uint32_t API_EXPORTED libusb_transfer_get_stream_id(
+	struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	return itransfer->stream_id;
+}
+
+/** \ingroup asyncio
+ * Schedule the next submission of an isochronous transfer to start in a
+ * specific (micro)frame, instead of as soon as possible.
+ *
+ * By default isochronous transfers are queued behind the transfers already
+ * pending on the endpoint, or scheduled for the next frame the host
+ * controller can manage if there are none. Requesting an explicit start
+ * frame allows keeping a pipeline gapless across restarts, or aligning
+ * transfers on several devices. The request applies to the next call to
+ * libusb_submit_transfer() for this transfer only, which fails if the
+ * frame cannot be scheduled (for example because it is in the past).
+ *
+ * The frame is in the units and numbering of the bus the device is on, see
+ * libusb_get_frame_number(). After completion, libusb_get_iso_start_frame()
+ * returns the frame the transfer actually started in, so that the next
+ * transfer can be scheduled for the frame after the last packet.
+ *
+ * This is currently only implemented on Linux and Darwin. Other backends
+ * ignore the request.
+ *
+ * \param transfer an isochronous transfer
+ * \param start_frame the frame to start the transfer in
+ */
+void API_EXPORTED libusb_set_iso_start_frame(struct libusb_transfer *transfer,
+	uint64_t start_frame)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	usbi_mutex_lock(&itransfer->lock);
+	itransfer->iso_start_frame = start_frame;
+	itransfer->iso_start_pending = 1;
+	usbi_mutex_unlock(&itransfer->lock);
+}
+
+/** \ingroup asyncio
+ * Get the frame in which an isochronous transfer started. This is available
+ * once the transfer has completed, whether or not its start frame was
+ * requested with libusb_set_iso_start_frame().
+ *
+ * \param transfer a completed isochronous transfer
+ * \param start_frame output location for the start frame
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the start frame is not known, because
+ * the transfer has not been submitted or the backend does not report it
+ */
+int API_EXPORTED libusb_get_iso_start_frame(struct libusb_transfer *transfer,
+	uint64_t *start_frame)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&itransfer->lock);
+	if (itransfer->flags & USBI_TRANSFER_ISO_START_KNOWN) {
+		*start_frame = itransfer->iso_start_frame;
+		r = 0;
+	}
+	usbi_mutex_unlock(&itransfer->lock);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Locate an isochronous packet within the buffer of a transfer, and get the
+ * amount of data it holds.
+ *
+ * Unlike libusb_get_iso_packet_buffer(), this does not add up the lengths of
+ * the preceding packets: their offsets are worked out once when the transfer
+ * is submitted, so visiting every packet of a completed transfer takes time
+ * proportional to the number of packets. Transfers which have not been
+ * submitted yet are looked up the slow way.
+ *
+ * The offsets are those of the packet lengths at submission time, which is
+ * how the data was laid out, even if the lengths have been changed since.
+ *
+ * \param transfer an isochronous transfer
+ * \param packet the packet to locate
+ * \param actual_length output location for the
+ * \ref libusb_iso_packet_descriptor::actual_length "actual_length" of the
+ * packet. May be NULL.
+ * \returns the base address of the packet buffer inside the transfer buffer,
+ * or NULL if the packet does not exist.
+ * \see libusb_copy_iso_packets()
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_get_iso_packet_data(
+	struct libusb_transfer *transfer, unsigned int packet, int *actual_length)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	unsigned char *data;
+
+	if (packet >= (unsigned int)transfer->num_iso_packets)
+		return NULL;
+
+	if (itransfer->iso_offsets_valid)
+		data = transfer->buffer + iso_offsets(itransfer)[packet];
+	else
+		data = libusb_get_iso_packet_buffer(transfer, packet);
+	if (actual_length)
+		*actual_length = transfer->iso_packet_desc[packet].actual_length;
+	return data;
+}
+
+/** \ingroup asyncio
+ * Copy the data received by the packets of a completed isochronous IN
+ * transfer to a contiguous buffer, dropping the gaps left by packets which
+ * came back short.
+ *
+ * Packets are copied in order, each one with its
+ * \ref libusb_iso_packet_descriptor::actual_length "actual_length" bytes.
+ * Consecutive packets which came back full are contiguous in the transfer
+ * buffer too, and are copied in one go.
+ *
+ * \param transfer a completed isochronous transfer
+ * \param data the buffer to copy to
+ * \param length the size of data
+ * \returns the number of bytes copied
+ * \returns LIBUSB_ERROR_OVERFLOW if the data does not fit. Nothing is copied
+ * in that case.
+ * \see libusb_get_iso_packet_data()
+ */
+int API_EXPORTED libusb_copy_iso_packets(struct libusb_transfer *transfer,
+	unsigned char *data, int length)
+{
+	struct libusb_iso_packet_descriptor *desc = transfer->iso_packet_desc;
+	unsigned char *run = NULL;
+	int run_length = 0;
+	int total = 0;
+	int i;
+
+	for (i = 0; i < transfer->num_iso_packets; i++)
+		total += desc[i].actual_length;
+	if (total > length)
+		return LIBUSB_ERROR_OVERFLOW;
+
+	/* runs of packets end with the first one which is not full */
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		if (!run)
+			run = libusb_get_iso_packet_data(transfer, i, NULL);
+		run_length += desc[i].actual_length;
+		if (desc[i].actual_length != desc[i].length
+				|| i == transfer->num_iso_packets - 1) {
+			memcpy(data, run, run_length);
+			data += run_length;
+			run = NULL;
+			run_length = 0;
+		}
+	}
+	return total;
+}
+
+/** \ingroup asyncio
+ * Get the current frame number of the bus a device is on, as a reference for
+ * libusb_set_iso_start_frame().
+ *
+ * \param dev_handle a device handle
+ * \param frame_number output location for the frame number
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform cannot report it. On
+ * Linux, the start frames reported by libusb_get_iso_start_frame() for
+ * completed transfers can be used instead.
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_get_frame_number(libusb_device_handle *dev_handle,
+	uint64_t *frame_number)
+{
+	if (!usbi_backend->get_frame_number)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return usbi_backend->get_frame_number(dev_handle, frame_number);
+}
+
+/** \ingroup asyncio
+ * Asynchronously cancel a previously submitted transfer.
+ * This function returns immediately, but this does not indicate cancellation
+ * is complete. Your callback function will be invoked at some later time
+ * with a transfer status of
  * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
  * "LIBUSB_TRANSFER_CANCELLED."
  *
- * \param transfer the transfer to cancel
+ * \param transfer the transfer to cancel
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the transfer is already complete or
+ * cancelled.
+ * \returns a LIBUSB_ERROR code on failure
+ */
+/* Callers of this function must hold the usbi_transfer lock. */
+static int cancel_transfer_locked(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int r;
+
+	r = usbi_backend->cancel_transfer(itransfer);
+	if (r < 0) {
+		if (r != LIBUSB_ERROR_NOT_FOUND &&
+		    r != LIBUSB_ERROR_NO_DEVICE)
+			usbi_err(TRANSFER_CTX(transfer),
+				"cancel transfer failed error %d", r);
+		else
+			usbi_dbg("cancel transfer failed error %d", r);
+
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			itransfer->flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
+	}
+
+	itransfer->flags |= USBI_TRANSFER_CANCELLING;
+	return r;
+}
+
+int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int r;
+
+	usbi_dbg("");
+	usbi_mutex_lock(&itransfer->lock);
+	r = cancel_transfer_locked(itransfer);
+	usbi_mutex_unlock(&itransfer->lock);
+	return r;
+}
+
+/* the transfers cancelled together by one call to cancel_transfers() */
+struct usbi_cancel_group {
+	struct libusb_device_handle *dev_handle;
+	libusb_cancel_cb_fn callback;
+	void *user_data;
+	int num_transfers;
+	/* transfers not reaped yet, protected by the handle's flying_lock */
+	int remaining;
+	/* links the groups finished during flush_completion_batch() */
+	struct usbi_cancel_group *next;
+};
+
+/* take a transfer that leaves the flying list out of its cancel group.
+ * returns the group if this was the last transfer the group waited for.
+ * Callers of this function must hold the handle's flying_lock. */
+static struct usbi_cancel_group *leave_cancel_group(
+	struct usbi_transfer *itransfer)
+{
+	struct usbi_cancel_group *group = itransfer->cancel_group;
+
+	if (!group)
+		return NULL;
+
+	itransfer->cancel_group = NULL;
+	return --group->remaining == 0 ? group : NULL;
+}
+
+static void finish_cancel_group(struct usbi_cancel_group *group)
+{
+	usbi_dbg("%d cancelled transfers reaped", group->num_transfers);
+	group->callback(group->dev_handle, group->num_transfers,
+		group->user_data);
+	free(group);
+}
+
+/* cancel the transfers in flight on a handle, or on one of its endpoints if
+ * endpoint is not -1, in a single pass over the flying list */
+static int cancel_transfers(struct libusb_device_handle *dev_handle,
+	int endpoint, libusb_cancel_cb_fn callback, void *user_data)
+{
+	struct usbi_cancel_group *group = NULL;
+	struct usbi_transfer *itransfer;
+	struct list_head *pos;
+	int num_transfers = 0;
+
+	if (callback) {
+		group = malloc(sizeof(*group));
+		if (!group)
+			return LIBUSB_ERROR_NO_MEM;
+		group->dev_handle = dev_handle;
+		group->callback = callback;
+		group->user_data = user_data;
+		group->remaining = 0;
+		group->next = NULL;
+	}
+
+	/* transfers can't leave the flying list while its lock is held, so
+	 * none of them can complete and be freed under us. nobody who holds the
+	 * lock of a transfer in flight waits for flying_lock, which makes
+	 * taking the transfer locks here safe.
+	 *
+	 * the list is walked backwards: discarding the most recently submitted
+	 * transfers first keeps the OS from starting queued transfers that are
+	 * about to be cancelled anyway */
+	usbi_mutex_lock(&dev_handle->flying_lock);
+	for (pos = dev_handle->flying_transfers.prev;
+			pos != &dev_handle->flying_transfers; pos = pos->prev) {
+		struct libusb_transfer *transfer;
+
+		itransfer = list_entry(pos, struct usbi_transfer, list);
+		transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+		if (endpoint != -1 && transfer->endpoint != endpoint)
+			continue;
+
+		/* already cancelled by an earlier call, which reports it */
+		if (itransfer->cancel_group)
+			continue;
+
+		/* transfers queued for batched delivery have been reaped */
+		if (!(itransfer->flags & USBI_TRANSFER_COMPLETING)) {
+			usbi_mutex_lock(&itransfer->lock);
+			cancel_transfer_locked(itransfer);
+			usbi_mutex_unlock(&itransfer->lock);
+		}
+
+		if (group) {
+			itransfer->cancel_group = group;
+			group->remaining++;
+		}
+		num_transfers++;
+	}
+	usbi_mutex_unlock(&dev_handle->flying_lock);
+
+	usbi_dbg("cancelling %d transfers", num_transfers);
+	if (group) {
+		group->num_transfers = num_transfers;
+		if (!num_transfers)
+			free(group);
+	}
+	return num_transfers;
+}
+
+/** \ingroup asyncio
+ * Asynchronously cancel all transfers in flight on an endpoint. This is
+ * equivalent to calling libusb_cancel_transfer() on each of them, but the
+ * transfers are all cancelled in one go, which is much faster when there are
+ * many of them.
+ *
+ * Every cancelled transfer still completes with its own callback as
+ * described for libusb_cancel_transfer(). In addition, the callback given here
+ * is called once when all of them have been reaped. With completion workers
+ * (see libusb_set_completion_workers()) the callbacks of the individual
+ * transfers may still be running at that point.
+ *
+ * Transfers already cancelled with this function or
+ * libusb_cancel_all_transfers() are left to the earlier call and not counted
+ * again.
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint, including the direction bit
+ * \param callback function called once all cancelled transfers have been
+ * reaped, or NULL. It is only called if at least one transfer was cancelled.
+ * \param user_data user data passed to the callback
+ * \returns the number of transfers being cancelled
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \see libusb_cancel_all_transfers()
+ */
+int API_EXPORTED libusb_cancel_endpoint_transfers(
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	libusb_cancel_cb_fn callback, void *user_data)
+{
+	usbi_dbg("endpoint %02x", endpoint);
+	return cancel_transfers(dev_handle, endpoint, callback, user_data);
+}
+
+/** \ingroup asyncio
+ * Asynchronously cancel all transfers in flight on a device handle, such as
+ * before closing it or changing an alternate setting. It behaves like
+ * libusb_cancel_endpoint_transfers() for every endpoint of the handle,
+ * with a single callback once all the transfers have been reaped.
+ *
+ * \param dev_handle a device handle
+ * \param callback function called once all cancelled transfers have been
+ * reaped, or NULL. It is only called if at least one transfer was cancelled.
+ * \param user_data user data passed to the callback
+ * \returns the number of transfers being cancelled
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_cancel_all_transfers(libusb_device_handle *dev_handle,
+	libusb_cancel_cb_fn callback, void *user_data)
+{
+	usbi_dbg("");
+	return cancel_transfers(dev_handle, -1, callback, user_data);
+}
+
+/* a latency sample in progress, taken before a transfer callback runs since
+ * the callback may free the transfer */
+struct latency_sample {
+	struct libusb_device_handle *handle;
+	unsigned char endpoint;
+	uint64_t submit_time;
+	uint64_t reap_time;
+	uint64_t callback_time;
+};
+
+/* record the time the OS handed a finished transfer back. backends which
+ * complete transfers in several steps call this for each of them, the last
+ * call wins. */
+void usbi_latency_mark_reap(struct usbi_transfer *itransfer)
+{
+	itransfer->reap_time = monotonic_time_ns();
+}
+
+static uint64_t time_diff_us(uint64_t start, uint64_t end)
+{
+	return end > start ? (end - start) / 1000 : 0;
+}
+
+static void latency_histogram_add(struct libusb_latency_histogram *histogram,
+	uint64_t us)
+{
+	int bucket = 0;
+
+	while (bucket < LIBUSB_LATENCY_BUCKETS - 1 && (us >> bucket))
+		bucket++;
+	usbi_atomic_add32(&histogram->buckets[bucket], 1);
+	usbi_atomic_add32(&histogram->count, 1);
+	usbi_atomic_add64(&histogram->total_us, us);
+	usbi_atomic_max64(&histogram->max_us, us);
+}
+
+/* start a latency sample for a transfer that is about to be handed to its
+ * callback. returns 0 if there is nothing to record. */
+static int latency_sample_begin(struct usbi_transfer *itransfer,
+	struct latency_sample *sample)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	if (!itransfer->submit_time)
+		return 0;
+
+	sample->handle = transfer->dev_handle;
+	sample->endpoint = transfer->endpoint;
+	sample->submit_time = itransfer->submit_time;
+	sample->callback_time = monotonic_time_ns();
+	if (itransfer->reap_time)
+		sample->reap_time = itransfer->reap_time;
+	else
+		sample->reap_time = sample->callback_time;
+	itransfer->submit_time = 0;
+	return 1;
+}
+
+/* finish a latency sample and add it to the statistics of its endpoint.
+ * with_callback is 0 if the time spent in the callback was not measured. */
+static void latency_sample_end(struct latency_sample *sample,
+	int with_callback)
+{
+	struct libusb_device_handle *handle = sample->handle;
+	struct libusb_endpoint_latency *latency;
+	uint64_t now = 0;
+
+	if (with_callback)
+		now = monotonic_time_ns();
+
+	/* samples can be added by the event handler, event shards and
+	 * completion workers at the same time, so the histograms are updated
+	 * with atomic operations. the table itself is allocated and published
+	 * under the lock, and only read under it */
+	usbi_mutex_lock(&handle->lock);
+	if (!handle->latency)
+		handle->latency = calloc(USBI_MAX_ENDPOINTS,
+			sizeof(*handle->latency));
+	latency = handle->latency;
+	usbi_mutex_unlock(&handle->lock);
+	if (!latency)
+		return;
+	latency += USBI_EP_INDEX(sample->endpoint);
+	latency_histogram_add(&latency->os_latency,
+		time_diff_us(sample->submit_time, sample->reap_time));
+	latency_histogram_add(&latency->dispatch_latency,
+		time_diff_us(sample->reap_time, sample->callback_time));
+	if (with_callback)
+		latency_histogram_add(&latency->callback_time,
+			time_diff_us(sample->callback_time, now));
+}
+
+/** \ingroup asyncio
+ * Enable or disable latency tracking for a context.
+ *
+ * While enabled, every transfer is timestamped when it is submitted, when
+ * the OS hands it back and around its callback, and the resulting latencies
+ * are added to per-endpoint histograms of the device handle, which can be
+ * read with libusb_get_endpoint_latency(). This tells apart time spent in
+ * the OS and the device, in libusbx's event handling and in the
+ * application's callbacks.
+ *
+ * Latency tracking is disabled by default, and costs nothing but a flag
+ * check per transfer then. Transfers already in flight when it is enabled
+ * are not accounted for.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param enable non-zero to enable latency tracking, 0 to disable it
+ */
+void API_EXPORTED libusb_set_latency_tracking(libusb_context *ctx, int enable)
+{
+	USBI_GET_CONTEXT(ctx);
+	ctx->latency_tracking = enable ? 1 : 0;
+}
+
+/** \ingroup asyncio
+ * Get the latency statistics collected for an endpoint of a device handle.
+ * See libusb_set_latency_tracking().
+ *
+ * The histograms keep growing for as long as the handle is open, unless
+ * they are cleared with libusb_reset_endpoint_latency(). Transfers are not
+ * held up while the copy is taken, so the fields of a copy taken while
+ * transfers complete may disagree by the samples recorded meanwhile.
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint. Control transfers on the
+ * default control pipe are accounted for under endpoint 0.
+ * \param latency output location for a copy of the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if no latency has been recorded on this
+ * device handle
+ */
+int API_EXPORTED libusb_get_endpoint_latency(libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_endpoint_latency *latency)
+{
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	if (dev_handle->latency) {
+		*latency = dev_handle->latency[USBI_EP_INDEX(endpoint)];
+		r = 0;
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Clear the latency statistics of all endpoints of a device handle.
+ *
+ * \param dev_handle a device handle
+ */
+void API_EXPORTED libusb_reset_endpoint_latency(
+	libusb_device_handle *dev_handle)
+{
+	usbi_mutex_lock(&dev_handle->lock);
+	if (dev_handle->latency)
+		memset(dev_handle->latency, 0,
+			USBI_MAX_ENDPOINTS * sizeof(*dev_handle->latency));
+	usbi_mutex_unlock(&dev_handle->lock);
+}
+
+/* account a finished transfer in the context's performance counters */
+static void update_transfer_stats(struct libusb_context *ctx,
+	struct libusb_transfer *transfer)
+{
+	int type = transfer->type;
+	uint64_t bytes = 0;
+	int i;
+
+	if (type >= LIBUSB_STATS_TRANSFER_TYPES)
+		return;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		usbi_stats_inc(ctx, transfers_completed[type]);
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		usbi_stats_inc(ctx, transfers_cancelled[type]);
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		usbi_stats_inc(ctx, transfers_timed_out[type]);
+		break;
+	default:
+		usbi_stats_inc(ctx, transfers_failed[type]);
+		break;
+	}
+
+	if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		for (i = 0; i < transfer->num_iso_packets; i++)
+			bytes += transfer->iso_packet_desc[i].actual_length;
+	} else {
+		bytes = transfer->actual_length;
+	}
+	if (!bytes)
+		return;
+	/* the direction of control transfers is in the setup packet */
+	if (type == LIBUSB_TRANSFER_TYPE_CONTROL ? IS_EPIN(transfer->buffer[0])
+			: IS_XFERIN(transfer))
+		usbi_stats_add(ctx, bytes_in, bytes);
+	else
+		usbi_stats_add(ctx, bytes_out, bytes);
+}
+
+/* fill in the final status and length of a transfer that has finished */
+static void set_transfer_result(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	if (status == LIBUSB_TRANSFER_COMPLETED
+			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
+		int rqlen = transfer->length;
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
+		if (rqlen != itransfer->transferred) {
+			usbi_dbg("interpreting short transfer as error");
+			status = LIBUSB_TRANSFER_ERROR;
+		}
+	}
+
+	transfer->status = status;
+	transfer->actual_length = itransfer->transferred;
+	update_transfer_stats(ITRANSFER_CTX(itransfer), transfer);
+	if (USBI_CAPTURING(ITRANSFER_CTX(itransfer)))
+		usbi_capture_completion(ITRANSFER_CTX(itransfer), transfer);
+}
+
+/* a completion callback that needs its device handle once it has returned,
+ * because it runs on a completion worker or records a latency sample.
+ * usbi_drain_handle_completions() waits for it before a handle is freed */
+struct running_callback {
+	struct list_head list;
+	struct libusb_device_handle *handle;
+	int tid;
+	/* set if the callback closed the handle itself. protected by the
+	 * context's dispatch_lock */
+	int closed;
+};
+
+/* Callers of this function must hold the context's dispatch_lock. */
+static void add_running_callback(struct libusb_context *ctx,
+	struct running_callback *running, struct libusb_device_handle *handle,
+	int tid)
+{
+	running->handle = handle;
+	running->tid = tid;
+	running->closed = 0;
+	list_add_tail(&running->list, &ctx->running_callbacks);
+}
+
+/* Callers of this function must hold the context's dispatch_lock. */
+static void remove_running_callback(struct libusb_context *ctx,
+	struct running_callback *running)
+{
+	list_del(&running->list);
+	usbi_cond_broadcast(&ctx->dispatch_cond);
+}
+
+/* whether the device handle of a running callback is still open */
+static int running_callback_handle_open(struct libusb_context *ctx,
+	struct running_callback *running)
+{
+	int closed;
+
+	usbi_mutex_lock(&ctx->dispatch_lock);
+	closed = running->closed;
+	usbi_mutex_unlock(&ctx->dispatch_lock);
+	return !closed;
+}
+
+/* invoke the callback of a transfer that is sampled for latency, and finish
+ * the sample unless the callback closed the handle. running is the record
+ * of a completion worker, or NULL on other threads */
+static void run_sampled_callback(struct libusb_context *ctx,
+	struct libusb_transfer *transfer, struct latency_sample *sample,
+	struct running_callback *running)
+{
+	struct running_callback local;
+
+	if (!running) {
+		running = &local;
+		usbi_mutex_lock(&ctx->dispatch_lock);
+		add_running_callback(ctx, running, transfer->dev_handle,
+			usbi_get_tid());
+		usbi_mutex_unlock(&ctx->dispatch_lock);
+	}
+
+	usbi_trace(callback, transfer, transfer->endpoint,
+		transfer->actual_length, transfer->status);
+	transfer->callback(transfer);
+	/* transfer might have been freed by the above call, do not use
+	 * from this point. */
+	if (running_callback_handle_open(ctx, running))
+		latency_sample_end(sample, 1);
+
+	if (running == &local) {
+		usbi_mutex_lock(&ctx->dispatch_lock);
+		remove_running_callback(ctx, running);
+		usbi_mutex_unlock(&ctx->dispatch_lock);
+	}
+}
+
+/* queue a finished transfer for delivery at the end of the current event
+ * handling pass. returns 0 if the transfer was queued.
+ * Callers of this function must hold the events_lock. */
+static int queue_completion(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer, enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	if (ctx->batch_len == ctx->batch_size) {
+		int size = ctx->batch_size ? ctx->batch_size * 2 : 16;
+		struct libusb_transfer **transfers;
+		uint8_t *flags;
+
+		transfers = realloc(ctx->batch_transfers, size * sizeof(*transfers));
+		if (!transfers)
+			return LIBUSB_ERROR_NO_MEM;
+		ctx->batch_transfers = transfers;
+		flags = realloc(ctx->batch_flags, size * sizeof(*flags));
+		if (!flags)
+			return LIBUSB_ERROR_NO_MEM;
+		ctx->batch_flags = flags;
+		ctx->batch_size = size;
+	}
+
+	set_transfer_result(itransfer, status);
+	itransfer->flags |= USBI_TRANSFER_COMPLETING;
+	ctx->batch_transfers[ctx->batch_len++] = transfer;
+	return 0;
+}
+
+/* deliver all completions queued during an event handling pass: the
+ * transfers leave the flying list under one lock acquisition, the callbacks
+ * run, and event waiters are woken up once.
+ * Callers of this function must hold the events_lock. */
+static void flush_completion_batch(struct libusb_context *ctx)
+{
+	struct libusb_transfer **transfers = ctx->batch_transfers;
+	uint8_t *flags = ctx->batch_flags;
+	struct usbi_cancel_group *finished = NULL, *group;
+	int n = ctx->batch_len;
+	int num_batched = 0;
+	int i;
+
+	if (!n)
+		return;
+
+	for (i = 0; i < n; i++) {
+		struct libusb_device_handle *handle = transfers[i]->dev_handle;
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+		usbi_mutex_lock(&handle->flying_lock);
+		if (usbi_remove_from_flying_list(itransfer) < 0)
+			usbi_warn(ctx, "failed to rearm timerfd");
+		group = leave_cancel_group(itransfer);
+		usbi_mutex_unlock(&handle->flying_lock);
+		if (group) {
+			group->next = finished;
+			finished = group;
+		}
+	}
+
+	/* transfers without a callback of their own are handed to the batch
+	 * callback, packed at the front of the array */
+	for (i = 0; i < n; i++) {
+		struct libusb_transfer *transfer = transfers[i];
+		struct latency_sample sample;
+		uint8_t transfer_flags = transfer->flags;
+		int sampled;
+
+		sampled = latency_sample_begin(
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer), &sample);
+		if (!transfer->callback) {
+			/* the batch callback is not accounted to any transfer */
+			if (sampled)
+				latency_sample_end(&sample, 0);
+			flags[num_batched] = transfer_flags;
+			transfers[num_batched++] = transfer;
+			continue;
+		}
+		if (sampled) {
+			run_sampled_callback(ctx, transfer, &sample, NULL);
+		} else {
+			usbi_trace(callback, transfer, transfer->endpoint,
+				transfer->actual_length, transfer->status);
+			transfer->callback(transfer);
+		}
+		if (transfer_flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+			libusb_free_transfer(transfer);
+	}
+
+	if (num_batched && ctx->batch_cb)
+		ctx->batch_cb(transfers, num_batched, ctx->batch_cb_user_data);
+	for (i = 0; i < num_batched; i++) {
+		if (flags[i] & LIBUSB_TRANSFER_FREE_TRANSFER)
+			libusb_free_transfer(transfers[i]);
+	}
+	ctx->batch_len = 0;
+
+	while (finished) {
+		group = finished;
+		finished = group->next;
+		finish_cancel_group(group);
+	}
+
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+}
+
+/** \ingroup asyncio
+ * Enable or disable batched completion delivery.
+ *
+ * By default, libusbx invokes the callback of each transfer as soon as the
+ * backend reports its completion. With batching enabled, the completions
+ * found during one pass of event handling are collected and delivered
+ * together when the pass ends: the transfers are removed from libusbx's
+ * internal bookkeeping in one go, their callbacks are invoked in completion
+ * order, and threads waiting in libusb_wait_for_event() are woken up once
+ * for the whole batch.
+ *
+ * Transfers which have no callback of their own (transfer->callback is NULL)
+ * are additionally passed to batch_cb, in a single call per pass, so that
+ * their data can be processed in larger chunks. The array passed to
+ * batch_cb is only valid for the duration of the call. Transfers flagged
+ * with \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+ * "LIBUSB_TRANSFER_FREE_TRANSFER" are freed after batch_cb returns.
+ *
+ * This function takes the event handling lock, so the change takes effect
+ * between two passes of event handling. It must not be called from within a
+ * transfer or batch callback.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param enable non-zero to enable batching, 0 to disable it
+ * \param batch_cb function to call with the transfers of each batch that
+ * have no callback of their own, or NULL
+ * \param user_data user data to pass to batch_cb
+ */
+void API_EXPORTED libusb_set_completion_batching(libusb_context *ctx,
+	int enable, libusb_transfer_batch_cb_fn batch_cb, void *user_data)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->events_lock);
+	ctx->completion_batching = enable ? 1 : 0;
+	ctx->batch_cb = enable ? batch_cb : NULL;
+	ctx->batch_cb_user_data = user_data;
+	usbi_mutex_unlock(&ctx->events_lock);
+}
+
+/* invoke the callback of a completed transfer, free it if asked to, and wake
+ * up event waiters. running is the record of a completion worker, or NULL
+ * on other threads */
+static void run_completion_callback(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer, struct running_callback *running)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct latency_sample sample;
+	uint8_t flags;
+	int sampled;
+
+	flags = transfer->flags;
+	sampled = latency_sample_begin(itransfer, &sample);
+	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
+	if (transfer->callback && sampled) {
+		run_sampled_callback(ctx, transfer, &sample, running);
+	} else if (transfer->callback) {
+		usbi_trace(callback, transfer, transfer->endpoint,
+			transfer->actual_length, transfer->status);
+		transfer->callback(transfer);
+	} else if (sampled) {
+		latency_sample_end(&sample, 0);
+	}
+	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+}
+
+/* a thread of the completion dispatch pool. each worker owns the completions
+ * of the device handles hashed to it, so that they are delivered in order */
+struct usbi_dispatch_worker {
+	struct libusb_context *ctx;
+	usbi_thread_t thread;
+	/* signalled when a completion is queued or the worker must exit */
+	usbi_cond_t cond;
+	/* completed transfers, linked through their list member. protected by
+	 * the context's dispatch_lock, like stop */
+	struct list_head queue;
+	int stop;
+};
+
+static void *dispatch_worker_main(void *arg)
+{
+	struct usbi_dispatch_worker *worker = arg;
+	struct libusb_context *ctx = worker->ctx;
+	struct usbi_transfer *itransfer;
+	struct running_callback running;
+	int tid = usbi_get_tid();
+
+	usbi_dbg("dispatch worker started");
+	usbi_mutex_lock(&ctx->dispatch_lock);
+	for (;;) {
+		while (list_empty(&worker->queue) && !worker->stop)
+			usbi_cond_wait(&worker->cond, &ctx->dispatch_lock);
+		/* a stopping worker still delivers what was queued before */
+		if (list_empty(&worker->queue))
+			break;
+
+		itransfer = list_entry(worker->queue.next, struct usbi_transfer,
+			list);
+		list_del(&itransfer->list);
+		/* libusb_close() waits for the callback before freeing the
+		 * handle */
+		add_running_callback(ctx, &running,
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle, tid);
+		usbi_mutex_unlock(&ctx->dispatch_lock);
+		run_completion_callback(ctx, itransfer, &running);
+		usbi_mutex_lock(&ctx->dispatch_lock);
+		remove_running_callback(ctx, &running);
+	}
+	usbi_mutex_unlock(&ctx->dispatch_lock);
+	usbi_dbg("dispatch worker exiting");
+	return NULL;
+}
+
+/* hand a completed transfer to the worker that owns its device handle.
+ * returns LIBUSB_ERROR_NOT_FOUND if there is no worker pool. */
+static int dispatch_completion(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct usbi_dispatch_worker *worker;
+	size_t hash;
+
+	usbi_mutex_lock(&ctx->dispatch_lock);
+	if (!ctx->dispatch_num_workers) {
+		usbi_mutex_unlock(&ctx->dispatch_lock);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	/* handles are heap allocated, so the low bits carry no information */
+	hash = (size_t)transfer->dev_handle >> 4;
+	worker = &ctx->dispatch_workers[hash % ctx->dispatch_num_workers];
+	list_add_tail(&itransfer->list, &worker->queue);
+	usbi_cond_signal(&worker->cond);
+	usbi_mutex_unlock(&ctx->dispatch_lock);
+	return 0;
+}
+
+/* stop and join all workers of the pool, after they have delivered the
+ * completions that were already queued. */
+static void stop_dispatch_workers(struct libusb_context *ctx)
+{
+	struct usbi_dispatch_worker *workers;
+	int num_workers;
+	int i;
+
+	/* detach the pool first, later completions are delivered inline */
+	usbi_mutex_lock(&ctx->dispatch_lock);
+	workers = ctx->dispatch_workers;
+	num_workers = ctx->dispatch_num_workers;
+	ctx->dispatch_workers = NULL;
+	ctx->dispatch_num_workers = 0;
+	for (i = 0; i < num_workers; i++) {
+		workers[i].stop = 1;
+		usbi_cond_signal(&workers[i].cond);
+	}
+	usbi_mutex_unlock(&ctx->dispatch_lock);
+
+	for (i = 0; i < num_workers; i++) {
+		usbi_thread_join(workers[i].thread);
+		usbi_cond_destroy(&workers[i].cond);
+	}
+	free(workers);
+}
+
+/* Called by libusb_close() before the handle is freed. The completions
+ * of the handle that are still queued on the worker pool are delivered on
+ * the calling thread, and the callbacks of the handle that are running on
+ * other threads are waited for. A callback that closes its own handle is
+ * flagged instead, so that it leaves the handle alone once it returns. This
+ * is also done for all of them on platforms without thread IDs.
+ * Do not call this function with the events_lock held, the callbacks that
+ * are waited for may need it. */
+void usbi_drain_handle_completions(struct libusb_device_handle *handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	struct usbi_transfer *itransfer, *tmp;
+	struct running_callback *running;
+	struct list_head queued;
+	int tid = usbi_get_tid();
+	int waiting;
+	int i;
+
+	list_init(&queued);
+	usbi_mutex_lock(&ctx->dispatch_lock);
+	for (i = 0; i < ctx->dispatch_num_workers; i++) {
+		list_for_each_entry_safe(itransfer, tmp,
+				&ctx->dispatch_workers[i].queue, list,
+				struct usbi_transfer) {
+			if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle
+					!= handle)
+				continue;
+			list_del(&itransfer->list);
+			list_add_tail(&itransfer->list, &queued);
+		}
+	}
+
+	/* the running callbacks came first, so they are done before the
+	 * queued ones are delivered */
+	do {
+		waiting = 0;
+		list_for_each_entry(running, &ctx->running_callbacks, list,
+				struct running_callback) {
+			if (running->handle != handle)
+				continue;
+			if (tid == -1 || running->tid == tid)
+				running->closed = 1;
+			else
+				waiting = 1;
+		}
+		if (waiting)
+			usbi_cond_wait(&ctx->dispatch_cond, &ctx->dispatch_lock);
+	} while (waiting);
+	usbi_mutex_unlock(&ctx->dispatch_lock);
+
+	list_for_each_entry_safe(itransfer, tmp, &queued, list,
+			struct usbi_transfer) {
+		list_del(&itransfer->list);
+		run_completion_callback(ctx, itransfer, NULL);
+	}
+}
+
+/** \ingroup asyncio
+ * Deliver transfer completions on a pool of worker threads.
+ *
+ * By default, transfer callbacks run on the thread that handles events, so
+ * a slow callback delays the reaping of every other device on the context.
+ * With a worker pool, the event handler only reaps completed transfers and
+ * queues them; the callbacks are invoked by num_workers threads managed by
+ * libusbx. The completions of one device handle are always delivered by the
+ * same worker, so they still arrive in order, and callbacks of different
+ * handles may run concurrently. Callbacks are then free to perform
+ * lengthy processing, and to submit transfers, but they should be written
+ * with that concurrency in mind.
+ *
+ * Synchronous I/O (\ref syncio) is not affected: its completions are still
+ * handled on the event handling thread. Completions that are batched (see
+ * libusb_set_completion_batching()) are also delivered by the event handler.
+ *
+ * Calling this function again replaces the pool. Passing 0 stops the
+ * workers, after they have delivered the completions they already had
+ * queued; libusb_exit() does this implicitly. This function must not be
+ * called from within a transfer callback. Because of the queueing,
+ * libusb_wait_for_event() and the completed argument of
+ * libusb_handle_events_completed() only see the completion once its
+ * callback has run on the worker.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param num_workers the number of worker threads, or 0 to invoke callbacks
+ * on the event handling thread again
  * \returns 0 on success
- * \returns LIBUSB_ERROR_NOT_FOUND if the transfer is already complete or
- * cancelled.
- * \returns a LIBUSB_ERROR code on failure
+ * \returns LIBUSB_ERROR_INVALID_PARAM if num_workers is negative
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_OTHER if a worker thread could not be created
  */
-int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+int API_EXPORTED libusb_set_completion_workers(libusb_context *ctx,
+	int num_workers)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	int r;
+	struct usbi_dispatch_worker *workers;
+	int r = 0;
+	int i;
 
-	usbi_dbg("");
-	usbi_mutex_lock(&itransfer->lock);
-	r = usbi_backend->cancel_transfer(itransfer);
-	if (r < 0) {
-		if (r != LIBUSB_ERROR_NOT_FOUND &&
-		    r != LIBUSB_ERROR_NO_DEVICE)
-			usbi_err(TRANSFER_CTX(transfer),
-				"cancel transfer failed error %d", r);
-		else
-			usbi_dbg("cancel transfer failed error %d", r);
+	USBI_GET_CONTEXT(ctx);
+	if (num_workers < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
 
-		if (r == LIBUSB_ERROR_NO_DEVICE)
-			itransfer->flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
+	stop_dispatch_workers(ctx);
+	if (!num_workers)
+		return 0;
+
+	workers = calloc(num_workers, sizeof(*workers));
+	if (!workers)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < num_workers; i++) {
+		workers[i].ctx = ctx;
+		list_init(&workers[i].queue);
+		usbi_cond_init(&workers[i].cond, NULL);
+		if (usbi_thread_create(&workers[i].thread, dispatch_worker_main,
+				&workers[i]) != 0) {
+			usbi_err(ctx, "failed to create dispatch worker %d", i);
+			usbi_cond_destroy(&workers[i].cond);
+			r = LIBUSB_ERROR_OTHER;
+			break;
+		}
 	}
 
-	itransfer->flags |= USBI_TRANSFER_CANCELLING;
+	/* a partially created pool is published and torn down again, so that
+	 * the workers that did start exit the normal way */
+	usbi_mutex_lock(&ctx->dispatch_lock);
+	ctx->dispatch_workers = workers;
+	ctx->dispatch_num_workers = i;
+	usbi_mutex_unlock(&ctx->dispatch_lock);
+	if (r < 0)
+		stop_dispatch_workers(ctx);
 
-	usbi_mutex_unlock(&itransfer->lock);
+	usbi_dbg("%d dispatch workers", num_workers);
 	return r;
 }
 
+/* the LIBUSB_ERROR code matching the status of a finished transfer, 0 for
+ * LIBUSB_TRANSFER_COMPLETED. used by the helpers built on asynchronous
+ * transfers, which report a cancelled transfer as LIBUSB_ERROR_INTERRUPTED */
+int usbi_transfer_status_to_error(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	case LIBUSB_TRANSFER_ERROR:
+		return LIBUSB_ERROR_IO;
+	default:
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+
 /* Handle completion of a transfer (completion might be an error condition).
  * This will invoke the user-supplied callback function, which may end up
  * freeing the transfer. Therefore you cannot use the transfer structure
  * after calling this function, and you should free all backend-specific
  * data before calling it.
+ * When completion batching is enabled and this is called from event
+ * handling, the transfer is queued instead and the callback runs at the end
+ * of the event handling pass. With a completion worker pool, the callback
+ * runs on one of the workers.
  * Do not call this function with the usbi_transfer lock held. User-specified
  * callback functions may attempt to directly resubmit the transfer, which
  * will attempt to take the lock. */
@@ -1522,43 +3318,69 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct libusb_context *ctx = TRANSFER_CTX(transfer);
-	uint8_t flags;
+	struct usbi_cancel_group *group;
 	int r = 0;
 
-	/* FIXME: could be more intelligent with the timerfd here. we don't need
-	 * to disarm the timerfd if there was no timer running, and we only need
-	 * to rearm the timerfd if the transfer that expired was the one with
-	 * the shortest timeout. */
+	/* sharded handles are reaped by their own thread, outside the budget */
+	if (ctx->budget_active && !transfer->dev_handle->shard_pollfd)
+		ctx->budget_completions++;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	list_del(&itransfer->list);
-	if (usbi_using_timerfd(ctx))
-		r = arm_timerfd_for_next_timeout(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-	if (usbi_using_timerfd(ctx) && (r < 0))
+	/* completions of a sharded handle are reaped outside of the batch */
+	if (ctx->batch_active && !transfer->dev_handle->shard_pollfd
+			&& queue_completion(ctx, itransfer, status) == 0)
+		return 0;
+
+	/* the timerfd is only touched if this transfer held the earliest
+	 * pending timeout */
+	usbi_mutex_lock(&transfer->dev_handle->flying_lock);
+	r = usbi_remove_from_flying_list(itransfer);
+	group = leave_cancel_group(itransfer);
+	usbi_mutex_unlock(&transfer->dev_handle->flying_lock);
+	if (r < 0) {
+		if (group)
+			finish_cancel_group(group);
 		return r;
+	}
 
-	if (status == LIBUSB_TRANSFER_COMPLETED
-			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
-		int rqlen = transfer->length;
-		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
-			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
-		if (rqlen != itransfer->transferred) {
-			usbi_dbg("interpreting short transfer as error");
-			status = LIBUSB_TRANSFER_ERROR;
-		}
+	set_transfer_result(itransfer, status);
+	if (itransfer->inline_callback || dispatch_completion(ctx, itransfer) < 0)
+		run_completion_callback(ctx, itransfer, NULL);
+	if (group)
+		finish_cancel_group(group);
+	return 0;
+}
+
+/* Deliver data received by a LIBUSB_TRANSFER_AUTO_RESUBMIT transfer that the
+ * backend has already put back in flight. The transfer stays on the flying
+ * list. The callback runs right here rather than through the batch or the
+ * completion workers: the backend reuses the buffer for the next-but-one
+ * completion, which it can't reap before this returns.
+ * Do not call this function with the usbi_transfer lock held. */
+int usbi_handle_transfer_data(struct usbi_transfer *itransfer, int length)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+
+	if (ctx->budget_active && !transfer->dev_handle->shard_pollfd)
+		ctx->budget_completions++;
+
+	transfer->status = LIBUSB_TRANSFER_COMPLETED;
+	transfer->actual_length = length;
+	update_transfer_stats(ctx, transfer);
+	if (USBI_CAPTURING(ctx)) {
+		usbi_capture_completion(ctx, transfer);
+		usbi_capture_submit(ctx, transfer);
 	}
+	if (transfer->type < LIBUSB_STATS_TRANSFER_TYPES)
+		usbi_stats_inc(ctx, transfers_submitted[transfer->type]);
 
-	flags = transfer->flags;
-	transfer->status = status;
-	transfer->actual_length = itransfer->transferred;
 	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
-	if (transfer->callback)
+	if (transfer->callback) {
+		usbi_trace(callback, transfer, transfer->endpoint,
+			transfer->actual_length, transfer->status);
 		transfer->callback(transfer);
-	/* transfer might have been freed by the above call, do not use from
-	 * this point. */
-	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
-		libusb_free_transfer(transfer);
+	}
 	usbi_mutex_lock(&ctx->event_waiters_lock);
 	usbi_cond_broadcast(&ctx->event_waiters_cond);
 	usbi_mutex_unlock(&ctx->event_waiters_lock);
@@ -1661,6 +3483,8 @@ void API_EXPORTED libusb_lock_events(libusb_context *ctx)
  */
 void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
 {
+	struct usbi_sync_waiter *waiter;
+
 	USBI_GET_CONTEXT(ctx);
 	ctx->event_handler_active = 0;
 	usbi_mutex_unlock(&ctx->events_lock);
@@ -1669,6 +3493,16 @@ void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
 	 * the availability of the events lock when we are modifying pollfds
 	 * (check ctx->pollfd_modify)? */
 	usbi_mutex_lock(&ctx->event_waiters_lock);
+	/* of the synchronous waiters, only one needs to take over event
+	 * handling. skip those whose transfer is already done, as they are
+	 * about to leave */
+	list_for_each_entry(waiter, &ctx->sync_waiters, list,
+			struct usbi_sync_waiter) {
+		if (!waiter->completed) {
+			usbi_cond_signal(&waiter->cond);
+			break;
+		}
+	}
 	usbi_cond_broadcast(&ctx->event_waiters_cond);
 	usbi_mutex_unlock(&ctx->event_waiters_lock);
 }
@@ -1776,39 +3610,16 @@ void API_EXPORTED libusb_unlock_event_waiters(libusb_context *ctx)
 	usbi_mutex_unlock(&ctx->event_waiters_lock);
 }
 
-/** \ingroup poll
- * Wait for another thread to signal completion of an event. Must be called
- * with the event waiters lock held, see libusb_lock_event_waiters().
- *
- * This function will block until any of the following conditions are met:
- * -# The timeout expires
- * -# A transfer completes
- * -# A thread releases the event handling lock through libusb_unlock_events()
- *
- * Condition 1 is obvious. Condition 2 unblocks your thread <em>after</em>
- * the callback for the transfer has completed. Condition 3 is important
- * because it means that the thread that was previously handling events is no
- * longer doing so, so if any events are to complete, another thread needs to
- * step up and start event handling.
- *
- * This function releases the event waiters lock before putting your thread
- * to sleep, and reacquires the lock as it is being woken up.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \param tv maximum timeout for this blocking function. A NULL value
- * indicates unlimited timeout.
- * \returns 0 after a transfer completes or another thread stops event handling
- * \returns 1 if the timeout expired
- * \see \ref mtasync
- */
-int API_EXPORTED libusb_wait_for_event(libusb_context *ctx, struct timeval *tv)
+/* wait on a condition associated with event_waiters_lock, for at most tv
+ * (or forever if tv is NULL). returns 1 on timeout */
+static int wait_for_cond(struct libusb_context *ctx, usbi_cond_t *cond,
+	struct timeval *tv)
 {
 	struct timespec timeout;
 	int r;
 
-	USBI_GET_CONTEXT(ctx);
 	if (tv == NULL) {
-		usbi_cond_wait(&ctx->event_waiters_cond, &ctx->event_waiters_lock);
+		usbi_cond_wait(cond, &ctx->event_waiters_lock);
 		return 0;
 	}
 
@@ -1825,11 +3636,41 @@ int API_EXPORTED libusb_wait_for_event(libusb_context *ctx, struct timeval *tv)
 		timeout.tv_sec++;
 	}
 
-	r = usbi_cond_timedwait(&ctx->event_waiters_cond,
-		&ctx->event_waiters_lock, &timeout);
+	r = usbi_cond_timedwait(cond, &ctx->event_waiters_lock, &timeout);
 	return (r == ETIMEDOUT);
 }
 
+/** \ingroup poll
+ * Wait for another thread to signal completion of an event. Must be called
+ * with the event waiters lock held, see libusb_lock_event_waiters().
+ *
+ * This function will block until any of the following conditions are met:
+ * -# The timeout expires
+ * -# A transfer completes
+ * -# A thread releases the event handling lock through libusb_unlock_events()
+ *
+ * Condition 1 is obvious. Condition 2 unblocks your thread <em>after</em>
+ * the callback for the transfer has completed. Condition 3 is important
+ * because it means that the thread that was previously handling events is no
+ * longer doing so, so if any events are to complete, another thread needs to
+ * step up and start event handling.
+ *
+ * This function releases the event waiters lock before putting your thread
+ * to sleep, and reacquires the lock as it is being woken up.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param tv maximum timeout for this blocking function. A NULL value
+ * indicates unlimited timeout.
+ * \returns 0 after a transfer completes or another thread stops event handling
+ * \returns 1 if the timeout expired
+ * \see \ref mtasync
+ */
+int API_EXPORTED libusb_wait_for_event(libusb_context *ctx, struct timeval *tv)
+{
+	USBI_GET_CONTEXT(ctx);
+	return wait_for_cond(ctx, &ctx->event_waiters_cond, tv);
+}
+
 static void handle_timeout(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
@@ -1837,6 +3678,8 @@ static void handle_timeout(struct usbi_transfer *itransfer)
 	int r;
 
 	itransfer->flags |= USBI_TRANSFER_TIMED_OUT;
+	usbi_trace(timeout, transfer, transfer->endpoint, transfer->length,
+		itransfer->transferred);
 	r = libusb_cancel_transfer(transfer);
 	if (r < 0)
 		usbi_warn(TRANSFER_CTX(transfer),
@@ -1850,7 +3693,7 @@ static int handle_timeouts_locked(struct libusb_context *ctx)
 	struct timeval systime;
 	struct usbi_transfer *transfer;
 
-	if (list_empty(&ctx->flying_transfers))
+	if (!ctx->timeout_heap_len)
 		return 0;
 
 	/* get current time */
@@ -1860,27 +3703,21 @@ static int handle_timeouts_locked(struct libusb_context *ctx)
 
 	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
 
-	/* iterate through flying transfers list, finding all transfers that
-	 * have expired timeouts */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!timerisset(cur_tv))
-			return 0;
-
-		/* ignore timeouts we've already handled */
-		if (transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
+	/* pop transfers off the timeout heap for as long as the earliest
+	 * timeout has expired. a timed out transfer stays in the flying list
+	 * until its cancellation completes, but doesn't need the timer again */
+	while (ctx->timeout_heap_len) {
+		transfer = ctx->timeout_heap[0];
 
 		/* if transfer has non-expired timeout, nothing more to do */
-		if ((cur_tv->tv_sec > systime.tv_sec) ||
-				(cur_tv->tv_sec == systime.tv_sec &&
-					cur_tv->tv_usec > systime.tv_usec))
+		if (timercmp(&transfer->timeout, &systime, >))
 			return 0;
 
-		/* otherwise, we've got an expired timeout to handle */
-		handle_timeout(transfer);
+		/* otherwise, we've got an expired timeout to handle, unless the
+		 * transfer already completed and awaits batched delivery */
+		timeout_heap_remove(ctx, transfer);
+		if (!(transfer->flags & USBI_TRANSFER_COMPLETING))
+			handle_timeout(transfer);
 	}
 	return 0;
 }
@@ -1889,9 +3726,9 @@ static int handle_timeouts(struct libusb_context *ctx)
 {
 	int r;
 	USBI_GET_CONTEXT(ctx);
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&ctx->timeouts_lock);
 	r = handle_timeouts_locked(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&ctx->timeouts_lock);
 	return r;
 }
 
@@ -1900,7 +3737,7 @@ static int handle_timerfd_trigger(struct libusb_context *ctx)
 {
 	int r;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&ctx->timeouts_lock);
 
 	/* process the timeout that just happened */
 	r = handle_timeouts_locked(ctx);
@@ -1911,29 +3748,345 @@ static int handle_timerfd_trigger(struct libusb_context *ctx)
 	r = arm_timerfd_for_next_timeout(ctx);
 
 out:
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&ctx->timeouts_lock);
+	return r;
+}
+#endif
+
+/* Interrupt the event handler, if there is one, so that it goes round its
+ * loop again. This does not wait for the event handler: several signals sent
+ * before it gets around to waking up are coalesced into a single wakeup. */
+void usbi_signal_event(struct libusb_context *ctx)
+{
+	int pending;
+
+	usbi_mutex_lock(&ctx->pollfd_modify_lock);
+	pending = (ctx->ctrl_gen++ != ctx->ctrl_gen_seen);
+	if (!pending) {
+		ssize_t r;
+#ifdef USBI_EVENTFD_AVAILABLE
+		if (usbi_using_eventfd(ctx)) {
+			uint64_t value = 1;
+			r = write(ctx->ctrl_pipe[1], &value, sizeof(value));
+		} else
+#endif
+		{
+			unsigned char dummy = 1;
+			r = usbi_write(ctx->ctrl_pipe[1], &dummy, sizeof(dummy));
+		}
+		if (r <= 0) {
+			usbi_warn(ctx, "internal signalling write failed");
+			ctx->ctrl_gen--;
+		}
+	}
+	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+}
+
+/* consume the wakeup written by usbi_signal_event(), if any, and record that
+ * the event handler has caught up with all signals sent so far */
+static void clear_event(struct libusb_context *ctx)
+{
+	usbi_mutex_lock(&ctx->pollfd_modify_lock);
+	if (ctx->ctrl_gen != ctx->ctrl_gen_seen) {
+		ssize_t r;
+#ifdef USBI_EVENTFD_AVAILABLE
+		if (usbi_using_eventfd(ctx)) {
+			uint64_t value;
+			r = read(ctx->ctrl_pipe[0], &value, sizeof(value));
+		} else
+#endif
+		{
+			unsigned char dummy;
+			r = usbi_read(ctx->ctrl_pipe[0], &dummy, sizeof(dummy));
+		}
+		if (r <= 0)
+			usbi_warn(ctx, "internal signalling read failed");
+		ctx->ctrl_gen_seen = ctx->ctrl_gen;
+	}
+	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+}
+
+/* number of hotplug messages read from the pipe at once, and kept on the
+ * stack by handle_hotplug_messages() */
+#define USBI_HOTPLUG_BATCH_SIZE 32
+
+/* read every message pending on the hotplug pipe and dispatch them. a burst
+ * of hotplug events, such as a hub bringing up all its ports, is thus handled
+ * in a single wakeup */
+static int handle_hotplug_messages(struct libusb_context *ctx)
+{
+	libusb_hotplug_message stack_messages[USBI_HOTPLUG_BATCH_SIZE];
+	libusb_hotplug_message *messages = stack_messages;
+	size_t capacity = USBI_HOTPLUG_BATCH_SIZE;
+	size_t count = 0;
+	size_t i, num_events;
+	ssize_t ret;
+
+	usbi_dbg("caught a fish on the hotplug pipe");
+
+	/* read the messages from the hotplug thread. writes to the pipe are
+	 * atomic, so only whole messages are ever read */
+	while (1) {
+		struct pollfd fd;
+
+		if (count == capacity) {
+			libusb_hotplug_message *more =
+				malloc(2 * capacity * sizeof(*messages));
+			if (!more)
+				break;	/* the rest is read on the next wakeup */
+			memcpy(more, messages, count * sizeof(*messages));
+			if (messages != stack_messages)
+				free(messages);
+			messages = more;
+			capacity *= 2;
+		}
+
+		ret = usbi_read(ctx->hotplug_pipe[0], messages + count,
+			(capacity - count) * sizeof(*messages));
+		if (ret < (ssize_t) sizeof(*messages)) {
+			if (count)
+				break;
+			usbi_err(ctx, "hotplug pipe read error %d < %d",
+				 ret, sizeof(*messages));
+			return LIBUSB_ERROR_OTHER;
+		}
+		count += ret / sizeof(*messages);
+		if (count < capacity)
+			break;
+
+		/* the read was filled, look for more without blocking */
+		fd.fd = ctx->hotplug_pipe[0];
+		fd.events = POLLIN;
+		fd.revents = 0;
+		if (usbi_poll(&fd, 1, 0) <= 0 || !(fd.revents & POLLIN))
+			break;
+	}
+	usbi_dbg("%d hotplug messages", (int) count);
+
+	/* deregistration wakeups carry no device. leave them out of the
+	 * events passed to the batch callback */
+	for (i = 0, num_events = 0; i < count; i++) {
+		usbi_hotplug_match(ctx, messages[i].device, messages[i].event);
+		if (messages[i].device)
+			messages[num_events++] = messages[i];
+	}
+	usbi_hotplug_match_batch(ctx, messages, (int) num_events);
+
+	/* the devices that left. dereference them */
+	for (i = 0; i < num_events; i++)
+		if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == messages[i].event)
+			libusb_unref_device(messages[i].device);
+
+	if (messages != stack_messages)
+		free(messages);
+	return 0;
+}
+
+/* hand one ready fd to the backend. fds registered for a device handle go
+ * straight to its handle_fd_event(), so that the backend doesn't have to look
+ * the handle up under open_devs_lock, which would hold up libusb_open() and
+ * libusb_close() for as long as the callbacks run. the handle can't go away
+ * meanwhile: libusb_close() locks the event handler out before it removes
+ * the fd. */
+static int handle_ready_fd(struct libusb_context *ctx,
+	struct libusb_device_handle *handle, struct pollfd *pollfd)
+{
+	int r;
+
+	if (handle && usbi_backend->handle_fd_event)
+		r = usbi_backend->handle_fd_event(ctx, handle, pollfd->fd,
+			pollfd->revents);
+	else
+		r = usbi_backend->handle_events(ctx, pollfd, 1, 1);
+	if (r)
+		usbi_err(ctx, "backend handle_events failed with error %d", r);
+	return r;
+}
+
+#ifdef USBI_EPOLL_AVAILABLE
+/* epoll flavour of handle_events(). the interest set is kept up to date by
+ * usbi_add_pollfd() and usbi_remove_pollfd(), and each ready event carries
+ * its struct usbi_pollfd, so a wakeup only costs work for the fds that are
+ * actually ready. */
+static int handle_epoll_events(struct libusb_context *ctx, int timeout_ms)
+{
+	struct epoll_event *events = ctx->epoll_events;
+	int r;
+	int i;
+
+	/* the ready fds a previous pass left unserved because the budget of
+	 * libusb_handle_events_budget() ran out are served first, without
+	 * waiting. epoll_wait() would report them again, but behind the ones
+	 * served last time: the kernel hands a level-triggered set back in the
+	 * same order every time, which would let a busy device take the whole
+	 * budget of every pass */
+	if (ctx->epoll_next < ctx->epoll_nready) {
+		usbi_dbg("serving %d ready fds left from the last pass",
+			ctx->epoll_nready - ctx->epoll_next);
+		goto serve;
+	}
+
+	/* the probes report the fds being waited on, as with poll(). the set
+	 * only changes while event handling is interrupted, so the count is
+	 * stable here */
+	usbi_dbg("epoll_wait() with timeout in %dms", timeout_ms);
+	usbi_trace(poll_enter, ctx, ctx->pollfds_cnt, timeout_ms, 0);
+	r = epoll_wait(ctx->epoll_fd, events, USBI_EPOLL_MAX_EVENTS, timeout_ms);
+	usbi_trace(poll_exit, ctx, ctx->pollfds_cnt, timeout_ms, r);
+	usbi_dbg("epoll_wait() returned %d", r);
+	if (r >= 0)
+		usbi_stats_inc(ctx, event_wakeups);
+	if (r == 0) {
+		usbi_stats_inc(ctx, timeout_wakeups);
+		return handle_timeouts(ctx);
+	} else if (r == -1 && errno == EINTR) {
+		return LIBUSB_ERROR_INTERRUPTED;
+	} else if (r < 0) {
+		usbi_err(ctx, "epoll_wait failed %d err=%d\n", r, errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	/* usbi_remove_pollfd() clears entries of this array as their fds go
+	 * away, which can happen from within the callbacks invoked below or
+	 * while entries are left for the next pass */
+	ctx->epoll_nready = r;
+	ctx->epoll_next = 0;
+
+serve:
+	r = 0;
+	for (i = ctx->epoll_next; i < ctx->epoll_nready; i++) {
+		struct usbi_pollfd *ipollfd = events[i].data.ptr;
+		short revents = (short)events[i].events;
+		struct pollfd pollfd;
+		int fd;
+
+		ctx->epoll_next = i + 1;
+		if (!ipollfd)
+			continue;
+		fd = ipollfd->pollfd.fd;
+
+		if (fd == ctx->ctrl_pipe[0]) {
+			/* another thread wanted to interrupt event handling. carry
+			 * on with anything else that cropped up at the same time */
+			usbi_dbg("caught a fish on the control pipe");
+			usbi_stats_inc(ctx, ctrl_wakeups);
+			clear_event(ctx);
+			continue;
+		}
+
+		if (fd == ctx->hotplug_pipe[0]) {
+			if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+				r = handle_hotplug_messages(ctx);
+				if (r < 0)
+					break;
+			}
+			continue;
+		}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+		if (usbi_using_timerfd(ctx) && fd == ctx->timerfd) {
+			usbi_dbg("timerfd triggered");
+			usbi_stats_inc(ctx, timeout_wakeups);
+			r = handle_timerfd_trigger(ctx);
+			if (r < 0)
+				break;
+			continue;
+		}
+#endif
+
+		usbi_stats_inc(ctx, io_wakeups);
+		pollfd.fd = fd;
+		pollfd.events = ipollfd->pollfd.events;
+		pollfd.revents = revents;
+		r = handle_ready_fd(ctx, ipollfd->handle, &pollfd);
+		if (r)
+			break;
+		if (usbi_event_budget_exhausted(ctx))
+			break;
+	}
+
+	/* keep the unserved entries for the next pass, unless an error cut
+	 * this one short */
+	if (r || ctx->epoll_next >= ctx->epoll_nready) {
+		ctx->epoll_nready = 0;
+		ctx->epoll_next = 0;
+	}
+
 	return r;
 }
 #endif
 
+/* hand the ready fds of a poll() pass to the backend one at a time, until the
+ * budget of libusb_handle_events_budget() runs out. the next pass carries on
+ * from the fd after the last one served, so that a busy device can't keep
+ * the others waiting */
+static int handle_ready_fds_budget(struct libusb_context *ctx,
+	struct pollfd *fds, POLL_NFDS_TYPE nfds)
+{
+	POLL_NFDS_TYPE n, i;
+	int r = 0;
+
+	for (n = 0; n < nfds; n++) {
+		i = (ctx->poll_rr + n) % nfds;
+		/* fds removed by a callback of this pass are skipped */
+		if (!fds[i].revents || fds[i].fd < 0)
+			continue;
+
+		r = handle_ready_fd(ctx, ctx->poll_handles[i], &fds[i]);
+		if (r)
+			break;
+		if (usbi_event_budget_exhausted(ctx)) {
+			ctx->poll_rr = (i + 1) % nfds;
+			break;
+		}
+	}
+
+	return r;
+}
+
 /* do the actual event handling. assumes that no other thread is concurrently
  * doing the same thing. */
-static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+static int handle_events_pass(struct libusb_context *ctx, struct timeval *tv)
 {
 	int r;
 	struct usbi_pollfd *ipollfd;
-	POLL_NFDS_TYPE nfds = 0;
-	struct pollfd *fds = NULL;
+	POLL_NFDS_TYPE nfds;
+	struct pollfd *fds;
 	int i = -1;
 	int timeout_ms;
 
-	usbi_mutex_lock(&ctx->pollfds_lock);
-	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
-		nfds++;
+	timeout_ms = (int)(tv->tv_sec * 1000) + (tv->tv_usec / 1000);
+
+	/* round up to next millisecond */
+	if (tv->tv_usec % 1000)
+		timeout_ms++;
+
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx))
+		return handle_epoll_events(ctx, timeout_ms);
+#endif
 
-	/* TODO: malloc when number of fd's changes, not on every poll */
-	if (nfds != 0)
-		fds = malloc(sizeof(*fds) * nfds);
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	nfds = ctx->pollfds_cnt;
+
+	/* only reallocate when the number of fd's grows, not on every poll */
+	if (nfds > ctx->poll_fds_size) {
+		struct libusb_device_handle **handles;
+
+		fds = realloc(ctx->poll_fds, sizeof(*fds) * nfds);
+		if (fds)
+			ctx->poll_fds = fds;
+		handles = realloc(ctx->poll_handles, sizeof(*handles) * nfds);
+		if (handles)
+			ctx->poll_handles = handles;
+		if (!fds || !handles) {
+			ctx->poll_nfds = 0;
+			usbi_mutex_unlock(&ctx->pollfds_lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		ctx->poll_fds_size = nfds;
+	}
+	fds = ctx->poll_fds;
 	if (!fds) {
 		usbi_mutex_unlock(&ctx->pollfds_lock);
 		return LIBUSB_ERROR_NO_MEM;
@@ -1946,26 +4099,24 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 		fds[i].fd = fd;
 		fds[i].events = pollfd->events;
 		fds[i].revents = 0;
+		ctx->poll_handles[i] = ipollfd->handle;
 	}
+	ctx->poll_nfds = nfds;
 	usbi_mutex_unlock(&ctx->pollfds_lock);
 
-	timeout_ms = (int)(tv->tv_sec * 1000) + (tv->tv_usec / 1000);
-
-	/* round up to next millisecond */
-	if (tv->tv_usec % 1000)
-		timeout_ms++;
-
 	usbi_dbg("poll() %d fds with timeout in %dms", nfds, timeout_ms);
+	usbi_trace(poll_enter, ctx, nfds, timeout_ms, 0);
 	r = usbi_poll(fds, nfds, timeout_ms);
+	usbi_trace(poll_exit, ctx, nfds, timeout_ms, r);
 	usbi_dbg("poll() returned %d", r);
+	if (r >= 0)
+		usbi_stats_inc(ctx, event_wakeups);
 	if (r == 0) {
-		free(fds);
+		usbi_stats_inc(ctx, timeout_wakeups);
 		return handle_timeouts(ctx);
 	} else if (r == -1 && errno == EINTR) {
-		free(fds);
 		return LIBUSB_ERROR_INTERRUPTED;
 	} else if (r < 0) {
-		free(fds);
 		usbi_err(ctx, "poll failed %d err=%d\n", r, errno);
 		return LIBUSB_ERROR_IO;
 	}
@@ -1974,12 +4125,14 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	if (fds[0].revents) {
 		/* another thread wanted to interrupt event handling, and it succeeded!
 		 * handle any other events that cropped up at the same time, and
-		 * simply return */
+		 * simply return. the next call rebuilds the poll set, picking up
+		 * whatever the other thread changed */
 		usbi_dbg("caught a fish on the control pipe");
+		usbi_stats_inc(ctx, ctrl_wakeups);
+		clear_event(ctx);
 
 		if (r == 1) {
-			r = 0;
-			goto handled;
+			return 0;
 		} else {
 			/* prevent OS backend from trying to handle events on ctrl pipe */
 			fds[0].revents = 0;
@@ -1989,29 +4142,13 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 
 	/* fd[1] is always the hotplug pipe */
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) && fds[1].revents) {
-		libusb_hotplug_message message;
-		ssize_t ret;
-
-		usbi_dbg("caught a fish on the hotplug pipe");
-
-		/* read the message from the hotplug thread */
-		ret = usbi_read(ctx->hotplug_pipe[0], &message, sizeof (message));
-		if (ret < sizeof(message)) {
-			usbi_err(ctx, "hotplug pipe read error %d < %d",
-				 ret, sizeof(message));
-			r = LIBUSB_ERROR_OTHER;
-			goto handled;
-		}
-
-		usbi_hotplug_match(ctx, message.device, message.event);
-
-		/* the device left. dereference the device */
-		if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == message.event)
-			libusb_unref_device(message.device);
+		int ret = handle_hotplug_messages(ctx);
+		if (ret < 0)
+			return ret;
 
 		fds[1].revents = 0;
 		if (1 == r--)
-			goto handled;
+			return 0;
 	} /* else there shouldn't be anything on this pipe */
 
 #ifdef USBI_TIMERFD_AVAILABLE
@@ -2020,16 +4157,15 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 		/* timerfd indicates that a timeout has expired */
 		int ret;
 		usbi_dbg("timerfd triggered");
+		usbi_stats_inc(ctx, timeout_wakeups);
 
 		ret = handle_timerfd_trigger(ctx);
 		if (ret < 0) {
 			/* return error code */
-			r = ret;
-			goto handled;
+			return ret;
 		} else if (r == 1) {
 			/* no more active file descriptors, nothing more to do */
-			r = 0;
-			goto handled;
+			return 0;
 		} else {
 			/* more events pending...
 			 * prevent OS backend from trying to handle events on timerfd */
@@ -2039,12 +4175,49 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	}
 #endif
 
+	usbi_stats_inc(ctx, io_wakeups);
+	if (ctx->budget_active)
+		return handle_ready_fds_budget(ctx, fds, nfds);
+
+	if (usbi_backend->handle_fd_event) {
+		POLL_NFDS_TYPE n;
+		int num_ready = r;
+
+		r = 0;
+		for (n = 0; n < nfds && num_ready > 0; n++) {
+			if (!fds[n].revents)
+				continue;
+			num_ready--;
+			/* removed by a callback of this pass */
+			if (fds[n].fd < 0)
+				continue;
+			r = handle_ready_fd(ctx, ctx->poll_handles[n], &fds[n]);
+			if (r)
+				break;
+		}
+		return r;
+	}
+
 	r = usbi_backend->handle_events(ctx, fds, nfds, r);
 	if (r)
 		usbi_err(ctx, "backend handle_events failed with error %d", r);
 
-handled:
-	free(fds);
+	return r;
+}
+
+/* handle one pass of events, delivering the completions it produced in one
+ * batch if completion batching is enabled */
+static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+{
+	int r;
+
+	if (!ctx->completion_batching)
+		return handle_events_pass(ctx, tv);
+
+	ctx->batch_active = 1;
+	r = handle_events_pass(ctx, tv);
+	ctx->batch_active = 0;
+	flush_completion_batch(ctx);
 	return r;
 }
 
@@ -2140,18 +4313,299 @@ retry:
 		goto retry;
 	}
 
-	usbi_dbg("another thread is doing event handling");
-	r = libusb_wait_for_event(ctx, &poll_timeout);
+	usbi_dbg("another thread is doing event handling");
+	r = libusb_wait_for_event(ctx, &poll_timeout);
+
+already_done:
+	libusb_unlock_event_waiters(ctx);
+
+	if (r < 0)
+		return r;
+	else if (r == 1)
+		return handle_timeouts(ctx);
+	else
+		return 0;
+}
+
+/* Backends may call this between the completions they reap in one go, and
+ * stop reaping when it returns 1: the libusb_handle_events_budget() call
+ * being served has used up its completion or time budget. The rest is left
+ * for the next call. Must be called from the thread handling events. */
+int usbi_event_budget_exhausted(struct libusb_context *ctx)
+{
+	struct timespec now_ts;
+	struct timeval now;
+
+	if (!ctx->budget_active)
+		return 0;
+	if (ctx->budget_limit && ctx->budget_completions >= ctx->budget_limit)
+		return 1;
+	if (!timerisset(&ctx->budget_deadline))
+		return 0;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now_ts) < 0)
+		return 0;
+	TIMESPEC_TO_TIMEVAL(&now, &now_ts);
+	return !timercmp(&now, &ctx->budget_deadline, <);
+}
+
+/** \ingroup poll
+ * Handle pending events, within a budget of completions and time.
+ *
+ * Like libusb_handle_events_timeout(), but event handling stops once
+ * max_completions transfers have completed or max_time has elapsed, even if
+ * more events are pending. The remaining events are handled by the next
+ * call. Ready devices are served in turn, starting after the last device
+ * served by the previous call, so that a burst of completions on one device
+ * cannot hold up the others, or the application's own main loop, for long.
+ *
+ * The budget is checked between completions, so a burst can overshoot it by
+ * the completions the backend reaped in one go. Callbacks are still invoked
+ * from within this function, and their run time counts against max_time.
+ *
+ * If another thread is handling events, this function waits for it like
+ * libusb_handle_events_timeout() does, and returns 0.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param tv the maximum time to block waiting for events, or an all zero
+ * timeval struct for non-blocking mode
+ * \param max_completions the maximum number of transfer completions to
+ * handle, or 0 for no limit
+ * \param max_time the maximum time to spend handling events once they are
+ * ready, or NULL for no limit
+ * \returns the number of transfer completions handled, or a LIBUSB_ERROR
+ * code on failure
+ */
+int API_EXPORTED libusb_handle_events_budget(libusb_context *ctx,
+	struct timeval *tv, int max_completions, struct timeval *max_time)
+{
+	struct timeval poll_timeout;
+	struct timespec now_ts;
+	struct timeval now;
+	int r;
+
+	USBI_GET_CONTEXT(ctx);
+	if (max_completions < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (libusb_try_lock_events(ctx)) {
+		r = libusb_handle_events_timeout_completed(ctx, tv, NULL);
+		return r < 0 ? r : 0;
+	}
+
+	ctx->budget_active = 1;
+	ctx->budget_completions = 0;
+	ctx->budget_limit = max_completions;
+	timerclear(&ctx->budget_deadline);
+	if (max_time && timerisset(max_time)) {
+		r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now_ts);
+		if (r < 0)
+			goto out;
+		TIMESPEC_TO_TIMEVAL(&now, &now_ts);
+		timeradd(&now, max_time, &ctx->budget_deadline);
+	}
+
+	r = get_next_timeout(ctx, tv, &poll_timeout);
+	if (r)
+		r = handle_timeouts(ctx);
+	else
+		r = handle_events(ctx, &poll_timeout);
+
+out:
+	ctx->budget_active = 0;
+	libusb_unlock_events(ctx);
+	return r < 0 ? r : ctx->budget_completions;
+}
+
+/* what libusb_start_event_thread() hands to the new thread. it is only
+ * used until the thread reports how applying the attributes went */
+struct usbi_event_thread_start {
+	struct libusb_context *ctx;
+	const struct libusb_event_thread_attr *attr;
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	int done;
+	int err;
+};
+
+static uint64_t monotonic_us(void)
+{
+	struct timespec ts;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *event_thread_main(void *arg)
+{
+	struct usbi_event_thread_start *start = arg;
+	struct libusb_context *ctx = start->ctx;
+	unsigned int spin_us = start->attr->spin_us;
+	struct timeval zero_tv = { 0, 0 };
+	uint64_t spin_until;
+	int err, r;
+
+	ctx->event_thread_tid = usbi_get_tid();
+	err = usbi_thread_set_scheduling(start->attr->cpus,
+		start->attr->num_cpus, start->attr->priority);
+	usbi_mutex_lock(&start->lock);
+	start->err = err;
+	start->done = 1;
+	usbi_cond_signal(&start->cond);
+	usbi_mutex_unlock(&start->lock);
+	if (err)
+		return NULL;
+
+	usbi_dbg("event thread running");
+	while (!usbi_atomic_load(&ctx->event_thread_stop)) {
+		/* libusb_stop_event_thread() interrupts this wait */
+		struct timeval tv = { 60, 0 };
+
+		r = libusb_handle_events_budget(ctx, &tv, 0, NULL);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_err(ctx, "event handling failed with error %d", r);
+		if (r <= 0 || !spin_us)
+			continue;
+
+		/* more completions are likely to follow, catch them without
+		 * going through a wakeup */
+		spin_until = monotonic_us() + spin_us;
+		while (!usbi_atomic_load(&ctx->event_thread_stop)
+				&& monotonic_us() < spin_until) {
+			r = libusb_handle_events_budget(ctx, &zero_tv, 0, NULL);
+			if (r > 0)
+				spin_until = monotonic_us() + spin_us;
+			else if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+				break;
+		}
+	}
+	usbi_dbg("event thread exiting");
+
+	return NULL;
+}
+
+/** \ingroup poll
+ * Start a thread handling the events of a context, so that the application
+ * doesn't have to run its own loop around libusb_handle_events(). The thread
+ * keeps handling events until libusb_stop_event_thread() or libusb_exit() is
+ * called, and transfer callbacks run on it.
+ *
+ * The attributes can pin the thread to a set of CPUs, give it a SCHED_FIFO
+ * priority, and have it keep polling for a while after each completion
+ * instead of going back to sleep, which saves wakeup latency on busy
+ * devices at the expense of CPU time. They are applied by the thread before
+ * this function returns.
+ *
+ * Other threads may still call the synchronous API, and may still call
+ * libusb_handle_events() and friends, which then wait for the event thread
+ * to do the work.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param attr the settings of the thread, or NULL for the defaults
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if the context already has an event thread
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if CPU affinity isn't supported on
+ * this platform
+ * \returns LIBUSB_ERROR_ACCESS if the priority could not be raised
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the CPUs or the priority are out of
+ * range
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_start_event_thread(libusb_context *ctx,
+	const struct libusb_event_thread_attr *attr)
+{
+	static const struct libusb_event_thread_attr default_attr;
+	struct usbi_event_thread_start start;
+	int r;
+
+	USBI_GET_CONTEXT(ctx);
+	if (ctx->event_thread_running)
+		return LIBUSB_ERROR_BUSY;
+
+	start.ctx = ctx;
+	start.attr = attr ? attr : &default_attr;
+	start.done = 0;
+	start.err = 0;
+	usbi_mutex_init(&start.lock, NULL);
+	usbi_cond_init(&start.cond, NULL);
+
+	usbi_atomic_store(&ctx->event_thread_stop, 0);
+	if (usbi_thread_create(&ctx->event_thread, event_thread_main,
+			&start) != 0) {
+		usbi_err(ctx, "failed to create the event thread");
+		r = LIBUSB_ERROR_OTHER;
+		goto out;
+	}
+
+	usbi_mutex_lock(&start.lock);
+	while (!start.done)
+		usbi_cond_wait(&start.cond, &start.lock);
+	usbi_mutex_unlock(&start.lock);
+
+	switch (start.err) {
+	case 0:
+		ctx->event_thread_running = 1;
+		r = 0;
+		break;
+	case EPERM:
+		r = LIBUSB_ERROR_ACCESS;
+		break;
+	case EINVAL:
+		r = LIBUSB_ERROR_INVALID_PARAM;
+		break;
+	case ENOTSUP:
+	case ENOSYS:
+		r = LIBUSB_ERROR_NOT_SUPPORTED;
+		break;
+	default:
+		r = LIBUSB_ERROR_OTHER;
+		break;
+	}
+	if (r < 0) {
+		usbi_err(ctx, "failed to set up the event thread, errno=%d",
+			start.err);
+		usbi_thread_join(ctx->event_thread);
+	}
+
+out:
+	usbi_cond_destroy(&start.cond);
+	usbi_mutex_destroy(&start.lock);
+	return r;
+}
+
+/** \ingroup poll
+ * Stop the thread started by libusb_start_event_thread(), and wait for it
+ * to return. Transfer callbacks running on it are finished first, and no
+ * more events are handled once this function returns, so the application
+ * has to take over event handling if it still has transfers in flight.
+ *
+ * libusb_exit() calls this function. It must not be called from a transfer
+ * callback, as the event thread can't wait for itself.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ */
+void API_EXPORTED libusb_stop_event_thread(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (!ctx->event_thread_running)
+		return;
+
+	if (ctx->event_thread_tid != -1 && ctx->event_thread_tid == usbi_get_tid()) {
+		usbi_err(ctx, "the event thread can't stop itself");
+		return;
+	}
 
-already_done:
-	libusb_unlock_event_waiters(ctx);
+	usbi_atomic_store(&ctx->event_thread_stop, 1);
+	usbi_signal_event(ctx);
+	/* it could also be waiting for another thread's event handling */
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
 
-	if (r < 0)
-		return r;
-	else if (r == 1)
-		return handle_timeouts(ctx);
-	else
-		return 0;
+	usbi_thread_join(ctx->event_thread);
+	ctx->event_thread_running = 0;
+	usbi_dbg("event thread stopped");
 }
 
 /** \ingroup poll
@@ -2221,6 +4675,103 @@ int API_EXPORTED libusb_handle_events_completed(libusb_context *ctx,
 	return libusb_handle_events_timeout_completed(ctx, &tv, completed);
 }
 
+/* Handle events until the transfer of a synchronous waiter completes, like
+ * libusb_handle_events_completed(). While another thread is handling
+ * events, the waiter sleeps on its own condition instead of
+ * event_waiters_cond, so that a completion only wakes up the thread that
+ * waits for it. */
+int usbi_handle_events_sync(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter)
+{
+	int r;
+	struct timeval tv;
+	struct timeval poll_timeout;
+
+	tv.tv_sec = 60;
+	tv.tv_usec = 0;
+	r = get_next_timeout(ctx, &tv, &poll_timeout);
+	if (r) {
+		/* timeout already expired */
+		return handle_timeouts(ctx);
+	}
+
+retry:
+	if (libusb_try_lock_events(ctx) == 0) {
+		if (!usbi_sync_waiter_completed(ctx, waiter)) {
+			usbi_dbg("doing our own event handling");
+			r = handle_events(ctx, &poll_timeout);
+		}
+		libusb_unlock_events(ctx);
+		return r;
+	}
+
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	if (waiter->completed) {
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+		return 0;
+	}
+
+	if (!libusb_event_handler_active(ctx)) {
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+		usbi_dbg("event handler was active but went away, retrying");
+		goto retry;
+	}
+
+	usbi_dbg("another thread is doing event handling");
+	list_add_tail(&waiter->list, &ctx->sync_waiters);
+	r = wait_for_cond(ctx, &waiter->cond, &poll_timeout);
+	list_del(&waiter->list);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+
+	if (r < 0)
+		return r;
+	else if (r == 1)
+		return handle_timeouts(ctx);
+	else
+		return 0;
+}
+
+/* whether the transfer of a synchronous waiter is done */
+int usbi_sync_waiter_completed(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter)
+{
+	int completed;
+
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	completed = waiter->completed;
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+	return completed;
+}
+
+/* mark the transfer of a synchronous waiter as done, and wake it up if it
+ * is sleeping in usbi_handle_events_sync(). the signal is sent before the
+ * lock is released, see usbi_sync_waiter_destroy().
+ * Callers of this function must hold the context's event_waiters_lock. */
+void usbi_sync_waiter_complete_locked(struct usbi_sync_waiter *waiter)
+{
+	waiter->completed = 1;
+	usbi_cond_signal(&waiter->cond);
+}
+
+void usbi_sync_waiter_complete(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter)
+{
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_sync_waiter_complete_locked(waiter);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+}
+
+/* waiters usually live on the stack of the waiting thread. taking the lock
+ * once makes sure that the thread completing the waiter is done signalling
+ * it before its condition goes away */
+void usbi_sync_waiter_destroy(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter)
+{
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+	usbi_cond_destroy(&waiter->cond);
+}
+
 /** \ingroup poll
  * Handle any pending events by polling file descriptors, without checking if
  * any other threads are already doing so. Must be called with the event lock
@@ -2324,44 +4875,25 @@ int API_EXPORTED libusb_pollfds_handle_timeouts(libusb_context *ctx)
 int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv)
 {
-	struct usbi_transfer *transfer;
 	struct timespec cur_ts;
 	struct timeval cur_tv;
-	struct timeval *next_timeout;
+	struct timeval next_timeout;
 	int r;
-	int found = 0;
 
 	USBI_GET_CONTEXT(ctx);
 	if (usbi_using_timerfd(ctx))
 		return 0;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	if (list_empty(&ctx->flying_transfers)) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_dbg("no URBs, no timeout!");
-		return 0;
-	}
-
-	/* find next transfer which hasn't already been processed as timed out */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		if (transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* no timeout for this transfer? */
-		if (!timerisset(&transfer->timeout))
-			continue;
-
-		found = 1;
-		break;
-	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-
-	if (!found) {
+	/* the heap only holds transfers whose timeout we still have to handle,
+	 * so the next one is always at the root */
+	usbi_mutex_lock(&ctx->timeouts_lock);
+	if (!ctx->timeout_heap_len) {
+		usbi_mutex_unlock(&ctx->timeouts_lock);
 		usbi_dbg("no URB with timeout or all handled by OS; no timeout!");
 		return 0;
 	}
-
-	next_timeout = &transfer->timeout;
+	next_timeout = ctx->timeout_heap[0]->timeout;
+	usbi_mutex_unlock(&ctx->timeouts_lock);
 
 	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &cur_ts);
 	if (r < 0) {
@@ -2370,11 +4902,11 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	}
 	TIMESPEC_TO_TIMEVAL(&cur_tv, &cur_ts);
 
-	if (!timercmp(&cur_tv, next_timeout, <)) {
+	if (!timercmp(&cur_tv, &next_timeout, <)) {
 		usbi_dbg("first timeout already expired");
 		timerclear(tv);
 	} else {
-		timersub(next_timeout, &cur_tv, tv);
+		timersub(&next_timeout, &cur_tv, tv);
 		usbi_dbg("next timeout in %d.%06ds", tv->tv_sec, tv->tv_usec);
 	}
 
@@ -2412,11 +4944,78 @@ void API_EXPORTED libusb_set_pollfd_notifiers(libusb_context *ctx,
 	ctx->fd_cb_user_data = user_data;
 }
 
-/* Add a file descriptor to the list of file descriptors to be monitored.
- * events should be specified as a bitmask of events passed to poll(), e.g.
- * POLLIN and/or POLLOUT. */
-int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
+/* Link an fd into the context's poll set. Must be called with the pollfds
+ * lock held. */
+static int attach_pollfd(struct libusb_context *ctx,
+	struct usbi_pollfd *ipollfd)
+{
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx)) {
+		struct epoll_event event;
+
+		/* the EPOLL* event bits share their values with the POLL* ones */
+		memset(&event, 0, sizeof(event));
+		event.events = (uint32_t)ipollfd->pollfd.events;
+		event.data.ptr = ipollfd;
+		if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ipollfd->pollfd.fd,
+				&event) < 0) {
+			usbi_err(ctx, "failed to add fd %d to epoll set, errno %d",
+				ipollfd->pollfd.fd, errno);
+			return LIBUSB_ERROR_OTHER;
+		}
+	}
+#endif
+	list_add_tail(&ipollfd->list, &ctx->pollfds);
+	ctx->pollfds_cnt++;
+	return 0;
+}
+
+/* Unlink an fd from the context's poll set. Must be called with the pollfds
+ * lock held. */
+static void detach_pollfd(struct libusb_context *ctx,
+	struct usbi_pollfd *ipollfd)
+{
+	list_del(&ipollfd->list);
+	ctx->pollfds_cnt--;
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx)) {
+		struct epoll_event event;
+		int i;
+
+		/* pre-2.6.9 kernels insist on a non-NULL event for EPOLL_CTL_DEL */
+		memset(&event, 0, sizeof(event));
+		epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, ipollfd->pollfd.fd, &event);
+
+		/* fds are only removed by the event handling thread, or by a thread
+		 * that has locked it out, so this cannot race with epoll_wait().
+		 * drop any pending event so it is not dispatched to freed memory */
+		for (i = 0; i < ctx->epoll_nready; i++)
+			if (ctx->epoll_events[i].data.ptr == ipollfd)
+				ctx->epoll_events[i].data.ptr = NULL;
+		return;
+	}
+#endif
+
+	/* the same goes for the poll() set of the pass in progress, which
+	 * must not hand the fd to its handle, or to the backend, any more */
+	{
+		POLL_NFDS_TYPE i;
+
+		for (i = 0; i < ctx->poll_nfds; i++) {
+			if (ctx->poll_fds[i].fd != ipollfd->pollfd.fd
+					|| ctx->poll_handles[i] != ipollfd->handle)
+				continue;
+			ctx->poll_fds[i].fd = -1;
+			ctx->poll_fds[i].revents = 0;
+			ctx->poll_handles[i] = NULL;
+		}
+	}
+}
+
+static int add_pollfd(struct libusb_context *ctx,
+	struct libusb_device_handle *handle, int fd, short events)
 {
+	int r;
 	struct usbi_pollfd *ipollfd = malloc(sizeof(*ipollfd));
 	if (!ipollfd)
 		return LIBUSB_ERROR_NO_MEM;
@@ -2424,15 +5023,37 @@ int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
 	usbi_dbg("add fd %d events %d", fd, events);
 	ipollfd->pollfd.fd = fd;
 	ipollfd->pollfd.events = events;
+	ipollfd->handle = handle;
 	usbi_mutex_lock(&ctx->pollfds_lock);
-	list_add_tail(&ipollfd->list, &ctx->pollfds);
+	r = attach_pollfd(ctx, ipollfd);
 	usbi_mutex_unlock(&ctx->pollfds_lock);
+	if (r < 0) {
+		free(ipollfd);
+		return r;
+	}
 
 	if (ctx->fd_added_cb)
 		ctx->fd_added_cb(fd, events, ctx->fd_cb_user_data);
 	return 0;
 }
 
+/* Add a file descriptor to the list of file descriptors to be monitored.
+ * events should be specified as a bitmask of events passed to poll(), e.g.
+ * POLLIN and/or POLLOUT. */
+int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
+{
+	return add_pollfd(ctx, NULL, fd, events);
+}
+
+/* Same as usbi_add_pollfd(), but records the device handle that owns the fd,
+ * so that events on it can be dispatched to the backend's handle_fd_event()
+ * without searching the list of open devices. */
+int usbi_add_handle_pollfd(struct libusb_device_handle *handle, int fd,
+	short events)
+{
+	return add_pollfd(HANDLE_CTX(handle), handle, fd, events);
+}
+
 /* Remove a file descriptor from the list of file descriptors to be polled. */
 void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 {
@@ -2453,13 +5074,291 @@ void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 		return;
 	}
 
-	list_del(&ipollfd->list);
+	detach_pollfd(ctx, ipollfd);
 	usbi_mutex_unlock(&ctx->pollfds_lock);
 	free(ipollfd);
 	if (ctx->fd_removed_cb)
 		ctx->fd_removed_cb(fd, ctx->fd_cb_user_data);
 }
 
+/* wake a thread blocked in libusb_handle_shard_events() for this handle, so
+ * that it drops the shard lock. the byte is left in the pipe until the shard
+ * is torn down, so that it also wakes a thread that was about to poll */
+static void signal_shard(struct libusb_device_handle *dev_handle)
+{
+	unsigned char dummy = 1;
+	ssize_t r;
+
+	r = usbi_write(dev_handle->shard_pipe[1], &dummy, sizeof(dummy));
+	if (r <= 0)
+		usbi_warn(HANDLE_CTX(dev_handle), "shard pipe write failed");
+}
+
+/* Move the fd of a device handle into (or out of) its own event shard.
+ * Must be called with the event lock held, by a thread that has already
+ * interrupted the event handler. */
+static int update_event_shard(struct libusb_device_handle *dev_handle,
+	int enable)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_pollfd *ipollfd;
+	int found = 0;
+	int r = 0;
+
+	if (!enable && dev_handle->shard_pollfd) {
+		usbi_atomic_store(&dev_handle->shard_closing, 1);
+		signal_shard(dev_handle);
+	}
+	usbi_mutex_lock(&dev_handle->shard_lock);
+
+	if (enable && !dev_handle->shard_pollfd) {
+		r = usbi_pipe(dev_handle->shard_pipe);
+		if (r < 0) {
+			r = LIBUSB_ERROR_OTHER;
+			goto out;
+		}
+
+		usbi_mutex_lock(&ctx->pollfds_lock);
+		list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
+			if (ipollfd->handle == dev_handle) {
+				found = 1;
+				break;
+			}
+		if (found)
+			detach_pollfd(ctx, ipollfd);
+		usbi_mutex_unlock(&ctx->pollfds_lock);
+
+		if (!found) {
+			/* the backend doesn't give this handle an fd of its own */
+			usbi_close(dev_handle->shard_pipe[0]);
+			usbi_close(dev_handle->shard_pipe[1]);
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+			goto out;
+		}
+
+		usbi_dbg("fd %d moved to its own event shard", ipollfd->pollfd.fd);
+		dev_handle->shard_pollfd = ipollfd;
+		if (ctx->fd_removed_cb)
+			ctx->fd_removed_cb(ipollfd->pollfd.fd, ctx->fd_cb_user_data);
+	} else if (!enable && dev_handle->shard_pollfd) {
+		ipollfd = dev_handle->shard_pollfd;
+		usbi_mutex_lock(&ctx->pollfds_lock);
+		r = attach_pollfd(ctx, ipollfd);
+		usbi_mutex_unlock(&ctx->pollfds_lock);
+		if (r < 0)
+			goto out;
+
+		usbi_dbg("fd %d moved back to the context", ipollfd->pollfd.fd);
+		dev_handle->shard_pollfd = NULL;
+		usbi_close(dev_handle->shard_pipe[0]);
+		usbi_close(dev_handle->shard_pipe[1]);
+		if (ctx->fd_added_cb)
+			ctx->fd_added_cb(ipollfd->pollfd.fd, ipollfd->pollfd.events,
+				ctx->fd_cb_user_data);
+	}
+
+out:
+	usbi_atomic_store(&dev_handle->shard_closing, 0);
+	usbi_mutex_unlock(&dev_handle->shard_lock);
+	return r;
+}
+
+/* called from libusb_close() with the event lock held, before the backend
+ * gets to remove the handle's fd from the poll set */
+void usbi_release_event_shard(struct libusb_device_handle *dev_handle)
+{
+	if (dev_handle->shard_pollfd)
+		update_event_shard(dev_handle, 0);
+}
+
+/** \ingroup poll
+ * Give a device handle its own event shard, or return it to its context.
+ *
+ * Normally all of a context's file descriptors are serviced by whichever
+ * thread holds the event lock, so reaping and completion callbacks for every
+ * device on that context run on a single thread. Once a handle is sharded,
+ * its file descriptor is removed from the context's poll set (the removal
+ * notifier is invoked, and it no longer appears in libusb_get_pollfds()), and
+ * its transfers only complete when some thread calls
+ * libusb_handle_shard_events() on it. Different handles can then be serviced
+ * by different threads at the same time, independent of the event lock.
+ *
+ * Transfers on one handle still complete in order, because only one thread
+ * at a time handles the events of a shard. Completions of a sharded handle
+ * are never batched (see libusb_set_completion_batching()). Synchronous I/O
+ * on a sharded handle waits through libusb_handle_shard_events().
+ *
+ * Timeouts are processed by both the regular event handler and the shard
+ * handlers, so a context whose handles are all sharded does not need a
+ * thread in libusb_handle_events().
+ *
+ * This function must not be called from within a transfer callback. Turning
+ * sharding off, or closing the handle, interrupts a thread blocked in
+ * libusb_handle_shard_events() for it.
+ *
+ * \param dev_handle the device handle
+ * \param enable non-zero to shard the handle, zero to return its events to
+ * the context
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the backend does not keep a file
+ * descriptor per device handle
+ * \returns another LIBUSB_ERROR code on other failure
+ * \see libusb_handle_shard_events()
+ */
+int API_EXPORTED libusb_set_event_shard(libusb_device_handle *dev_handle,
+	int enable)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	int r;
+
+	if (!usbi_backend->handle_fd_event)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	/* same dance as libusb_close(): interrupt the event handler and take the
+	 * event lock, so that the poll set can be changed under it */
+	usbi_mutex_lock(&ctx->pollfd_modify_lock);
+	ctx->pollfd_modify++;
+	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	usbi_signal_event(ctx);
+
+	libusb_lock_events(ctx);
+	r = update_event_shard(dev_handle, enable);
+
+	usbi_mutex_lock(&ctx->pollfd_modify_lock);
+	ctx->pollfd_modify--;
+	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	libusb_unlock_events(ctx);
+
+	return r;
+}
+
+/** \ingroup poll
+ * Handle pending events of a sharded device handle. This is the counterpart
+ * of libusb_handle_events_timeout_completed() for a handle that was given
+ * its own event shard with libusb_set_event_shard(). It does not require
+ * the event lock; instead, one thread at a time may handle the events of a
+ * given shard. If another thread is already doing so, this function waits
+ * for it to complete a transfer, like libusb_wait_for_event() does.
+ *
+ * \param dev_handle the sharded device handle
+ * \param tv the maximum time to block waiting for events, or zero for
+ * non-blocking mode
+ * \param completed pointer to completion integer to check, or NULL
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the handle is not sharded, or its shard
+ * is being returned to the context
+ * \returns LIBUSB_ERROR_INTERRUPTED if interrupted by a signal
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_handle_shard_events(libusb_device_handle *dev_handle,
+	struct timeval *tv, int *completed)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_pollfd *ipollfd;
+	struct pollfd fds[3];
+	POLL_NFDS_TYPE nfds = 2;
+	struct timeval poll_timeout;
+	int timeout_ms;
+	int r;
+
+	if (usbi_mutex_trylock(&dev_handle->shard_lock) != 0) {
+		/* another thread is handling this shard */
+		libusb_lock_event_waiters(ctx);
+		if (!completed || !*completed)
+			libusb_wait_for_event(ctx, tv);
+		libusb_unlock_event_waiters(ctx);
+		return 0;
+	}
+
+	if (completed && *completed) {
+		r = 0;
+		goto out;
+	}
+
+	/* the shard is waiting to be torn down, which needs the lock */
+	ipollfd = dev_handle->shard_pollfd;
+	if (!ipollfd || usbi_atomic_load(&dev_handle->shard_closing)) {
+		r = LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
+
+	if (get_next_timeout(ctx, tv, &poll_timeout)) {
+		/* timeout already expired */
+		r = handle_timeouts(ctx);
+		goto out;
+	}
+	timeout_ms = (int)(poll_timeout.tv_sec * 1000)
+		+ (poll_timeout.tv_usec / 1000);
+	if (poll_timeout.tv_usec % 1000)
+		timeout_ms++;
+
+	fds[0].fd = ipollfd->pollfd.fd;
+	fds[0].events = ipollfd->pollfd.events;
+	fds[1].fd = dev_handle->shard_pipe[0];
+	fds[1].events = POLLIN;
+#ifdef USBI_TIMERFD_AVAILABLE
+	/* the timerfd stays readable until someone handles the timeout, so it is
+	 * safe to watch it from several threads */
+	if (usbi_using_timerfd(ctx)) {
+		fds[2].fd = ctx->timerfd;
+		fds[2].events = POLLIN;
+		nfds++;
+	}
+#endif
+	fds[0].revents = fds[1].revents = fds[2].revents = 0;
+
+	usbi_dbg("poll() shard fd %d with timeout in %dms", fds[0].fd,
+		timeout_ms);
+	usbi_trace(poll_enter, ctx, nfds, timeout_ms, 0);
+	r = usbi_poll(fds, nfds, timeout_ms);
+	usbi_trace(poll_exit, ctx, nfds, timeout_ms, r);
+	usbi_dbg("poll() returned %d", r);
+	if (r >= 0)
+		usbi_stats_inc(ctx, event_wakeups);
+	if (r == 0) {
+		usbi_stats_inc(ctx, timeout_wakeups);
+		r = handle_timeouts(ctx);
+		goto out;
+	} else if (r == -1 && errno == EINTR) {
+		r = LIBUSB_ERROR_INTERRUPTED;
+		goto out;
+	} else if (r < 0) {
+		usbi_err(ctx, "poll failed %d err=%d\n", r, errno);
+		r = LIBUSB_ERROR_IO;
+		goto out;
+	}
+
+	r = 0;
+	if (fds[1].revents) {
+		/* the shard is being torn down. the pipe is not drained, it is
+		 * closed along with the shard */
+		usbi_dbg("caught a fish on the shard pipe");
+		usbi_stats_inc(ctx, ctrl_wakeups);
+		goto out;
+	}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+	if (nfds > 2 && fds[2].revents) {
+		usbi_stats_inc(ctx, timeout_wakeups);
+		r = handle_timerfd_trigger(ctx);
+		if (r < 0)
+			goto out;
+	}
+#endif
+
+	if (fds[0].revents) {
+		usbi_stats_inc(ctx, io_wakeups);
+		r = usbi_backend->handle_fd_event(ctx, dev_handle, fds[0].fd,
+			fds[0].revents);
+		if (r)
+			usbi_err(ctx, "backend handle_fd_event failed with error %d", r);
+	}
+
+out:
+	usbi_mutex_unlock(&dev_handle->shard_lock);
+	return r;
+}
+
 /** \ingroup poll
  * Retrieve a list of file descriptors that should be polled by your main loop
  * as libusbx event sources.
@@ -2508,6 +5407,39 @@ out:
 #endif
 }
 
+/** \ingroup poll
+ * Retrieve a single file descriptor standing for all of libusbx's event
+ * sources on a context, for main loops that would rather not keep track of
+ * the set returned by libusb_get_pollfds().
+ *
+ * The file descriptor polls readable whenever any of the file descriptors
+ * of the set has activity, including those added later on, so that a
+ * main loop only needs to register this one, once. When it is readable,
+ * call libusb_handle_events_timeout() in non-blocking mode, as you would on
+ * activity on libusb_get_pollfds() descriptors. Time-based events still
+ * need libusb_get_next_timeout(), unless libusb_pollfds_handle_timeouts()
+ * returns 1.
+ *
+ * On Linux, this is the epoll file descriptor libusbx handles its own events
+ * with. It belongs to the context: don't read from it, add file descriptors
+ * to it or close it. Devices moved to their own event shard with
+ * libusb_set_event_shard() are not covered by it.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns the file descriptor, valid until libusb_exit()
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform or the backend can't
+ * aggregate its file descriptors. Use libusb_get_pollfds() instead.
+ */
+int API_EXPORTED libusb_get_event_fd(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx))
+		return ctx->epoll_fd;
+#endif
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
 /* Backends may call this from handle_events to report disconnection of a
  * device. This function ensures transfers get cancelled appropriately.
  * Callers of this function must hold the events_lock.
@@ -2524,7 +5456,7 @@ void usbi_handle_disconnect(struct libusb_device_handle *handle)
 	 * status code.
 	 *
 	 * this is a bit tricky because:
-	 * 1. we can't do transfer completion while holding flying_transfers_lock
+	 * 1. we can't do transfer completion while holding the flying_lock
 	 *    because the completion handler may try to re-submit the transfer
 	 * 2. the transfers list can change underneath us - if we were to build a
 	 *    list of transfers to complete (while holding lock), the situation
@@ -2533,25 +5465,25 @@ void usbi_handle_disconnect(struct libusb_device_handle *handle)
 	 * so we resort to a loop-based approach as below
 	 *
 	 * This is safe because transfers are only removed from the
-	 * flying_transfer list by usbi_handle_transfer_completion and
+	 * handle's flying_transfers list by usbi_handle_transfer_completion and
 	 * libusb_close, both of which hold the events_lock while doing so,
 	 * so usbi_handle_disconnect cannot be running at the same time.
 	 *
 	 * Note that libusb_submit_transfer also removes the transfer from
-	 * the flying_transfer list on submission failure, but it keeps the
-	 * flying_transfer list locked between addition and removal, so
+	 * the flying_transfers list on submission failure, but it keeps the
+	 * flying_transfers list locked between addition and removal, so
 	 * usbi_handle_disconnect never sees such transfers.
 	 */
 
 	while (1) {
-		usbi_mutex_lock(&HANDLE_CTX(handle)->flying_transfers_lock);
+		usbi_mutex_lock(&handle->flying_lock);
 		to_cancel = NULL;
-		list_for_each_entry(cur, &HANDLE_CTX(handle)->flying_transfers, list, struct usbi_transfer)
-			if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(cur)->dev_handle == handle) {
+		list_for_each_entry(cur, &handle->flying_transfers, list, struct usbi_transfer)
+			if (!(cur->flags & USBI_TRANSFER_COMPLETING)) {
 				to_cancel = cur;
 				break;
 			}
-		usbi_mutex_unlock(&HANDLE_CTX(handle)->flying_transfers_lock);
+		usbi_mutex_unlock(&handle->flying_lock);
 
 		if (!to_cancel)
 			break;
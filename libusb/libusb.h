@@ -46,6 +46,7 @@
 typedef unsigned __int8   uint8_t;
 typedef unsigned __int16  uint16_t;
 typedef unsigned __int32  uint32_t;
+typedef unsigned __int64  uint64_t;
 #else
 #include <stdint.h>
 #endif
@@ -144,7 +145,7 @@ typedef unsigned __int32  uint32_t;
  * Internally, LIBUSBX_API_VERSION is defined as follows:
  * (libusbx major << 24) | (libusbx minor << 16) | (16 bit incremental)
  */
-#define LIBUSBX_API_VERSION 0x01000102
+#define LIBUSBX_API_VERSION 0x01000120
 
 #ifdef __cplusplus
 extern "C" {
@@ -340,7 +341,10 @@ enum libusb_transfer_type {
 	LIBUSB_TRANSFER_TYPE_BULK = 2,
 
 	/** Interrupt endpoint */
-	LIBUSB_TRANSFER_TYPE_INTERRUPT = 3
+	LIBUSB_TRANSFER_TYPE_INTERRUPT = 3,
+
+	/** Stream endpoint */
+	LIBUSB_TRANSFER_TYPE_BULK_STREAM = 4
 };
 
 /** \ingroup misc
@@ -859,6 +863,38 @@ struct libusb_container_id_descriptor {
 	uint8_t  ContainerID[16];
 };
 
+/** \ingroup desc
+ * A cursor over the descriptors of a raw configuration descriptor, as
+ * returned by libusb_get_raw_config_descriptor(). Iterating does not
+ * allocate any memory: the descriptors are looked at in place, and can be
+ * decoded into the usual descriptor structures on the stack as needed.
+ *
+ * Initialize it with libusb_init_descriptor_iterator(), then move from one
+ * descriptor to the next with libusb_next_descriptor(). All fields are
+ * read-only.
+ */
+struct libusb_descriptor_iterator {
+	/** The buffer being iterated over */
+	const unsigned char *buffer;
+
+	/** Length of the buffer */
+	int length;
+
+	/** Offset of the current descriptor in the buffer, or -1 before the
+	 * first call to libusb_next_descriptor() */
+	int offset;
+
+	/** The current descriptor, pointing into the buffer. Its first two
+	 * bytes are bLength and bDescriptorType. */
+	const unsigned char *descriptor;
+
+	/** bInterfaceNumber and bAlternateSetting of the interface descriptor
+	 * the current descriptor belongs to, or -1 if it comes before the first
+	 * interface descriptor */
+	int interface_number;
+	int altsetting;
+};
+
 /** \ingroup asyncio
  * Setup packet for control transfers. */
 struct libusb_control_setup {
@@ -895,6 +931,7 @@ struct libusb_context;
 struct libusb_device;
 struct libusb_device_handle;
 struct libusb_hotplug_callback;
+struct libusb_transfer_pool;
 
 /** \ingroup lib
  * Structure providing the version of the libusbx runtime
@@ -955,6 +992,12 @@ typedef struct libusb_context libusb_context;
  */
 typedef struct libusb_device libusb_device;
 
+/** \ingroup dev
+ * Structure representing a reference counted, read-only list of devices.
+ * This is an opaque type for which you are only ever provided with a
+ * pointer, originating from libusb_get_device_snapshot().
+ */
+typedef struct libusb_device_snapshot libusb_device_snapshot;
 
 /** \ingroup dev
  * Structure representing a handle on a USB device. This is an opaque type for
@@ -966,6 +1009,95 @@ typedef struct libusb_device libusb_device;
  */
 typedef struct libusb_device_handle libusb_device_handle;
 
+/** \ingroup asyncio
+ * Structure representing a pool of reusable transfers. This is an opaque type
+ * for which you are only ever provided with a pointer, originating from
+ * libusb_alloc_transfer_pool().
+ *
+ * Transfers obtained from a pool with libusb_pool_get_transfer() are handed
+ * back to it by libusb_free_transfer(), and keep their backend resources
+ * between uses. See \ref asyncpool.
+ */
+typedef struct libusb_transfer_pool libusb_transfer_pool;
+
+/** \ingroup stream
+ * Structure representing a stream reading continuously from an IN endpoint.
+ * This is an opaque type for which you are only ever provided with a
+ * pointer, originating from libusb_stream_open(). See \ref stream.
+ */
+typedef struct libusb_stream libusb_stream;
+
+/** \ingroup ctrlqueue
+ * Structure representing a queue running batches of control requests on a
+ * device. This is an opaque type for which you are only ever provided with
+ * a pointer, originating from libusb_control_queue_open(). See
+ * \ref ctrlqueue.
+ */
+typedef struct libusb_control_queue libusb_control_queue;
+
+/** \ingroup ctrlqueue
+ * A control request in a batch run by libusb_control_queue_run(). The
+ * first six fields describe the request and are filled in by the
+ * application; the last two report its outcome.
+ */
+struct libusb_control_request {
+	/** Request type. See libusb_control_setup::bmRequestType. The
+	 * direction bit also tells the direction of the data stage. */
+	uint8_t bmRequestType;
+
+	/** Request. See libusb_control_setup::bRequest. */
+	uint8_t bRequest;
+
+	/** Value. See libusb_control_setup::wValue. */
+	uint16_t wValue;
+
+	/** Index. See libusb_control_setup::wIndex. */
+	uint16_t wIndex;
+
+	/** Length of the data stage, which may be 0. */
+	uint16_t wLength;
+
+	/** Data to send, or buffer for the data received, of wLength bytes.
+	 * May be NULL if wLength is 0. */
+	unsigned char *data;
+
+	/** 0 if the request completed successfully, otherwise a LIBUSB_ERROR
+	 * code. Set by libusb_control_queue_run(). */
+	int status;
+
+	/** Number of bytes transferred in the data stage. Set by
+	 * libusb_control_queue_run(). */
+	int actual_length;
+};
+
+/** \ingroup ctrlqueue
+ * Flags for libusb_control_queue_run().
+ */
+enum libusb_control_queue_flags {
+	/** Submit no more requests after the first one that stalls, and cancel
+	 * those already in flight behind it. */
+	LIBUSB_CONTROL_QUEUE_STOP_ON_STALL = 1 << 0,
+};
+
+/** \ingroup writer
+ * Structure representing a writer coalescing small messages into larger
+ * transfers on a bulk OUT endpoint. This is an opaque type for which you are
+ * only ever provided with a pointer, originating from libusb_writer_open().
+ * See \ref writer.
+ */
+typedef struct libusb_writer libusb_writer;
+
+/** \ingroup writer
+ * Flags for libusb_writer_open().
+ */
+enum libusb_writer_flags {
+	/** Terminate each transfer with a zero-length packet if its length is
+	 * a multiple of the endpoint's maximum packet size. See
+	 * \ref libusb_transfer_flags::LIBUSB_TRANSFER_ADD_ZERO_PACKET
+	 * "LIBUSB_TRANSFER_ADD_ZERO_PACKET". */
+	LIBUSB_WRITER_ZERO_PACKET = 1 << 0,
+};
+
 /** \ingroup dev
  * Speed codes. Indicates the speed at which the device is operating.
  */
@@ -1167,6 +1299,36 @@ enum libusb_transfer_flags {
 	 * Available since libusb-1.0.9.
 	 */
 	LIBUSB_TRANSFER_ADD_ZERO_PACKET = 1 << 3,
+
+	/** Keep a bulk or interrupt IN transfer in flight: the backend
+	 * resubmits it as soon as it completes, before the callback runs, so
+	 * that the endpoint always has a request posted.
+	 *
+	 * Each time data arrives, the callback is called with status
+	 * \ref libusb_transfer_status::LIBUSB_TRANSFER_COMPLETED
+	 * "LIBUSB_TRANSFER_COMPLETED" while the transfer remains submitted.
+	 * The transfer alternates between its own buffer and a second one
+	 * allocated by libusbx, so the callback must read the data through
+	 * the buffer field rather than a pointer kept from before submission,
+	 * and must not use it after returning. These callbacks always run from
+	 * the thread handling events, even if completion workers are enabled.
+	 *
+	 * The transfer only stops when it is cancelled or fails, in which case
+	 * the callback is called a last time with the corresponding status and
+	 * the buffer field pointing back at the transfer's own buffer. Data
+	 * received together with the failure is still reported. The
+	 * transfer must not be freed or resubmitted until then.
+	 *
+	 * The transfer must have no timeout and must fit in a single request
+	 * to the operating system, otherwise libusb_submit_transfer() returns
+	 * LIBUSB_ERROR_INVALID_PARAM or LIBUSB_ERROR_NOT_SUPPORTED
+	 * respectively.
+	 *
+	 * This flag is currently only supported on Linux. On other systems,
+	 * libusb_submit_transfer() will return LIBUSB_ERROR_NOT_SUPPORTED for
+	 * every transfer where this flag is set.
+	 */
+	LIBUSB_TRANSFER_AUTO_RESUBMIT = 1 << 4,
 };
 
 /** \ingroup asyncio
@@ -1195,6 +1357,30 @@ struct libusb_transfer;
  */
 typedef void (LIBUSB_CALL *libusb_transfer_cb_fn)(struct libusb_transfer *transfer);
 
+/** \ingroup asyncio
+ * Callback function type for libusb_cancel_endpoint_transfers() and
+ * libusb_cancel_all_transfers(), called once all the transfers that were
+ * cancelled have been reaped.
+ * \param dev_handle the device handle the transfers were cancelled on
+ * \param num_transfers the number of transfers that were cancelled
+ * \param user_data the user data given when cancelling the transfers
+ */
+typedef void (LIBUSB_CALL *libusb_cancel_cb_fn)(
+	libusb_device_handle *dev_handle, int num_transfers, void *user_data);
+
+/** \ingroup asyncio
+ * Batch completion callback. When completion batching is enabled with
+ * libusb_set_completion_batching(), this is called once per event handling
+ * pass with all transfers that completed during that pass and that have no
+ * callback of their own.
+ * \param transfers array of completed transfers
+ * \param num_transfers number of transfers in the array
+ * \param user_data user data provided when setting the callback
+ * \see libusb_set_completion_batching()
+ */
+typedef void (LIBUSB_CALL *libusb_transfer_batch_cb_fn)(
+	struct libusb_transfer **transfers, int num_transfers, void *user_data);
+
 /** \ingroup asyncio
  * The generic USB transfer structure. The user populates this structure and
  * then submits it in order to request a transfer. After the transfer has
@@ -1259,6 +1445,127 @@ struct libusb_transfer {
 	;
 };
 
+/** \ingroup asyncio
+ * Number of buckets of a \ref libusb_latency_histogram. */
+#define LIBUSB_LATENCY_BUCKETS 32
+
+/** \ingroup asyncio
+ * Histogram of latencies, in microseconds, with logarithmic buckets.
+ * Bucket 0 counts latencies below 1us, and bucket i (for i > 0) counts
+ * latencies of at least 2^(i-1)us and below 2^i us. The last bucket also
+ * counts everything longer than that.
+ */
+struct libusb_latency_histogram {
+	/** Number of samples in each bucket */
+	uint32_t buckets[LIBUSB_LATENCY_BUCKETS];
+
+	/** Number of samples */
+	uint32_t count;
+
+	/** Sum of all samples, in microseconds */
+	uint64_t total_us;
+
+	/** Largest sample, in microseconds */
+	uint64_t max_us;
+};
+
+/** \ingroup asyncio
+ * Latency statistics of one endpoint of an open device, collected while
+ * latency tracking is enabled with libusb_set_latency_tracking(). Retrieve
+ * them with libusb_get_endpoint_latency().
+ */
+struct libusb_endpoint_latency {
+	/** Time from libusb_submit_transfer() until the OS handed the finished
+	 * transfer back to libusbx */
+	struct libusb_latency_histogram os_latency;
+
+	/** Time from the OS handing the transfer back until its callback was
+	 * invoked, i.e. the time spent in libusbx's event handling */
+	struct libusb_latency_histogram dispatch_latency;
+
+	/** Time spent in the transfer callback */
+	struct libusb_latency_histogram callback_time;
+};
+
+/** \ingroup poll
+ * Settings of the event handling thread started by
+ * libusb_start_event_thread(). Zero-initialize it to get the defaults.
+ */
+struct libusb_event_thread_attr {
+	/** CPUs the thread may run on, or NULL to leave its affinity alone.
+	 * Only supported on Linux and Windows. */
+	const int *cpus;
+
+	/** Number of entries in cpus */
+	int num_cpus;
+
+	/** SCHED_FIFO priority of the thread, or 0 for normal scheduling.
+	 * Raising the priority usually requires privileges. On Windows, any
+	 * non-zero value selects THREAD_PRIORITY_TIME_CRITICAL. */
+	int priority;
+
+	/** Time in microseconds to keep polling without blocking after
+	 * transfers completed, before going back to sleep. 0 to block right
+	 * away. Spinning trades a CPU for wakeup latency. */
+	unsigned int spin_us;
+};
+
+/** \ingroup misc
+ * Number of transfer types the per-type counters of \ref libusb_context_stats
+ * have room for. */
+#define LIBUSB_STATS_TRANSFER_TYPES 5
+
+/** \ingroup misc
+ * Performance counters of a context, as returned by
+ * libusb_get_context_stats(). All counters start at zero when the context
+ * is created and only ever increase. Per-type counters are indexed by
+ * \ref libusb_transfer_type.
+ */
+struct libusb_context_stats {
+	/** Transfers submitted successfully */
+	uint64_t transfers_submitted[LIBUSB_STATS_TRANSFER_TYPES];
+
+	/** Transfers completed with \ref LIBUSB_TRANSFER_COMPLETED */
+	uint64_t transfers_completed[LIBUSB_STATS_TRANSFER_TYPES];
+
+	/** Transfers completed with an error, a stall, an overflow or because
+	 * the device went away */
+	uint64_t transfers_failed[LIBUSB_STATS_TRANSFER_TYPES];
+
+	/** Transfers cancelled */
+	uint64_t transfers_cancelled[LIBUSB_STATS_TRANSFER_TYPES];
+
+	/** Transfers timed out */
+	uint64_t transfers_timed_out[LIBUSB_STATS_TRANSFER_TYPES];
+
+	/** Bytes received by completed transfers */
+	uint64_t bytes_in;
+
+	/** Bytes sent by completed transfers */
+	uint64_t bytes_out;
+
+	/** Requests handed to the operating system. Transfers are split in
+	 * several requests when they are too large for the OS (URBs on
+	 * Linux) */
+	uint64_t urbs_submitted;
+
+	/** Calls made to the operating system to retrieve completed requests */
+	uint64_t reap_calls;
+
+	/** Returns from poll() or equivalent in event handling */
+	uint64_t event_wakeups;
+
+	/** Wakeups caused by libusbx's internal control pipe, e.g. because the
+	 * set of file descriptors changed */
+	uint64_t ctrl_wakeups;
+
+	/** Wakeups with device I/O to process */
+	uint64_t io_wakeups;
+
+	/** Wakeups caused by an expired transfer timeout */
+	uint64_t timeout_wakeups;
+};
+
 /** \ingroup misc
  * Capabilities supported by an instance of libusb on the current running
  * platform. Test if the loaded library supports a given capability by calling
@@ -1297,11 +1604,84 @@ enum libusb_log_level {
 	LIBUSB_LOG_LEVEL_DEBUG,
 };
 
+/** \ingroup lib
+ * Flags for libusb_set_log_callback().
+ */
+enum libusb_log_flags {
+	/** Queue the messages and deliver them from a background thread, so
+	 * that the threads logging them never wait on the output. */
+	LIBUSB_LOG_ASYNC = 1 << 0,
+};
+
+/** \ingroup lib
+ * Flags for libusb_init_with_flags().
+ */
+enum libusb_init_flags {
+	/** Defer the initialization of the backend, which on Linux includes
+	 * starting the hotplug monitor and enumerating every device, until
+	 * the first call which needs devices. Ignored on platforms which
+	 * cannot defer it. */
+	LIBUSB_INIT_LAZY = 1 << 0,
+};
+
+/** \ingroup lib
+ * The set of devices a context created by libusb_init_scoped() is limited
+ * to. A device must match every criterion that is set.
+ */
+struct libusb_context_scope {
+	/** Number of the bus the devices are on, or -1 for any bus. */
+	int bus_number;
+
+	/** Port numbers leading to the subtree of devices, from the root hub
+	 * down, as returned by libusb_get_port_numbers(). The device at this
+	 * path and all devices below it are in scope, along with the hubs
+	 * leading to it. Requires bus_number to be set. May be NULL if
+	 * num_port_numbers is 0. */
+	const uint8_t *port_numbers;
+
+	/** Number of entries in port_numbers, up to 7. 0 for the whole bus. */
+	int num_port_numbers;
+
+	/** USB-IF vendor ID of the devices, or -1 for any vendor. */
+	int vendor_id;
+
+	/** USB-IF product ID of the devices, or -1 for any product. */
+	int product_id;
+
+	/** Non-zero to leave out every device: the context then does not scan
+	 * the system at all, and only holds the devices passed to
+	 * libusb_wrap_fd() or libusb_open_path(). The other criteria are
+	 * ignored. */
+	int no_scan;
+};
+
+/** \ingroup lib
+ * Log callback function type, see libusb_set_log_callback().
+ *
+ * \param ctx   context the message was logged on. Debug messages are
+ *              always logged on the default context, see
+ *              libusb_set_log_callback().
+ * \param level the level of the message
+ * \param str   the formatted message, terminated by a newline
+ */
+typedef void (LIBUSB_CALL *libusb_log_callback_fn)(libusb_context *ctx,
+	enum libusb_log_level level, const char *str);
+
 int LIBUSB_CALL libusb_init(libusb_context **ctx);
+int LIBUSB_CALL libusb_init_scoped(libusb_context **ctx,
+	const struct libusb_context_scope *scope);
+int LIBUSB_CALL libusb_init_with_flags(libusb_context **ctx, int flags);
 void LIBUSB_CALL libusb_exit(libusb_context *ctx);
 void LIBUSB_CALL libusb_set_debug(libusb_context *ctx, int level);
+int LIBUSB_CALL libusb_set_log_callback(libusb_context *ctx,
+	libusb_log_callback_fn cb_fn, int flags);
 const struct libusb_version * LIBUSB_CALL libusb_get_version(void);
 int LIBUSB_CALL libusb_has_capability(uint32_t capability);
+void LIBUSB_CALL libusb_get_context_stats(libusb_context *ctx,
+	struct libusb_context_stats *stats);
+int LIBUSB_CALL libusb_start_capture(libusb_context *ctx, const char *path,
+	unsigned int snaplen);
+void LIBUSB_CALL libusb_stop_capture(libusb_context *ctx);
 const char * LIBUSB_CALL libusb_error_name(int errcode);
 int LIBUSB_CALL libusb_setlocale(const char *locale);
 const char * LIBUSB_CALL libusb_strerror(enum libusb_error errcode);
@@ -1312,6 +1692,17 @@ void LIBUSB_CALL libusb_free_device_list(libusb_device **list,
 	int unref_devices);
 libusb_device * LIBUSB_CALL libusb_ref_device(libusb_device *dev);
 void LIBUSB_CALL libusb_unref_device(libusb_device *dev);
+uint32_t LIBUSB_CALL libusb_get_device_generation(libusb_context *ctx);
+int LIBUSB_CALL libusb_get_device_snapshot(libusb_context *ctx,
+	libusb_device_snapshot **snapshot);
+ssize_t LIBUSB_CALL libusb_get_snapshot_devices(
+	libusb_device_snapshot *snapshot, libusb_device * const **devices);
+uint32_t LIBUSB_CALL libusb_get_snapshot_generation(
+	libusb_device_snapshot *snapshot);
+libusb_device_snapshot * LIBUSB_CALL libusb_ref_device_snapshot(
+	libusb_device_snapshot *snapshot);
+void LIBUSB_CALL libusb_unref_device_snapshot(
+	libusb_device_snapshot *snapshot);
 
 int LIBUSB_CALL libusb_get_configuration(libusb_device_handle *dev,
 	int *config);
@@ -1325,6 +1716,26 @@ int LIBUSB_CALL libusb_get_config_descriptor_by_value(libusb_device *dev,
 	uint8_t bConfigurationValue, struct libusb_config_descriptor **config);
 void LIBUSB_CALL libusb_free_config_descriptor(
 	struct libusb_config_descriptor *config);
+int LIBUSB_CALL libusb_get_raw_active_config_descriptor(libusb_device *dev,
+	unsigned char *data, int length);
+int LIBUSB_CALL libusb_get_raw_config_descriptor(libusb_device *dev,
+	uint8_t config_index, unsigned char *data, int length);
+void LIBUSB_CALL libusb_init_descriptor_iterator(
+	struct libusb_descriptor_iterator *iter, const unsigned char *buffer,
+	int length);
+int LIBUSB_CALL libusb_next_descriptor(struct libusb_descriptor_iterator *iter);
+int LIBUSB_CALL libusb_get_iterator_config_descriptor(
+	const struct libusb_descriptor_iterator *iter,
+	struct libusb_config_descriptor *config);
+int LIBUSB_CALL libusb_get_iterator_interface_descriptor(
+	const struct libusb_descriptor_iterator *iter,
+	struct libusb_interface_descriptor *altsetting);
+int LIBUSB_CALL libusb_get_iterator_endpoint_descriptor(
+	const struct libusb_descriptor_iterator *iter,
+	struct libusb_endpoint_descriptor *endpoint);
+int LIBUSB_CALL libusb_get_iterator_ss_endpoint_companion_descriptor(
+	const struct libusb_descriptor_iterator *iter,
+	struct libusb_ss_endpoint_companion_descriptor *ep_comp);
 int LIBUSB_CALL libusb_get_ss_endpoint_companion_descriptor(
 	struct libusb_context *ctx,
 	const struct libusb_endpoint_descriptor *endpoint,
@@ -1365,6 +1776,10 @@ int LIBUSB_CALL libusb_get_max_iso_packet_size(libusb_device *dev,
 	unsigned char endpoint);
 
 int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **handle);
+int LIBUSB_CALL libusb_wrap_fd(libusb_context *ctx, int fd,
+	libusb_device_handle **handle);
+int LIBUSB_CALL libusb_open_path(libusb_context *ctx, const char *path,
+	libusb_device_handle **handle);
 void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle);
 libusb_device * LIBUSB_CALL libusb_get_device(libusb_device_handle *dev_handle);
 
@@ -1384,6 +1799,15 @@ int LIBUSB_CALL libusb_clear_halt(libusb_device_handle *dev,
 	unsigned char endpoint);
 int LIBUSB_CALL libusb_reset_device(libusb_device_handle *dev);
 
+int LIBUSB_CALL libusb_alloc_streams(libusb_device_handle *dev,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints);
+int LIBUSB_CALL libusb_free_streams(libusb_device_handle *dev,
+	unsigned char *endpoints, int num_endpoints);
+int LIBUSB_CALL libusb_set_raw_io(libusb_device_handle *dev,
+	unsigned char endpoint, int enable);
+int LIBUSB_CALL libusb_set_bulk_window(libusb_device_handle *dev,
+	int num_requests);
+
 int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev,
 	int interface_number);
 int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev,
@@ -1467,9 +1891,50 @@ static inline void libusb_fill_control_setup(unsigned char *buffer,
 
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_submit_transfers(struct libusb_transfer **transfers,
+	int num_transfers, int *num_submitted);
+void LIBUSB_CALL libusb_set_completion_batching(libusb_context *ctx,
+	int enable, libusb_transfer_batch_cb_fn batch_cb, void *user_data);
+int LIBUSB_CALL libusb_set_completion_workers(libusb_context *ctx,
+	int num_workers);
+void LIBUSB_CALL libusb_set_latency_tracking(libusb_context *ctx, int enable);
+int LIBUSB_CALL libusb_get_endpoint_latency(libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_endpoint_latency *latency);
+void LIBUSB_CALL libusb_reset_endpoint_latency(
+	libusb_device_handle *dev_handle);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_cancel_endpoint_transfers(
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	libusb_cancel_cb_fn callback, void *user_data);
+int LIBUSB_CALL libusb_cancel_all_transfers(libusb_device_handle *dev_handle,
+	libusb_cancel_cb_fn callback, void *user_data);
+void LIBUSB_CALL libusb_transfer_set_stream_id(
+	struct libusb_transfer *transfer, uint32_t stream_id);
+uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
+	struct libusb_transfer *transfer);
+void LIBUSB_CALL libusb_set_iso_start_frame(struct libusb_transfer *transfer,
+	uint64_t start_frame);
+int LIBUSB_CALL libusb_get_iso_start_frame(struct libusb_transfer *transfer,
+	uint64_t *start_frame);
+unsigned char * LIBUSB_CALL libusb_get_iso_packet_data(
+	struct libusb_transfer *transfer, unsigned int packet, int *actual_length);
+int LIBUSB_CALL libusb_copy_iso_packets(struct libusb_transfer *transfer,
+	unsigned char *data, int length);
+int LIBUSB_CALL libusb_get_frame_number(libusb_device_handle *dev_handle,
+	uint64_t *frame_number);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
 
+libusb_transfer_pool * LIBUSB_CALL libusb_alloc_transfer_pool(
+	int num_transfers, int iso_packets);
+struct libusb_transfer * LIBUSB_CALL libusb_pool_get_transfer(
+	libusb_transfer_pool *pool);
+void LIBUSB_CALL libusb_free_transfer_pool(libusb_transfer_pool *pool);
+
+unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(
+	libusb_device_handle *dev_handle, size_t length);
+int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle *dev_handle,
+	unsigned char *buffer, size_t length);
+
 /** \ingroup asyncio
  * Helper function to populate the required \ref libusb_transfer fields
  * for a control transfer.
@@ -1543,6 +2008,33 @@ static inline void libusb_fill_bulk_transfer(struct libusb_transfer *transfer,
 	transfer->callback = callback;
 }
 
+/** \ingroup asyncio
+ * Helper function to populate the required \ref libusb_transfer fields
+ * for a bulk transfer using bulk streams.
+ *
+ * \param transfer the transfer to populate
+ * \param dev_handle handle of the device that will handle the transfer
+ * \param endpoint address of the endpoint where this transfer will be sent
+ * \param stream_id bulk stream id for this transfer
+ * \param buffer data buffer
+ * \param length length of data buffer
+ * \param callback callback function to be invoked on transfer completion
+ * \param user_data user data to pass to callback function
+ * \param timeout timeout for the transfer in milliseconds
+ * \see libusb_alloc_streams()
+ */
+static inline void libusb_fill_bulk_stream_transfer(
+	struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+	unsigned char endpoint, uint32_t stream_id,
+	unsigned char *buffer, int length, libusb_transfer_cb_fn callback,
+	void *user_data, unsigned int timeout)
+{
+	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer,
+				  length, callback, user_data, timeout);
+	transfer->type = LIBUSB_TRANSFER_TYPE_BULK_STREAM;
+	libusb_transfer_set_stream_id(transfer, stream_id);
+}
+
 /** \ingroup asyncio
  * Helper function to populate the required \ref libusb_transfer fields
  * for an interrupt transfer.
@@ -1625,7 +2117,8 @@ static inline void libusb_set_iso_packet_lengths(
  * accumulating their lengths to find the position of the specified packet.
  * Typically you will assign equal lengths to each packet in the transfer,
  * and hence the above method is sub-optimal. You may wish to use
- * libusb_get_iso_packet_buffer_simple() instead.
+ * libusb_get_iso_packet_buffer_simple() instead, or libusb_get_iso_packet_data()
+ * on submitted transfers.
  *
  * \param transfer a transfer
  * \param packet the packet to return the address of
@@ -1707,6 +2200,46 @@ int LIBUSB_CALL libusb_interrupt_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
 	int *actual_length, unsigned int timeout);
 
+/* managed streaming I/O */
+
+int LIBUSB_CALL libusb_stream_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char type, int num_transfers,
+	int transfer_size, libusb_stream **stream);
+int LIBUSB_CALL libusb_stream_acquire(libusb_stream *stream,
+	unsigned char **data, int *length);
+int LIBUSB_CALL libusb_stream_release(libusb_stream *stream);
+void LIBUSB_CALL libusb_stream_close(libusb_stream *stream);
+
+/* pipelined control transfers */
+
+int LIBUSB_CALL libusb_control_queue_open(libusb_device_handle *dev_handle,
+	int depth, int max_length, libusb_control_queue **queue);
+int LIBUSB_CALL libusb_control_queue_run(libusb_control_queue *queue,
+	struct libusb_control_request *requests, int num_requests, int flags,
+	unsigned int timeout);
+void LIBUSB_CALL libusb_control_queue_close(libusb_control_queue *queue);
+
+/* coalescing bulk writes */
+
+/** \ingroup writer
+ * Callback function for a message written through a libusb_writer.
+ * \param writer the writer the message was written through
+ * \param status 0 if the message was sent, otherwise a LIBUSB_ERROR code
+ * \param user_data the user data given to libusb_writer_write()
+ * \see libusb_writer_write()
+ */
+typedef void (LIBUSB_CALL *libusb_writer_cb_fn)(libusb_writer *writer,
+	int status, void *user_data);
+
+int LIBUSB_CALL libusb_writer_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int num_transfers, int transfer_size,
+	unsigned int max_delay, int flags, libusb_writer **writer);
+int LIBUSB_CALL libusb_writer_write(libusb_writer *writer,
+	const unsigned char *data, int length, libusb_writer_cb_fn callback,
+	void *user_data);
+int LIBUSB_CALL libusb_writer_flush(libusb_writer *writer);
+void LIBUSB_CALL libusb_writer_close(libusb_writer *writer);
+
 /** \ingroup desc
  * Retrieve a descriptor from the default control pipe.
  * This is a convenience function which formulates the appropriate control
@@ -1751,6 +2284,10 @@ static inline int libusb_get_string_descriptor(libusb_device_handle *dev,
 
 int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	uint8_t desc_index, unsigned char *data, int length);
+int LIBUSB_CALL libusb_set_string_cache(libusb_device_handle *dev,
+	int enable);
+int LIBUSB_CALL libusb_prefetch_string_descriptors(libusb_device_handle *dev,
+	const uint8_t *desc_indices, int num_indices);
 
 /* polling and timeouts */
 
@@ -1765,12 +2302,21 @@ int LIBUSB_CALL libusb_wait_for_event(libusb_context *ctx, struct timeval *tv);
 
 int LIBUSB_CALL libusb_handle_events_timeout(libusb_context *ctx,
 	struct timeval *tv);
+int LIBUSB_CALL libusb_handle_events_budget(libusb_context *ctx,
+	struct timeval *tv, int max_completions, struct timeval *max_time);
 int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context *ctx,
 	struct timeval *tv, int *completed);
 int LIBUSB_CALL libusb_handle_events(libusb_context *ctx);
+int LIBUSB_CALL libusb_start_event_thread(libusb_context *ctx,
+	const struct libusb_event_thread_attr *attr);
+void LIBUSB_CALL libusb_stop_event_thread(libusb_context *ctx);
 int LIBUSB_CALL libusb_handle_events_completed(libusb_context *ctx, int *completed);
 int LIBUSB_CALL libusb_handle_events_locked(libusb_context *ctx,
 	struct timeval *tv);
+int LIBUSB_CALL libusb_set_event_shard(libusb_device_handle *dev_handle,
+	int enable);
+int LIBUSB_CALL libusb_handle_shard_events(libusb_device_handle *dev_handle,
+	struct timeval *tv, int *completed);
 int LIBUSB_CALL libusb_pollfds_handle_timeouts(libusb_context *ctx);
 int LIBUSB_CALL libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv);
@@ -1818,6 +2364,7 @@ const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
 void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context *ctx,
 	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
 	void *user_data);
+int LIBUSB_CALL libusb_get_event_fd(libusb_context *ctx);
 
 /** \ingroup hotplug
  * Callback handle.
@@ -1934,6 +2481,57 @@ int LIBUSB_CALL libusb_hotplug_register_callback(libusb_context *ctx,
 void LIBUSB_CALL libusb_hotplug_deregister_callback(libusb_context *ctx,
 						libusb_hotplug_callback_handle handle);
 
+/** \ingroup hotplug
+ * A hotplug event, as passed to a \ref libusb_hotplug_batch_callback_fn.
+ */
+struct libusb_hotplug_batch_event {
+	/** The event that occurred */
+	libusb_hotplug_event event;
+
+	/** The device this event occurred on */
+	libusb_device *device;
+};
+
+/** \ingroup hotplug
+ * Hotplug batch callback function type, see
+ * libusb_hotplug_set_batch_callback().
+ *
+ * The devices are only guaranteed to remain valid until the callback
+ * returns; use libusb_ref_device() to keep them longer.
+ *
+ * \param ctx        context of this notification
+ * \param events     the events, in the order they occurred
+ * \param num_events the number of entries in events
+ * \param user_data  user data provided when this callback was set
+ */
+typedef void (LIBUSB_CALL *libusb_hotplug_batch_callback_fn)(libusb_context *ctx,
+						const struct libusb_hotplug_batch_event *events,
+						int num_events, void *user_data);
+
+/** \ingroup hotplug
+ * Set a callback receiving hotplug events in batches.
+ *
+ * Hotplug events that are pending when libusbx handles events are all
+ * dispatched in one go. Once the callbacks registered with
+ * libusb_hotplug_register_callback() have been invoked for each of them,
+ * the batch callback is invoked once, with every arrival and departure of
+ * the burst, on any device. An application rebuilding its view of the
+ * devices can thus do it once per burst rather than once per event.
+ *
+ * There is at most one batch callback per context.
+ *
+ * \param[in] ctx context to set the callback on, or NULL for the default
+ * context
+ * \param[in] cb_fn the function to be invoked, or NULL to remove the batch
+ * callback
+ * \param[in] user_data user data to pass to the callback function
+ * \returns LIBUSB_SUCCESS on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if hotplug is not supported
+ */
+int LIBUSB_CALL libusb_hotplug_set_batch_callback(libusb_context *ctx,
+						libusb_hotplug_batch_callback_fn cb_fn,
+						void *user_data);
+
 #ifdef __cplusplus
 }
 #endif
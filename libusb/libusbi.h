@@ -55,6 +55,9 @@
 /* Backend specific capabilities */
 #define USBI_CAP_HAS_HID_ACCESS					0x00010000
 #define USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER	0x00020000
+#define USBI_CAP_AUTO_RESUBMIT					0x00040000
+#define USBI_CAP_LAZY_INIT					0x00080000
+#define USBI_CAP_SUPPORTS_ZERO_PACKET			0x00100000
 
 /* Maximum number of bytes in a log line */
 #define USBI_MAX_LOG_LEN	1024
@@ -153,19 +156,44 @@ void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, va_list args);
 
+/* the most verbose level of the messages compiled in, from 1 (errors only)
+ * to 4 (debug). the messages of the levels above it are left out of the
+ * binary altogether, arguments included */
+#ifndef USBI_MAX_LOG_LEVEL
+#define USBI_MAX_LOG_LEVEL 4
+#endif
+
 #if !defined(_MSC_VER) || _MSC_VER >= 1400
 
 #ifdef ENABLE_LOGGING
 #define _usbi_log(ctx, level, ...) usbi_log(ctx, level, __FUNCTION__, __VA_ARGS__)
-#define usbi_dbg(...) _usbi_log(NULL, LIBUSB_LOG_LEVEL_DEBUG, __VA_ARGS__)
 #else
 #define _usbi_log(ctx, level, ...) do { (void)(ctx); } while(0)
+#endif
+
+/* debug messages have no context, and are logged on the default one, as
+ * documented for libusb_set_log_callback() */
+#if defined(ENABLE_LOGGING) && USBI_MAX_LOG_LEVEL >= 4
+#define usbi_dbg(...) _usbi_log(NULL, LIBUSB_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
 #define usbi_dbg(...) do {} while(0)
 #endif
 
+#if USBI_MAX_LOG_LEVEL >= 3
 #define usbi_info(ctx, ...) _usbi_log(ctx, LIBUSB_LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define usbi_info(ctx, ...) do { (void)(ctx); } while(0)
+#endif
+#if USBI_MAX_LOG_LEVEL >= 2
 #define usbi_warn(ctx, ...) _usbi_log(ctx, LIBUSB_LOG_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define usbi_warn(ctx, ...) do { (void)(ctx); } while(0)
+#endif
+#if USBI_MAX_LOG_LEVEL >= 1
 #define usbi_err(ctx, ...) _usbi_log(ctx, LIBUSB_LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define usbi_err(ctx, ...) do { (void)(ctx); } while(0)
+#endif
 
 #else /* !defined(_MSC_VER) || _MSC_VER >= 1400 */
 
@@ -173,6 +201,8 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 #define LOG_BODY(ctxt, level) \
 {                             \
 	va_list args;             \
+	if ((level) > USBI_MAX_LOG_LEVEL) \
+		return;               \
 	va_start (args, format);  \
 	usbi_log_v(ctxt, level, "", format, args); \
 	va_end(args);             \
@@ -196,6 +226,19 @@ static inline void usbi_dbg(const char *format, ...)
 
 #endif /* !defined(_MSC_VER) || _MSC_VER >= 1400 */
 
+/* static tracepoints of the "libusb" provider, for perf, bpftrace, SystemTap
+ * or DTrace. built from <sys/sdt.h> when configured with --enable-usdt, a
+ * single nop each until a tracer attaches. the arguments are the transfer,
+ * its endpoint, a length and a status; the poll probes pass the context,
+ * the number of fds, the timeout in ms and the result instead */
+#ifdef USE_USDT
+#include <sys/sdt.h>
+#define usbi_trace(name, transfer, endpoint, length, status) \
+	DTRACE_PROBE4(libusb, name, transfer, endpoint, length, status)
+#else
+#define usbi_trace(name, transfer, endpoint, length, status) do {} while(0)
+#endif
+
 #define USBI_GET_CONTEXT(ctx) if (!(ctx)) (ctx) = usbi_default_context
 #define DEVICE_CTX(dev) ((dev)->ctx)
 #define HANDLE_CTX(handle) (DEVICE_CTX((handle)->dev))
@@ -208,6 +251,19 @@ static inline void usbi_dbg(const char *format, ...)
 #define IS_XFERIN(xfer) (0 != ((xfer)->endpoint & LIBUSB_ENDPOINT_IN))
 #define IS_XFEROUT(xfer) (!IS_XFERIN(xfer))
 
+/* number of buckets of the session ID index of a context's devices */
+#define USBI_DEVICE_HASH_SIZE 64
+#define USBI_DEVICE_HASH(session_id) ((session_id) % USBI_DEVICE_HASH_SIZE)
+
+/* number of buckets of each index of a context's hotplug callbacks */
+#define USBI_HOTPLUG_HASH_SIZE 64
+
+/* index of an endpoint in per-endpoint tables: the endpoint number, plus 16
+ * for IN endpoints */
+#define USBI_MAX_ENDPOINTS 32
+#define USBI_EP_INDEX(ep) (((ep) & LIBUSB_ENDPOINT_ADDRESS_MASK) \
+	| (IS_EPIN(ep) ? 0x10 : 0))
+
 /* Internal abstraction for thread synchronization */
 #if defined(THREADS_POSIX)
 #include "os/threads_posix.h"
@@ -217,15 +273,55 @@ static inline void usbi_dbg(const char *format, ...)
 
 extern struct libusb_context *usbi_default_context;
 
+/* deepest port path a device can have, see libusb_get_port_numbers() */
+#define USBI_MAX_PORT_DEPTH	7
+
+/* a copy of the scope given to libusb_init_scoped() */
+struct usbi_context_scope {
+	int bus_number;
+	uint8_t port_numbers[USBI_MAX_PORT_DEPTH];
+	int num_port_numbers;
+	int vendor_id;
+	int product_id;
+	int no_scan;
+};
+
 struct libusb_context {
 	int debug;
 	int debug_fixed;
 
+	/* devices outside of the scope are not tracked by this context. set
+	 * before the backend first enumerates devices and never changed */
+	int scoped;
+	struct usbi_context_scope scope;
+
+	/* with LIBUSB_INIT_LAZY the backend is initialized by the first call
+	 * which needs devices instead of by libusb_init. lazy_init is set at
+	 * init and never changed, backend_pending is protected by
+	 * backend_lock */
+	int lazy_init;
+	int backend_pending;
+	usbi_mutex_t backend_lock;
+
+	/* where the log messages go, stderr when NULL. when log_async is set,
+	 * they go through log_ring to a background thread first */
+	libusb_log_callback_fn log_cb;
+	struct usbi_log_ring *log_ring;
+	int log_async;
+
 	/* internal control pipe, used for interrupting event handling when
-	 * something needs to modify poll fds. */
+	 * something needs to modify poll fds. when an eventfd is used instead
+	 * of a pipe, both entries hold the same eventfd. */
 	int ctrl_pipe[2];
 
+	/* the known devices, also hashed by session ID in usb_devs_hash.
+	 * device_generation changes whenever a device is added or removed, and
+	 * device_snapshot caches a read-only copy of the list for the current
+	 * generation. all of these are protected by usb_devs_lock */
 	struct list_head usb_devs;
+	struct list_head usb_devs_hash[USBI_DEVICE_HASH_SIZE];
+	uint32_t device_generation;
+	struct libusb_device_snapshot *device_snapshot;
 	usbi_mutex_t usb_devs_lock;
 
 	/* A list of open handles. Backends are free to traverse this if required.
@@ -233,27 +329,57 @@ struct libusb_context {
 	struct list_head open_devs;
 	usbi_mutex_t open_devs_lock;
 
-	/* A list of registered hotplug callbacks */
+	/* A list of registered hotplug callbacks, and an index of the same
+	 * callbacks by what they match, see hotplug.c. protected by
+	 * hotplug_cbs_lock */
 	struct list_head hotplug_cbs;
+	struct list_head hotplug_cbs_by_id[USBI_HOTPLUG_HASH_SIZE];
+	struct list_head hotplug_cbs_by_class[USBI_HOTPLUG_HASH_SIZE];
+	struct list_head hotplug_cbs_any;
+	libusb_hotplug_batch_callback_fn hotplug_batch_cb;
+	void *hotplug_batch_user_data;
 	usbi_mutex_t hotplug_cbs_lock;
 	int hotplug_pipe[2];
 
-	/* this is a list of in-flight transfer handles, sorted by timeout
-	 * expiration. URBs to timeout the soonest are placed at the beginning of
-	 * the list, URBs that will time out later are placed after, and urbs with
-	 * infinite timeout are always placed at the very end. */
-	struct list_head flying_transfers;
-	usbi_mutex_t flying_transfers_lock;
+	/* in-flight transfers are listed by their device handle. those with a
+	 * pending timeout that libusbx has to enforce are also kept in
+	 * timeout_heap, a binary min-heap ordered by expiry time so the next
+	 * timeout is always at index 0. transfers with an infinite timeout, or
+	 * whose timeout has fired or is handled by the OS, are not in the heap.
+	 * the heap and the timerfd are protected by timeouts_lock, which is
+	 * taken after the flying_lock of a device handle. */
+	struct usbi_transfer **timeout_heap;
+	int timeout_heap_len;
+	int timeout_heap_size;
+	usbi_mutex_t timeouts_lock;
 
 	/* list of poll fds */
 	struct list_head pollfds;
 	usbi_mutex_t pollfds_lock;
 
+	/* number of entries in pollfds, and an array of that many struct pollfd
+	 * reused by handle_events() from one poll() to the next. poll_handles
+	 * holds the device handle each of them was registered for, if any.
+	 * poll_nfds is the number of entries filled in by the last poll() */
+	POLL_NFDS_TYPE pollfds_cnt;
+	struct pollfd *poll_fds;
+	struct libusb_device_handle **poll_handles;
+	POLL_NFDS_TYPE poll_fds_size;
+	POLL_NFDS_TYPE poll_nfds;
+
 	/* a counter that is set when we want to interrupt event handling, in order
 	 * to modify the poll fd set. and a lock to protect it. */
 	unsigned int pollfd_modify;
 	usbi_mutex_t pollfd_modify_lock;
 
+	/* generation counters for wakeups sent on the control pipe, also
+	 * protected by pollfd_modify_lock. a wakeup is only written when
+	 * ctrl_gen catches up with ctrl_gen_seen, so the pipe never holds more
+	 * than one pending signal, and the event handler drains it and records
+	 * the generation it has seen. */
+	unsigned int ctrl_gen;
+	unsigned int ctrl_gen_seen;
+
 	/* user callbacks for pollfd changes */
 	libusb_pollfd_added_cb fd_added_cb;
 	libusb_pollfd_removed_cb fd_removed_cb;
@@ -270,24 +396,134 @@ struct libusb_context {
 	usbi_mutex_t event_waiters_lock;
 	usbi_cond_t event_waiters_cond;
 
+	/* threads in synchronous I/O waiting for their transfer while another
+	 * thread handles events, protected by event_waiters_lock */
+	struct list_head sync_waiters;
+
+	/* batched completion delivery, see libusb_set_completion_batching().
+	 * completions reported by the backend while batch_active is set are
+	 * queued in batch_transfers (with their flags in batch_flags) and
+	 * delivered together at the end of the event handling pass. all of
+	 * these are protected by events_lock. */
+	int completion_batching;
+	libusb_transfer_batch_cb_fn batch_cb;
+	void *batch_cb_user_data;
+	int batch_active;
+	struct libusb_transfer **batch_transfers;
+	uint8_t *batch_flags;
+	int batch_len;
+	int batch_size;
+
+	/* the limits of the libusb_handle_events_budget() call in progress, see
+	 * usbi_event_budget_exhausted(). budget_completions counts the
+	 * completions reaped so far. budget_limit and budget_deadline are 0 when
+	 * there is no such limit. poll_rr is where the next budgeted poll() pass
+	 * starts looking for ready fds. all of these are protected by
+	 * events_lock. */
+	int budget_active;
+	int budget_completions;
+	int budget_limit;
+	struct timeval budget_deadline;
+	POLL_NFDS_TYPE poll_rr;
+
+	/* callback dispatch onto worker threads, see
+	 * libusb_set_completion_workers(). dispatch_lock protects the pool and
+	 * the queues of its workers */
+	usbi_mutex_t dispatch_lock;
+	struct usbi_dispatch_worker *dispatch_workers;
+	int dispatch_num_workers;
+
+	/* the completion callbacks which still need their device handle when
+	 * they return, see usbi_drain_handle_completions(). protected by
+	 * dispatch_lock, dispatch_cond is broadcast when one of them is done */
+	struct list_head running_callbacks;
+	usbi_cond_t dispatch_cond;
+
+	/* the thread started by libusb_start_event_thread(). event_thread_stop
+	 * tells it to return, event_thread_tid lets it be recognized if it calls
+	 * libusb_stop_event_thread() from a callback */
+	usbi_thread_t event_thread;
+	int event_thread_running;
+	int event_thread_tid;
+	volatile long event_thread_stop;
+
+	/* whether transfers are timestamped for the per-endpoint latency
+	 * statistics, see libusb_set_latency_tracking() */
+	int latency_tracking;
+
+	/* performance counters, only ever updated with usbi_stats_add() */
+	volatile struct libusb_context_stats stats;
+
+	/* transfer capture, see capture.c. capture is only changed with
+	 * capture_lock held, but read without it by USBI_CAPTURING() */
+	struct usbi_capture *capture;
+	usbi_mutex_t capture_lock;
+
+	/* set with capture_lock held while libusb_start_capture() sets up a
+	 * capture, so that a concurrent call does not touch the file */
+	int capture_starting;
+
 #ifdef USBI_TIMERFD_AVAILABLE
 	/* used for timeout handling, if supported by OS.
 	 * this timerfd is maintained to trigger on the next pending timeout */
 	int timerfd;
 #endif
 
+#ifdef USBI_EPOLL_AVAILABLE
+	/* used for event handling, if supported by OS and backend.
+	 * the epoll interest set mirrors the pollfds list, and each entry points
+	 * back to its struct usbi_pollfd. epoll_events is only touched by the
+	 * thread holding events_lock. entries from epoll_next up to
+	 * epoll_nready were left unserved by the last pass, when its event
+	 * budget ran out. */
+	int epoll_fd;
+	struct epoll_event *epoll_events;
+	int epoll_nready;
+	int epoll_next;
+#endif
+
 	struct list_head list;
 };
 
+#define usbi_latency_tracking(ctx) ((ctx)->latency_tracking)
+
+/* add to one of the performance counters of a context */
+/* whether the transfers of ctx are being captured. a transfer event that
+ * races with the start or the end of a capture may or may not be recorded */
+#define USBI_CAPTURING(ctx) ((ctx)->capture != NULL)
+
+void usbi_capture_submit(struct libusb_context *ctx,
+	struct libusb_transfer *transfer);
+void usbi_capture_submit_error(struct libusb_context *ctx,
+	struct libusb_transfer *transfer, int error);
+void usbi_capture_completion(struct libusb_context *ctx,
+	struct libusb_transfer *transfer);
+
+#define usbi_stats_add(ctx, counter, n) \
+	usbi_atomic_add64(&(ctx)->stats.counter, (n))
+#define usbi_stats_inc(ctx, counter) usbi_stats_add(ctx, counter, 1)
+
 #ifdef USBI_TIMERFD_AVAILABLE
 #define usbi_using_timerfd(ctx) ((ctx)->timerfd >= 0)
 #else
 #define usbi_using_timerfd(ctx) (0)
 #endif
 
+#ifdef USBI_EVENTFD_AVAILABLE
+#define usbi_using_eventfd(ctx) ((ctx)->ctrl_pipe[0] == (ctx)->ctrl_pipe[1])
+#else
+#define usbi_using_eventfd(ctx) (0)
+#endif
+
+#ifdef USBI_EPOLL_AVAILABLE
+#define usbi_using_epoll(ctx) ((ctx)->epoll_fd >= 0)
+#else
+#define usbi_using_epoll(ctx) (0)
+#endif
+
 struct libusb_device {
-	/* lock protects refcnt, everything else is finalized at initialization
-	 * time */
+	/* lock protects refcnt and altsetting, everything else is finalized
+	 * at initialization time */
 	usbi_mutex_t lock;
 	int refcnt;
 
@@ -301,11 +537,29 @@ struct libusb_device {
 	enum libusb_speed speed;
 
 	struct list_head list;
+	struct list_head hash_list;
 	unsigned long session_data;
 
 	struct libusb_device_descriptor device_descriptor;
 	int attached;
 
+	/* parsed configuration descriptors, shared by everyone asking for
+	 * them and protected by the config cache lock in descriptor.c.
+	 * config_cache is indexed by configuration index and allocated on
+	 * first use. active_config_gen changes whenever the cached active
+	 * configuration is invalidated. */
+	struct usbi_cached_config **config_cache;
+	struct usbi_cached_config *active_config_cache;
+	unsigned int active_config_gen;
+
+	/* the alternate setting selected on each interface through any handle
+	 * of the device, reset to 0 by set_configuration, reset_device and
+	 * release_interface. ep_info_gen changes, atomically, whenever the
+	 * endpoints that handles describe in their endpoint tables may have
+	 * changed */
+	uint8_t altsetting[USB_MAXINTERFACES];
+	volatile long ep_info_gen;
+
 	unsigned char os_priv
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
 	[] /* valid C99 code */
@@ -315,6 +569,13 @@ struct libusb_device {
 	;
 };
 
+/* what a device handle knows about an endpoint of the active configuration */
+struct usbi_endpoint_info {
+	uint8_t bEndpointAddress; /* 0 if the endpoint does not exist */
+	uint8_t bmAttributes;
+	uint16_t wMaxPacketSize;
+};
+
 struct libusb_device_handle {
 	/* lock protects claimed_interfaces */
 	usbi_mutex_t lock;
@@ -323,6 +584,52 @@ struct libusb_device_handle {
 	struct list_head list;
 	struct libusb_device *dev;
 	int auto_detach_kernel_driver;
+
+	/* this is a list of in-flight transfers on this handle, in submission
+	 * order, protected by flying_lock. the backend's submit_transfer() is
+	 * called with flying_lock held */
+	struct list_head flying_transfers;
+	usbi_mutex_t flying_lock;
+
+	/* per-endpoint latency statistics, indexed with USBI_EP_INDEX().
+	 * allocated the first time a sample is recorded. the pointer is
+	 * protected by lock, the histograms are updated atomically. NULL while
+	 * latency tracking has never been used. */
+	struct libusb_endpoint_latency *latency;
+
+	/* an idle transfer and its buffer, kept by the synchronous I/O
+	 * functions for reuse. protected by lock */
+	struct libusb_transfer *sync_transfer;
+	unsigned char *sync_buffer;
+	int sync_buffer_size;
+
+	/* the endpoints of the active configuration and alternate settings,
+	 * indexed with USBI_EP_INDEX() and built on first lookup, see
+	 * usbi_get_endpoint_info(). ep_info_gen is the ep_info_gen of the
+	 * device the table was built for. protected by lock */
+	struct usbi_endpoint_info ep_info[USBI_MAX_ENDPOINTS];
+	int ep_info_valid;
+	long ep_info_gen;
+
+	/* string descriptors read so far, if enabled with
+	 * libusb_set_string_cache(). private to descriptor.c and protected
+	 * by lock */
+	struct usbi_string_cache *string_cache;
+
+	/* set by libusb_set_event_shard(): the handle's fd, taken out of the
+	 * context's poll set, and a pipe to interrupt the thread polling it.
+	 * shard_lock is held by whoever is handling the shard's events.
+	 * shard_closing is set while the shard is waiting to be torn down, so
+	 * that shard handlers give the lock up instead of polling again. */
+	usbi_mutex_t shard_lock;
+	struct usbi_pollfd *shard_pollfd;
+	int shard_pipe[2];
+	volatile long shard_closing;
+
+	/* the most URBs of a split bulk transfer kept in flight at once, set
+	 * with libusb_set_bulk_window(). 0 selects the backend default */
+	int bulk_window;
+
 	unsigned char os_priv
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
 	[] /* valid C99 code */
@@ -350,12 +657,28 @@ enum {
  * OS-private data.
  */
 
+/* The fields used on every submission and completion, from list to the end
+ * of the structure, are grouped next to the public libusb_transfer which
+ * follows it in memory, and the rarely used ones at the start. Keep it that
+ * way, and keep the structure compact: applications may preallocate many
+ * thousands of transfers. Transfers come straight from calloc(), as aligning
+ * the hot fields on a cache line costs more memory than it is worth. */
 struct usbi_transfer {
-	int num_iso_packets;
-	struct list_head list;
-	struct timeval timeout;
-	int transferred;
-	uint8_t flags;
+	/* the pool this transfer belongs to, or NULL */
+	struct libusb_transfer_pool *pool;
+	/* isochronous start frame, see libusb_set_iso_start_frame(). this is
+	 * the requested frame while iso_start_pending is set or the transfer
+	 * is in flight with USBI_TRANSFER_ISO_SCHEDULED, and the frame the
+	 * transfer actually started in once USBI_TRANSFER_ISO_START_KNOWN is
+	 * set by the backend */
+	uint64_t iso_start_frame;
+	/* when the transfer was submitted and reaped, in nanoseconds of the
+	 * monotonic clock, if the context tracks latencies. a zero submit_time
+	 * means there is nothing to record */
+	uint64_t submit_time;
+	uint64_t reap_time;
+	/* bulk stream the transfer is routed to */
+	uint32_t stream_id;
 
 	/* this lock is held during libusb_submit_transfer() and
 	 * libusb_cancel_transfer() (allowing the OS backend to prevent duplicate
@@ -365,6 +688,24 @@ struct usbi_transfer {
 	 * its completion (presumably there would be races within your OS backend
 	 * if this were possible). */
 	usbi_mutex_t lock;
+
+	struct list_head list;
+	struct timeval timeout;
+	/* set while the transfer is cancelled as part of
+	 * libusb_cancel_endpoint_transfers() or libusb_cancel_all_transfers().
+	 * protected by the handle's flying_lock */
+	struct usbi_cancel_group *cancel_group;
+	int num_iso_packets;
+	/* position in the context's timeout_heap, or -1 if not in it */
+	int timeout_heap_idx;
+	int transferred;
+	uint8_t flags;
+	/* the callback must run on the thread that reaped the transfer rather
+	 * than on a completion worker. left alone by submission */
+	uint8_t inline_callback;
+	uint8_t iso_start_pending;
+	/* the iso offset table holds the offsets of the last submission */
+	uint8_t iso_offsets_valid;
 };
 
 enum usbi_transfer_flags {
@@ -382,8 +723,22 @@ enum usbi_transfer_flags {
 
 	/* Set by backend submit_transfer() if the fds in use have been updated */
 	USBI_TRANSFER_UPDATED_FDS = 1 << 4,
+
+	/* Completion has been queued for batched delivery */
+	USBI_TRANSFER_COMPLETING = 1 << 5,
+
+	/* Isochronous transfer must start in iso_start_frame rather than ASAP */
+	USBI_TRANSFER_ISO_SCHEDULED = 1 << 6,
+
+	/* Set by the backend once iso_start_frame holds the actual start frame */
+	USBI_TRANSFER_ISO_START_KNOWN = 1 << 7,
 };
 
+/* fails to compile if the flags outgrow usbi_transfer.flags. the last flag
+ * above must be the one checked */
+typedef char usbi_transfer_flags_fit[USBI_TRANSFER_ISO_START_KNOWN
+	< (1 << (8 * sizeof(((struct usbi_transfer *)0)->flags))) ? 1 : -1];
+
 #define USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer) \
 	((struct libusb_transfer *)(((unsigned char *)(transfer)) \
 		+ sizeof(struct usbi_transfer)))
@@ -417,15 +772,30 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	unsigned long session_id);
 int usbi_sanitize_device(struct libusb_device *dev);
+int usbi_scope_match_location(struct libusb_context *ctx, uint8_t bus_number,
+	const uint8_t *port_numbers, int num_port_numbers);
+int usbi_scope_match_device(struct libusb_device *dev);
+int usbi_init_backend(struct libusb_context *ctx);
 void usbi_handle_disconnect(struct libusb_device_handle *handle);
+void usbi_drain_handle_completions(struct libusb_device_handle *handle);
 
+void usbi_latency_mark_reap(struct usbi_transfer *itransfer);
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status);
 int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer);
+int usbi_handle_transfer_data(struct usbi_transfer *itransfer, int length);
+int usbi_transfer_status_to_error(enum libusb_transfer_status status);
+int usbi_event_budget_exhausted(struct libusb_context *ctx);
+int usbi_remove_from_flying_list(struct usbi_transfer *transfer);
 
 int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 	void *dest, int host_endian);
 int usbi_device_cache_descriptor(libusb_device *dev);
+void usbi_invalidate_active_config(struct libusb_device *dev);
+void usbi_free_config_cache(struct libusb_device *dev);
+void usbi_free_string_cache(struct libusb_device_handle *dev_handle);
+int usbi_get_endpoint_info(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct usbi_endpoint_info *info);
 int usbi_get_config_index_by_value(struct libusb_device *dev,
 	uint8_t bConfigurationValue, int *idx);
 
@@ -433,7 +803,7 @@ void usbi_connect_device (struct libusb_device *dev);
 void usbi_disconnect_device (struct libusb_device *dev);
 
 /* Internal abstraction for poll (needs struct usbi_transfer on Windows) */
-#if defined(OS_LINUX) || defined(OS_DARWIN) || defined(OS_OPENBSD)
+#if defined(OS_LINUX) || defined(OS_DARWIN) || defined(OS_OPENBSD) || defined(OS_NULL)
 #include <unistd.h>
 #include "os/poll_posix.h"
 #elif defined(OS_WINDOWS) || defined(OS_WINCE)
@@ -457,12 +827,46 @@ struct usbi_pollfd {
 	/* must come first */
 	struct libusb_pollfd pollfd;
 
+	/* the device handle this fd belongs to, or NULL for library-internal
+	 * fds such as the control and hotplug pipes */
+	struct libusb_device_handle *handle;
+
 	struct list_head list;
 };
 
 int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events);
+int usbi_add_handle_pollfd(struct libusb_device_handle *handle, int fd,
+	short events);
 void usbi_remove_pollfd(struct libusb_context *ctx, int fd);
+void usbi_release_event_shard(struct libusb_device_handle *dev_handle);
+
+/* a thread blocked in synchronous I/O. it sleeps on its own condition and
+ * is only woken when its transfer completes, or when it is picked to take
+ * over event handling, see usbi_handle_events_sync(). completed is
+ * protected by the context's event_waiters_lock */
+struct usbi_sync_waiter {
+	struct list_head list;
+	usbi_cond_t cond;
+	int completed;
+};
+
+#define usbi_sync_waiter_init(waiter) \
+	do { (waiter)->completed = 0; usbi_cond_init(&(waiter)->cond, NULL); } \
+	while (0)
+
+void usbi_sync_waiter_destroy(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter);
+int usbi_handle_events_sync(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter);
+int usbi_sync_waiter_completed(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter);
+void usbi_sync_waiter_complete(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter);
+void usbi_sync_waiter_complete_locked(struct usbi_sync_waiter *waiter);
+int usbi_sync_transfer_batch(struct libusb_device_handle *dev_handle,
+	struct libusb_transfer **transfers, int num_transfers);
 void usbi_fd_notification(struct libusb_context *ctx);
+void usbi_signal_event(struct libusb_context *ctx);
 
 /* device discovery */
 
@@ -502,7 +906,11 @@ struct usbi_os_backend {
 	 * data structures for later, etc.
 	 *
 	 * This function is called when a libusbx user initializes the library
-	 * prior to use.
+	 * prior to use. Backends with USBI_CAP_LAZY_INIT may instead be
+	 * initialized later on, by the first call which needs devices, for
+	 * contexts created with LIBUSB_INIT_LAZY. They must then manage
+	 * without it until then: the clock_gettime() and get_timerfd_clockid()
+	 * functions in particular may be called before it.
 	 *
 	 * Return 0 on success, or a LIBUSB_ERROR code on failure.
 	 */
@@ -623,6 +1031,33 @@ struct usbi_os_backend {
 	 */
 	void (*close)(struct libusb_device_handle *handle);
 
+	/* Find or create the device that an already open file descriptor
+	 * belongs to, as handed to libusb_wrap_fd(). The device should be built
+	 * from what the descriptor itself tells about it, without enumerating
+	 * the system, and be added to the context with usbi_connect_device()
+	 * like a discovered one. Leave the descriptor open.
+	 *
+	 * On success, store a new reference to the device in dev.
+	 *
+	 * Optional; if not set, libusb_wrap_fd() returns LIBUSB_ERROR_NOT_SUPPORTED.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_INVALID_PARAM if fd is not a USB device
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*device_from_fd)(struct libusb_context *ctx, int fd,
+		struct libusb_device **dev);
+
+	/* Open a device like open() does, on the file descriptor passed to
+	 * device_from_fd(). On success the handle owns the descriptor and
+	 * close() closes it; on failure it must be left open.
+	 *
+	 * Required if device_from_fd is set.
+	 */
+	int (*open_fd)(struct libusb_device_handle *handle, int fd);
+
 	/* Retrieve the device descriptor from a device.
 	 *
 	 * The descriptor should be retrieved from memory, NOT via bus I/O to the
@@ -832,6 +1267,44 @@ struct usbi_os_backend {
 	 */
 	int (*reset_device)(struct libusb_device_handle *handle);
 
+	/* Allocate num_streams bulk streams on each of the endpoints. Optional.
+	 *
+	 * All endpoints must belong to the same claimed interface.
+	 *
+	 * Return:
+	 * - the number of streams allocated on success, which may be less than
+	 *   requested
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*alloc_streams)(struct libusb_device_handle *handle,
+		uint32_t num_streams, unsigned char *endpoints, int num_endpoints);
+
+	/* Free the bulk streams allocated on each of the endpoints. Optional.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*free_streams)(struct libusb_device_handle *handle,
+		unsigned char *endpoints, int num_endpoints);
+
+	/* Let the driver complete reads on an IN endpoint as whole packets
+	 * straight into the transfer buffers (e.g. WinUSB RAW_IO). Optional.
+	 *
+	 * The interface of the endpoint must be claimed.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_FOUND if the endpoint is not on a claimed interface
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the driver of the interface does not
+	 *   support it
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*set_raw_io)(struct libusb_device_handle *handle,
+		unsigned char endpoint, int enable);
+
 	/* Determine if a kernel driver is active on an interface. Optional.
 	 *
 	 * The presence of a kernel driver on an interface indicates that any
@@ -880,6 +1353,76 @@ struct usbi_os_backend {
 	int (*attach_kernel_driver)(struct libusb_device_handle *handle,
 		int interface_number);
 
+	/* Allocate memory suitable for DMA, tied to a device handle. Optional.
+	 *
+	 * Transfers using buffers obtained from here should not need to be
+	 * copied through a kernel bounce buffer. If this is not provided, the
+	 * core falls back to the system allocator.
+	 *
+	 * Return a pointer to the memory, or NULL if it could not be allocated.
+	 */
+	void *(*dev_mem_alloc)(struct libusb_device_handle *handle, size_t len);
+
+	/* Free memory obtained from dev_mem_alloc(). Optional, but required
+	 * if dev_mem_alloc() is provided.
+	 *
+	 * Return 0 on success, or a LIBUSB_ERROR code on failure.
+	 */
+	int (*dev_mem_free)(struct libusb_device_handle *handle, void *buffer,
+		size_t len);
+
+	/* Get the current frame number of the bus the device is on, in the same
+	 * units as isochronous start frames. Optional.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*get_frame_number)(struct libusb_device_handle *handle,
+		uint64_t *frame_number);
+
+	/* Perform a control transfer to completion in the calling thread,
+	 * without going through submit_transfer() and event handling. Optional.
+	 *
+	 * This is a fast path for libusb_control_transfer(). data holds
+	 * wLength bytes, which are sent or filled in depending on the direction
+	 * in bmRequestType. timeout is in milliseconds, 0 meaning unlimited.
+	 *
+	 * Return:
+	 * - the number of bytes actually transferred on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if this request cannot take the fast
+	 *   path, in which case the core falls back to an asynchronous transfer.
+	 *   Nothing may have been sent to the device in that case.
+	 * - LIBUSB_ERROR_TIMEOUT if the transfer timed out
+	 * - LIBUSB_ERROR_PIPE if the control request was not supported by the
+	 *   device
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*sync_control_transfer)(struct libusb_device_handle *handle,
+		uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+		uint16_t wIndex, unsigned char *data, uint16_t wLength,
+		unsigned int timeout);
+
+	/* Perform a bulk or interrupt transfer to completion in the calling
+	 * thread, like sync_control_transfer(). Optional.
+	 *
+	 * transferred must be set to the number of bytes transferred, which may
+	 * be non-zero on failure.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if this request cannot take the fast
+	 *   path, in which case the core falls back to an asynchronous transfer
+	 * - LIBUSB_ERROR_TIMEOUT, LIBUSB_ERROR_PIPE, LIBUSB_ERROR_OVERFLOW,
+	 *   LIBUSB_ERROR_NO_DEVICE or another LIBUSB_ERROR code, with the same
+	 *   meaning as for libusb_bulk_transfer()
+	 */
+	int (*sync_bulk_transfer)(struct libusb_device_handle *handle,
+		unsigned char endpoint, unsigned char *data, int length,
+		int *transferred, unsigned int timeout);
+
 	/* Destroy a device. Optional.
 	 *
 	 * This function is called when the last reference to a device is
@@ -894,7 +1437,8 @@ struct usbi_os_backend {
 	 *
 	 * This function must not block.
 	 *
-	 * This function gets called with the flying_transfers_lock locked!
+	 * This function gets called with the flying_lock of the transfer's
+	 * device handle locked!
 	 *
 	 * Return:
 	 * - 0 on success
@@ -923,6 +1467,16 @@ struct usbi_os_backend {
 	 */
 	void (*clear_transfer_priv)(struct usbi_transfer *itransfer);
 
+	/* Release any resources held in the private data of a transfer that is
+	 * about to be freed. Optional.
+	 *
+	 * This allows backends to keep allocations (such as the OS-level
+	 * request structures) attached to a transfer across submissions instead
+	 * of allocating and freeing them every time. It is never called for a
+	 * transfer that is in flight.
+	 */
+	void (*free_transfer_priv)(struct usbi_transfer *itransfer);
+
 	/* Handle any pending events. This involves monitoring any active
 	 * transfers and processing their completion or cancellation.
 	 *
@@ -935,6 +1489,9 @@ struct usbi_os_backend {
 	 *
 	 * For any cancelled transfers, call usbi_handle_transfer_cancellation().
 	 * For completed transfers, call usbi_handle_transfer_completion().
+	 * Backends with USBI_CAP_AUTO_RESUBMIT call usbi_handle_transfer_data()
+	 * instead when they have resubmitted a LIBUSB_TRANSFER_AUTO_RESUBMIT
+	 * transfer, with the buffer field pointing at the received data.
 	 * For control/bulk/interrupt transfers, populate the "transferred"
 	 * element of the appropriate usbi_transfer structure before calling the
 	 * above functions. For isochronous transfers, populate the status and
@@ -952,6 +1509,23 @@ struct usbi_os_backend {
 	int (*handle_events)(struct libusb_context *ctx,
 		struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready);
 
+	/* Handle pending events on a single file descriptor that was registered
+	 * against a device handle with usbi_add_handle_pollfd(). Optional.
+	 *
+	 * When this is provided and the OS supports it, the core uses epoll
+	 * and hands each ready handle fd directly to this function, along with
+	 * the poll()-style revents it reported, instead of building a pollfd
+	 * array for handle_events(). The same completion, cancellation and
+	 * disconnection rules as for handle_events() apply.
+	 *
+	 * The core holds the events lock for the duration of the call, so the
+	 * handle cannot be closed underneath you.
+	 *
+	 * Return 0 on success, or a LIBUSB_ERROR code on failure.
+	 */
+	int (*handle_fd_event)(struct libusb_context *ctx,
+		struct libusb_device_handle *handle, int fd, short revents);
+
 	/* Get time from specified clock. At least two clocks must be implemented
 	   by the backend: USBI_CLOCK_REALTIME, and USBI_CLOCK_MONOTONIC.
 
@@ -997,6 +1571,7 @@ extern const struct usbi_os_backend darwin_backend;
 extern const struct usbi_os_backend openbsd_backend;
 extern const struct usbi_os_backend windows_backend;
 extern const struct usbi_os_backend wince_backend;
+extern const struct usbi_os_backend null_backend;
 
 extern struct list_head active_contexts_list;
 extern usbi_mutex_static_t active_contexts_lock;
@@ -26,12 +26,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/event.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <libkern/OSAtomic.h>
 
 #include <mach/clock.h>
 #include <mach/clock_types.h>
+#include <mach/mach.h>
 #include <mach/mach_host.h>
 #include <mach/mach_port.h>
 
@@ -52,6 +54,12 @@ static clock_serv_t clock_monotonic;
 static CFRunLoopRef libusb_darwin_acfl = NULL; /* event cf loop */
 static volatile int32_t initCount = 0;
 
+/* frame lists of low latency isochronous transfers are only read on completion */
+#define DARWIN_LL_UPDATE_FREQUENCY 0
+
+/* large enough for any IOKit async completion message */
+#define DARWIN_ASYNC_MSG_SIZE      4096
+
 static usbi_mutex_t darwin_cached_devices_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct list_head darwin_cached_devices = {&darwin_cached_devices, &darwin_cached_devices};
 
@@ -65,6 +73,8 @@ static int darwin_claim_interface(struct libusb_device_handle *dev_handle, int i
 static int darwin_release_interface(struct libusb_device_handle *dev_handle, int iface);
 static int darwin_reset_device(struct libusb_device_handle *dev_handle);
 static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0);
+static void darwin_handle_callback (struct usbi_transfer *itransfer, kern_return_t result, UInt32 io_size);
+static void darwin_destroy_ll_buffers (struct darwin_interface *cInterface);
 
 static int darwin_scan_devices(struct libusb_context *ctx);
 static int process_new_device (struct libusb_context *ctx, io_service_t service);
@@ -225,6 +235,19 @@ static int get_ioregistry_value_number (io_service_t service, CFStringRef proper
   return ret;
 }
 
+/* read an unsigned registry property of up to 32 bits. CFNumbers are signed so reading the
+   property into a narrower type fails for values with the top bit set (e.g. idVendor 0x8087) */
+static int get_ioregistry_value_uint32 (io_service_t service, CFStringRef property, UInt32 *p) {
+  SInt32 value;
+
+  if (!get_ioregistry_value_number (service, property, kCFNumberSInt32Type, &value))
+    return 0;
+
+  *p = (UInt32) value;
+
+  return 1;
+}
+
 static usb_device_t **darwin_device_from_service (io_service_t service)
 {
   io_cf_plugin_ref_t *plugInInterface = NULL;
@@ -527,8 +550,34 @@ static int darwin_get_config_descriptor(struct libusb_device *dev, uint8_t confi
   return len;
 }
 
+/* the os publishes the value of the active configuration on each of the device's interfaces */
+static int darwin_get_registry_configuration (io_service_t service, UInt8 *config) {
+  io_iterator_t child_iterator;
+  io_service_t  child;
+  UInt32        value;
+  int           found = 0;
+
+  if (kIOReturnSuccess != IORegistryEntryGetChildIterator (service, kIOServicePlane, &child_iterator))
+    return -1;
+
+  while ((child = IOIteratorNext (child_iterator)) != 0) {
+    if (!found && IOObjectConformsTo (child, "IOUSBInterface") &&
+        get_ioregistry_value_uint32 (child, CFSTR("bConfigurationValue"), &value)) {
+      *config = (UInt8) value;
+      found = 1;
+    }
+
+    IOObjectRelease (child);
+  }
+
+  IOObjectRelease (child_iterator);
+
+  return found ? 0 : -1;
+}
+
 /* check whether the os has configured the device */
-static int darwin_check_configuration (struct libusb_context *ctx, struct darwin_cached_device *dev) {
+static int darwin_check_configuration (struct libusb_context *ctx, struct darwin_cached_device *dev,
+                                       io_service_t service) {
   usb_device_t **darwin_device = dev->device;
 
   IOUSBConfigurationDescriptorPtr configDesc;
@@ -546,6 +595,12 @@ static int darwin_check_configuration (struct libusb_context *ctx, struct darwin
   kresult = (*darwin_device)->GetConfigurationDescriptorPtr (darwin_device, 0, &configDesc);
   dev->first_config = (kIOReturnSuccess == kresult) ? configDesc->bConfigurationValue : 1;
 
+  /* avoid GetConfiguration (a device request) when the registry already knows the answer */
+  if (0 == darwin_get_registry_configuration (service, &dev->active_config)) {
+    usbi_dbg ("active config: %u (from registry), first config: %u", dev->active_config, dev->first_config);
+    return 0;
+  }
+
   /* check if the device is already configured. there is probably a better way than iterating over the
      to accomplish this (the trick is we need to avoid a call to GetConfigurations since buggy devices
      might lock up on the device request) */
@@ -603,7 +658,52 @@ static int darwin_request_descriptor (usb_device_t **device, UInt8 desc, UInt8 d
   return (*device)->DeviceRequestTO (device, &req);
 }
 
-static int darwin_cache_device_descriptor (struct libusb_context *ctx, struct darwin_cached_device *dev) {
+/* fill the device descriptor from the properties IOUSBFamily publishes for the device. this does
+   not touch the bus so it can not stall on a misbehaving device */
+static int darwin_registry_device_descriptor (io_service_t service, struct darwin_cached_device *dev) {
+  IOUSBDeviceDescriptor *desc = &dev->dev_descriptor;
+  UInt32 bcdUSB, bDeviceClass, bDeviceSubClass, bDeviceProtocol, bMaxPacketSize0;
+  UInt32 idVendor, idProduct, bcdDevice, iManufacturer, iProduct, iSerialNumber, bNumConfigurations;
+
+  if (!get_ioregistry_value_uint32 (service, CFSTR("bcdUSB"), &bcdUSB) ||
+      !get_ioregistry_value_uint32 (service, CFSTR("bDeviceClass"), &bDeviceClass) ||
+      !get_ioregistry_value_uint32 (service, CFSTR("bDeviceSubClass"), &bDeviceSubClass) ||
+      !get_ioregistry_value_uint32 (service, CFSTR("bDeviceProtocol"), &bDeviceProtocol) ||
+      !get_ioregistry_value_uint32 (service, CFSTR("bMaxPacketSize0"), &bMaxPacketSize0) ||
+      !get_ioregistry_value_uint32 (service, CFSTR("idVendor"), &idVendor) ||
+      !get_ioregistry_value_uint32 (service, CFSTR("idProduct"), &idProduct) ||
+      !get_ioregistry_value_uint32 (service, CFSTR("bcdDevice"), &bcdDevice) ||
+      !get_ioregistry_value_uint32 (service, CFSTR("iManufacturer"), &iManufacturer) ||
+      !get_ioregistry_value_uint32 (service, CFSTR("iProduct"), &iProduct) ||
+      !get_ioregistry_value_uint32 (service, CFSTR("iSerialNumber"), &iSerialNumber) ||
+      !get_ioregistry_value_uint32 (service, CFSTR("bNumConfigurations"), &bNumConfigurations))
+    return -1;
+
+  /* let the bus request deal with incorrectly configured devices */
+  if (0 == bNumConfigurations || 0 == bcdUSB)
+    return -1;
+
+  /* keep the descriptor in bus order like the one returned by the device */
+  desc->bLength            = LIBUSB_DT_DEVICE_SIZE;
+  desc->bDescriptorType    = kUSBDeviceDesc;
+  desc->bcdUSB             = libusb_cpu_to_le16 ((uint16_t) bcdUSB);
+  desc->bDeviceClass       = (UInt8) bDeviceClass;
+  desc->bDeviceSubClass    = (UInt8) bDeviceSubClass;
+  desc->bDeviceProtocol    = (UInt8) bDeviceProtocol;
+  desc->bMaxPacketSize0    = (UInt8) bMaxPacketSize0;
+  desc->idVendor           = libusb_cpu_to_le16 ((uint16_t) idVendor);
+  desc->idProduct          = libusb_cpu_to_le16 ((uint16_t) idProduct);
+  desc->bcdDevice          = libusb_cpu_to_le16 ((uint16_t) bcdDevice);
+  desc->iManufacturer      = (UInt8) iManufacturer;
+  desc->iProduct           = (UInt8) iProduct;
+  desc->iSerialNumber      = (UInt8) iSerialNumber;
+  desc->bNumConfigurations = (UInt8) bNumConfigurations;
+
+  return 0;
+}
+
+/* retrieve the device descriptor with a device request */
+static int darwin_request_device_descriptor (struct libusb_context *ctx, struct darwin_cached_device *dev) {
   usb_device_t **device = dev->device;
   int retries = 1, delay = 30000;
   int unsuspended = 0, try_unsuspend = 1, try_reconfigure = 1;
@@ -612,8 +712,6 @@ static int darwin_cache_device_descriptor (struct libusb_context *ctx, struct da
   UInt8 bDeviceClass;
   UInt16 idProduct, idVendor;
 
-  dev->can_enumerate = 0;
-
   (*device)->GetDeviceClass (device, &bDeviceClass);
   (*device)->GetDeviceProduct (device, &idProduct);
   (*device)->GetDeviceVendor (device, &idVendor);
@@ -712,6 +810,19 @@ static int darwin_cache_device_descriptor (struct libusb_context *ctx, struct da
     return -1;
   }
 
+  return 0;
+}
+
+static int darwin_cache_device_descriptor (struct libusb_context *ctx, struct darwin_cached_device *dev,
+                                           io_service_t service) {
+  dev->can_enumerate = 0;
+
+  /* only fall back on the bus when the registry does not have a usable descriptor */
+  if (0 == darwin_registry_device_descriptor (service, dev))
+    usbi_dbg ("using device descriptor from the registry");
+  else if (darwin_request_device_descriptor (ctx, dev))
+    return -1;
+
   usbi_dbg ("cached device descriptor:");
   usbi_dbg ("  bDescriptorType:    0x%02x", dev->dev_descriptor.bDescriptorType);
   usbi_dbg ("  bcdUSB:             0x%04x", dev->dev_descriptor.bcdUSB);
@@ -734,8 +845,9 @@ static int darwin_cache_device_descriptor (struct libusb_context *ctx, struct da
 
 static int darwin_get_cached_device(struct libusb_context *ctx, io_service_t service,
                                     struct darwin_cached_device **cached_out) {
-  struct darwin_cached_device *new_device;
+  struct darwin_cached_device *new_device, *next;
   UInt64 sessionID, parent_sessionID;
+  UInt32 location = 0, address;
   int ret = LIBUSB_SUCCESS;
   usb_device_t **device;
   io_service_t parent;
@@ -747,6 +859,7 @@ static int darwin_get_cached_device(struct libusb_context *ctx, io_service_t ser
   /* get some info from the io registry */
   (void) get_ioregistry_value_number (service, CFSTR("sessionID"), kCFNumberSInt64Type, &sessionID);
   (void) get_ioregistry_value_number (service, CFSTR("PortNum"), kCFNumberSInt8Type, &port);
+  (void) get_ioregistry_value_uint32 (service, CFSTR("locationID"), &location);
 
   usbi_dbg("finding cached device for sessionID 0x\n" PRIx64, sessionID);
 
@@ -759,13 +872,28 @@ static int darwin_get_cached_device(struct libusb_context *ctx, io_service_t ser
 
   usbi_mutex_lock(&darwin_cached_devices_lock);
   do {
-    list_for_each_entry(new_device, &darwin_cached_devices, list, struct darwin_cached_device) {
+    /* the cache is shared by all contexts and outlives them, so a device is only ever
+       enumerated once per process. entries are keyed by location ID: only one device
+       can be attached at a location so an entry with a different session is stale */
+    list_for_each_entry_safe(new_device, next, &darwin_cached_devices, list, struct darwin_cached_device) {
+      if (location && new_device->location != location)
+        continue;
+
       usbi_dbg("matching sessionID 0x%x against cached device with sessionID 0x%x", sessionID, new_device->session);
       if (new_device->session == sessionID) {
         usbi_dbg("using cached device for device");
         *cached_out = new_device;
         break;
       }
+
+      if (location) {
+        usbi_dbg("dropping stale cached device at location 0x%08x", location);
+        /* libusb devices may still reference the entry. keep the list entry valid for
+           darwin_deref_cached_device () */
+        list_del(&new_device->list);
+        list_init(&new_device->list);
+        darwin_deref_cached_device(new_device);
+      }
     }
 
     if (*cached_out)
@@ -790,19 +918,25 @@ static int darwin_get_cached_device(struct libusb_context *ctx, io_service_t ser
     /* add this device to the cached device list */
     list_add(&new_device->list, &darwin_cached_devices);
 
-    (*device)->GetDeviceAddress (device, (USBDeviceAddress *)&new_device->address);
+    if (get_ioregistry_value_uint32 (service, CFSTR("USB Address"), &address))
+      new_device->address = (UInt16) address;
+    else
+      (*device)->GetDeviceAddress (device, (USBDeviceAddress *)&new_device->address);
 
     /* keep a reference to this device */
     darwin_ref_cached_device(new_device);
 
     new_device->device = device;
     new_device->session = sessionID;
-    (*device)->GetLocationID (device, &new_device->location);
+    if (location)
+      new_device->location = location;
+    else
+      (*device)->GetLocationID (device, &new_device->location);
     new_device->port = port;
     new_device->parent_session = parent_sessionID;
 
     /* cache the device descriptor */
-    ret = darwin_cache_device_descriptor(ctx, new_device);
+    ret = darwin_cache_device_descriptor(ctx, new_device, service);
     if (ret)
       break;
 
@@ -839,7 +973,7 @@ static int process_new_device (struct libusb_context *ctx, io_service_t service)
 
     /* check current active configuration (and cache the first configuration value--
        which may be used by claim_interface) */
-    ret = darwin_check_configuration (ctx, cached_device);
+    ret = darwin_check_configuration (ctx, cached_device, service);
     if (ret)
       break;
 
@@ -891,7 +1025,7 @@ static int process_new_device (struct libusb_context *ctx, io_service_t service)
               dev->port_number, (void *) dev->parent_dev, priv->dev->sys_path);
   } while (0);
 
-  if (0 == ret) {
+  if (0 == ret && usbi_scope_match_device (dev)) {
     usbi_connect_device (dev);
   } else {
     libusb_unref_device (dev);
@@ -920,65 +1054,137 @@ static int darwin_scan_devices(struct libusb_context *ctx) {
   return 0;
 }
 
+static int darwin_add_async_port (struct libusb_device_handle *dev_handle, mach_port_t port) {
+  struct darwin_cached_device *dpriv = DARWIN_CACHED_DEVICE(dev_handle->dev);
+  kern_return_t kresult;
+
+  kresult = mach_port_insert_member (mach_task_self (), port, dpriv->port_set);
+  if (kresult != KERN_SUCCESS) {
+    usbi_err (HANDLE_CTX (dev_handle), "mach_port_insert_member: %d", kresult);
+    return LIBUSB_ERROR_OTHER;
+  }
+
+  return LIBUSB_SUCCESS;
+}
+
+static void darwin_remove_async_port (struct libusb_device_handle *dev_handle, mach_port_t port) {
+  struct darwin_cached_device *dpriv = DARWIN_CACHED_DEVICE(dev_handle->dev);
+
+  (void) mach_port_extract_member (mach_task_self (), port, dpriv->port_set);
+}
+
+static void darwin_destroy_event_source (struct darwin_cached_device *dpriv) {
+  if (dpriv->kq >= 0) {
+    close (dpriv->kq);
+    dpriv->kq = -1;
+  }
+
+  if (dpriv->port_set != MACH_PORT_NULL) {
+    (void) mach_port_mod_refs (mach_task_self (), dpriv->port_set, MACH_PORT_RIGHT_PORT_SET, -1);
+    dpriv->port_set = MACH_PORT_NULL;
+  }
+}
+
+/* IOKit posts async completions as mach messages. Instead of dispatching them
+ * on the CFRunLoop thread and forwarding them through a pipe, all the ports of
+ * a device are gathered in a port set that a kqueue watches, and the event
+ * handling thread dispatches the completions itself (see
+ * darwin_drain_async_ports ()). A port can only be a member of one set, so
+ * the set belongs to the device and is shared by all its open handles; it is
+ * created by the first darwin_open () and destroyed by the last
+ * darwin_close (). */
+static int darwin_create_event_source (struct libusb_device_handle *dev_handle) {
+  struct darwin_cached_device *dpriv = DARWIN_CACHED_DEVICE(dev_handle->dev);
+  struct kevent event;
+  kern_return_t kresult;
+
+  dpriv->device_port = MACH_PORT_NULL;
+  dpriv->kq = -1;
+
+  kresult = mach_port_allocate (mach_task_self (), MACH_PORT_RIGHT_PORT_SET, &dpriv->port_set);
+  if (kresult != KERN_SUCCESS) {
+    usbi_err (HANDLE_CTX (dev_handle), "could not allocate port set: %d", kresult);
+    dpriv->port_set = MACH_PORT_NULL;
+    return LIBUSB_ERROR_NO_MEM;
+  }
+
+  dpriv->kq = kqueue ();
+  if (dpriv->kq < 0) {
+    usbi_err (HANDLE_CTX (dev_handle), "kqueue failed: %s", strerror (errno));
+    darwin_destroy_event_source (dpriv);
+    return LIBUSB_ERROR_OTHER;
+  }
+
+  fcntl (dpriv->kq, F_SETFD, FD_CLOEXEC);
+
+  EV_SET (&event, dpriv->port_set, EVFILT_MACHPORT, EV_ADD, 0, 0, NULL);
+  if (kevent (dpriv->kq, &event, 1, NULL, 0, NULL) < 0) {
+    usbi_err (HANDLE_CTX (dev_handle), "could not watch port set: %s", strerror (errno));
+    darwin_destroy_event_source (dpriv);
+    return LIBUSB_ERROR_OTHER;
+  }
+
+  return LIBUSB_SUCCESS;
+}
+
 static int darwin_open (struct libusb_device_handle *dev_handle) {
-  struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)dev_handle->os_priv;
   struct darwin_cached_device *dpriv = DARWIN_CACHED_DEVICE(dev_handle->dev);
   IOReturn kresult;
+  int rc;
 
   if (0 == dpriv->open_count) {
+    rc = darwin_create_event_source (dev_handle);
+    if (LIBUSB_SUCCESS != rc) {
+      return rc;
+    }
+
     /* try to open the device */
     kresult = (*(dpriv->device))->USBDeviceOpenSeize (dpriv->device);
     if (kresult != kIOReturnSuccess) {
       usbi_warn (HANDLE_CTX (dev_handle), "USBDeviceOpen: %s", darwin_error_str(kresult));
 
       if (kIOReturnExclusiveAccess != kresult) {
+        darwin_destroy_event_source (dpriv);
         return darwin_to_libusb (kresult);
       }
 
       /* it is possible to perform some actions on a device that is not open so do not return an error */
-      priv->is_open = 0;
+      dpriv->is_open = 0;
     } else {
-      priv->is_open = 1;
+      dpriv->is_open = 1;
     }
 
-    /* create async event source */
-    kresult = (*(dpriv->device))->CreateDeviceAsyncEventSource (dpriv->device, &priv->cfSource);
+    /* create the device's async port */
+    kresult = (*(dpriv->device))->CreateDeviceAsyncPort (dpriv->device, &dpriv->device_port);
+    if (kresult == kIOReturnSuccess && darwin_add_async_port (dev_handle, dpriv->device_port) != LIBUSB_SUCCESS) {
+      kresult = kIOReturnError;
+    }
     if (kresult != kIOReturnSuccess) {
-      usbi_err (HANDLE_CTX (dev_handle), "CreateDeviceAsyncEventSource: %s", darwin_error_str(kresult));
+      usbi_err (HANDLE_CTX (dev_handle), "CreateDeviceAsyncPort: %s", darwin_error_str(kresult));
 
-      if (priv->is_open) {
+      if (dpriv->is_open) {
         (*(dpriv->device))->USBDeviceClose (dpriv->device);
       }
 
-      priv->is_open = 0;
+      dpriv->is_open = 0;
+      dpriv->device_port = MACH_PORT_NULL;
+      darwin_destroy_event_source (dpriv);
 
       return darwin_to_libusb (kresult);
     }
 
-    CFRetain (libusb_darwin_acfl);
-
-    /* add the cfSource to the aync run loop */
-    CFRunLoopAddSource(libusb_darwin_acfl, priv->cfSource, kCFRunLoopCommonModes);
+    usbi_add_pollfd(HANDLE_CTX(dev_handle), dpriv->kq, POLLIN);
   }
 
   /* device opened successfully */
   dpriv->open_count++;
 
-  /* create a file descriptor for notifications */
-  pipe (priv->fds);
-
-  /* set the pipe to be non-blocking */
-  fcntl (priv->fds[1], F_SETFD, O_NONBLOCK);
-
-  usbi_add_pollfd(HANDLE_CTX(dev_handle), priv->fds[0], POLLIN);
-
   usbi_dbg ("device open for access");
 
   return 0;
 }
 
 static void darwin_close (struct libusb_device_handle *dev_handle) {
-  struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)dev_handle->os_priv;
   struct darwin_cached_device *dpriv = DARWIN_CACHED_DEVICE(dev_handle->dev);
   IOReturn kresult;
   int i;
@@ -997,15 +1203,13 @@ static void darwin_close (struct libusb_device_handle *dev_handle) {
       libusb_release_interface (dev_handle, i);
 
   if (0 == dpriv->open_count) {
-    /* delete the device's async event source */
-    if (priv->cfSource) {
-      CFRunLoopRemoveSource (libusb_darwin_acfl, priv->cfSource, kCFRunLoopDefaultMode);
-      CFRelease (priv->cfSource);
-      priv->cfSource = NULL;
-      CFRelease (libusb_darwin_acfl);
+    /* stop listening on the device's async port */
+    if (dpriv->device_port != MACH_PORT_NULL) {
+      darwin_remove_async_port (dev_handle, dpriv->device_port);
+      dpriv->device_port = MACH_PORT_NULL;
     }
 
-    if (priv->is_open) {
+    if (dpriv->is_open) {
       /* close the device */
       kresult = (*(dpriv->device))->USBDeviceClose(dpriv->device);
       if (kresult) {
@@ -1013,15 +1217,13 @@ static void darwin_close (struct libusb_device_handle *dev_handle) {
          * close isn't really an error, so return success anyway */
         usbi_warn (HANDLE_CTX (dev_handle), "USBDeviceClose: %s", darwin_error_str(kresult));
       }
+      dpriv->is_open = 0;
     }
-  }
 
-  /* file descriptors are maintained per-instance */
-  usbi_remove_pollfd (HANDLE_CTX (dev_handle), priv->fds[0]);
-  close (priv->fds[1]);
-  close (priv->fds[0]);
-
-  priv->fds[0] = priv->fds[1] = -1;
+    /* the event source goes with the last handle */
+    usbi_remove_pollfd (HANDLE_CTX (dev_handle), dpriv->kq);
+    darwin_destroy_event_source (dpriv);
+  }
 }
 
 static int darwin_get_configuration(struct libusb_device_handle *dev_handle, int *config) {
@@ -1192,9 +1394,10 @@ static int darwin_claim_interface(struct libusb_device_handle *dev_handle, int i
     return LIBUSB_ERROR_NOT_FOUND;
   }
 
-  /* Do the actual claim */
+  /* Do the actual claim. Ask for the interface version usb_interface_t describes,
+     the low latency isochronous calls are not in the original one */
   kresult = (*plugInInterface)->QueryInterface(plugInInterface,
-                                               CFUUIDGetUUIDBytes(kIOUSBInterfaceInterfaceID),
+                                               CFUUIDGetUUIDBytes(InterfaceInterfaceID),
                                                (LPVOID)&cInterface->interface);
   /* We no longer need the intermediate plug-in */
   /* Use release instead of IODestroyPlugInInterface to avoid stopping IOServices associated with this device */
@@ -1204,10 +1407,18 @@ static int darwin_claim_interface(struct libusb_device_handle *dev_handle, int i
     return darwin_to_libusb (kresult);
   }
 
+  cInterface->port = MACH_PORT_NULL;
+  usbi_mutex_init (&cInterface->ll_lock, NULL);
+  list_init (&cInterface->ll_buffers);
+
   /* claim the interface */
   kresult = (*(cInterface->interface))->USBInterfaceOpen(cInterface->interface);
   if (kresult) {
     usbi_err (HANDLE_CTX (dev_handle), "USBInterfaceOpen: %s", darwin_error_str(kresult));
+    /* not claimed, so darwin_release_interface () will not undo any of this */
+    (*(cInterface->interface))->Release(cInterface->interface);
+    cInterface->interface = IO_OBJECT_NULL;
+    usbi_mutex_destroy (&cInterface->ll_lock);
     return darwin_to_libusb (kresult);
   }
 
@@ -1220,22 +1431,21 @@ static int darwin_claim_interface(struct libusb_device_handle *dev_handle, int i
     return kresult;
   }
 
-  cInterface->cfSource = NULL;
-
-  /* create async event source */
-  kresult = (*(cInterface->interface))->CreateInterfaceAsyncEventSource (cInterface->interface, &cInterface->cfSource);
+  /* create the interface's async port */
+  kresult = (*(cInterface->interface))->CreateInterfaceAsyncPort (cInterface->interface, &cInterface->port);
+  if (kresult == kIOReturnSuccess && darwin_add_async_port (dev_handle, cInterface->port) != LIBUSB_SUCCESS) {
+    kresult = kIOReturnError;
+  }
   if (kresult != kIOReturnSuccess) {
-    usbi_err (HANDLE_CTX (dev_handle), "could not create async event source");
+    usbi_err (HANDLE_CTX (dev_handle), "could not create async port");
+    cInterface->port = MACH_PORT_NULL;
 
-    /* can't continue without an async event source */
+    /* can't continue without an async port */
     (void)darwin_release_interface (dev_handle, iface);
 
     return darwin_to_libusb (kresult);
   }
 
-  /* add the cfSource to the async thread's run loop */
-  CFRunLoopAddSource(libusb_darwin_acfl, cInterface->cfSource, kCFRunLoopDefaultMode);
-
   usbi_dbg ("interface opened");
 
   return 0;
@@ -1255,12 +1465,14 @@ static int darwin_release_interface(struct libusb_device_handle *dev_handle, int
   /* clean up endpoint data */
   cInterface->num_endpoints = 0;
 
-  /* delete the interface's async event source */
-  if (cInterface->cfSource) {
-    CFRunLoopRemoveSource (libusb_darwin_acfl, cInterface->cfSource, kCFRunLoopDefaultMode);
-    CFRelease (cInterface->cfSource);
+  /* stop listening on the interface's async port */
+  if (cInterface->port != MACH_PORT_NULL) {
+    darwin_remove_async_port (dev_handle, cInterface->port);
+    cInterface->port = MACH_PORT_NULL;
   }
 
+  darwin_destroy_ll_buffers (cInterface);
+
   kresult = (*(cInterface->interface))->USBInterfaceClose(cInterface->interface);
   if (kresult)
     usbi_warn (HANDLE_CTX (dev_handle), "USBInterfaceClose: %s", darwin_error_str(kresult));
@@ -1270,6 +1482,7 @@ static int darwin_release_interface(struct libusb_device_handle *dev_handle, int
     usbi_warn (HANDLE_CTX (dev_handle), "Release: %s", darwin_error_str(kresult));
 
   cInterface->interface = IO_OBJECT_NULL;
+  usbi_mutex_destroy (&cInterface->ll_lock);
 
   return darwin_to_libusb (kresult);
 }
@@ -1416,6 +1629,22 @@ static int darwin_detach_kernel_driver (struct libusb_device_handle *dev_handle,
   return LIBUSB_ERROR_NOT_SUPPORTED;
 }
 
+static int darwin_get_frame_number (struct libusb_device_handle *dev_handle, uint64_t *frame_number) {
+  struct darwin_device_priv *dpriv = (struct darwin_device_priv *)dev_handle->dev->os_priv;
+  AbsoluteTime atTime;
+  UInt64 frame;
+  IOReturn kresult;
+
+  kresult = (*(dpriv->device))->GetBusFrameNumber (dpriv->device, &frame, &atTime);
+  if (kresult != kIOReturnSuccess) {
+    usbi_err (HANDLE_CTX (dev_handle), "failed to get bus frame number: %s", darwin_error_str(kresult));
+    return darwin_to_libusb (kresult);
+  }
+
+  *frame_number = frame;
+  return 0;
+}
+
 static void darwin_destroy_device(struct libusb_device *dev) {
   struct darwin_device_priv *dpriv = (struct darwin_device_priv *) dev->os_priv;
 
@@ -1485,6 +1714,76 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer) {
   return darwin_to_libusb (ret);
 }
 
+/* Low latency isochronous transfers need their data and frame list in buffers
+ * allocated by IOKit for the interface. Those are expensive to create, so they
+ * are recycled through a per-interface list until the interface is released. */
+static struct darwin_ll_buffer *darwin_get_ll_buffer (struct darwin_interface *cInterface, UInt32 size,
+                                                      UInt32 num_frames, int is_read) {
+  struct darwin_ll_buffer *buffer;
+  UInt32 type = is_read ? kUSBLowLatencyReadBuffer : kUSBLowLatencyWriteBuffer;
+  IOReturn kresult;
+
+  usbi_mutex_lock (&cInterface->ll_lock);
+  list_for_each_entry(buffer, &cInterface->ll_buffers, list, struct darwin_ll_buffer) {
+    if (buffer->type == type && buffer->size >= size && buffer->num_frames >= num_frames) {
+      list_del (&buffer->list);
+      usbi_mutex_unlock (&cInterface->ll_lock);
+      return buffer;
+    }
+  }
+  usbi_mutex_unlock (&cInterface->ll_lock);
+
+  buffer = calloc (1, sizeof (*buffer));
+  if (!buffer)
+    return NULL;
+
+  buffer->type = type;
+  buffer->size = size;
+  buffer->num_frames = num_frames;
+
+  kresult = (*(cInterface->interface))->LowLatencyCreateBuffer (cInterface->interface, &buffer->data, size, type);
+  if (kresult != kIOReturnSuccess) {
+    usbi_dbg ("could not create low latency buffer: %s", darwin_error_str (kresult));
+    free (buffer);
+    return NULL;
+  }
+
+  kresult = (*(cInterface->interface))->LowLatencyCreateBuffer (cInterface->interface, (void **) &buffer->frames,
+                                                                num_frames * sizeof (IOUSBLowLatencyIsocFrame),
+                                                                kUSBLowLatencyFrameListBuffer);
+  if (kresult != kIOReturnSuccess) {
+    usbi_dbg ("could not create low latency frame list: %s", darwin_error_str (kresult));
+    (*(cInterface->interface))->LowLatencyDestroyBuffer (cInterface->interface, buffer->data);
+    free (buffer);
+    return NULL;
+  }
+
+  return buffer;
+}
+
+static void darwin_put_ll_buffer (struct darwin_interface *cInterface, struct darwin_ll_buffer *buffer) {
+  if (!cInterface->interface) {
+    /* the interface was released (which destroyed its buffers) while the transfer was in flight */
+    free (buffer);
+    return;
+  }
+
+  usbi_mutex_lock (&cInterface->ll_lock);
+  list_add (&buffer->list, &cInterface->ll_buffers);
+  usbi_mutex_unlock (&cInterface->ll_lock);
+}
+
+static void darwin_destroy_ll_buffers (struct darwin_interface *cInterface) {
+  struct darwin_ll_buffer *buffer, *next;
+
+  list_for_each_entry_safe(buffer, next, &cInterface->ll_buffers, list, struct darwin_ll_buffer) {
+    list_del (&buffer->list);
+    (*(cInterface->interface))->LowLatencyDestroyBuffer (cInterface->interface, buffer->frames);
+    (*(cInterface->interface))->LowLatencyDestroyBuffer (cInterface->interface, buffer->data);
+    free (buffer);
+  }
+}
+
 static int submit_iso_transfer(struct usbi_transfer *itransfer) {
   struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
   struct darwin_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
@@ -1495,9 +1794,11 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
   uint16_t maxPacketSize;
   UInt64 frame;
   AbsoluteTime atTime;
+  UInt32 total_length = 0;
   int i;
 
   struct darwin_interface *cInterface;
+  struct darwin_ll_buffer *ll_buffer = NULL;
 
   /* construct an array of IOUSBIsocFrames, reuse the old one if possible */
   if (tpriv->isoc_framelist && tpriv->num_iso_packets != transfer->num_iso_packets) {
@@ -1548,8 +1849,39 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
   if (cInterface->frames[transfer->endpoint] && frame < cInterface->frames[transfer->endpoint])
     frame = cInterface->frames[transfer->endpoint];
 
-  /* submit the request */
-  if (IS_XFERIN(transfer))
+  /* unless the caller asked for a specific frame */
+  if (itransfer->flags & USBI_TRANSFER_ISO_SCHEDULED)
+    frame = itransfer->iso_start_frame;
+
+  /* submit the request. Prefer the low latency calls, which complete from the
+     controller's interrupt rather than a later software pass over the frame list */
+  for (i = 0 ; i < transfer->num_iso_packets ; i++)
+    total_length += transfer->iso_packet_desc[i].length;
+
+  if (total_length)
+    ll_buffer = darwin_get_ll_buffer (cInterface, total_length, transfer->num_iso_packets, IS_XFERIN(transfer));
+
+  tpriv->ll_buffer = ll_buffer;
+  tpriv->ll_iface = iface;
+
+  if (ll_buffer) {
+    for (i = 0 ; i < transfer->num_iso_packets ; i++) {
+      ll_buffer->frames[i].frReqCount = transfer->iso_packet_desc[i].length;
+      ll_buffer->frames[i].frActCount = 0;
+      ll_buffer->frames[i].frStatus   = kIOReturnSuccess;
+    }
+
+    if (IS_XFERIN(transfer)) {
+      kresult = (*(cInterface->interface))->LowLatencyReadIsochPipeAsync(cInterface->interface, pipeRef, ll_buffer->data, frame,
+                                                                         transfer->num_iso_packets, DARWIN_LL_UPDATE_FREQUENCY,
+                                                                         ll_buffer->frames, darwin_async_io_callback, itransfer);
+    } else {
+      memcpy (ll_buffer->data, transfer->buffer, total_length);
+      kresult = (*(cInterface->interface))->LowLatencyWriteIsochPipeAsync(cInterface->interface, pipeRef, ll_buffer->data, frame,
+                                                                          transfer->num_iso_packets, DARWIN_LL_UPDATE_FREQUENCY,
+                                                                          ll_buffer->frames, darwin_async_io_callback, itransfer);
+    }
+  } else if (IS_XFERIN(transfer))
     kresult = (*(cInterface->interface))->ReadIsochPipeAsync(cInterface->interface, pipeRef, transfer->buffer, frame,
                                                              transfer->num_iso_packets, tpriv->isoc_framelist, darwin_async_io_callback,
                                                              itransfer);
@@ -1570,6 +1902,14 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
                darwin_error_str(kresult));
     free (tpriv->isoc_framelist);
     tpriv->isoc_framelist = NULL;
+    if (ll_buffer) {
+      darwin_put_ll_buffer (cInterface, ll_buffer);
+      tpriv->ll_buffer = NULL;
+    }
+  } else {
+    /* the transfer will start exactly in the frame it was queued for */
+    itransfer->iso_start_frame = frame;
+    itransfer->flags |= USBI_TRANSFER_ISO_START_KNOWN;
   }
 
   return darwin_to_libusb (kresult);
@@ -1713,14 +2053,19 @@ static void darwin_clear_transfer_priv (struct usbi_transfer *itransfer) {
     free (tpriv->isoc_framelist);
     tpriv->isoc_framelist = NULL;
   }
+
+  if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS && tpriv->ll_buffer) {
+    struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)transfer->dev_handle->os_priv;
+
+    darwin_put_ll_buffer (&priv->interfaces[tpriv->ll_iface], tpriv->ll_buffer);
+    tpriv->ll_buffer = NULL;
+  }
 }
 
 static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0) {
   struct usbi_transfer *itransfer = (struct usbi_transfer *)refcon;
   struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
   struct darwin_device_handle_priv *priv = (struct darwin_device_handle_priv *)transfer->dev_handle->os_priv;
-  struct darwin_msg_async_io_complete message = {.itransfer = itransfer, .result = result,
-                                                 .size = (UInt32) (uintptr_t) arg0};
 
   usbi_dbg ("an async io operation has completed");
 
@@ -1735,8 +2080,8 @@ static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0)
     (*(cInterface->interface))->WritePipe (cInterface->interface, pipeRef, transfer->buffer, 0);
   }
 
-  /* send a completion message to the device's file descriptor */
-  write (priv->fds[1], &message, sizeof (message));
+  /* this runs on the event handling thread, see darwin_drain_async_ports () */
+  darwin_handle_callback (itransfer, result, (UInt32) (uintptr_t) arg0);
 }
 
 static int darwin_transfer_status (struct usbi_transfer *itransfer, kern_return_t result) {
@@ -1783,7 +2128,20 @@ static void darwin_handle_callback (struct usbi_transfer *itransfer, kern_return
              isControl ? "control" : isBulk ? "bulk" : isIsoc ? "isoc" : "interrupt", result);
 
   if (kIOReturnSuccess == result || kIOReturnUnderrun == result) {
-    if (isIsoc && tpriv->isoc_framelist) {
+    if (isIsoc && tpriv->ll_buffer) {
+      /* copy low latency isochronous results and data back */
+      UInt32 total_length = 0;
+
+      for (i = 0; i < transfer->num_iso_packets ; i++) {
+        struct libusb_iso_packet_descriptor *lib_desc = &transfer->iso_packet_desc[i];
+        lib_desc->status = darwin_to_libusb (tpriv->ll_buffer->frames[i].frStatus);
+        lib_desc->actual_length = tpriv->ll_buffer->frames[i].frActCount;
+        total_length += lib_desc->length;
+      }
+
+      if (IS_XFERIN(transfer))
+        memcpy (transfer->buffer, tpriv->ll_buffer->data, total_length);
+    } else if (isIsoc && tpriv->isoc_framelist) {
       /* copy isochronous results back */
 
       for (i = 0; i < transfer->num_iso_packets ; i++) {
@@ -1799,12 +2157,39 @@ static void darwin_handle_callback (struct usbi_transfer *itransfer, kern_return
   usbi_handle_transfer_completion (itransfer, darwin_transfer_status (itransfer, result));
 }
 
+/* dispatch all the async completions queued on the ports of a device */
+static void darwin_drain_async_ports (struct libusb_device_handle *dev_handle) {
+  struct darwin_cached_device *dpriv = DARWIN_CACHED_DEVICE(dev_handle->dev);
+  union {
+    mach_msg_header_t header;
+    uint8_t           buffer[DARWIN_ASYNC_MSG_SIZE];
+  } msg;
+  struct kevent event;
+  struct timespec zero = {0, 0};
+  mach_msg_return_t ret;
+
+  /* consume the kqueue event first, so that a message queued while the ports
+     are being drained leaves the kqueue readable for the next poll */
+  (void) kevent (dpriv->kq, NULL, 0, &event, 1, &zero);
+
+  for (;;) {
+    ret = mach_msg (&msg.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof (msg),
+                    dpriv->port_set, 0, MACH_PORT_NULL);
+    if (MACH_MSG_SUCCESS != ret) {
+      if (MACH_RCV_TIMED_OUT != ret)
+        usbi_warn (HANDLE_CTX (dev_handle), "could not receive async completion: %d", ret);
+      break;
+    }
+
+    /* calls darwin_async_io_callback () */
+    IODispatchCalloutFromMessage (NULL, &msg.header, NULL);
+  }
+}
+
 static int op_handle_events(struct libusb_context *ctx, struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready) {
-  struct darwin_msg_async_io_complete message;
+  struct libusb_device_handle *handle;
   POLL_NFDS_TYPE i = 0;
-  ssize_t ret;
-
-  usbi_mutex_lock(&ctx->open_devs_lock);
+  int found;
 
   for (i = 0; i < nfds && num_ready > 0; i++) {
     struct pollfd *pollfd = &fds[i];
@@ -1821,18 +2206,25 @@ static int op_handle_events(struct libusb_context *ctx, struct pollfd *fds, POLL
       continue;
     }
 
-    /* there is only one type of message */
-    ret = read (pollfd->fd, &message, sizeof (message));
-    if (ret < (ssize_t) sizeof (message)) {
-      usbi_dbg ("WARNING: short read on async io completion pipe\n");
+    found = 0;
+    usbi_mutex_lock(&ctx->open_devs_lock);
+    list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
+      if (DARWIN_CACHED_DEVICE(handle->dev)->kq == pollfd->fd) {
+        found = 1;
+        break;
+      }
+    }
+    usbi_mutex_unlock(&ctx->open_devs_lock);
+
+    if (!found) {
+      usbi_dbg ("WARNING: no device handle for fd %i", pollfd->fd);
       continue;
     }
 
-    darwin_handle_callback (message.itransfer, message.result, message.size);
+    /* the handle can not be closed while we hold the event lock */
+    darwin_drain_async_ports (handle);
   }
 
-  usbi_mutex_unlock(&ctx->open_devs_lock);
-
   return 0;
 }
 
@@ -1863,7 +2255,7 @@ static int darwin_clock_gettime(int clk_id, struct timespec *tp) {
 
 const struct usbi_os_backend darwin_backend = {
         .name = "Darwin",
-        .caps = 0,
+        .caps = USBI_CAP_SUPPORTS_ZERO_PACKET,
         .init = darwin_init,
         .exit = darwin_exit,
         .get_device_list = NULL, /* not needed */
@@ -1886,6 +2278,8 @@ const struct usbi_os_backend darwin_backend = {
         .detach_kernel_driver = darwin_detach_kernel_driver,
         .attach_kernel_driver = darwin_attach_kernel_driver,
 
+        .get_frame_number = darwin_get_frame_number,
+
         .destroy_device = darwin_destroy_device,
 
         .submit_transfer = darwin_submit_transfer,
@@ -121,23 +121,42 @@ struct darwin_cached_device {
   UInt8                 first_config, active_config, port;  
   int                   can_enumerate;
   int                   refcount;
+
+  /* set up by the first open handle, see darwin_create_event_source ().
+   * async completions of the device and the interfaces claimed by any of its
+   * handles are queued on mach ports gathered in port_set, which the event
+   * loop polls through kq */
+  int                   is_open;
+  mach_port_t           port_set;
+  mach_port_t           device_port;
+  int                   kq;
 };
 
 struct darwin_device_priv {
   struct darwin_cached_device *dev;
 };
 
-struct darwin_device_handle_priv {
-  int                  is_open;
-  CFRunLoopSourceRef   cfSource;
-  int                  fds[2];
+/* isochronous buffers allocated with LowLatencyCreateBuffer (), kept per interface */
+struct darwin_ll_buffer {
+  struct list_head          list;
+  UInt32                    type;     /* kUSBLowLatencyReadBuffer or kUSBLowLatencyWriteBuffer */
+  void                     *data;
+  UInt32                    size;
+  IOUSBLowLatencyIsocFrame *frames;
+  UInt32                    num_frames;
+};
 
+struct darwin_device_handle_priv {
   struct darwin_interface {
     usb_interface_t    **interface;
     uint8_t              num_endpoints;
-    CFRunLoopSourceRef   cfSource;
+    mach_port_t          port;
     uint64_t             frames[256];
     uint8_t            endpoint_addrs[USB_MAXENDPOINTS];
+
+    /* unused low latency isochronous buffers */
+    usbi_mutex_t         ll_lock;
+    struct list_head     ll_buffers;
   } interfaces[USB_MAXINTERFACES];
 };
 
@@ -145,6 +164,8 @@ struct darwin_transfer_priv {
   /* Isoc */
   IOUSBIsocFrame *isoc_framelist;
   int num_iso_packets;
+  struct darwin_ll_buffer *ll_buffer;
+  uint8_t ll_iface;
 
   /* Control */
   IOUSBDevRequestTO req;
@@ -152,11 +173,4 @@ struct darwin_transfer_priv {
   /* Bulk */
 };
 
-/* structure for signaling io completion */
-struct darwin_msg_async_io_complete {
-  struct usbi_transfer *itransfer;
-  IOReturn result;
-  UInt32 size;
-};
-
 #endif
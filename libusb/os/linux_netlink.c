@@ -42,6 +42,10 @@
 
 #define KERNEL 1
 
+/* number of messages read in one go by linux_netlink_read_messages() */
+#define NETLINK_BATCH_SIZE 16
+#define NETLINK_MESSAGE_SIZE 1024
+
 static int linux_netlink_socket = -1;
 static pthread_t libusb_linux_event_thread;
 
@@ -49,8 +53,31 @@ static void *linux_netlink_event_thread_main(void *arg);
 
 struct sockaddr_nl snl = { .nl_family=AF_NETLINK, .nl_groups=KERNEL };
 
+/* Kernel uevents start with a "<action>@<devpath>" header. Only add and remove
+ * events are of interest, so have the kernel drop everything else (change,
+ * bind, move, online...) before it wakes up the event thread. The subsystem
+ * comes after the devpath, at an offset that classic BPF cannot compute
+ * without loops, so it is still checked in linux_netlink_parse(). */
+static struct sock_filter netlink_filter[] = {
+	/* "add@" */
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x61646440, 6, 0),
+	/* "remove@" */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x72656d6f, 0, 4),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x7665, 0, 2),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, '@', 1, 0),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+	BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+};
+
 int linux_netlink_start_event_monitor(void)
 {
+	struct sock_fprog filter = {
+		.len = sizeof(netlink_filter) / sizeof(netlink_filter[0]),
+		.filter = netlink_filter,
+	};
 	int ret;
 
 	snl.nl_groups = KERNEL;
@@ -65,6 +92,13 @@ int linux_netlink_start_event_monitor(void)
 		return LIBUSB_ERROR_OTHER;
 	}
 
+	/* not fatal: without the filter, the events are sorted out in
+	 * userspace */
+	if (0 != setsockopt(linux_netlink_socket, SOL_SOCKET, SO_ATTACH_FILTER,
+			    &filter, sizeof(filter))) {
+		usbi_dbg("could not attach netlink socket filter, errno=%d", errno);
+	}
+
 	/* TODO -- add authentication */
 	/* setsockopt(linux_netlink_socket, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)); */
 
@@ -182,32 +216,21 @@ static int linux_netlink_parse(char *buffer, size_t len, int *detached, const ch
 	return 0;
 }
 
-static int linux_netlink_read_message(void)
+static void linux_netlink_handle_message(char *buffer, size_t len)
 {
-	unsigned char buffer[1024];
-	struct iovec iov = {.iov_base = buffer, .iov_len = sizeof(buffer)};
-	struct msghdr meh = { .msg_iov=&iov, .msg_iovlen=1,
-			     .msg_name=&snl, .msg_namelen=sizeof(snl) };
 	const char *sys_name = NULL;
 	uint8_t busnum, devaddr;
 	int detached, r;
-	size_t len;
 
-	/* read netlink message */
-	memset(buffer, 0, sizeof(buffer));
-	len = recvmsg(linux_netlink_socket, &meh, 0);
-	if (len < 32) {
-		if (errno != EAGAIN)
-			usbi_dbg("error recieving message from netlink");
-		return -1;
-	}
+	if (len < 32)
+		return;
 
 	/* TODO -- authenticate this message is from the kernel or udevd */
 
 	r = linux_netlink_parse(buffer, len, &detached, &sys_name,
 				&busnum, &devaddr);
 	if (r)
-		return r;
+		return;
 
 	usbi_dbg("netlink hotplug found device busnum: %hhu, devaddr: %hhu, sys_name: %s, removed: %s",
 		 busnum, devaddr, sys_name, detached ? "yes" : "no");
@@ -217,8 +240,71 @@ static int linux_netlink_read_message(void)
 		linux_hotplug_disconnected(busnum, devaddr, sys_name);
 	else
 		linux_hotplug_enumerate(busnum, devaddr, sys_name);
+}
 
-	return 0;
+/* read and handle the messages queued on the netlink socket, up to
+ * NETLINK_BATCH_SIZE of them. with recvmmsg() a burst of events costs a
+ * single syscall. returns the number of messages read, or -1 if there were
+ * none. called with linux_hotplug_lock held */
+static int linux_netlink_read_messages(void)
+{
+	/* one extra byte per message keeps the last string terminated */
+	static char buffers[NETLINK_BATCH_SIZE][NETLINK_MESSAGE_SIZE + 1];
+	struct sockaddr_nl addrs[NETLINK_BATCH_SIZE];
+	struct iovec iovs[NETLINK_BATCH_SIZE];
+	size_t lens[NETLINK_BATCH_SIZE];
+	int i, n;
+#if defined(MSG_WAITFORONE)
+	struct mmsghdr msgs[NETLINK_BATCH_SIZE];
+	static int have_recvmmsg = 1;
+#endif
+
+	for (i = 0; i < NETLINK_BATCH_SIZE; i++) {
+		iovs[i].iov_base = buffers[i];
+		iovs[i].iov_len = NETLINK_MESSAGE_SIZE;
+	}
+
+	n = -1;
+#if defined(MSG_WAITFORONE)
+	if (have_recvmmsg) {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < NETLINK_BATCH_SIZE; i++) {
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		}
+		n = recvmmsg(linux_netlink_socket, msgs, NETLINK_BATCH_SIZE,
+			     MSG_DONTWAIT, NULL);
+		if (n < 0 && errno == ENOSYS)
+			have_recvmmsg = 0;
+		for (i = 0; i < n; i++)
+			lens[i] = msgs[i].msg_len;
+	}
+	if (!have_recvmmsg)
+#endif
+	{
+		struct msghdr meh = { .msg_iov=&iovs[0], .msg_iovlen=1,
+				     .msg_name=&addrs[0], .msg_namelen=sizeof(addrs[0]) };
+		ssize_t len = recvmsg(linux_netlink_socket, &meh, MSG_DONTWAIT);
+
+		n = len < 0 ? -1 : 1;
+		lens[0] = len;
+	}
+
+	/* errno only means something if the call failed */
+	if (n <= 0) {
+		if (n < 0 && errno != EAGAIN)
+			usbi_dbg("error recieving message from netlink");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		buffers[i][lens[i]] = '\0';
+		linux_netlink_handle_message(buffers[i], lens[i]);
+	}
+
+	return n;
 }
 
 static void *linux_netlink_event_thread_main(void *arg)
@@ -235,7 +321,7 @@ static void *linux_netlink_event_thread_main(void *arg)
 		}
 
 		usbi_mutex_static_lock(&linux_hotplug_lock);
-		linux_netlink_read_message();
+		linux_netlink_read_messages();
 		usbi_mutex_static_unlock(&linux_hotplug_lock);
 	}
 
@@ -248,7 +334,7 @@ void linux_netlink_hotplug_poll(void)
 
 	usbi_mutex_static_lock(&linux_hotplug_lock);
 	do {
-		r = linux_netlink_read_message();
-	} while (r == 0);
+		r = linux_netlink_read_messages();
+	} while (r > 0);
 	usbi_mutex_static_unlock(&linux_hotplug_lock);
 }
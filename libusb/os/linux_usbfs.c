@@ -27,12 +27,15 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <unistd.h>
@@ -133,13 +136,33 @@ static int detach_kernel_driver_and_claim(struct libusb_device_handle *, int);
 static int linux_default_scan_devices (struct libusb_context *ctx);
 #endif
 
-struct linux_device_priv {
+/* what is known about a device whatever the context. the devices that are
+ * related to sysfs share it between contexts, through device_registry, so
+ * that the descriptors are read and stored once per process. immutable once
+ * published there; refcnt and list are protected by device_registry_lock */
+struct linux_device_data {
+	struct list_head list;
+	int refcnt;
+	uint8_t busnum;
+	uint8_t devaddr;
+	enum libusb_speed speed;
 	char *sysfs_dir;
 	unsigned char *descriptors;
 	int descriptors_len;
+};
+
+struct linux_device_priv {
+	struct linux_device_data *data;
 	int active_config; /* cache val for !sysfs_can_relate_devices  */
 };
 
+/* the published linux_device_data of the attached devices, hashed by
+ * session ID. entries are unlinked once their device is disconnected, and
+ * freed with their last user */
+static struct list_head device_registry[USBI_DEVICE_HASH_SIZE];
+static int device_registry_init = 0;
+static usbi_mutex_static_t device_registry_lock = USBI_MUTEX_INITIALIZER;
+
 struct linux_device_handle_priv {
 	int fd;
 	uint32_t caps;
@@ -170,10 +193,31 @@ struct linux_transfer_priv {
 	enum reap_action reap_action;
 	int num_urbs;
 	int num_retired;
+
+	/* bulk URBs handed to the kernel so far. split transfers keep at most
+	 * bulk_window URBs in flight and submit the others as earlier ones
+	 * retire. once a transfer ends abnormally, num_urbs is cut back to
+	 * num_submitted since the URBs never submitted won't be reaped */
+	int num_submitted;
+	int bulk_window;
 	enum libusb_transfer_status reap_status;
 
 	/* next iso packet in user-supplied transfer to be populated */
 	int iso_packet_offset;
+
+	/* storage backing urbs/iso_urbs. it is kept across submissions and
+	 * only released when the transfer itself is freed, so that resubmitting
+	 * a transfer does not have to go through the heap */
+	void *urb_mem;
+	size_t urb_mem_size;
+
+	/* LIBUSB_TRANSFER_AUTO_RESUBMIT transfers alternate between the user's
+	 * buffer and a spare one, so that the URB can be resubmitted before
+	 * the callback is done with the data that came in. the spare buffer
+	 * is kept like urb_mem */
+	unsigned char *user_buffer;
+	unsigned char *spare_buffer;
+	int spare_buffer_size;
 };
 
 static int _get_usbfs_fd(struct libusb_device *dev, mode_t mode, int silent)
@@ -182,6 +226,9 @@ static int _get_usbfs_fd(struct libusb_device *dev, mode_t mode, int silent)
 	char path[PATH_MAX];
 	int fd;
 
+	if (!usbfs_path)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
 	if (usbdev_names)
 		snprintf(path, PATH_MAX, "%s/usbdev%d.%d",
 			usbfs_path, dev->bus_number, dev->device_address);
@@ -213,6 +260,107 @@ static struct linux_device_priv *_device_priv(struct libusb_device *dev)
 	return (struct linux_device_priv *) dev->os_priv;
 }
 
+/* devices created by op_device_from_fd() have no sysfs directory, their
+ * descriptors come from usbfs whatever sysfs supports */
+static int device_has_sysfs_descriptors(struct libusb_device *dev)
+{
+	return sysfs_has_descriptors && _device_priv(dev)->data->sysfs_dir;
+}
+
+static int device_can_relate_sysfs(struct libusb_device *dev)
+{
+	return sysfs_can_relate_devices && _device_priv(dev)->data->sysfs_dir;
+}
+
+/* find the published data of the device at busnum/devaddr whose sysfs
+ * directory is sysfs_dir, and take a reference to it */
+static struct linux_device_data *get_device_data(uint8_t busnum,
+	uint8_t devaddr, const char *sysfs_dir)
+{
+	unsigned long session_id = busnum << 8 | devaddr;
+	struct linux_device_data *data;
+	struct linux_device_data *ret = NULL;
+
+	usbi_mutex_static_lock(&device_registry_lock);
+	if (device_registry_init) {
+		list_for_each_entry(data,
+				&device_registry[USBI_DEVICE_HASH(session_id)],
+				list, struct linux_device_data) {
+			if (data->busnum == busnum && data->devaddr == devaddr
+					&& !strcmp(data->sysfs_dir, sysfs_dir)) {
+				data->refcnt++;
+				ret = data;
+				break;
+			}
+		}
+	}
+	usbi_mutex_static_unlock(&device_registry_lock);
+	return ret;
+}
+
+/* make the data of a newly initialized device available to the other
+ * contexts, unless another one got there first */
+static void publish_device_data(struct linux_device_data *data)
+{
+	unsigned long session_id = data->busnum << 8 | data->devaddr;
+	struct linux_device_data *it;
+	int i;
+
+	usbi_mutex_static_lock(&device_registry_lock);
+	if (!device_registry_init) {
+		for (i = 0; i < USBI_DEVICE_HASH_SIZE; i++)
+			list_init(&device_registry[i]);
+		device_registry_init = 1;
+	}
+	list_for_each_entry(it, &device_registry[USBI_DEVICE_HASH(session_id)],
+			list, struct linux_device_data) {
+		if (it->busnum == data->busnum && it->devaddr == data->devaddr
+				&& !strcmp(it->sysfs_dir, data->sysfs_dir))
+			goto out;
+	}
+	list_add(&data->list, &device_registry[USBI_DEVICE_HASH(session_id)]);
+out:
+	usbi_mutex_static_unlock(&device_registry_lock);
+}
+
+/* the device at busnum/devaddr is gone, a new device may reuse its
+ * address */
+static void unpublish_device_data(uint8_t busnum, uint8_t devaddr)
+{
+	unsigned long session_id = busnum << 8 | devaddr;
+	struct linux_device_data *data, *tmp;
+
+	usbi_mutex_static_lock(&device_registry_lock);
+	if (device_registry_init) {
+		list_for_each_entry_safe(data, tmp,
+				&device_registry[USBI_DEVICE_HASH(session_id)],
+				list, struct linux_device_data) {
+			if (data->busnum == busnum && data->devaddr == devaddr) {
+				list_del(&data->list);
+				list_init(&data->list);
+			}
+		}
+	}
+	usbi_mutex_static_unlock(&device_registry_lock);
+}
+
+static void unref_device_data(struct linux_device_data *data)
+{
+	int refcnt;
+
+	usbi_mutex_static_lock(&device_registry_lock);
+	refcnt = --data->refcnt;
+	if (!refcnt)
+		list_del(&data->list);
+	usbi_mutex_static_unlock(&device_registry_lock);
+
+	if (refcnt)
+		return;
+	free(data->descriptors);
+	free(data->sysfs_dir);
+	free(data);
+}
+
 static struct linux_device_handle_priv *_device_handle_priv(
 	struct libusb_device_handle *handle)
 {
@@ -317,6 +465,14 @@ static clockid_t find_monotonic_clock(void)
 	return CLOCK_REALTIME;
 }
 
+/* contexts created with LIBUSB_INIT_LAZY need the clock before op_init() */
+static clockid_t get_monotonic_clkid(void)
+{
+	if (monotonic_clkid == -1)
+		monotonic_clkid = find_monotonic_clock();
+	return monotonic_clkid;
+}
+
 static int kernel_version_ge(int major, int minor, int sublevel)
 {
 	struct utsname uts;
@@ -348,19 +504,30 @@ static int kernel_version_ge(int major, int minor, int sublevel)
 	return ksublevel >= sublevel;
 }
 
-static int op_init(struct libusb_context *ctx)
+/* the kernel does not change under a running process, so it is only probed
+ * by the first op_init(). called with linux_hotplug_lock held */
+static int probe_kernel(struct libusb_context *ctx)
 {
+	static int probed = 0;
 	struct stat statbuf;
 	int r;
 
-	usbfs_path = find_usbfs_path();
+	if (!usbfs_path)
+		usbfs_path = find_usbfs_path();
 	if (!usbfs_path) {
-		usbi_err(ctx, "could not find usbfs");
-		return LIBUSB_ERROR_OTHER;
+		/* a context without devices of its own only deals with the
+		 * ones passed in by file descriptor, it can do without */
+		if (!(ctx->scoped && ctx->scope.no_scan)) {
+			usbi_err(ctx, "could not find usbfs");
+			return LIBUSB_ERROR_OTHER;
+		}
+		usbi_dbg("could not find usbfs");
 	}
 
-	if (monotonic_clkid == -1)
-		monotonic_clkid = find_monotonic_clock();
+	if (probed)
+		return LIBUSB_SUCCESS;
+
+	get_monotonic_clkid();
 
 	if (supports_flag_bulk_continuation == -1) {
 		/* bulk continuation URB flag available from Linux 2.6.32 */
@@ -419,14 +586,28 @@ static int op_init(struct libusb_context *ctx)
 	if (sysfs_has_descriptors)
 		usbi_dbg("sysfs has complete descriptors");
 
+	probed = 1;
+	return LIBUSB_SUCCESS;
+}
+
+static int op_init(struct libusb_context *ctx)
+{
+	int r;
+
 	usbi_mutex_static_lock(&linux_hotplug_lock);
-	r = LIBUSB_SUCCESS;
+	r = probe_kernel(ctx);
+	if (r != LIBUSB_SUCCESS) {
+		usbi_mutex_static_unlock(&linux_hotplug_lock);
+		return r;
+	}
+
 	if (init_count == 0) {
 		/* start up hotplug event handler */
 		r = linux_start_event_monitor();
 	}
 	if (r == LIBUSB_SUCCESS) {
-		r = linux_scan_devices(ctx);
+		if (!(ctx->scoped && ctx->scope.no_scan))
+			r = linux_scan_devices(ctx);
 		if (r == LIBUSB_SUCCESS)
 			init_count++;
 		else if (init_count == 0)
@@ -492,7 +673,7 @@ static int _open_sysfs_attr(struct libusb_device *dev, const char *attr)
 	int fd;
 
 	snprintf(filename, PATH_MAX, "%s/%s/%s",
-		SYSFS_DEVICE_PATH, priv->sysfs_dir, attr);
+		SYSFS_DEVICE_PATH, priv->data->sysfs_dir, attr);
 	fd = open(filename, O_RDONLY);
 	if (fd < 0) {
 		usbi_err(DEVICE_CTX(dev),
@@ -503,39 +684,85 @@ static int _open_sysfs_attr(struct libusb_device *dev, const char *attr)
 	return fd;
 }
 
-/* Note only suitable for attributes which always read >= 0, < 0 is error */
-static int __read_sysfs_attr(struct libusb_context *ctx,
-	const char *devname, const char *attr)
+/* open the sysfs directory of a device. if devices_fd is a descriptor of
+ * SYSFS_DEVICE_PATH, the directory is looked up relative to it, which saves
+ * the kernel from walking the whole path again for every device */
+static int sysfs_open_device_dir(struct libusb_context *ctx, int devices_fd,
+	const char *devname)
 {
-	char filename[PATH_MAX];
-	FILE *f;
-	int r, value;
+	char dirname[PATH_MAX];
+	int fd;
 
-	snprintf(filename, PATH_MAX, "%s/%s/%s", SYSFS_DEVICE_PATH,
-		 devname, attr);
-	f = fopen(filename, "r");
-	if (f == NULL) {
+	if (devices_fd >= 0) {
+		fd = openat(devices_fd, devname, O_RDONLY | O_DIRECTORY);
+	} else {
+		snprintf(dirname, PATH_MAX, "%s/%s", SYSFS_DEVICE_PATH, devname);
+		fd = open(dirname, O_RDONLY | O_DIRECTORY);
+	}
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return LIBUSB_ERROR_NO_DEVICE;
+		usbi_err(ctx, "open %s failed errno=%d", devname, errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	return fd;
+}
+
+/* read an attribute from an open sysfs device directory, with a single
+ * open/read/close and no stdio buffering.
+ * Note only suitable for attributes which always read >= 0, < 0 is error */
+static int read_sysfs_attr_at(struct libusb_context *ctx, int dir_fd,
+	const char *attr)
+{
+	char tmp[24];
+	char *endptr;
+	long value;
+	ssize_t r;
+	int fd;
+
+	fd = openat(dir_fd, attr, O_RDONLY);
+	if (fd < 0) {
 		if (errno == ENOENT) {
 			/* File doesn't exist. Assume the device has been
 			   disconnected (see trac ticket #70). */
 			return LIBUSB_ERROR_NO_DEVICE;
 		}
-		usbi_err(ctx, "open %s failed errno=%d", filename, errno);
+		usbi_err(ctx, "open %s failed errno=%d", attr, errno);
 		return LIBUSB_ERROR_IO;
 	}
 
-	r = fscanf(f, "%d", &value);
-	fclose(f);
-	if (r != 1) {
-		usbi_err(ctx, "fscanf %s returned %d, errno=%d", attr, r, errno);
+	r = read(fd, tmp, sizeof(tmp) - 1);
+	close(fd);
+	if (r <= 0) {
+		usbi_err(ctx, "read %s returned %d, errno=%d", attr, (int)r, errno);
 		return LIBUSB_ERROR_NO_DEVICE; /* For unplug race (trac #70) */
 	}
-	if (value < 0) {
-		usbi_err(ctx, "%s contains a negative value", filename);
+	tmp[r] = 0;
+
+	value = strtol(tmp, &endptr, 10);
+	if (endptr == tmp) {
+		usbi_err(ctx, "error converting '%s' to integer", tmp);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (value < 0 || value > INT_MAX) {
+		usbi_err(ctx, "%s contains an invalid value", attr);
 		return LIBUSB_ERROR_IO;
 	}
 
-	return value;
+	return (int)value;
+}
+
+/* Note only suitable for attributes which always read >= 0, < 0 is error */
+static int __read_sysfs_attr(struct libusb_context *ctx,
+	const char *devname, const char *attr)
+{
+	char filename[PATH_MAX];
+
+	snprintf(filename, PATH_MAX, "%s/%s/%s", SYSFS_DEVICE_PATH,
+		 devname, attr);
+	/* an absolute path makes openat() ignore the directory */
+	return read_sysfs_attr_at(ctx, AT_FDCWD, filename);
 }
 
 static int op_get_device_descriptor(struct libusb_device *dev,
@@ -543,8 +770,8 @@ static int op_get_device_descriptor(struct libusb_device *dev,
 {
 	struct linux_device_priv *priv = _device_priv(dev);
 
-	*host_endian = sysfs_has_descriptors ? 0 : 1;
-	memcpy(buffer, priv->descriptors, DEVICE_DESC_LENGTH);
+	*host_endian = device_has_sysfs_descriptors(dev) ? 0 : 1;
+	memcpy(buffer, priv->data->descriptors, DEVICE_DESC_LENGTH);
 
 	return 0;
 }
@@ -656,9 +883,10 @@ static int seek_to_next_descriptor(struct libusb_context *ctx,
 }
 
 /* Return offset to next config */
-static int seek_to_next_config(struct libusb_context *ctx,
+static int seek_to_next_config(struct libusb_device *dev,
 	unsigned char *buffer, int size)
 {
+	struct libusb_context *ctx = DEVICE_CTX(dev);
 	struct libusb_config_descriptor config;
 
 	if (size == 0)
@@ -685,7 +913,7 @@ static int seek_to_next_config(struct libusb_context *ctx,
 	 * config descriptor with verified bLength fields, with descriptors
 	 * with an invalid bLength removed.
 	 */
-	if (sysfs_has_descriptors) {
+	if (device_has_sysfs_descriptors(dev)) {
 		int next = seek_to_next_descriptor(ctx, LIBUSB_DT_CONFIG,
 						   buffer, size);
 		if (next == LIBUSB_ERROR_NOT_FOUND)
@@ -714,10 +942,9 @@ static int seek_to_next_config(struct libusb_context *ctx,
 static int op_get_config_descriptor_by_value(struct libusb_device *dev,
 	uint8_t value, unsigned char **buffer, int *host_endian)
 {
-	struct libusb_context *ctx = DEVICE_CTX(dev);
 	struct linux_device_priv *priv = _device_priv(dev);
-	unsigned char *descriptors = priv->descriptors;
-	int size = priv->descriptors_len;
+	unsigned char *descriptors = priv->data->descriptors;
+	int size = priv->data->descriptors_len;
 	struct libusb_config_descriptor *config;
 
 	*buffer = NULL;
@@ -730,7 +957,7 @@ static int op_get_config_descriptor_by_value(struct libusb_device *dev,
 
 	/* Seek till the config is found, or till "EOF" */
 	while (1) {
-		int next = seek_to_next_config(ctx, descriptors, size);
+		int next = seek_to_next_config(dev, descriptors, size);
 		if (next < 0)
 			return next;
 		config = (struct libusb_config_descriptor *)descriptors;
@@ -749,7 +976,7 @@ static int op_get_active_config_descriptor(struct libusb_device *dev,
 	int r, config;
 	unsigned char *config_desc;
 
-	if (sysfs_can_relate_devices) {
+	if (device_can_relate_sysfs(dev)) {
 		r = sysfs_get_active_config(dev, &config);
 		if (r < 0)
 			return r;
@@ -775,8 +1002,8 @@ static int op_get_config_descriptor(struct libusb_device *dev,
 	uint8_t config_index, unsigned char *buffer, size_t len, int *host_endian)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
-	unsigned char *descriptors = priv->descriptors;
-	int i, r, size = priv->descriptors_len;
+	unsigned char *descriptors = priv->data->descriptors;
+	int i, r, size = priv->data->descriptors_len;
 
 	/* Unlike the device desc. config descs. are always in raw format */
 	*host_endian = 0;
@@ -787,7 +1014,7 @@ static int op_get_config_descriptor(struct libusb_device *dev,
 
 	/* Seek till the config is found, or till "EOF" */
 	for (i = 0; ; i++) {
-		r = seek_to_next_config(DEVICE_CTX(dev), descriptors, size);
+		r = seek_to_next_config(dev, descriptors, size);
 		if (r < 0)
 			return r;
 		if (i == config_index)
@@ -831,11 +1058,15 @@ static int usbfs_get_active_config(struct libusb_device *dev, int fd)
 	return active_config;
 }
 
+/* sysfs_fd is either -1 or an open descriptor of the sysfs directory of the
+ * device. usbfs_fd is either -1 or an open usbfs descriptor of the device,
+ * which is then used instead of opening one */
 static int initialize_device(struct libusb_device *dev, uint8_t busnum,
-	uint8_t devaddr, const char *sysfs_dir)
+	uint8_t devaddr, const char *sysfs_dir, int sysfs_fd, int usbfs_fd)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
 	struct libusb_context *ctx = DEVICE_CTX(dev);
+	struct linux_device_data *data;
 	int descriptors_size = 512; /* Begin with a 1024 byte alloc */
 	int fd, speed;
 	ssize_t r;
@@ -843,15 +1074,24 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 	dev->bus_number = busnum;
 	dev->device_address = devaddr;
 
+	data = calloc(1, sizeof(*data));
+	if (!data)
+		return LIBUSB_ERROR_NO_MEM;
+	list_init(&data->list);
+	data->refcnt = 1;
+	data->busnum = busnum;
+	data->devaddr = devaddr;
+	priv->data = data;
+
 	if (sysfs_dir) {
-		priv->sysfs_dir = malloc(strlen(sysfs_dir) + 1);
-		if (!priv->sysfs_dir)
+		data->sysfs_dir = malloc(strlen(sysfs_dir) + 1);
+		if (!data->sysfs_dir)
 			return LIBUSB_ERROR_NO_MEM;
-		strcpy(priv->sysfs_dir, sysfs_dir);
+		strcpy(data->sysfs_dir, sysfs_dir);
 
-		/* Note speed can contain 1.5, in this case __read_sysfs_attr
+		/* Note speed can contain 1.5, in this case read_sysfs_attr_at
 		   will stop parsing at the '.' and return 1 */
-		speed = __read_sysfs_attr(DEVICE_CTX(dev), sysfs_dir, "speed");
+		speed = read_sysfs_attr_at(DEVICE_CTX(dev), sysfs_fd, "speed");
 		if (speed >= 0) {
 			switch (speed) {
 			case     1: dev->speed = LIBUSB_SPEED_LOW; break;
@@ -865,60 +1105,79 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 	}
 
 	/* cache descriptors in memory */
-	if (sysfs_has_descriptors)
+	if (device_has_sysfs_descriptors(dev) && sysfs_fd >= 0) {
+		fd = openat(sysfs_fd, "descriptors", O_RDONLY);
+		if (fd < 0) {
+			usbi_err(ctx, "open %s/descriptors failed errno=%d",
+				 sysfs_dir, errno);
+			return LIBUSB_ERROR_IO;
+		}
+	} else if (device_has_sysfs_descriptors(dev)) {
 		fd = _open_sysfs_attr(dev, "descriptors");
-	else
+	} else if (usbfs_fd >= 0) {
+		fd = usbfs_fd;
+		if (lseek(fd, 0, SEEK_SET) < 0) {
+			usbi_err(ctx, "seek on usbfs fd failed errno=%d", errno);
+			return LIBUSB_ERROR_IO;
+		}
+	} else
 		fd = _get_usbfs_fd(dev, O_RDONLY, 0);
 	if (fd < 0)
 		return fd;
 
 	do {
 		descriptors_size *= 2;
-		priv->descriptors = usbi_reallocf(priv->descriptors,
+		data->descriptors = usbi_reallocf(data->descriptors,
 						  descriptors_size);
-		if (!priv->descriptors) {
-			close(fd);
+		if (!data->descriptors) {
+			if (fd != usbfs_fd)
+				close(fd);
 			return LIBUSB_ERROR_NO_MEM;
 		}
 		/* usbfs has holes in the file */
-		if (!sysfs_has_descriptors) {
-			memset(priv->descriptors + priv->descriptors_len,
-			       0, descriptors_size - priv->descriptors_len);
+		if (!device_has_sysfs_descriptors(dev)) {
+			memset(data->descriptors + data->descriptors_len,
+			       0, descriptors_size - data->descriptors_len);
 		}
-		r = read(fd, priv->descriptors + priv->descriptors_len,
-			 descriptors_size - priv->descriptors_len);
+		r = read(fd, data->descriptors + data->descriptors_len,
+			 descriptors_size - data->descriptors_len);
 		if (r < 0) {
 			usbi_err(ctx, "read descriptor failed ret=%d errno=%d",
 				 fd, errno);
-			close(fd);
+			if (fd != usbfs_fd)
+				close(fd);
 			return LIBUSB_ERROR_IO;
 		}
-		priv->descriptors_len += r;
-	} while (priv->descriptors_len == descriptors_size);
+		data->descriptors_len += r;
+	} while (data->descriptors_len == descriptors_size);
 	
-	close(fd);
+	if (fd != usbfs_fd)
+		close(fd);
 
-	if (priv->descriptors_len < DEVICE_DESC_LENGTH) {
+	if (data->descriptors_len < DEVICE_DESC_LENGTH) {
 		usbi_err(ctx, "short descriptor read (%d)",
-			 priv->descriptors_len);
+			 data->descriptors_len);
 		return LIBUSB_ERROR_IO;
 	}
 
-	if (sysfs_can_relate_devices)
+	if (device_can_relate_sysfs(dev))
 		return LIBUSB_SUCCESS;
 
 	/* cache active config */
-	fd = _get_usbfs_fd(dev, O_RDWR, 1);
+	if (usbfs_fd >= 0)
+		fd = usbfs_fd;
+	else
+		fd = _get_usbfs_fd(dev, O_RDWR, 1);
 	if (fd < 0) {
 		/* cannot send a control message to determine the active
 		 * config. just assume the first one is active. */
 		usbi_warn(ctx, "Missing rw usbfs access; cannot determine "
 			       "active configuration descriptor");
-		if (priv->descriptors_len >=
+		if (data->descriptors_len >=
 				(DEVICE_DESC_LENGTH + LIBUSB_DT_CONFIG_SIZE)) {
 			struct libusb_config_descriptor config;
 			usbi_parse_descriptor(
-				priv->descriptors + DEVICE_DESC_LENGTH,
+				data->descriptors + DEVICE_DESC_LENGTH,
 				"bbwbbbbb", &config, 0);
 			priv->active_config = config.bConfigurationValue;
 		} else
@@ -949,7 +1208,8 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 		r = LIBUSB_SUCCESS;
 	} /* else r < 0, just return the error code */
 
-	close(fd);
+	if (fd != usbfs_fd)
+		close(fd);
 	return r;
 }
 
@@ -993,7 +1253,8 @@ retry:
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_for_each_entry(it, &ctx->usb_devs, list, struct libusb_device) {
 		struct linux_device_priv *priv = _device_priv(it);
-		if (0 == strcmp (priv->sysfs_dir, parent_sysfs_dir)) {
+		if (priv->data->sysfs_dir
+				&& 0 == strcmp (priv->data->sysfs_dir, parent_sysfs_dir)) {
 			dev->parent_dev = libusb_ref_device(it);
 			break;
 		}
@@ -1016,8 +1277,38 @@ retry:
 	return LIBUSB_SUCCESS;
 }
 
-int linux_enumerate_device(struct libusb_context *ctx,
-	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir)
+/* check the location of a device against the scope of a context before
+ * enumerating it. the port path is taken from the sysfs name, which is
+ * "usbB" for the root hub of bus B and "B-P.P.P" for the devices on it */
+static int location_in_scope(struct libusb_context *ctx, uint8_t busnum,
+	const char *sysfs_dir)
+{
+	uint8_t port_numbers[USBI_MAX_PORT_DEPTH];
+	int num_port_numbers = 0;
+	const char *p;
+	char *end;
+
+	if (!ctx->scoped)
+		return 1;
+
+	p = sysfs_dir ? strchr(sysfs_dir, '-') : NULL;
+	while (p && num_port_numbers < USBI_MAX_PORT_DEPTH) {
+		long port = strtol(p + 1, &end, 10);
+
+		if (end == p + 1 || port <= 0 || port > 255)
+			break;
+		port_numbers[num_port_numbers++] = (uint8_t)port;
+		p = *end == '.' ? end : NULL;
+	}
+
+	return usbi_scope_match_location(ctx, busnum, port_numbers,
+		num_port_numbers);
+}
+
+/* enumerate a device. sysfs_fd is either -1 or an open descriptor of the
+ * sysfs directory of the device, which is then used to read its attributes */
+static int enumerate_device(struct libusb_context *ctx, uint8_t busnum,
+	uint8_t devaddr, const char *sysfs_dir, int sysfs_fd)
 {
 	unsigned long session_id;
 	struct libusb_device *dev;
@@ -1036,15 +1327,52 @@ int linux_enumerate_device(struct libusb_context *ctx,
 		return LIBUSB_SUCCESS;
 	}
 
+	if (!location_in_scope(ctx, busnum, sysfs_dir)) {
+		usbi_dbg("%d/%d is outside of the context's scope", busnum, devaddr);
+		return LIBUSB_SUCCESS;
+	}
+
 	usbi_dbg("allocating new device for %d/%d (session %ld)",
 		 busnum, devaddr, session_id);
 	dev = usbi_alloc_device(ctx, session_id);
 	if (!dev)
 		return LIBUSB_ERROR_NO_MEM;
 
-	r = initialize_device(dev, busnum, devaddr, sysfs_dir);
+	if (sysfs_dir && sysfs_can_relate_devices) {
+		/* another context may have read it already */
+		struct linux_device_data *data = get_device_data(busnum,
+			devaddr, sysfs_dir);
+		if (data) {
+			usbi_dbg("sharing the data of %d/%d", busnum, devaddr);
+			_device_priv(dev)->data = data;
+			dev->bus_number = busnum;
+			dev->device_address = devaddr;
+			dev->speed = data->speed;
+			goto initialized;
+		}
+	}
+
+	if (sysfs_dir && sysfs_fd < 0) {
+		sysfs_fd = sysfs_open_device_dir(ctx, -1, sysfs_dir);
+		if (sysfs_fd < 0) {
+			r = sysfs_fd;
+			goto out;
+		}
+		r = initialize_device(dev, busnum, devaddr, sysfs_dir, sysfs_fd,
+				      -1);
+		close(sysfs_fd);
+	} else {
+		r = initialize_device(dev, busnum, devaddr, sysfs_dir, sysfs_fd,
+				      -1);
+	}
 	if (r < 0)
 		goto out;
+	if (device_can_relate_sysfs(dev)) {
+		_device_priv(dev)->data->speed = dev->speed;
+		publish_device_data(_device_priv(dev)->data);
+	}
+
+initialized:
 	r = usbi_sanitize_device(dev);
 	if (r < 0)
 		goto out;
@@ -1052,6 +1380,12 @@ int linux_enumerate_device(struct libusb_context *ctx,
 	r = linux_get_parent_info(dev, sysfs_dir);
 	if (r < 0)
 		goto out;
+
+	if (!usbi_scope_match_device(dev)) {
+		usbi_dbg("%d/%d is outside of the context's scope", busnum, devaddr);
+		libusb_unref_device(dev);
+		return LIBUSB_SUCCESS;
+	}
 out:
 	if (r < 0)
 		libusb_unref_device(dev);
@@ -1061,6 +1395,88 @@ out:
 	return r;
 }
 
+int linux_enumerate_device(struct libusb_context *ctx,
+	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir)
+{
+	return enumerate_device(ctx, busnum, devaddr, sysfs_dir, -1);
+}
+
+/* usbfs device nodes are numbered (busnum - 1) * 128 + (devaddr - 1) */
+#define USB_DEVICE_MAJOR	189
+
+static int op_device_from_fd(struct libusb_context *ctx, int fd,
+	struct libusb_device **device)
+{
+	struct usbfs_connectinfo ci;
+	unsigned long session_id;
+	struct libusb_device *dev;
+	struct stat statbuf;
+	uint8_t busnum, devaddr;
+	int r;
+
+	if (fstat(fd, &statbuf) < 0) {
+		usbi_err(ctx, "fstat failed errno=%d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+	if (!S_ISCHR(statbuf.st_mode)
+			|| major(statbuf.st_rdev) != USB_DEVICE_MAJOR) {
+		usbi_dbg("fd %d is not a usbfs device node", fd);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	r = ioctl(fd, IOCTL_USBFS_CONNECTINFO, &ci);
+	if (r < 0) {
+		if (errno == ENODEV)
+			return LIBUSB_ERROR_NO_DEVICE;
+		usbi_err(ctx, "connectinfo failed (%d)", errno);
+		return LIBUSB_ERROR_IO;
+	}
+	busnum = minor(statbuf.st_rdev) / 128 + 1;
+	devaddr = ci.devnum;
+
+	session_id = busnum << 8 | devaddr;
+	usbi_dbg("fd %d is busnum %d devaddr %d session_id %ld", fd,
+		busnum, devaddr, session_id);
+
+	dev = usbi_get_device_by_session_id(ctx, session_id);
+	if (dev) {
+		*device = libusb_ref_device(dev);
+		return LIBUSB_SUCCESS;
+	}
+
+	dev = usbi_alloc_device(ctx, session_id);
+	if (!dev)
+		return LIBUSB_ERROR_NO_MEM;
+
+	r = initialize_device(dev, busnum, devaddr, NULL, -1, fd);
+	if (r < 0)
+		goto err;
+
+	/* newer kernels tell the speed, older ones only whether it is low */
+	switch (ioctl(fd, IOCTL_USBFS_GET_SPEED)) {
+	case 1: dev->speed = LIBUSB_SPEED_LOW; break;
+	case 2: dev->speed = LIBUSB_SPEED_FULL; break;
+	case 3: dev->speed = LIBUSB_SPEED_HIGH; break;
+	case 5:
+	case 6: dev->speed = LIBUSB_SPEED_SUPER; break;
+	default:
+		if (ci.slow)
+			dev->speed = LIBUSB_SPEED_LOW;
+	}
+
+	r = usbi_sanitize_device(dev);
+	if (r < 0)
+		goto err;
+
+	usbi_connect_device(dev);
+	*device = libusb_ref_device(dev);
+	return LIBUSB_SUCCESS;
+
+err:
+	libusb_unref_device(dev);
+	return r;
+}
+
 void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_name)
 {
 	struct libusb_context *ctx;
@@ -1078,6 +1494,8 @@ void linux_hotplug_disconnected(uint8_t busnum, uint8_t devaddr, const char *sys
 	struct libusb_device *dev;
 	unsigned long session_id = busnum << 8 | devaddr;
 
+	unpublish_device_data(busnum, devaddr);
+
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
 		dev = usbi_get_device_by_session_id (ctx, session_id);
@@ -1179,18 +1597,47 @@ static int usbfs_get_device_list(struct libusb_context *ctx)
 }
 #endif
 
-static int sysfs_scan_device(struct libusb_context *ctx, const char *devname)
+/* scan a device found in sysfs. devices_fd is either -1 or an open
+ * descriptor of SYSFS_DEVICE_PATH. the device directory is opened once, and
+ * all attributes are then read relative to it */
+static int sysfs_scan_device_at(struct libusb_context *ctx, int devices_fd,
+	const char *devname)
 {
-	uint8_t busnum, devaddr;
-	int ret;
+	int busnum, devaddr;
+	int fd, r;
+
+	fd = sysfs_open_device_dir(ctx, devices_fd, devname);
+	if (fd < 0)
+		return fd;
 
-	ret = linux_get_device_address (ctx, 0, &busnum, &devaddr, NULL, devname);
-	if (LIBUSB_SUCCESS != ret) {
-		return ret;
+	usbi_dbg("scan %s", devname);
+
+	busnum = read_sysfs_attr_at(ctx, fd, "busnum");
+	if (busnum < 0) {
+		r = busnum;
+		goto out;
+	}
+	devaddr = read_sysfs_attr_at(ctx, fd, "devnum");
+	if (devaddr < 0) {
+		r = devaddr;
+		goto out;
 	}
+	usbi_dbg("bus=%d dev=%d", busnum, devaddr);
+	if (busnum > 255 || devaddr > 255) {
+		r = LIBUSB_ERROR_INVALID_PARAM;
+		goto out;
+	}
+
+	r = enumerate_device(ctx, (uint8_t) busnum, (uint8_t) devaddr,
+		devname, fd);
+out:
+	close(fd);
+	return r;
+}
 
-	return linux_enumerate_device(ctx, busnum & 0xff, devaddr & 0xff,
-		devname);
+static int sysfs_scan_device(struct libusb_context *ctx, const char *devname)
+{
+	return sysfs_scan_device_at(ctx, -1, devname);
 }
 
 #if !defined(USE_UDEV)
@@ -1210,7 +1657,7 @@ static int sysfs_get_device_list(struct libusb_context *ctx)
 				|| strchr(entry->d_name, ':'))
 			continue;
 
-		if (sysfs_scan_device(ctx, entry->d_name)) {
+		if (sysfs_scan_device_at(ctx, dirfd(devices), entry->d_name)) {
 			usbi_dbg("failed to enumerate dir entry %s", entry->d_name);
 			continue;
 		}
@@ -1241,14 +1688,12 @@ static int linux_default_scan_devices (struct libusb_context *ctx)
 }
 #endif
 
-static int op_open(struct libusb_device_handle *handle)
+static int initialize_handle(struct libusb_device_handle *handle, int fd)
 {
 	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
 	int r;
 
-	hpriv->fd = _get_usbfs_fd(handle->dev, O_RDWR, 0);
-	if (hpriv->fd < 0)
-		return hpriv->fd;
+	hpriv->fd = fd;
 
 	r = ioctl(hpriv->fd, IOCTL_USBFS_GET_CAPABILITIES, &hpriv->caps);
 	if (r < 0) {
@@ -1263,7 +1708,26 @@ static int op_open(struct libusb_device_handle *handle)
 			hpriv->caps |= USBFS_CAP_BULK_CONTINUATION;
 	}
 
-	return usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	return usbi_add_handle_pollfd(handle, hpriv->fd, POLLOUT);
+}
+
+static int op_open(struct libusb_device_handle *handle)
+{
+	int fd, r;
+
+	fd = _get_usbfs_fd(handle->dev, O_RDWR, 0);
+	if (fd < 0)
+		return fd;
+
+	r = initialize_handle(handle, fd);
+	if (r < 0)
+		close(fd);
+	return r;
+}
+
+static int op_open_fd(struct libusb_device_handle *handle, int fd)
+{
+	return initialize_handle(handle, fd);
 }
 
 static void op_close(struct libusb_device_handle *dev_handle)
@@ -1278,7 +1742,7 @@ static int op_get_configuration(struct libusb_device_handle *handle,
 {
 	int r;
 
-	if (sysfs_can_relate_devices) {
+	if (device_can_relate_sysfs(handle->dev)) {
 		r = sysfs_get_active_config(handle->dev, config);
 	} else {
 		r = usbfs_get_active_config(handle->dev,
@@ -1449,23 +1913,151 @@ out:
 	return ret;
 }
 
-static int op_kernel_driver_active(struct libusb_device_handle *handle,
-	int interface)
+static int do_streams_ioctl(struct libusb_device_handle *handle, long req,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints)
 {
-	int fd = _device_handle_priv(handle)->fd;
-	struct usbfs_getdriver getdrv;
-	int r;
+	int r, fd = _device_handle_priv(handle)->fd;
+	struct usbfs_streams *streams;
 
-	getdrv.interface = interface;
-	r = ioctl(fd, IOCTL_USBFS_GETDRIVER, &getdrv);
-	if (r) {
-		if (errno == ENODATA)
-			return 0;
+	if (num_endpoints > 30) /* Max 15 in + 15 out eps */
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	streams = malloc(sizeof(struct usbfs_streams) + num_endpoints);
+	if (!streams)
+		return LIBUSB_ERROR_NO_MEM;
+
+	streams->num_streams = num_streams;
+	streams->num_eps = num_endpoints;
+	memcpy(streams->eps, endpoints, num_endpoints);
+
+	r = ioctl(fd, req, streams);
+
+	free(streams);
+
+	if (r < 0) {
+		if (errno == ENOTTY)
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		else if (errno == EINVAL)
+			return LIBUSB_ERROR_INVALID_PARAM;
 		else if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
 
 		usbi_err(HANDLE_CTX(handle),
-			"get driver failed error %d errno %d", r, errno);
+			"streams-ioctl failed error %d errno %d", r, errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+	return r;
+}
+
+static int op_alloc_streams(struct libusb_device_handle *handle,
+	uint32_t num_streams, unsigned char *endpoints, int num_endpoints)
+{
+	return do_streams_ioctl(handle, IOCTL_USBFS_ALLOC_STREAMS,
+				num_streams, endpoints, num_endpoints);
+}
+
+static int op_free_streams(struct libusb_device_handle *handle,
+		unsigned char *endpoints, int num_endpoints)
+{
+	return do_streams_ioctl(handle, IOCTL_USBFS_FREE_STREAMS, 0,
+				endpoints, num_endpoints);
+}
+
+/* map the errno of a failed synchronous usbfs transfer ioctl. these are the
+ * codes that end up in urb->status for the asynchronous path */
+static int sync_transfer_error(struct libusb_device_handle *handle,
+	const char *what)
+{
+	switch (errno) {
+	case ETIMEDOUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case EPIPE:
+		return LIBUSB_ERROR_PIPE;
+	case EOVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case ENODEV:
+	case ESHUTDOWN:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case EINTR:
+		return LIBUSB_ERROR_INTERRUPTED;
+	case ENOMEM:
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	usbi_dbg("%s failed errno %d", what, errno);
+	(void)handle;
+	return LIBUSB_ERROR_IO;
+}
+
+static int op_sync_control_transfer(struct libusb_device_handle *handle,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+	uint16_t wIndex, unsigned char *data, uint16_t wLength,
+	unsigned int timeout)
+{
+	int r, fd = _device_handle_priv(handle)->fd;
+	struct usbfs_ctrltransfer ctrl;
+
+	/* usbfs refuses anything larger than a page */
+	if (wLength > MAX_CTRL_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	ctrl.bmRequestType = bmRequestType;
+	ctrl.bRequest = bRequest;
+	ctrl.wValue = wValue;
+	ctrl.wIndex = wIndex;
+	ctrl.wLength = wLength;
+	ctrl.timeout = timeout;
+	ctrl.data = data;
+
+	r = ioctl(fd, IOCTL_USBFS_CONTROL, &ctrl);
+	if (r < 0)
+		return sync_transfer_error(handle, "control ioctl");
+	return r;
+}
+
+static int op_sync_bulk_transfer(struct libusb_device_handle *handle,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *transferred, unsigned int timeout)
+{
+	int r, fd = _device_handle_priv(handle)->fd;
+	struct usbfs_bulktransfer bulk;
+
+	/* larger transfers must be split into several URBs, and older kernels
+	 * reject them here. interrupt endpoints are handled by usbfs too */
+	*transferred = 0;
+	if (length < 0 || length > MAX_BULK_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	bulk.ep = endpoint;
+	bulk.len = length;
+	bulk.timeout = timeout;
+	bulk.data = data;
+
+	/* usbfs does not report partial transfers when the request fails */
+	r = ioctl(fd, IOCTL_USBFS_BULK, &bulk);
+	if (r < 0)
+		return sync_transfer_error(handle, "bulk ioctl");
+	*transferred = r;
+	return 0;
+}
+
+static int op_kernel_driver_active(struct libusb_device_handle *handle,
+	int interface)
+{
+	int fd = _device_handle_priv(handle)->fd;
+	struct usbfs_getdriver getdrv;
+	int r;
+
+	getdrv.interface = interface;
+	r = ioctl(fd, IOCTL_USBFS_GETDRIVER, &getdrv);
+	if (r) {
+		if (errno == ENODATA)
+			return 0;
+		else if (errno == ENODEV)
+			return LIBUSB_ERROR_NO_DEVICE;
+
+		usbi_err(HANDLE_CTX(handle),
+			"get driver failed error %d errno %d", r, errno);
 		return LIBUSB_ERROR_OTHER;
 	}
 
@@ -1506,6 +2098,41 @@ static int op_detach_kernel_driver(struct libusb_device_handle *handle,
 	return 0;
 }
 
+static void *op_dev_mem_alloc(struct libusb_device_handle *handle,
+	size_t len)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	void *buffer;
+
+	/* usbfs hands out DMA-capable memory through mmap() on the device fd
+	 * since linux 4.6. URBs whose buffer lies in such a mapping are not
+	 * copied through a kernel bounce buffer */
+	if (!(hpriv->caps & USBFS_CAP_MMAP)) {
+		usbi_dbg("usbfs does not support mmap");
+		return NULL;
+	}
+
+	buffer = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		hpriv->fd, 0);
+	if (buffer == MAP_FAILED) {
+		usbi_err(HANDLE_CTX(handle),
+			"alloc dev mem failed errno %d", errno);
+		return NULL;
+	}
+	return buffer;
+}
+
+static int op_dev_mem_free(struct libusb_device_handle *handle, void *buffer,
+	size_t len)
+{
+	if (munmap(buffer, len) != 0) {
+		usbi_err(HANDLE_CTX(handle),
+			"free dev mem failed errno %d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+	return LIBUSB_SUCCESS;
+}
+
 static int op_attach_kernel_driver(struct libusb_device_handle *handle,
 	int interface)
 {
@@ -1599,10 +2226,8 @@ static int op_release_interface(struct libusb_device_handle *handle, int iface)
 static void op_destroy_device(struct libusb_device *dev)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
-	if (priv->descriptors)
-		free(priv->descriptors);
-	if (priv->sysfs_dir)
-		free(priv->sysfs_dir);
+	if (priv->data)
+		unref_device_data(priv->data);
 }
 
 /* URBs are discarded in reverse order of submission to avoid races. */
@@ -1642,18 +2267,176 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 	return ret;
 }
 
+/* return zeroed URB storage of at least size bytes, reusing the memory of
+ * earlier submissions of this transfer when it is large enough */
+static void *get_urb_mem(struct linux_transfer_priv *tpriv, size_t size)
+{
+	if (size > tpriv->urb_mem_size) {
+		void *mem = malloc(size);
+		if (!mem)
+			return NULL;
+		free(tpriv->urb_mem);
+		tpriv->urb_mem = mem;
+		tpriv->urb_mem_size = size;
+	}
+	memset(tpriv->urb_mem, 0, size);
+	return tpriv->urb_mem;
+}
+
 static void free_iso_urbs(struct linux_transfer_priv *tpriv)
 {
+	/* the URBs live in urb_mem, which is kept for the next submission */
+	tpriv->iso_urbs = NULL;
+}
+
+/* set up the double buffering of an auto-resubmitting transfer */
+static int prepare_auto_resubmit(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	if (transfer->length > tpriv->spare_buffer_size) {
+		unsigned char *buffer = malloc(transfer->length);
+		if (!buffer)
+			return LIBUSB_ERROR_NO_MEM;
+		free(tpriv->spare_buffer);
+		tpriv->spare_buffer = buffer;
+		tpriv->spare_buffer_size = transfer->length;
+	}
+	tpriv->user_buffer = transfer->buffer;
+	return 0;
+}
+
+/* point an auto-resubmitting transfer back at the user's buffer once it has
+ * stopped, moving the data of its last completion there if needed */
+static void restore_user_buffer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	if (transfer->buffer == tpriv->user_buffer)
+		return;
+	if (itransfer->transferred > 0)
+		memcpy(tpriv->user_buffer, transfer->buffer, itransfer->transferred);
+	transfer->buffer = tpriv->user_buffer;
+}
+
+/* hand an URB to usbfs, accounting for it in the context's counters */
+static int submit_urb(struct libusb_context *ctx, int fd, struct usbfs_urb *urb)
+{
+	int r = ioctl(fd, IOCTL_USBFS_SUBMITURB, urb);
+
+	usbi_trace(urb_submit,
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(urb->usercontext),
+		urb->endpoint, urb->buffer_length, r < 0 ? -errno : 0);
+	if (r == 0)
+		usbi_stats_inc(ctx, urbs_submitted);
+	return r;
+}
+
+/* submit the bulk URBs of a transfer up to (not including) last_plus_one.
+ * on failure errno is left as set by usbfs */
+static int submit_bulk_urbs(struct usbi_transfer *itransfer, int last_plus_one)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct linux_device_handle_priv *dpriv =
+		_device_handle_priv(transfer->dev_handle);
+	int r, err;
+
+	for (; tpriv->num_submitted < last_plus_one; tpriv->num_submitted++) {
+		r = submit_urb(TRANSFER_CTX(transfer), dpriv->fd,
+			&tpriv->urbs[tpriv->num_submitted]);
+		if (r == 0)
+			continue;
+
+		err = errno;
+		if (err == ENODEV) {
+			r = LIBUSB_ERROR_NO_DEVICE;
+		} else if (err == ENOMEM) {
+			r = LIBUSB_ERROR_NO_MEM;
+		} else {
+			usbi_err(TRANSFER_CTX(transfer),
+				"submiturb failed error %d errno=%d", r, err);
+			r = LIBUSB_ERROR_IO;
+		}
+		errno = err;
+		return r;
+	}
+
+	return 0;
+}
+
+/* keep the window of a split bulk transfer full */
+static int refill_bulk_window(struct usbi_transfer *itransfer)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	int last_plus_one = tpriv->num_retired + tpriv->bulk_window;
+
+	if (last_plus_one > tpriv->num_urbs)
+		last_plus_one = tpriv->num_urbs;
+
+	return submit_bulk_urbs(itransfer, last_plus_one);
+}
+
+/* lay out the URBs of a bulk transfer split in bulk_buffer_len blocks */
+static int fill_bulk_urbs(struct usbi_transfer *itransfer,
+	unsigned char urb_type, int bulk_buffer_len, int use_bulk_continuation)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct usbfs_urb *urbs;
+	int is_out = (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK)
+		== LIBUSB_ENDPOINT_OUT;
+	int num_urbs = transfer->length / bulk_buffer_len;
+	int last_urb_partial = 0;
 	int i;
-	for (i = 0; i < tpriv->num_urbs; i++) {
-		struct usbfs_urb *urb = tpriv->iso_urbs[i];
-		if (!urb)
-			break;
-		free(urb);
+
+	if (transfer->length == 0) {
+		num_urbs = 1;
+	} else if ((transfer->length % bulk_buffer_len) > 0) {
+		last_urb_partial = 1;
+		num_urbs++;
 	}
+	usbi_dbg("need %d urbs for new transfer with length %d", num_urbs,
+		transfer->length);
+	urbs = get_urb_mem(tpriv, num_urbs * sizeof(struct usbfs_urb));
+	if (!urbs)
+		return LIBUSB_ERROR_NO_MEM;
+	tpriv->urbs = urbs;
+	tpriv->num_urbs = num_urbs;
 
-	free(tpriv->iso_urbs);
-	tpriv->iso_urbs = NULL;
+	for (i = 0; i < num_urbs; i++) {
+		struct usbfs_urb *urb = &urbs[i];
+		urb->usercontext = itransfer;
+		urb->type = urb_type;
+		urb->endpoint = transfer->endpoint;
+		urb->stream_id = itransfer->stream_id;
+		urb->buffer = transfer->buffer + (i * bulk_buffer_len);
+		/* don't set the short not ok flag for the last URB */
+		if (use_bulk_continuation && !is_out && (i < num_urbs - 1))
+			urb->flags = USBFS_URB_SHORT_NOT_OK;
+		if (i == num_urbs - 1 && last_urb_partial)
+			urb->buffer_length = transfer->length % bulk_buffer_len;
+		else if (transfer->length == 0)
+			urb->buffer_length = 0;
+		else
+			urb->buffer_length = bulk_buffer_len;
+
+		if (i > 0 && use_bulk_continuation)
+			urb->flags |= USBFS_URB_BULK_CONTINUATION;
+
+		/* we have already checked that the flag is supported */
+		if (is_out && i == num_urbs - 1 &&
+		    transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)
+			urb->flags |= USBFS_URB_ZERO_PACKET;
+	}
+
+	return 0;
 }
 
 static int submit_bulk_transfer(struct usbi_transfer *itransfer,
@@ -1664,13 +2447,11 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
 	struct linux_device_handle_priv *dpriv =
 		_device_handle_priv(transfer->dev_handle);
-	struct usbfs_urb *urbs;
 	int is_out = (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK)
 		== LIBUSB_ENDPOINT_OUT;
 	int bulk_buffer_len, use_bulk_continuation;
+	int split = 0, window = 0;
 	int r;
-	int i;
-	size_t alloc_size;
 
 	if (tpriv->urbs)
 		return LIBUSB_ERROR_BUSY;
@@ -1682,8 +2463,8 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 	/*
 	 * Older versions of usbfs place a 16kb limit on bulk URBs. We work
 	 * around this by splitting large transfers into 16k blocks, and then
-	 * submit all urbs at once. it would be simpler to submit one urb at
-	 * a time, but there is a big performance gain doing it this way.
+	 * submit several urbs at once. it would be simpler to submit one urb
+	 * at a time, but there is a big performance gain doing it this way.
 	 *
 	 * Newer versions lift the 16k limit (USBFS_CAP_NO_PACKET_SIZE_LIM),
 	 * using arbritary large transfers can still be a bad idea though, as
@@ -1697,6 +2478,11 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 	 * Last, there is the issue of short-transfers when splitting, for
 	 * short split-transfers to work reliable USBFS_CAP_BULK_CONTINUATION
 	 * is needed, but this is not always available.
+	 *
+	 * Split transfers only keep a window of URBs in flight (see
+	 * libusb_set_bulk_window()), so that a very large transfer does not
+	 * pin thousands of URBs and their kernel buffers at once. The others
+	 * are submitted from handle_bulk_completion() as URBs retire.
 	 */
 	if (dpriv->caps & USBFS_CAP_BULK_SCATTER_GATHER) {
 		/* Good! Just submit everything in one go */
@@ -1707,6 +2493,8 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 		   avoid issues with short-transfers */
 		bulk_buffer_len = MAX_BULK_BUFFER_LENGTH;
 		use_bulk_continuation = 1;
+		split = 1;
+		window = transfer->dev_handle->bulk_window;
 	} else if (dpriv->caps & USBFS_CAP_NO_PACKET_SIZE_LIM) {
 		/* Don't split, assume the kernel can alloc the buffer
 		   (otherwise the submit will fail with -ENOMEM) */
@@ -1719,106 +2507,101 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 		   2.6.32 and not a problem for most applications */
 		bulk_buffer_len = MAX_BULK_BUFFER_LENGTH;
 		use_bulk_continuation = 0;
+		split = 1;
+		window = transfer->dev_handle->bulk_window;
 	}
 
-	int num_urbs = transfer->length / bulk_buffer_len;
-	int last_urb_partial = 0;
+	if (window <= 0)
+		window = DEFAULT_BULK_WINDOW;
 
-	if (transfer->length == 0) {
-		num_urbs = 1;
-	} else if ((transfer->length % bulk_buffer_len) > 0) {
-		last_urb_partial = 1;
-		num_urbs++;
+	/* auto-resubmission works on a single URB */
+	if (transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT) {
+		if (transfer->length > bulk_buffer_len)
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		r = prepare_auto_resubmit(itransfer);
+		if (r < 0)
+			return r;
+		use_bulk_continuation = 0;
 	}
-	usbi_dbg("need %d urbs for new transfer with length %d", num_urbs,
-		transfer->length);
-	alloc_size = num_urbs * sizeof(struct usbfs_urb);
-	urbs = calloc(1, alloc_size);
-	if (!urbs)
-		return LIBUSB_ERROR_NO_MEM;
-	tpriv->urbs = urbs;
-	tpriv->num_urbs = num_urbs;
-	tpriv->num_retired = 0;
-	tpriv->reap_action = NORMAL;
-	tpriv->reap_status = LIBUSB_TRANSFER_COMPLETED;
 
-	for (i = 0; i < num_urbs; i++) {
-		struct usbfs_urb *urb = &urbs[i];
-		urb->usercontext = itransfer;
-		urb->type = urb_type;
-		urb->endpoint = transfer->endpoint;
-		urb->buffer = transfer->buffer + (i * bulk_buffer_len);
-		/* don't set the short not ok flag for the last URB */
-		if (use_bulk_continuation && !is_out && (i < num_urbs - 1))
-			urb->flags = USBFS_URB_SHORT_NOT_OK;
-		if (i == num_urbs - 1 && last_urb_partial)
-			urb->buffer_length = transfer->length % bulk_buffer_len;
-		else if (transfer->length == 0)
-			urb->buffer_length = 0;
-		else
-			urb->buffer_length = bulk_buffer_len;
-
-		if (i > 0 && use_bulk_continuation)
-			urb->flags |= USBFS_URB_BULK_CONTINUATION;
+	/* if the kernel takes URBs above 16k, grow them (in 16k steps, which
+	 * are a multiple of any bulk packet size) so that the window covers
+	 * more of the transfer, up to a size the kernel can still allocate */
+	if (use_bulk_continuation && (dpriv->caps & USBFS_CAP_NO_PACKET_SIZE_LIM)) {
+		int urb_len = transfer->length / window;
 
-		/* we have already checked that the flag is supported */
-		if (is_out && i == num_urbs - 1 &&
-		    transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)
-			urb->flags |= USBFS_URB_ZERO_PACKET;
+		urb_len = (urb_len + MAX_BULK_BUFFER_LENGTH - 1) /
+			MAX_BULK_BUFFER_LENGTH * MAX_BULK_BUFFER_LENGTH;
+		if (urb_len > MAX_BULK_WINDOW_BUFFER_LENGTH)
+			urb_len = MAX_BULK_WINDOW_BUFFER_LENGTH;
+		if (urb_len > bulk_buffer_len)
+			bulk_buffer_len = urb_len;
+	}
 
-		r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
-		if (r < 0) {
-			if (errno == ENODEV) {
-				r = LIBUSB_ERROR_NO_DEVICE;
-			} else {
-				usbi_err(TRANSFER_CTX(transfer),
-					"submiturb failed error %d errno=%d", r, errno);
-				r = LIBUSB_ERROR_IO;
-			}
-	
-			/* if the first URB submission fails, we can simply free up and
-			 * return failure immediately. */
-			if (i == 0) {
-				usbi_dbg("first URB failed, easy peasy");
-				free(urbs);
-				tpriv->urbs = NULL;
-				return r;
-			}
+	for (;;) {
+		r = fill_bulk_urbs(itransfer, urb_type, bulk_buffer_len,
+			use_bulk_continuation);
+		if (r < 0)
+			return r;
 
-			/* if it's not the first URB that failed, the situation is a bit
-			 * tricky. we may need to discard all previous URBs. there are
-			 * complications:
-			 *  - discarding is asynchronous - discarded urbs will be reaped
-			 *    later. the user must not have freed the transfer when the
-			 *    discarded URBs are reaped, otherwise libusbx will be using
-			 *    freed memory.
-			 *  - the earlier URBs may have completed successfully and we do
-			 *    not want to throw away any data.
-			 *  - this URB failing may be no error; EREMOTEIO means that
-			 *    this transfer simply didn't need all the URBs we submitted
-			 * so, we report that the transfer was submitted successfully and
-			 * in case of error we discard all previous URBs. later when
-			 * the final reap completes we can report error to the user,
-			 * or success if an earlier URB was completed successfully.
-			 */
-			tpriv->reap_action = EREMOTEIO == errno ? COMPLETED_EARLY : SUBMIT_FAILED;
+		tpriv->num_submitted = 0;
+		tpriv->num_retired = 0;
+		tpriv->bulk_window = split ? window : tpriv->num_urbs;
+		tpriv->reap_action = NORMAL;
+		tpriv->reap_status = LIBUSB_TRANSFER_COMPLETED;
 
-			/* The URBs we haven't submitted yet we count as already
-			 * retired. */
-			tpriv->num_retired += num_urbs - i;
+		r = refill_bulk_window(itransfer);
 
-			/* If we completed short then don't try to discard. */
-			if (COMPLETED_EARLY == tpriv->reap_action)
-				return 0;
+		/* the kernel could not allocate the larger URBs we picked */
+		if (r == LIBUSB_ERROR_NO_MEM && tpriv->num_submitted == 0 &&
+		    bulk_buffer_len > MAX_BULK_BUFFER_LENGTH && use_bulk_continuation) {
+			usbi_dbg("falling back to %d byte urbs", MAX_BULK_BUFFER_LENGTH);
+			bulk_buffer_len = MAX_BULK_BUFFER_LENGTH;
+			continue;
+		}
+		break;
+	}
 
-			discard_urbs(itransfer, 0, i);
+	if (r == 0)
+		return 0;
 
-			usbi_dbg("reporting successful submission but waiting for %d "
-				"discards before reporting error", i);
-			return 0;
-		}
+	/* if the first URB submission fails, we can simply free up and
+	 * return failure immediately. */
+	if (tpriv->num_submitted == 0) {
+		usbi_dbg("first URB failed, easy peasy");
+		tpriv->urbs = NULL;
+		return r;
 	}
 
+	/* if it's not the first URB that failed, the situation is a bit
+	 * tricky. we may need to discard all previous URBs. there are
+	 * complications:
+	 *  - discarding is asynchronous - discarded urbs will be reaped
+	 *    later. the user must not have freed the transfer when the
+	 *    discarded URBs are reaped, otherwise libusbx will be using
+	 *    freed memory.
+	 *  - the earlier URBs may have completed successfully and we do
+	 *    not want to throw away any data.
+	 *  - this URB failing may be no error; EREMOTEIO means that
+	 *    this transfer simply didn't need all the URBs we submitted
+	 * so, we report that the transfer was submitted successfully and
+	 * in case of error we discard all previous URBs. later when
+	 * the final reap completes we can report error to the user,
+	 * or success if an earlier URB was completed successfully.
+	 */
+	tpriv->reap_action = EREMOTEIO == errno ? COMPLETED_EARLY : SUBMIT_FAILED;
+
+	/* The URBs we haven't submitted yet won't be reaped. */
+	tpriv->num_urbs = tpriv->num_submitted;
+
+	/* If we completed short then don't try to discard. */
+	if (COMPLETED_EARLY == tpriv->reap_action)
+		return 0;
+
+	discard_urbs(itransfer, 0, tpriv->num_submitted);
+
+	usbi_dbg("reporting successful submission but waiting for %d "
+		"discards before reporting error", tpriv->num_submitted);
 	return 0;
 }
 
@@ -1831,9 +2614,13 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 		_device_handle_priv(transfer->dev_handle);
 	struct usbfs_urb **urbs;
 	size_t alloc_size;
+	size_t urb_size;
+	unsigned char *urb_mem;
 	int num_packets = transfer->num_iso_packets;
 	int i;
+	unsigned int max_urb_len;
 	int this_urb_len = 0;
+	int this_urb_packets = 0;
 	int num_urbs = 1;
 	int packet_offset = 0;
 	unsigned int packet_len;
@@ -1850,27 +2637,49 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	 * Newer kernels lift the 32k limit (USBFS_CAP_NO_PACKET_SIZE_LIM),
 	 * using arbritary large transfers is still be a bad idea though, as
 	 * the kernel needs to allocate physical contiguous memory for this,
-	 * which may fail for large buffers.
+	 * which may fail for large buffers. so we use larger URBs then, which
+	 * high-bandwidth USB 3 endpoints (up to 48k per packet) need, but still
+	 * cap them. any kernel takes at most 128 packets per URB.
 	 */
+	if (dpriv->caps & USBFS_CAP_NO_PACKET_SIZE_LIM)
+		max_urb_len = MAX_ISO_BUFFER_LENGTH_NO_LIM;
+	else
+		max_urb_len = MAX_ISO_BUFFER_LENGTH;
 
 	/* calculate how many URBs we need */
 	for (i = 0; i < num_packets; i++) {
-		unsigned int space_remaining = MAX_ISO_BUFFER_LENGTH - this_urb_len;
+		unsigned int space_remaining = max_urb_len - this_urb_len;
 		packet_len = transfer->iso_packet_desc[i].length;
 
-		if (packet_len > space_remaining) {
+		if (packet_len > max_urb_len) {
+			usbi_err(TRANSFER_CTX(transfer),
+				"iso packet length %u exceeds the %u byte URB limit",
+				packet_len, max_urb_len);
+			return LIBUSB_ERROR_INVALID_PARAM;
+		}
+
+		if (packet_len > space_remaining ||
+		    this_urb_packets == MAX_ISO_PACKETS_PER_URB) {
 			num_urbs++;
 			this_urb_len = packet_len;
+			this_urb_packets = 1;
 		} else {
 			this_urb_len += packet_len;
+			this_urb_packets++;
 		}
 	}
-	usbi_dbg("need %d 32k URBs for transfer", num_urbs);
+	usbi_dbg("need %d URBs of up to %u bytes for transfer", num_urbs,
+		max_urb_len);
 
-	alloc_size = num_urbs * sizeof(*urbs);
-	urbs = calloc(1, alloc_size);
+	/* the URB pointer array and all of the URBs, each followed by its
+	 * packet descriptors, are carved out of a single block. every URB
+	 * is padded so that the next one stays pointer-aligned */
+	alloc_size = num_urbs * (sizeof(*urbs) + sizeof(struct usbfs_urb)
+		+ sizeof(void *)) + num_packets * sizeof(struct usbfs_iso_packet_desc);
+	urbs = get_urb_mem(tpriv, alloc_size);
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
+	urb_mem = (unsigned char *)(urbs + num_urbs);
 
 	tpriv->iso_urbs = urbs;
 	tpriv->num_urbs = num_urbs;
@@ -1881,14 +2690,15 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	/* allocate + initialize each URB with the correct number of packets */
 	for (i = 0; i < num_urbs; i++) {
 		struct usbfs_urb *urb;
-		unsigned int space_remaining_in_urb = MAX_ISO_BUFFER_LENGTH;
+		unsigned int space_remaining_in_urb = max_urb_len;
 		int urb_packet_offset = 0;
 		unsigned char *urb_buffer_orig = urb_buffer;
 		int j;
 		int k;
 
 		/* swallow up all the packets we can fit into this URB */
-		while (packet_offset < transfer->num_iso_packets) {
+		while (packet_offset < transfer->num_iso_packets &&
+		       urb_packet_offset < MAX_ISO_PACKETS_PER_URB) {
 			packet_len = transfer->iso_packet_desc[packet_offset].length;
 			if (packet_len <= space_remaining_in_urb) {
 				/* throw it in */
@@ -1902,13 +2712,11 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 			}
 		}
 
-		alloc_size = sizeof(*urb)
+		urb_size = sizeof(*urb)
 			+ (urb_packet_offset * sizeof(struct usbfs_iso_packet_desc));
-		urb = calloc(1, alloc_size);
-		if (!urb) {
-			free_iso_urbs(tpriv);
-			return LIBUSB_ERROR_NO_MEM;
-		}
+		urb_size = (urb_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+		urb = (struct usbfs_urb *)urb_mem;
+		urb_mem += urb_size;
 		urbs[i] = urb;
 
 		/* populate packet lengths */
@@ -1920,8 +2728,14 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 		urb->usercontext = itransfer;
 		urb->type = USBFS_URB_TYPE_ISO;
-		/* FIXME: interface for non-ASAP data? */
-		urb->flags = USBFS_URB_ISO_ASAP;
+		/* a scheduled transfer pins its first URB to the requested frame,
+		 * the following ones are queued right behind it */
+		if (i == 0 && (itransfer->flags & USBI_TRANSFER_ISO_SCHEDULED)) {
+			urb->flags = 0;
+			urb->start_frame = (int)itransfer->iso_start_frame;
+		} else {
+			urb->flags = USBFS_URB_ISO_ASAP;
+		}
 		urb->endpoint = transfer->endpoint;
 		urb->number_of_packets = urb_packet_offset;
 		urb->buffer = urb_buffer_orig;
@@ -1929,7 +2743,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 	/* submit URBs */
 	for (i = 0; i < num_urbs; i++) {
-		int r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
+		int r = submit_urb(TRANSFER_CTX(transfer), dpriv->fd, urbs[i]);
 		if (r < 0) {
 			if (errno == ENODEV) {
 				r = LIBUSB_ERROR_NO_DEVICE;
@@ -1992,7 +2806,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	if (transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	urb = calloc(1, sizeof(struct usbfs_urb));
+	urb = get_urb_mem(tpriv, sizeof(struct usbfs_urb));
 	if (!urb)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urb;
@@ -2005,9 +2819,8 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	urb->buffer = transfer->buffer;
 	urb->buffer_length = transfer->length;
 
-	r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
+	r = submit_urb(TRANSFER_CTX(transfer), dpriv->fd, urb);
 	if (r < 0) {
-		free(urb);
 		tpriv->urbs = NULL;
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
@@ -2028,6 +2841,7 @@ static int op_submit_transfer(struct usbi_transfer *itransfer)
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
 		return submit_control_transfer(itransfer);
 	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 		return submit_bulk_transfer(itransfer, USBFS_URB_TYPE_BULK);
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
 		return submit_bulk_transfer(itransfer, USBFS_URB_TYPE_INTERRUPT);
@@ -2048,6 +2862,7 @@ static int op_cancel_transfer(struct usbi_transfer *itransfer)
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 		if (tpriv->reap_action == ERROR)
 			break;
 		/* else, fall through */
@@ -2065,6 +2880,12 @@ static int op_cancel_transfer(struct usbi_transfer *itransfer)
 	if (!tpriv->urbs)
 		return LIBUSB_ERROR_NOT_FOUND;
 
+	/* the rest of a split bulk transfer will not be submitted anymore */
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_BULK ||
+	    transfer->type == LIBUSB_TRANSFER_TYPE_BULK_STREAM ||
+	    transfer->type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		tpriv->num_urbs = tpriv->num_submitted;
+
 	return discard_urbs(itransfer, 0, tpriv->num_urbs);
 }
 
@@ -2078,10 +2899,11 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
 	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
 		usbi_mutex_lock(&itransfer->lock);
-		if (tpriv->urbs)
-			free(tpriv->urbs);
+		if (tpriv->urbs && (transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT))
+			transfer->buffer = tpriv->user_buffer;
 		tpriv->urbs = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 		break;
@@ -2097,12 +2919,25 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	}
 }
 
+static void op_free_transfer_priv(struct usbi_transfer *itransfer)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	free(tpriv->urb_mem);
+	tpriv->urb_mem = NULL;
+	tpriv->urb_mem_size = 0;
+	free(tpriv->spare_buffer);
+	tpriv->spare_buffer = NULL;
+	tpriv->spare_buffer_size = 0;
+}
+
 static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urb)
 {
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	int urb_idx = urb - tpriv->urbs;
+	int r;
 
 	usbi_mutex_lock(&itransfer->lock);
 	usbi_dbg("handling completion status %d of bulk urb %d/%d", urb->status,
@@ -2110,6 +2945,11 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 
 	tpriv->num_retired++;
 
+	/* the data of an auto-resubmitting transfer is in whichever of its two
+	 * buffers this URB was given */
+	if (transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT)
+		transfer->buffer = urb->buffer;
+
 	if (tpriv->reap_action != NORMAL) {
 		/* cancelled, submit_fail, or completed early */
 		usbi_dbg("abnormal reap: urb status %d", urb->status);
@@ -2196,6 +3036,32 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 		goto cancel_remaining;
 	}
 
+	/* put the URB of an auto-resubmitting transfer straight back in flight
+	 * on the other buffer, then hand the data to the callback */
+	if ((transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT) && urb->status == 0
+	    && (!(transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK)
+		|| urb->actual_length == urb->buffer_length)) {
+		int length = urb->actual_length;
+
+		urb->buffer = transfer->buffer == tpriv->user_buffer ?
+			tpriv->spare_buffer : tpriv->user_buffer;
+		r = submit_urb(TRANSFER_CTX(transfer),
+			_device_handle_priv(transfer->dev_handle)->fd, urb);
+		if (r == 0) {
+			itransfer->transferred = 0;
+			tpriv->num_retired = 0;
+			usbi_mutex_unlock(&itransfer->lock);
+			return usbi_handle_transfer_data(itransfer, length);
+		}
+
+		/* report what came in and stop */
+		usbi_dbg("auto-resubmission failed errno=%d", errno);
+		urb->buffer = transfer->buffer;
+		tpriv->reap_status = errno == ENODEV ?
+			LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+		goto completed;
+	}
+
 	/* if we're the last urb or we got less data than requested then we're
 	 * done */
 	if (urb_idx == tpriv->num_urbs - 1) {
@@ -2206,10 +3072,26 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 			urb->actual_length, urb->buffer_length);
 		if (tpriv->reap_action == NORMAL)
 			tpriv->reap_action = COMPLETED_EARLY;
-	} else
-		goto out_unlock;
+	} else {
+		/* slide the window of a split transfer along */
+		r = refill_bulk_window(itransfer);
+		if (r == 0)
+			goto out_unlock;
+
+		if (EREMOTEIO == errno) {
+			/* an URB still in flight completed short */
+			tpriv->reap_action = COMPLETED_EARLY;
+		} else {
+			tpriv->reap_action = SUBMIT_FAILED;
+			tpriv->reap_status = r == LIBUSB_ERROR_NO_DEVICE ?
+				LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+		}
+	}
 
 cancel_remaining:
+	/* there is nothing left to submit */
+	tpriv->num_urbs = tpriv->num_submitted;
+
 	if (ERROR == tpriv->reap_action && LIBUSB_TRANSFER_COMPLETED == tpriv->reap_status)
 		tpriv->reap_status = LIBUSB_TRANSFER_ERROR;
 
@@ -2225,7 +3107,8 @@ out_unlock:
 	return 0;
 
 completed:
-	free(tpriv->urbs);
+	if (transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT)
+		restore_user_buffer(itransfer);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
 	return CANCELLED == tpriv->reap_action ?
@@ -2260,6 +3143,12 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	usbi_dbg("handling completion status %d of iso urb %d/%d", urb->status,
 		urb_idx, num_urbs);
 
+	/* the kernel reports the frame the URB was scheduled in */
+	if (urb_idx == 1) {
+		itransfer->iso_start_frame = (unsigned int)urb->start_frame;
+		itransfer->flags |= USBI_TRANSFER_ISO_START_KNOWN;
+	}
+
 	/* copy isochronous results back in */
 
 	for (i = 0; i < urb->number_of_packets; i++) {
@@ -2369,7 +3258,6 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		if (urb->status != 0 && urb->status != -ENOENT)
 			usbi_warn(ITRANSFER_CTX(itransfer),
 				"cancel: unrecognised urb status %d", urb->status);
-		free(tpriv->urbs);
 		tpriv->urbs = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_cancellation(itransfer);
@@ -2410,7 +3298,6 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	}
 
-	free(tpriv->urbs);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
 	return usbi_handle_transfer_completion(itransfer, status);
@@ -2424,6 +3311,7 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	struct usbi_transfer *itransfer;
 	struct libusb_transfer *transfer;
 
+	usbi_stats_inc(HANDLE_CTX(handle), reap_calls);
 	r = ioctl(hpriv->fd, IOCTL_USBFS_REAPURBNDELAY, &urb);
 	if (r == -1 && errno == EAGAIN)
 		return 1;
@@ -2438,14 +3326,19 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 
 	itransfer = urb->usercontext;
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	if (usbi_latency_tracking(HANDLE_CTX(handle)))
+		usbi_latency_mark_reap(itransfer);
 
 	usbi_dbg("urb type=%d status=%d transferred=%d", urb->type, urb->status,
 		urb->actual_length);
+	usbi_trace(urb_reap, transfer, urb->endpoint, urb->actual_length,
+		urb->status);
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		return handle_iso_completion(itransfer, urb);
 	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
 		return handle_bulk_completion(itransfer, urb);
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
@@ -2457,10 +3350,30 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	}
 }
 
+/* process the events reported for the usbfs fd of one open handle */
+static int handle_fd_events(struct libusb_device_handle *handle, short revents)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	int r;
+
+	if (revents & POLLERR) {
+		usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->fd);
+		usbi_handle_disconnect(handle);
+		return 0;
+	}
+
+	do {
+		r = reap_for_handle(handle);
+	} while (r == 0 && !usbi_event_budget_exhausted(HANDLE_CTX(handle)));
+	if (r >= 0 || r == LIBUSB_ERROR_NO_DEVICE)
+		return 0;
+	return r;
+}
+
 static int op_handle_events(struct libusb_context *ctx,
 	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
 {
-	int r;
+	int r = 0;
 	unsigned int i = 0;
 
 	usbi_mutex_lock(&ctx->open_devs_lock);
@@ -2479,32 +3392,28 @@ static int op_handle_events(struct libusb_context *ctx,
 				break;
 		}
 
-		if (pollfd->revents & POLLERR) {
-			usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->fd);
-			usbi_handle_disconnect(handle);
-			continue;
-		}
-
-		do {
-			r = reap_for_handle(handle);
-		} while (r == 0);
-		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
-			continue;
-		else if (r < 0)
-			goto out;
+		r = handle_fd_events(handle, pollfd->revents);
+		if (r < 0)
+			break;
 	}
-
-	r = 0;
-out:
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 	return r;
 }
 
+static int op_handle_fd_event(struct libusb_context *ctx,
+	struct libusb_device_handle *handle, int fd, short revents)
+{
+	UNUSED(ctx);
+	UNUSED(fd);
+
+	return handle_fd_events(handle, revents);
+}
+
 static int op_clock_gettime(int clk_id, struct timespec *tp)
 {
 	switch (clk_id) {
 	case USBI_CLOCK_MONOTONIC:
-		return clock_gettime(monotonic_clkid, tp);
+		return clock_gettime(get_monotonic_clkid(), tp);
 	case USBI_CLOCK_REALTIME:
 		return clock_gettime(CLOCK_REALTIME, tp);
 	default:
@@ -2515,14 +3424,15 @@ static int op_clock_gettime(int clk_id, struct timespec *tp)
 #ifdef USBI_TIMERFD_AVAILABLE
 static clockid_t op_get_timerfd_clockid(void)
 {
-	return monotonic_clkid;
-
+	return get_monotonic_clkid();
 }
 #endif
 
 const struct usbi_os_backend linux_usbfs_backend = {
 	.name = "Linux usbfs",
-	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER,
+	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER|
+		USBI_CAP_AUTO_RESUBMIT|USBI_CAP_LAZY_INIT|
+		USBI_CAP_SUPPORTS_ZERO_PACKET,
 	.init = op_init,
 	.exit = op_exit,
 	.get_device_list = NULL,
@@ -2534,6 +3444,8 @@ const struct usbi_os_backend linux_usbfs_backend = {
 
 	.open = op_open,
 	.close = op_close,
+	.device_from_fd = op_device_from_fd,
+	.open_fd = op_open_fd,
 	.get_configuration = op_get_configuration,
 	.set_configuration = op_set_configuration,
 	.claim_interface = op_claim_interface,
@@ -2543,17 +3455,26 @@ const struct usbi_os_backend linux_usbfs_backend = {
 	.clear_halt = op_clear_halt,
 	.reset_device = op_reset_device,
 
+	.alloc_streams = op_alloc_streams,
+	.free_streams = op_free_streams,
+
 	.kernel_driver_active = op_kernel_driver_active,
 	.detach_kernel_driver = op_detach_kernel_driver,
 	.attach_kernel_driver = op_attach_kernel_driver,
+	.dev_mem_alloc = op_dev_mem_alloc,
+	.dev_mem_free = op_dev_mem_free,
+	.sync_control_transfer = op_sync_control_transfer,
+	.sync_bulk_transfer = op_sync_bulk_transfer,
 
 	.destroy_device = op_destroy_device,
 
 	.submit_transfer = op_submit_transfer,
 	.cancel_transfer = op_cancel_transfer,
 	.clear_transfer_priv = op_clear_transfer_priv,
+	.free_transfer_priv = op_free_transfer_priv,
 
 	.handle_events = op_handle_events,
+	.handle_fd_event = op_handle_fd_event,
 
 	.clock_gettime = op_clock_gettime,
 
@@ -82,7 +82,11 @@ struct usbfs_iso_packet_desc {
 };
 
 #define MAX_ISO_BUFFER_LENGTH		32768
+#define MAX_ISO_BUFFER_LENGTH_NO_LIM	524288
+#define MAX_ISO_PACKETS_PER_URB		128
 #define MAX_BULK_BUFFER_LENGTH		16384
+#define MAX_BULK_WINDOW_BUFFER_LENGTH	262144
+#define DEFAULT_BULK_WINDOW		32
 #define MAX_CTRL_BUFFER_LENGTH		4096
 
 struct usbfs_urb {
@@ -94,7 +98,10 @@ struct usbfs_urb {
 	int buffer_length;
 	int actual_length;
 	int start_frame;
-	int number_of_packets;
+	union {
+		int number_of_packets;	/* Only used for isoc urbs */
+		unsigned int stream_id;	/* Only used with bulk streams */
+	};
 	int error_count;
 	unsigned int signr;
 	void *usercontext;
@@ -122,6 +129,8 @@ struct usbfs_hub_portinfo {
 #define USBFS_CAP_BULK_CONTINUATION	0x02
 #define USBFS_CAP_NO_PACKET_SIZE_LIM	0x04
 #define USBFS_CAP_BULK_SCATTER_GATHER	0x08
+#define USBFS_CAP_REAP_AFTER_DISCONNECT	0x10
+#define USBFS_CAP_MMAP			0x20
 
 #define USBFS_DISCONNECT_CLAIM_IF_DRIVER	0x01
 #define USBFS_DISCONNECT_CLAIM_EXCEPT_DRIVER	0x02
@@ -132,6 +141,12 @@ struct usbfs_disconnect_claim {
 	char driver[USBFS_MAXDRIVERNAME + 1];
 };
 
+struct usbfs_streams {
+	unsigned int num_streams; /* Not used by USBDEVFS_FREE_STREAMS */
+	unsigned int num_eps;
+	unsigned char eps[0];
+};
+
 #define IOCTL_USBFS_CONTROL	_IOWR('U', 0, struct usbfs_ctrltransfer)
 #define IOCTL_USBFS_BULK		_IOWR('U', 2, struct usbfs_bulktransfer)
 #define IOCTL_USBFS_RESETEP	_IOR('U', 3, unsigned int)
@@ -155,6 +170,9 @@ struct usbfs_disconnect_claim {
 #define IOCTL_USBFS_RELEASE_PORT	_IOR('U', 25, unsigned int)
 #define IOCTL_USBFS_GET_CAPABILITIES	_IOR('U', 26, __u32)
 #define IOCTL_USBFS_DISCONNECT_CLAIM	_IOR('U', 27, struct usbfs_disconnect_claim)
+#define IOCTL_USBFS_ALLOC_STREAMS	_IOR('U', 28, struct usbfs_streams)
+#define IOCTL_USBFS_FREE_STREAMS	_IOR('U', 29, struct usbfs_streams)
+#define IOCTL_USBFS_GET_SPEED	_IO('U', 31)
 
 extern usbi_mutex_static_t linux_hotplug_lock;
 
@@ -0,0 +1,896 @@
+/*
+ * Device-free loopback backend for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This backend, selected with --enable-null-backend, has no hardware
+ * behind it. It makes up a number of identical in-memory devices, so that
+ * the overhead of the core, the event handling and the sync API can be
+ * measured on their own, and so that many devices can be simulated.
+ *
+ * The devices are configured through the environment when the first
+ * context is initialized:
+ *
+ * - LIBUSB_NULL_DEVICES: the number of devices, 1 by default.
+ * - LIBUSB_NULL_LATENCY: the time in microseconds between the submission
+ *   of a transfer and its completion, 0 by default.
+ * - LIBUSB_NULL_DESCRIPTORS: a file holding the raw device descriptor,
+ *   followed by bNumConfigurations configuration descriptors with their
+ *   interface and endpoint descriptors. By default, the devices have one
+ *   interface with bulk endpoints 0x01/0x81 and interrupt endpoints
+ *   0x02/0x82.
+ *
+ * Data written to an OUT endpoint is queued, and read back by transfers
+ * to the IN endpoint of the same number. An IN transfer finding nothing
+ * queued completes with no data. Vendor control requests loop back data
+ * the same way. Isochronous transfers are not supported.
+ *
+ * Completed transfers are posted to a pipe of the device handle, which is
+ * polled like the file descriptors of the other backends. Without latency
+ * transfers are posted right away; otherwise a thread per handle posts
+ * them when they are due. The pipe doesn't block the poster: once it is
+ * full, transfers wait in a list of the handle, and are moved to the pipe
+ * as event handling drains it.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libusb.h"
+#include "libusbi.h"
+
+#define NULL_MAX_DEVICES	(255 * 127)
+#define NULL_MAX_DESCRIPTORS	65536
+/* bound on the data queued on an endpoint, OUT transfers complete short
+ * once it is reached */
+#define NULL_MAX_QUEUED		(1024 * 1024)
+#define NULL_MAX_CONTROL	4096
+
+struct null_queue {
+	unsigned char *data;
+	size_t size;
+	size_t length;
+};
+
+struct device_priv {
+	int index;
+	int configuration;
+
+	usbi_mutex_t lock;		/* protects the queues */
+	struct null_queue queues[USB_MAXENDPOINTS];
+	unsigned char control[NULL_MAX_CONTROL];
+	int control_length;
+};
+
+struct handle_priv {
+	int pipe[2];			/* for event notification */
+
+	usbi_mutex_t lock;		/* protects the lists */
+	usbi_cond_t cond;
+	struct list_head pending;	/* transfers waiting for their latency */
+	struct list_head overflow;	/* completed, waiting for pipe space */
+	usbi_thread_t thread;
+	int running;
+	int stopping;
+};
+
+struct transfer_priv {
+	struct list_head list;		/* in the pending or overflow list */
+	struct usbi_transfer *itransfer;
+	struct timespec due;
+	enum libusb_transfer_status status;
+};
+
+/* the descriptors shared by all devices, set up by the first init */
+static usbi_mutex_static_t null_init_lock = USBI_MUTEX_INITIALIZER;
+static int init_count = 0;
+static int num_devices;
+static unsigned int latency_us;
+static unsigned char *descriptors;
+static unsigned char *config_descriptors[USB_MAXCONFIG];
+static int num_configs;
+
+static const unsigned char default_descriptors[] = {
+	/* device */
+	DEVICE_DESC_LENGTH, LIBUSB_DT_DEVICE, 0x00, 0x02, 0x00, 0x00, 0x00,
+	64, 0xff, 0xff, 0x00, 0x01, 0x00, 0x01, 1, 2, 3, 1,
+	/* configuration */
+	LIBUSB_DT_CONFIG_SIZE, LIBUSB_DT_CONFIG,
+	LIBUSB_DT_CONFIG_SIZE + LIBUSB_DT_INTERFACE_SIZE +
+		4 * LIBUSB_DT_ENDPOINT_SIZE, 0x00,
+	1, 1, 0, 0x80, 50,
+	/* interface */
+	LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE, 0, 0, 4,
+	LIBUSB_CLASS_VENDOR_SPEC, 0, 0, 0,
+	/* endpoints */
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, 0x01,
+	LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0,
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, 0x81,
+	LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0,
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, 0x02,
+	LIBUSB_TRANSFER_TYPE_INTERRUPT, 0x40, 0x00, 1,
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, 0x82,
+	LIBUSB_TRANSFER_TYPE_INTERRUPT, 0x40, 0x00, 1,
+};
+
+static const char * const strings[] = {
+	NULL, "libusbx", "Null loopback device"
+};
+
+static void *null_worker_main(void *arg);
+
+static int load_descriptors(struct libusb_context *ctx, const char *path)
+{
+	FILE *f;
+	size_t len, offset;
+	int i;
+
+	descriptors = malloc(NULL_MAX_DESCRIPTORS);
+	if (!descriptors)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if (path) {
+		f = fopen(path, "rb");
+		if (!f) {
+			usbi_err(ctx, "could not open %s, errno=%d", path, errno);
+			return LIBUSB_ERROR_IO;
+		}
+		len = fread(descriptors, 1, NULL_MAX_DESCRIPTORS, f);
+		fclose(f);
+	} else {
+		len = sizeof(default_descriptors);
+		memcpy(descriptors, default_descriptors, len);
+	}
+
+	if (len < DEVICE_DESC_LENGTH || descriptors[1] != LIBUSB_DT_DEVICE) {
+		usbi_err(ctx, "no device descriptor in %s", path);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	num_configs = descriptors[17];
+	if (num_configs > USB_MAXCONFIG)
+		num_configs = USB_MAXCONFIG;
+	offset = DEVICE_DESC_LENGTH;
+	for (i = 0; i < num_configs; i++) {
+		unsigned char *config = descriptors + offset;
+
+		if (offset + LIBUSB_DT_CONFIG_SIZE > len
+		    || config[1] != LIBUSB_DT_CONFIG
+		    || offset + (config[2] | (config[3] << 8)) > len) {
+			usbi_err(ctx, "configuration %d is truncated in %s", i, path);
+			return LIBUSB_ERROR_INVALID_PARAM;
+		}
+		config_descriptors[i] = config;
+		offset += config[2] | (config[3] << 8);
+	}
+
+	return 0;
+}
+
+static int null_init(struct libusb_context *ctx)
+{
+	const char *env;
+	int r = 0;
+
+	usbi_mutex_static_lock(&null_init_lock);
+	if (init_count == 0) {
+		env = getenv("LIBUSB_NULL_DEVICES");
+		num_devices = env ? atoi(env) : 1;
+		if (num_devices < 0)
+			num_devices = 0;
+		else if (num_devices > NULL_MAX_DEVICES)
+			num_devices = NULL_MAX_DEVICES;
+
+		env = getenv("LIBUSB_NULL_LATENCY");
+		latency_us = env ? (unsigned int)strtoul(env, NULL, 0) : 0;
+
+		r = load_descriptors(ctx, getenv("LIBUSB_NULL_DESCRIPTORS"));
+		if (r) {
+			free(descriptors);
+			descriptors = NULL;
+			goto out;
+		}
+		usbi_dbg("%d devices, latency %uus", num_devices, latency_us);
+	}
+	init_count++;
+
+out:
+	usbi_mutex_static_unlock(&null_init_lock);
+	return r;
+}
+
+static void null_exit(void)
+{
+	usbi_mutex_static_lock(&null_init_lock);
+	if (--init_count == 0) {
+		free(descriptors);
+		descriptors = NULL;
+	}
+	usbi_mutex_static_unlock(&null_init_lock);
+}
+
+static int null_get_device_list(struct libusb_context *ctx,
+	struct discovered_devs **discdevs)
+{
+	struct discovered_devs *ddd;
+	struct libusb_device *dev;
+	struct device_priv *dpriv;
+	unsigned long session_id;
+	int i, r;
+
+	for (i = 0; i < num_devices; i++) {
+		uint8_t busnum = (uint8_t)(1 + i / 127);
+		uint8_t devaddr = (uint8_t)(1 + i % 127);
+
+		session_id = busnum << 8 | devaddr;
+		dev = usbi_get_device_by_session_id(ctx, session_id);
+		if (!dev) {
+			dev = usbi_alloc_device(ctx, session_id);
+			if (!dev)
+				return LIBUSB_ERROR_NO_MEM;
+
+			dev->bus_number = busnum;
+			dev->device_address = devaddr;
+			dev->speed = LIBUSB_SPEED_HIGH;
+
+			dpriv = (struct device_priv *)dev->os_priv;
+			dpriv->index = i;
+			dpriv->configuration = num_configs ?
+				config_descriptors[0][5] : 0;
+			usbi_mutex_init(&dpriv->lock, NULL);
+
+			r = usbi_sanitize_device(dev);
+			if (r < 0) {
+				libusb_unref_device(dev);
+				return r;
+			}
+		}
+
+		ddd = discovered_devs_append(*discdevs, dev);
+		libusb_unref_device(dev);
+		if (!ddd)
+			return LIBUSB_ERROR_NO_MEM;
+		*discdevs = ddd;
+	}
+
+	return 0;
+}
+
+static void null_destroy_device(struct libusb_device *dev)
+{
+	struct device_priv *dpriv = (struct device_priv *)dev->os_priv;
+	int i;
+
+	for (i = 0; i < USB_MAXENDPOINTS; i++)
+		free(dpriv->queues[i].data);
+	usbi_mutex_destroy(&dpriv->lock);
+}
+
+static int null_open(struct libusb_device_handle *handle)
+{
+	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
+	int r;
+
+	if (pipe(hpriv->pipe) < 0)
+		return LIBUSB_ERROR_OTHER;
+	r = fcntl(hpriv->pipe[1], F_GETFL);
+	if (r < 0 || fcntl(hpriv->pipe[1], F_SETFL, r | O_NONBLOCK) < 0) {
+		r = LIBUSB_ERROR_OTHER;
+		goto err_close;
+	}
+
+	usbi_mutex_init(&hpriv->lock, NULL);
+	usbi_cond_init(&hpriv->cond, NULL);
+	list_init(&hpriv->pending);
+	list_init(&hpriv->overflow);
+	hpriv->stopping = 0;
+	hpriv->running = 0;
+
+	if (latency_us) {
+		r = usbi_thread_create(&hpriv->thread, null_worker_main, handle);
+		if (r) {
+			usbi_err(HANDLE_CTX(handle),
+				"could not start the completion thread, error %d", r);
+			goto err_close;
+		}
+		hpriv->running = 1;
+	}
+
+	r = usbi_add_handle_pollfd(handle, hpriv->pipe[0], POLLIN);
+	if (r < 0)
+		goto err_stop;
+	return 0;
+
+err_stop:
+	if (hpriv->running) {
+		usbi_mutex_lock(&hpriv->lock);
+		hpriv->stopping = 1;
+		usbi_cond_signal(&hpriv->cond);
+		usbi_mutex_unlock(&hpriv->lock);
+		usbi_thread_join(hpriv->thread);
+	}
+err_close:
+	close(hpriv->pipe[0]);
+	close(hpriv->pipe[1]);
+	return r > 0 ? LIBUSB_ERROR_OTHER : r;
+}
+
+static void null_close(struct libusb_device_handle *handle)
+{
+	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
+
+	if (hpriv->running) {
+		usbi_mutex_lock(&hpriv->lock);
+		hpriv->stopping = 1;
+		usbi_cond_signal(&hpriv->cond);
+		usbi_mutex_unlock(&hpriv->lock);
+		usbi_thread_join(hpriv->thread);
+	}
+
+	usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->pipe[0]);
+	close(hpriv->pipe[0]);
+	close(hpriv->pipe[1]);
+	usbi_cond_destroy(&hpriv->cond);
+	usbi_mutex_destroy(&hpriv->lock);
+}
+
+static int null_get_device_descriptor(struct libusb_device *dev,
+	unsigned char *buffer, int *host_endian)
+{
+	memcpy(buffer, descriptors, DEVICE_DESC_LENGTH);
+	*host_endian = 0;
+	return 0;
+}
+
+static int null_get_config_descriptor(struct libusb_device *dev,
+	uint8_t config_index, unsigned char *buffer, size_t len, int *host_endian)
+{
+	unsigned char *config;
+	size_t total;
+
+	if (config_index >= num_configs)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	config = config_descriptors[config_index];
+	total = config[2] | (config[3] << 8);
+	if (len > total)
+		len = total;
+	memcpy(buffer, config, len);
+	*host_endian = 0;
+	return (int)len;
+}
+
+static int null_get_active_config_descriptor(struct libusb_device *dev,
+	unsigned char *buffer, size_t len, int *host_endian)
+{
+	struct device_priv *dpriv = (struct device_priv *)dev->os_priv;
+	int i;
+
+	for (i = 0; i < num_configs; i++)
+		if (config_descriptors[i][5] == dpriv->configuration)
+			return null_get_config_descriptor(dev, (uint8_t)i, buffer,
+				len, host_endian);
+
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int null_get_configuration(struct libusb_device_handle *handle,
+	int *config)
+{
+	struct device_priv *dpriv = (struct device_priv *)handle->dev->os_priv;
+
+	*config = dpriv->configuration;
+	return 0;
+}
+
+static int null_set_configuration(struct libusb_device_handle *handle,
+	int config)
+{
+	struct device_priv *dpriv = (struct device_priv *)handle->dev->os_priv;
+	int i;
+
+	/* -1 and 0 both put the device in the unconfigured state */
+	if (config == -1)
+		config = 0;
+	for (i = 0; config && i < num_configs; i++)
+		if (config_descriptors[i][5] == config)
+			break;
+	if (config && i == num_configs)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	dpriv->configuration = config;
+	return 0;
+}
+
+static int null_claim_interface(struct libusb_device_handle *handle, int iface)
+{
+	return 0;
+}
+
+static int null_release_interface(struct libusb_device_handle *handle,
+	int iface)
+{
+	return 0;
+}
+
+static int null_set_interface_altsetting(struct libusb_device_handle *handle,
+	int iface, int altsetting)
+{
+	return 0;
+}
+
+static int null_clear_halt(struct libusb_device_handle *handle,
+	unsigned char endpoint)
+{
+	return 0;
+}
+
+static int null_reset_device(struct libusb_device_handle *handle)
+{
+	struct device_priv *dpriv = (struct device_priv *)handle->dev->os_priv;
+	int i;
+
+	usbi_mutex_lock(&dpriv->lock);
+	for (i = 0; i < USB_MAXENDPOINTS; i++)
+		dpriv->queues[i].length = 0;
+	dpriv->control_length = 0;
+	usbi_mutex_unlock(&dpriv->lock);
+	return 0;
+}
+
+/* a string descriptor in UTF-16LE, the serial number being the index of
+ * the device */
+static int get_string_descriptor(struct device_priv *dpriv, uint8_t index,
+	unsigned char *data, int length)
+{
+	unsigned char desc[2 + 2 * 32];
+	char serial[16];
+	const char *str;
+	int i, len;
+
+	if (index == 0) {
+		desc[0] = 4;
+		desc[1] = LIBUSB_DT_STRING;
+		desc[2] = 0x09;
+		desc[3] = 0x04;
+	} else {
+		if (index == 3) {
+			snprintf(serial, sizeof(serial), "%08d", dpriv->index);
+			str = serial;
+		} else if (index < sizeof(strings) / sizeof(strings[0])) {
+			str = strings[index];
+		} else {
+			return -1;
+		}
+		len = (int)strlen(str);
+		desc[0] = (unsigned char)(2 + 2 * len);
+		desc[1] = LIBUSB_DT_STRING;
+		for (i = 0; i < len; i++) {
+			desc[2 + 2 * i] = (unsigned char)str[i];
+			desc[3 + 2 * i] = 0;
+		}
+	}
+
+	if (length > desc[0])
+		length = desc[0];
+	memcpy(data, desc, length);
+	return length;
+}
+
+/* play the device side of a control transfer. returns the length of the
+ * data stage, or -1 to stall */
+static int run_control(struct device_priv *dpriv, unsigned char *buffer)
+{
+	struct libusb_control_setup *setup = (struct libusb_control_setup *)buffer;
+	unsigned char *data = buffer + LIBUSB_CONTROL_SETUP_SIZE;
+	uint16_t value = libusb_le16_to_cpu(setup->wValue);
+	int length = libusb_le16_to_cpu(setup->wLength);
+	unsigned char *config;
+	int r = -1;
+
+	if ((setup->bmRequestType & (0x03 << 5)) == LIBUSB_REQUEST_TYPE_VENDOR) {
+		usbi_mutex_lock(&dpriv->lock);
+		if (setup->bmRequestType & LIBUSB_ENDPOINT_IN) {
+			if (length > dpriv->control_length)
+				length = dpriv->control_length;
+			memcpy(data, dpriv->control, length);
+		} else {
+			if (length > NULL_MAX_CONTROL)
+				length = NULL_MAX_CONTROL;
+			memcpy(dpriv->control, data, length);
+			dpriv->control_length = length;
+		}
+		usbi_mutex_unlock(&dpriv->lock);
+		return length;
+	}
+
+	if ((setup->bmRequestType & (0x03 << 5)) != LIBUSB_REQUEST_TYPE_STANDARD)
+		return -1;
+
+	switch (setup->bRequest) {
+	case LIBUSB_REQUEST_GET_DESCRIPTOR:
+		switch (value >> 8) {
+		case LIBUSB_DT_DEVICE:
+			r = length < DEVICE_DESC_LENGTH ? length : DEVICE_DESC_LENGTH;
+			memcpy(data, descriptors, r);
+			break;
+		case LIBUSB_DT_CONFIG:
+			if ((value & 0xff) >= num_configs)
+				break;
+			config = config_descriptors[value & 0xff];
+			r = config[2] | (config[3] << 8);
+			if (r > length)
+				r = length;
+			memcpy(data, config, r);
+			break;
+		case LIBUSB_DT_STRING:
+			r = get_string_descriptor(dpriv, value & 0xff, data, length);
+			break;
+		}
+		break;
+	case LIBUSB_REQUEST_GET_CONFIGURATION:
+		if (length < 1)
+			break;
+		data[0] = (unsigned char)dpriv->configuration;
+		r = 1;
+		break;
+	case LIBUSB_REQUEST_GET_STATUS:
+		r = length < 2 ? length : 2;
+		memset(data, 0, r);
+		break;
+	case LIBUSB_REQUEST_SET_CONFIGURATION:
+		dpriv->configuration = value & 0xff;
+		r = 0;
+		break;
+	case LIBUSB_REQUEST_SET_INTERFACE:
+	case LIBUSB_REQUEST_CLEAR_FEATURE:
+	case LIBUSB_REQUEST_SET_FEATURE:
+		r = 0;
+		break;
+	}
+
+	return r;
+}
+
+/* move the data of a bulk or interrupt transfer through the queue of its
+ * endpoint number. returns the number of bytes transferred */
+static int run_loopback(struct device_priv *dpriv,
+	struct libusb_transfer *transfer)
+{
+	struct null_queue *queue =
+		&dpriv->queues[transfer->endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK];
+	size_t length = transfer->length;
+
+	usbi_mutex_lock(&dpriv->lock);
+	if (IS_XFERIN(transfer)) {
+		if (length > queue->length)
+			length = queue->length;
+		memcpy(transfer->buffer, queue->data, length);
+		queue->length -= length;
+		memmove(queue->data, queue->data + length, queue->length);
+	} else {
+		if (length > NULL_MAX_QUEUED - queue->length)
+			length = NULL_MAX_QUEUED - queue->length;
+		if (queue->length + length > queue->size) {
+			size_t size = queue->size ? queue->size : 4096;
+			unsigned char *data;
+
+			while (size < queue->length + length)
+				size *= 2;
+			data = realloc(queue->data, size);
+			if (!data) {
+				usbi_mutex_unlock(&dpriv->lock);
+				return -1;
+			}
+			queue->data = data;
+			queue->size = size;
+		}
+		memcpy(queue->data + queue->length, transfer->buffer, length);
+		queue->length += length;
+	}
+	usbi_mutex_unlock(&dpriv->lock);
+
+	return (int)length;
+}
+
+/* post a transfer to the event pipe of its handle, or to the overflow list
+ * if the pipe is full or other transfers are already waiting for space,
+ * so that they are delivered in order.
+ * Callers of this function must hold the handle lock. */
+static int post_transfer(struct handle_priv *hpriv,
+	struct usbi_transfer *itransfer)
+{
+	struct transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	if (list_empty(&hpriv->overflow)) {
+		if (write(hpriv->pipe[1], &itransfer, sizeof(itransfer)) >= 0)
+			return 0;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return LIBUSB_ERROR_IO;
+	}
+
+	list_add_tail(&tpriv->list, &hpriv->overflow);
+	return 0;
+}
+
+/* move the transfers waiting for pipe space to the pipe, for as long as it
+ * takes them. Callers of this function must hold the handle lock. */
+static void flush_overflow(struct handle_priv *hpriv)
+{
+	struct transfer_priv *tpriv;
+
+	while (!list_empty(&hpriv->overflow)) {
+		tpriv = list_entry(hpriv->overflow.next, struct transfer_priv,
+			list);
+		if (write(hpriv->pipe[1], &tpriv->itransfer,
+				sizeof(tpriv->itransfer)) < 0)
+			break;
+		list_del(&tpriv->list);
+	}
+}
+
+/* carry out a transfer once it is due, and post it to the event pipe.
+ * Callers of this function must hold the handle lock. */
+static int complete_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct handle_priv *hpriv =
+		(struct handle_priv *)transfer->dev_handle->os_priv;
+	struct device_priv *dpriv =
+		(struct device_priv *)transfer->dev_handle->dev->os_priv;
+	int r;
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		r = run_control(dpriv, transfer->buffer);
+	else
+		r = run_loopback(dpriv, transfer);
+
+	if (r < 0) {
+		tpriv->status = transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL ?
+			LIBUSB_TRANSFER_STALL : LIBUSB_TRANSFER_ERROR;
+		itransfer->transferred = 0;
+	} else {
+		tpriv->status = LIBUSB_TRANSFER_COMPLETED;
+		itransfer->transferred = r;
+	}
+
+	return post_transfer(hpriv, itransfer);
+}
+
+static void *null_worker_main(void *arg)
+{
+	struct libusb_device_handle *handle = arg;
+	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
+	struct transfer_priv *tpriv;
+	struct timespec now;
+
+	usbi_mutex_lock(&hpriv->lock);
+	while (!hpriv->stopping) {
+		if (list_empty(&hpriv->pending)) {
+			usbi_cond_wait(&hpriv->cond, &hpriv->lock);
+			continue;
+		}
+
+		/* transfers all have the same latency, so the list is sorted */
+		tpriv = list_entry(hpriv->pending.next, struct transfer_priv, list);
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (now.tv_sec < tpriv->due.tv_sec || (now.tv_sec == tpriv->due.tv_sec
+		    && now.tv_nsec < tpriv->due.tv_nsec)) {
+			usbi_cond_timedwait(&hpriv->cond, &hpriv->lock, &tpriv->due);
+			continue;
+		}
+
+		list_del(&tpriv->list);
+		complete_transfer(tpriv->itransfer);
+	}
+	usbi_mutex_unlock(&hpriv->lock);
+
+	return NULL;
+}
+
+static int null_submit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct handle_priv *hpriv =
+		(struct handle_priv *)transfer->dev_handle->os_priv;
+	int r;
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	tpriv->itransfer = itransfer;
+	if (!latency_us) {
+		usbi_mutex_lock(&hpriv->lock);
+		r = complete_transfer(itransfer);
+		usbi_mutex_unlock(&hpriv->lock);
+		return r;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &tpriv->due);
+	tpriv->due.tv_sec += latency_us / 1000000;
+	tpriv->due.tv_nsec += (latency_us % 1000000) * 1000;
+	if (tpriv->due.tv_nsec >= 1000000000) {
+		tpriv->due.tv_sec++;
+		tpriv->due.tv_nsec -= 1000000000;
+	}
+
+	usbi_mutex_lock(&hpriv->lock);
+	if (list_empty(&hpriv->pending))
+		usbi_cond_signal(&hpriv->cond);
+	list_add_tail(&tpriv->list, &hpriv->pending);
+	usbi_mutex_unlock(&hpriv->lock);
+
+	return 0;
+}
+
+static int null_cancel_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct handle_priv *hpriv =
+		(struct handle_priv *)transfer->dev_handle->os_priv;
+	struct transfer_priv *t;
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	/* transfers that were posted already can't be taken back */
+	usbi_mutex_lock(&hpriv->lock);
+	list_for_each_entry(t, &hpriv->pending, list, struct transfer_priv) {
+		if (t != tpriv)
+			continue;
+
+		list_del(&tpriv->list);
+		tpriv->status = LIBUSB_TRANSFER_CANCELLED;
+		r = post_transfer(hpriv, itransfer);
+		break;
+	}
+	usbi_mutex_unlock(&hpriv->lock);
+
+	return r;
+}
+
+static void null_clear_transfer_priv(struct usbi_transfer *itransfer)
+{
+	/* nothing to do */
+}
+
+/* deliver the transfers posted to the event pipe of a handle */
+static int handle_pipe_events(struct libusb_device_handle *handle)
+{
+	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
+	struct usbi_transfer *itransfers[32];
+	struct transfer_priv *tpriv;
+	ssize_t nr;
+	int j, r = 0;
+
+	nr = read(hpriv->pipe[0], itransfers, sizeof(itransfers));
+	if (nr < 0)
+		return LIBUSB_ERROR_IO;
+
+	usbi_mutex_lock(&hpriv->lock);
+	flush_overflow(hpriv);
+	usbi_mutex_unlock(&hpriv->lock);
+
+	for (j = 0; j < nr / (ssize_t)sizeof(itransfers[0]); j++) {
+		tpriv = usbi_transfer_get_os_priv(itransfers[j]);
+		if (tpriv->status == LIBUSB_TRANSFER_CANCELLED)
+			r = usbi_handle_transfer_cancellation(itransfers[j]);
+		else
+			r = usbi_handle_transfer_completion(itransfers[j],
+				tpriv->status);
+		if (r)
+			break;
+	}
+
+	return r;
+}
+
+static int null_handle_fd_event(struct libusb_context *ctx,
+	struct libusb_device_handle *handle, int fd, short revents)
+{
+	return handle_pipe_events(handle);
+}
+
+/* the event pipes are registered with their handle, so this is only reached
+ * for fds the core knows nothing about */
+static int null_handle_events(struct libusb_context *ctx,
+	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
+{
+	POLL_NFDS_TYPE i;
+
+	for (i = 0; i < nfds; i++)
+		if (fds[i].revents)
+			usbi_dbg("fd %d is not an event pipe", fds[i].fd);
+
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int null_clock_gettime(int clkid, struct timespec *tp)
+{
+	if (clkid == USBI_CLOCK_REALTIME)
+		return clock_gettime(CLOCK_REALTIME, tp);
+
+	if (clkid == USBI_CLOCK_MONOTONIC)
+#ifdef CLOCK_MONOTONIC
+		return clock_gettime(CLOCK_MONOTONIC, tp);
+#else
+		return clock_gettime(CLOCK_REALTIME, tp);
+#endif
+
+	return LIBUSB_ERROR_INVALID_PARAM;
+}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+static clockid_t null_get_timerfd_clockid(void)
+{
+	return CLOCK_MONOTONIC;
+}
+#endif
+
+const struct usbi_os_backend null_backend = {
+	.name = "Null loopback backend",
+	.caps = USBI_CAP_LAZY_INIT,
+	.init = null_init,
+	.exit = null_exit,
+	.get_device_list = null_get_device_list,
+	.get_device_descriptor = null_get_device_descriptor,
+	.get_active_config_descriptor = null_get_active_config_descriptor,
+	.get_config_descriptor = null_get_config_descriptor,
+
+	.open = null_open,
+	.close = null_close,
+	.get_configuration = null_get_configuration,
+	.set_configuration = null_set_configuration,
+	.claim_interface = null_claim_interface,
+	.release_interface = null_release_interface,
+
+	.set_interface_altsetting = null_set_interface_altsetting,
+	.clear_halt = null_clear_halt,
+	.reset_device = null_reset_device,
+
+	.destroy_device = null_destroy_device,
+
+	.submit_transfer = null_submit_transfer,
+	.cancel_transfer = null_cancel_transfer,
+	.clear_transfer_priv = null_clear_transfer_priv,
+
+	.handle_events = null_handle_events,
+	.handle_fd_event = null_handle_fd_event,
+
+	.clock_gettime = null_clock_gettime,
+
+#ifdef USBI_TIMERFD_AVAILABLE
+	.get_timerfd_clockid = null_get_timerfd_clockid,
+#endif
+
+	.device_priv_size = sizeof(struct device_priv),
+	.device_handle_priv_size = sizeof(struct handle_priv),
+	.transfer_priv_size = sizeof(struct transfer_priv),
+	.add_iso_packet_size = 0,
+};
@@ -21,6 +21,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,9 +40,34 @@ struct device_priv {
 	usb_device_descriptor_t ddesc;		/* usb device descriptor */
 };
 
+/*
+ * The ugen(4) interface only offers blocking I/O, so every endpoint gets
+ * a worker thread running its transfers one at a time.  Completed
+ * transfers are posted to the event pipe of the handle.
+ */
+struct endpoint_worker {
+	struct libusb_device_handle *handle;
+	pthread_t thread;
+	pthread_cond_t cond;
+	int running;
+	int busy;				/* doing the I/O of a transfer */
+	struct list_head queue;			/* transfers waiting for I/O */
+};
+
 struct handle_priv {
 	int pipe[2];				/* for event notification */
 	int endpoints[USB_MAX_ENDPOINTS];
+
+	pthread_mutex_t lock;			/* protects the workers and
+						   the endpoints */
+	int stopping;
+	struct endpoint_worker workers[USBI_MAX_ENDPOINTS];
+};
+
+struct transfer_priv {
+	struct list_head list;			/* in the worker queue */
+	struct usbi_transfer *itransfer;
+	enum libusb_transfer_status status;
 };
 
 /*
@@ -76,6 +102,8 @@ static int obsd_cancel_transfer(struct usbi_transfer *);
 static void obsd_clear_transfer_priv(struct usbi_transfer *);
 static int obsd_handle_events(struct libusb_context *ctx, struct pollfd *,
     nfds_t, int);
+static int obsd_handle_fd_event(struct libusb_context *,
+    struct libusb_device_handle *, int, short);
 static int obsd_clock_gettime(int, struct timespec *);
 
 /*
@@ -86,9 +114,12 @@ static int _cache_active_config_descriptor(struct libusb_device *, int);
 static int _sync_control_transfer(struct usbi_transfer *);
 static int _sync_gen_transfer(struct usbi_transfer *);
 static int _access_endpoint(struct libusb_transfer *);
+static int _queue_transfer(struct usbi_transfer *);
+static void *_worker_main(void *);
+static void _stop_workers(struct handle_priv *);
 
 const struct usbi_os_backend openbsd_backend = {
-	"Synchronous OpenBSD backend",
+	"OpenBSD backend",
 	0,
 	NULL,				/* init() */
 	NULL,				/* exit() */
@@ -96,6 +127,8 @@ const struct usbi_os_backend openbsd_backend = {
 	NULL,				/* hotplug_poll */
 	obsd_open,
 	obsd_close,
+	NULL,				/* device_from_fd() */
+	NULL,				/* open_fd() */
 
 	obsd_get_device_descriptor,
 	obsd_get_active_config_descriptor,
@@ -111,23 +144,33 @@ const struct usbi_os_backend openbsd_backend = {
 	obsd_set_interface_altsetting,
 	obsd_clear_halt,
 	obsd_reset_device,
+	NULL,				/* alloc_streams() */
+	NULL,				/* free_streams() */
+	NULL,				/* set_raw_io() */
 
 	NULL,				/* kernel_driver_active() */
 	NULL,				/* detach_kernel_driver() */
 	NULL,				/* attach_kernel_driver() */
+	NULL,				/* dev_mem_alloc() */
+	NULL,				/* dev_mem_free() */
+	NULL,				/* get_frame_number() */
+	NULL,				/* sync_control_transfer() */
+	NULL,				/* sync_bulk_transfer() */
 
 	obsd_destroy_device,
 
 	obsd_submit_transfer,
 	obsd_cancel_transfer,
 	obsd_clear_transfer_priv,
+	NULL,				/* free_transfer_priv() */
 
 	obsd_handle_events,
+	obsd_handle_fd_event,
 
 	obsd_clock_gettime,
 	sizeof(struct device_priv),
 	sizeof(struct handle_priv),
-	0,				/* transfer_priv_size */
+	sizeof(struct transfer_priv),
 	0,				/* add_iso_packet_size */
 };
 
@@ -211,6 +254,7 @@ obsd_open(struct libusb_device_handle *handle)
 {
 	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
 	struct device_priv *dpriv = (struct device_priv *)handle->dev->os_priv;
+	int i;
 
 	dpriv->fd = open(dpriv->devnode, O_RDWR);
 	if (dpriv->fd < 0) {
@@ -224,7 +268,20 @@ obsd_open(struct libusb_device_handle *handle)
 	if (pipe(hpriv->pipe) < 0)
 		return _errno_to_libusb(errno);
 
-	return usbi_add_pollfd(HANDLE_CTX(handle), hpriv->pipe[0], POLLIN);
+	for (i = 0; i < USB_MAX_ENDPOINTS; i++)
+		hpriv->endpoints[i] = -1;
+
+	pthread_mutex_init(&hpriv->lock, NULL);
+	hpriv->stopping = 0;
+	for (i = 0; i < USBI_MAX_ENDPOINTS; i++) {
+		hpriv->workers[i].handle = handle;
+		hpriv->workers[i].running = 0;
+		hpriv->workers[i].busy = 0;
+		list_init(&hpriv->workers[i].queue);
+		pthread_cond_init(&hpriv->workers[i].cond, NULL);
+	}
+
+	return usbi_add_handle_pollfd(handle, hpriv->pipe[0], POLLIN);
 }
 
 void
@@ -232,9 +289,17 @@ obsd_close(struct libusb_device_handle *handle)
 {
 	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
 	struct device_priv *dpriv = (struct device_priv *)handle->dev->os_priv;
+	int i;
 
 	usbi_dbg("close: fd %d", dpriv->fd);
 
+	/* The workers may still use the device and the event pipe. */
+	_stop_workers(hpriv);
+
+	for (i = 0; i < USB_MAX_ENDPOINTS; i++)
+		if (hpriv->endpoints[i] >= 0)
+			close(hpriv->endpoints[i]);
+
 	close(dpriv->fd);
 	dpriv->fd = -1;
 
@@ -347,12 +412,7 @@ obsd_set_configuration(struct libusb_device_handle *handle, int config)
 int
 obsd_claim_interface(struct libusb_device_handle *handle, int iface)
 {
-	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
-	int i;
-
-	for (i = 0; i < USB_MAX_ENDPOINTS; i++)
-		hpriv->endpoints[i] = -1;
-
+	/* Endpoint nodes are opened on first use. */
 	return (LIBUSB_SUCCESS);
 }
 
@@ -360,11 +420,64 @@ int
 obsd_release_interface(struct libusb_device_handle *handle, int iface)
 {
 	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
-	int i;
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface_descriptor *alt;
+	int used[USB_MAX_ENDPOINTS];
+	int i, j, k, endpt;
 
-	for (i = 0; i < USB_MAX_ENDPOINTS; i++)
+	/*
+	 * Only the nodes of the endpoints of this interface are closed.  If
+	 * the configuration cannot be read, all of them are.
+	 */
+	memset(used, 0, sizeof(used));
+	if (libusb_get_active_config_descriptor(handle->dev, &config) == 0) {
+		for (i = 0; i < config->bNumInterfaces; i++) {
+			for (j = 0; j < config->interface[i].num_altsetting; j++) {
+				alt = &config->interface[i].altsetting[j];
+				if (alt->bInterfaceNumber != iface)
+					continue;
+				for (k = 0; k < alt->bNumEndpoints; k++) {
+					endpt = UE_GET_ADDR(
+					    alt->endpoint[k].bEndpointAddress);
+					used[endpt] = 1;
+				}
+			}
+		}
+		libusb_free_config_descriptor(config);
+	} else {
+		for (i = 1; i < USB_MAX_ENDPOINTS; i++)
+			used[i] = 1;
+	}
+
+	pthread_mutex_lock(&hpriv->lock);
+
+	/*
+	 * The workers use the nodes without the lock, so refuse while one
+	 * of them has transfers of the interface to run.
+	 */
+	for (i = 0; i < USB_MAX_ENDPOINTS; i++) {
+		if (!used[i])
+			continue;
+		for (j = 0; j < 2; j++) {
+			struct endpoint_worker *worker = &hpriv->workers[
+			    USBI_EP_INDEX(i | (j ? LIBUSB_ENDPOINT_IN : 0))];
+
+			if (worker->busy || !list_empty(&worker->queue)) {
+				pthread_mutex_unlock(&hpriv->lock);
+				return (LIBUSB_ERROR_BUSY);
+			}
+		}
+	}
+
+	for (i = 0; i < USB_MAX_ENDPOINTS; i++) {
+		if (!used[i])
+			continue;
 		if (hpriv->endpoints[i] >= 0)
 			close(hpriv->endpoints[i]);
+		hpriv->endpoints[i] = -1;
+	}
+
+	pthread_mutex_unlock(&hpriv->lock);
 
 	return (LIBUSB_SUCCESS);
 }
@@ -431,17 +544,14 @@ int
 obsd_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer;
-	struct handle_priv *hpriv;
 	int err = 0;
 
 	usbi_dbg("");
 
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
-		err = _sync_control_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		if (IS_XFEROUT(transfer)) {
@@ -449,7 +559,6 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 			err = LIBUSB_ERROR_NOT_SUPPORTED;
 			break;
 		}
-		err = _sync_gen_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
@@ -458,25 +567,52 @@ obsd_submit_transfer(struct usbi_transfer *itransfer)
 			err = LIBUSB_ERROR_NOT_SUPPORTED;
 			break;
 		}
-		err = _sync_gen_transfer(itransfer);
 		break;
 	}
 
 	if (err)
 		return (err);
 
-	if (write(hpriv->pipe[1], &itransfer, sizeof(itransfer)) < 0)
-		return _errno_to_libusb(errno);
-
-	return (LIBUSB_SUCCESS);
+	return _queue_transfer(itransfer);
 }
 
 int
 obsd_cancel_transfer(struct usbi_transfer *itransfer)
 {
+	struct libusb_transfer *transfer;
+	struct transfer_priv *tpriv;
+	struct handle_priv *hpriv;
+	struct endpoint_worker *worker;
+	struct transfer_priv *t;
+	int err = LIBUSB_ERROR_NOT_SUPPORTED;
+
 	usbi_dbg("");
 
-	return (LIBUSB_ERROR_NOT_SUPPORTED);
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	tpriv = usbi_transfer_get_os_priv(itransfer);
+	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
+	worker = &hpriv->workers[USBI_EP_INDEX(transfer->endpoint)];
+
+	/*
+	 * A transfer doing I/O can not be interrupted, but one still
+	 * waiting in the queue can simply be dropped.
+	 */
+	pthread_mutex_lock(&hpriv->lock);
+	list_for_each_entry(t, &worker->queue, list, struct transfer_priv) {
+		if (t != tpriv)
+			continue;
+
+		list_del(&tpriv->list);
+		tpriv->status = LIBUSB_TRANSFER_CANCELLED;
+		if (write(hpriv->pipe[1], &itransfer, sizeof(itransfer)) < 0)
+			err = _errno_to_libusb(errno);
+		else
+			err = LIBUSB_SUCCESS;
+		break;
+	}
+	pthread_mutex_unlock(&hpriv->lock);
+
+	return (err);
 }
 
 void
@@ -491,58 +627,53 @@ int
 obsd_handle_events(struct libusb_context *ctx, struct pollfd *fds, nfds_t nfds,
     int num_ready)
 {
-	struct libusb_device_handle *handle;
-	struct handle_priv *hpriv = NULL;
-	struct usbi_transfer *itransfer;
-	struct pollfd *pollfd;
-	int i, err = 0;
+	nfds_t i;
 
 	usbi_dbg("");
 
-	pthread_mutex_lock(&ctx->open_devs_lock);
-	for (i = 0; i < nfds && num_ready > 0; i++) {
-		pollfd = &fds[i];
-
-		if (!pollfd->revents)
-			continue;
+	/* Event pipes are registered with their handle, and reach
+	 * obsd_handle_fd_event() instead. */
+	for (i = 0; i < nfds; i++)
+		if (fds[i].revents)
+			usbi_dbg("fd %d is not an event pipe!", fds[i].fd);
 
-		hpriv = NULL;
-		num_ready--;
-		list_for_each_entry(handle, &ctx->open_devs, list,
-		    struct libusb_device_handle) {
-			hpriv = (struct handle_priv *)handle->os_priv;
+	return (LIBUSB_ERROR_NOT_FOUND);
+}
 
-			if (hpriv->pipe[0] == pollfd->fd)
-				break;
+int
+obsd_handle_fd_event(struct libusb_context *ctx,
+    struct libusb_device_handle *handle, int fd, short revents)
+{
+	struct handle_priv *hpriv = (struct handle_priv *)handle->os_priv;
+	struct usbi_transfer *itransfers[32];
+	struct transfer_priv *tpriv;
+	ssize_t nr;
+	int j, err;
 
-			hpriv = NULL;
-		}
+	usbi_dbg("");
 
-		if (NULL == hpriv) {
-			usbi_dbg("fd %d is not an event pipe!", pollfd->fd);
-			err = ENOENT;
-			break;
-		}
+	if (revents & POLLERR) {
+		usbi_remove_pollfd(ctx, hpriv->pipe[0]);
+		usbi_handle_disconnect(handle);
+		return (LIBUSB_SUCCESS);
+	}
 
-		if (pollfd->revents & POLLERR) {
-			usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->pipe[0]);
-			usbi_handle_disconnect(handle);
-			continue;
-		}
+	/* Workers write whole pointers, drain as many as we can. */
+	nr = read(hpriv->pipe[0], itransfers, sizeof(itransfers));
+	if (nr < 0)
+		return _errno_to_libusb(errno);
 
-		if (read(hpriv->pipe[0], &itransfer, sizeof(itransfer)) < 0) {
-			err = errno;
-			break;
-		}
+	for (j = 0; j < nr / (ssize_t)sizeof(itransfers[0]); j++) {
+		tpriv = usbi_transfer_get_os_priv(itransfers[j]);
 
-		if ((err = usbi_handle_transfer_completion(itransfer,
-		    LIBUSB_TRANSFER_COMPLETED)))
-			break;
+		if (tpriv->status == LIBUSB_TRANSFER_CANCELLED)
+			err = usbi_handle_transfer_cancellation(itransfers[j]);
+		else
+			err = usbi_handle_transfer_completion(itransfers[j],
+			    tpriv->status);
+		if (err)
+			return (err);
 	}
-	pthread_mutex_unlock(&ctx->open_devs_lock);
-
-	if (err)
-		return _errno_to_libusb(err);
 
 	return (LIBUSB_SUCCESS);
 }
@@ -573,6 +704,8 @@ _errno_to_libusb(int err)
 		return (LIBUSB_ERROR_NO_DEVICE);
 	case ENOMEM:
 		return (LIBUSB_ERROR_NO_MEM);
+	case ETIMEDOUT:
+		return (LIBUSB_ERROR_TIMEOUT);
 	}
 
 	usbi_dbg("error: %s", strerror(err));
@@ -669,7 +802,7 @@ _access_endpoint(struct libusb_transfer *transfer)
 	struct handle_priv *hpriv;
 	struct device_priv *dpriv;
 	char *s, devnode[16];
-	int fd, endpt;
+	int fd, endpt, err;
 	mode_t mode;
 
 	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
@@ -680,6 +813,8 @@ _access_endpoint(struct libusb_transfer *transfer)
 
 	usbi_dbg("endpoint %d mode %d", endpt, mode);
 
+	/* The IN and OUT workers of an endpoint share its node. */
+	pthread_mutex_lock(&hpriv->lock);
 	if (hpriv->endpoints[endpt] < 0) {
 		/* Pick the right node given the control one */
 		strlcpy(devnode, dpriv->devnode, sizeof(devnode));
@@ -688,13 +823,20 @@ _access_endpoint(struct libusb_transfer *transfer)
 
 		/* We may need to read/write to the same endpoint later. */
 		if (((fd = open(devnode, O_RDWR)) < 0) && (errno == ENXIO))
-			if ((fd = open(devnode, mode)) < 0)
-				return (-1);
+			fd = open(devnode, mode);
+		if (fd < 0) {
+			err = errno;
+			pthread_mutex_unlock(&hpriv->lock);
+			errno = err;
+			return (-1);
+		}
 
 		hpriv->endpoints[endpt] = fd;
 	}
+	fd = hpriv->endpoints[endpt];
+	pthread_mutex_unlock(&hpriv->lock);
 
-	return (hpriv->endpoints[endpt]);
+	return (fd);
 }
 
 int
@@ -732,3 +874,126 @@ _sync_gen_transfer(struct usbi_transfer *itransfer)
 
 	return (0);
 }
+
+int
+_queue_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer;
+	struct transfer_priv *tpriv;
+	struct handle_priv *hpriv;
+	struct endpoint_worker *worker;
+	int err = 0;
+
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	tpriv = usbi_transfer_get_os_priv(itransfer);
+	hpriv = (struct handle_priv *)transfer->dev_handle->os_priv;
+	worker = &hpriv->workers[USBI_EP_INDEX(transfer->endpoint)];
+
+	tpriv->itransfer = itransfer;
+	tpriv->status = LIBUSB_TRANSFER_COMPLETED;
+
+	pthread_mutex_lock(&hpriv->lock);
+
+	/* Endpoints that never see a transfer do not need a thread. */
+	if (!worker->running) {
+		if ((err = pthread_create(&worker->thread, NULL, _worker_main,
+		    worker)) != 0) {
+			pthread_mutex_unlock(&hpriv->lock);
+			return _errno_to_libusb(err);
+		}
+		worker->running = 1;
+	}
+
+	list_add_tail(&tpriv->list, &worker->queue);
+	pthread_cond_signal(&worker->cond);
+
+	pthread_mutex_unlock(&hpriv->lock);
+
+	return (LIBUSB_SUCCESS);
+}
+
+void *
+_worker_main(void *arg)
+{
+	struct endpoint_worker *worker = arg;
+	struct handle_priv *hpriv;
+	struct libusb_transfer *transfer;
+	struct usbi_transfer *itransfer;
+	struct transfer_priv *tpriv;
+	int err;
+
+	hpriv = (struct handle_priv *)worker->handle->os_priv;
+
+	pthread_mutex_lock(&hpriv->lock);
+	for (;;) {
+		while (!hpriv->stopping && list_empty(&worker->queue))
+			pthread_cond_wait(&worker->cond, &hpriv->lock);
+
+		if (hpriv->stopping)
+			break;
+
+		tpriv = list_entry(worker->queue.next, struct transfer_priv,
+		    list);
+		list_del(&tpriv->list);
+		itransfer = tpriv->itransfer;
+		worker->busy = 1;
+		pthread_mutex_unlock(&hpriv->lock);
+
+		transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			err = _sync_control_transfer(itransfer);
+		else
+			err = _sync_gen_transfer(itransfer);
+
+		switch (err) {
+		case 0:
+			tpriv->status = LIBUSB_TRANSFER_COMPLETED;
+			break;
+		case LIBUSB_ERROR_TIMEOUT:
+			tpriv->status = LIBUSB_TRANSFER_TIMED_OUT;
+			break;
+		case LIBUSB_ERROR_NO_DEVICE:
+			tpriv->status = LIBUSB_TRANSFER_NO_DEVICE;
+			break;
+		default:
+			tpriv->status = LIBUSB_TRANSFER_ERROR;
+			break;
+		}
+
+		/* Done with the endpoint node before the completion is seen. */
+		pthread_mutex_lock(&hpriv->lock);
+		worker->busy = 0;
+		pthread_mutex_unlock(&hpriv->lock);
+
+		if (write(hpriv->pipe[1], &itransfer, sizeof(itransfer)) < 0)
+			usbi_err(HANDLE_CTX(worker->handle),
+			    "could not post completion: %s", strerror(errno));
+
+		pthread_mutex_lock(&hpriv->lock);
+	}
+	pthread_mutex_unlock(&hpriv->lock);
+
+	return (NULL);
+}
+
+void
+_stop_workers(struct handle_priv *hpriv)
+{
+	int i;
+
+	pthread_mutex_lock(&hpriv->lock);
+	hpriv->stopping = 1;
+	for (i = 0; i < USBI_MAX_ENDPOINTS; i++)
+		pthread_cond_signal(&hpriv->workers[i].cond);
+	pthread_mutex_unlock(&hpriv->lock);
+
+	/* Handles must not be closed with transfers pending, workers are idle. */
+	for (i = 0; i < USBI_MAX_ENDPOINTS; i++) {
+		if (hpriv->workers[i].running)
+			pthread_join(hpriv->workers[i].thread, NULL);
+		hpriv->workers[i].running = 0;
+		pthread_cond_destroy(&hpriv->workers[i].cond);
+	}
+
+	pthread_mutex_destroy(&hpriv->lock);
+}
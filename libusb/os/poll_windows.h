@@ -123,3 +123,14 @@ do {                                                    \
 	}                                                   \
 } while (0)
 #endif
+#if !defined(timeradd)
+#define timeradd(a, b, result)                          \
+do {                                                    \
+	(result)->tv_sec = (a)->tv_sec + (b)->tv_sec;       \
+	(result)->tv_usec = (a)->tv_usec + (b)->tv_usec;    \
+	if ((result)->tv_usec >= 1000000) {                 \
+		++(result)->tv_sec;                             \
+		(result)->tv_usec -= 1000000;                   \
+	}                                                   \
+} while (0)
+#endif
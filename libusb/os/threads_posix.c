@@ -33,6 +33,10 @@
 # include <windows.h>
 #endif
 
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+
 #include "threads_posix.h"
 
 int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr)
@@ -78,3 +82,54 @@ int usbi_get_tid(void)
 /* TODO: NetBSD thread ID support */
 	return ret;
 }
+
+/* Pin the calling thread to a set of CPUs and/or give it a SCHED_FIFO
+ * priority. Returns 0 or an errno value. */
+int usbi_thread_set_scheduling(const int *cpus, int num_cpus, int priority)
+{
+	struct sched_param param;
+	int err;
+
+	if (cpus && num_cpus > 0) {
+#if defined(__linux__)
+		cpu_set_t set;
+		int i;
+
+		CPU_ZERO(&set);
+		for (i = 0; i < num_cpus; i++) {
+			if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE)
+				return EINVAL;
+			CPU_SET(cpus[i], &set);
+		}
+		err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err != 0)
+			return err;
+#else
+		return ENOTSUP;
+#endif
+	}
+
+	if (priority > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = priority;
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (err != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+/* raise counter to n if it is lower */
+void usbi_atomic_max64(volatile uint64_t *counter, uint64_t n)
+{
+	uint64_t old = *counter;
+	uint64_t prev;
+
+	while (n > old) {
+		prev = __sync_val_compare_and_swap(counter, old, n);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+}
@@ -22,6 +22,7 @@
 #define LIBUSB_THREADS_POSIX_H
 
 #include <pthread.h>
+#include <stdint.h>
 
 #define usbi_mutex_static_t		pthread_mutex_t
 #define USBI_MUTEX_INITIALIZER		PTHREAD_MUTEX_INITIALIZER
@@ -43,8 +44,29 @@
 #define usbi_cond_destroy		pthread_cond_destroy
 #define usbi_cond_signal		pthread_cond_signal
 
+#define usbi_thread_t			pthread_t
+#define usbi_thread_create(thread, fn, arg) \
+	pthread_create((thread), NULL, (fn), (arg))
+#define usbi_thread_join(thread)	pthread_join((thread), NULL)
+
 extern int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr);
 
 int usbi_get_tid(void);
+int usbi_thread_set_scheduling(const int *cpus, int num_cpus, int priority);
+
+#define usbi_atomic_add64(counter, n) \
+	((void)__sync_fetch_and_add((counter), (uint64_t)(n)))
+#define usbi_atomic_add32(counter, n) \
+	((void)__sync_fetch_and_add((counter), (uint32_t)(n)))
+void usbi_atomic_max64(volatile uint64_t *counter, uint64_t n);
+
+/* full barrier operations on a volatile long. add and cas return the
+ * previous value */
+#define usbi_atomic_add(ptr, n) 	__sync_fetch_and_add((ptr), (long)(n))
+#define usbi_atomic_cas(ptr, old, new) \
+	__sync_val_compare_and_swap((ptr), (long)(old), (long)(new))
+#define usbi_atomic_load(ptr)		__sync_fetch_and_add((ptr), 0)
+#define usbi_atomic_store(ptr, v) \
+	do { __sync_synchronize(); *(ptr) = (long)(v); } while (0)
 
 #endif /* LIBUSB_THREADS_POSIX_H */
@@ -22,6 +22,7 @@
 #include <objbase.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdlib.h>
 
 #include "libusbi.h"
 
@@ -207,6 +208,93 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 	return usbi_cond_intwait(cond, mutex, millis);
 }
 
+struct usbi_thread_start {
+	void *(*fn)(void *);
+	void *arg;
+};
+
+static DWORD WINAPI usbi_thread_main(LPVOID param) {
+	struct usbi_thread_start start = *(struct usbi_thread_start *)param;
+
+	free(param);
+	start.fn(start.arg);
+	return 0;
+}
+
+int usbi_thread_create(usbi_thread_t *thread, void *(*fn)(void *),
+					   void *arg) {
+	struct usbi_thread_start *start = malloc(sizeof(*start));
+
+	if(!start) return ENOMEM;
+	start->fn  = fn;
+	start->arg = arg;
+	*thread = CreateThread(NULL, 0, usbi_thread_main, start, 0, NULL);
+	if(!*thread) {
+		free(start);
+		return EAGAIN;
+	}
+	return 0;
+}
+
+int usbi_thread_join(usbi_thread_t thread) {
+	if(WaitForSingleObject(thread, INFINITE) != WAIT_OBJECT_0) return EINVAL;
+	CloseHandle(thread);
+	return 0;
+}
+
 int usbi_get_tid(void) {
 	return GetCurrentThreadId();
 }
+
+int usbi_thread_set_scheduling(const int *cpus, int num_cpus, int priority) {
+	DWORD_PTR mask = 0;
+	int i;
+
+	if (cpus && num_cpus > 0) {
+		for (i = 0; i < num_cpus; i++) {
+			if (cpus[i] < 0 || cpus[i] >= (int)(sizeof(mask) * 8))
+				return EINVAL;
+			mask |= (DWORD_PTR)1 << cpus[i];
+		}
+		if (!SetThreadAffinityMask(GetCurrentThread(), mask))
+			return EINVAL;
+	}
+
+	if (priority > 0 &&
+	    !SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+		return EPERM;
+
+	return 0;
+}
+
+void usbi_atomic_add64(volatile uint64_t *counter, uint64_t n) {
+#if defined(_WIN32_WCE)
+	// no 64 bit interlocked operations on CE, an update may get lost
+	*counter += n;
+#else
+	LONGLONG old;
+
+	do {
+		old = *(volatile LONGLONG *)counter;
+	} while (InterlockedCompareExchange64((volatile LONGLONG *)counter,
+		old + (LONGLONG)n, old) != old);
+#endif
+}
+
+// raise counter to n if it is lower
+void usbi_atomic_max64(volatile uint64_t *counter, uint64_t n) {
+#if defined(_WIN32_WCE)
+	// no 64 bit interlocked operations on CE, an update may get lost
+	if (n > *counter)
+		*counter = n;
+#else
+	LONGLONG old;
+
+	do {
+		old = *(volatile LONGLONG *)counter;
+		if (n <= (uint64_t)old)
+			return;
+	} while (InterlockedCompareExchange64((volatile LONGLONG *)counter,
+		(LONGLONG)n, old) != old);
+#endif
+}
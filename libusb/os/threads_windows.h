@@ -55,6 +55,8 @@ struct timespec {
 #  define ETIMEDOUT 10060     /* This is the value in winsock.h. */
 #endif
 
+#define usbi_thread_t           HANDLE
+
 #define usbi_mutexattr_t void
 #define usbi_condattr_t  void
 
@@ -82,6 +84,27 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 int usbi_cond_broadcast(usbi_cond_t *cond);
 int usbi_cond_signal(usbi_cond_t *cond);
 
+int usbi_thread_create(usbi_thread_t *thread, void *(*fn)(void *),
+					   void *arg);
+int usbi_thread_join(usbi_thread_t thread);
+
 int usbi_get_tid(void);
+int usbi_thread_set_scheduling(const int *cpus, int num_cpus, int priority);
+
+void usbi_atomic_add64(volatile uint64_t *counter, uint64_t n);
+void usbi_atomic_max64(volatile uint64_t *counter, uint64_t n);
+#define usbi_atomic_add32(counter, n) \
+	((void)InterlockedExchangeAdd((LONG *)(counter), (LONG)(n)))
+
+// full barrier operations on a volatile long. add and cas return the
+// previous value
+#define usbi_atomic_add(ptr, n) \
+	InterlockedExchangeAdd((LONG *)(ptr), (LONG)(n))
+#define usbi_atomic_cas(ptr, old, new) \
+	InterlockedCompareExchange((LONG *)(ptr), (LONG)(new), (LONG)(old))
+#define usbi_atomic_load(ptr) \
+	InterlockedCompareExchange((LONG *)(ptr), 0, 0)
+#define usbi_atomic_store(ptr, v) \
+	((void)InterlockedExchange((LONG *)(ptr), (LONG)(v)))
 
 #endif /* LIBUSB_THREADS_WINDOWS_H */
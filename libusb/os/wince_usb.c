@@ -808,6 +808,7 @@ static int wince_handle_events(
 	struct wince_transfer_priv* transfer_priv = NULL;
 	POLL_NFDS_TYPE i = 0;
 	BOOL found = FALSE;
+	struct libusb_device_handle *handle;
 	struct usbi_transfer *transfer;
 	DWORD io_size, io_result;
 
@@ -824,15 +825,19 @@ static int wince_handle_events(
 
 		// Because a Windows OVERLAPPED is used for poll emulation,
 		// a pollable fd is created and stored with each transfer
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-			transfer_priv = usbi_transfer_get_os_priv(transfer);
-			if (transfer_priv->pollable_fd.fd == fds[i].fd) {
-				found = TRUE;
-				break;
+		list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
+			usbi_mutex_lock(&handle->flying_lock);
+			list_for_each_entry(transfer, &handle->flying_transfers, list, struct usbi_transfer) {
+				transfer_priv = usbi_transfer_get_os_priv(transfer);
+				if (transfer_priv->pollable_fd.fd == fds[i].fd) {
+					found = TRUE;
+					break;
+				}
 			}
+			usbi_mutex_unlock(&handle->flying_lock);
+			if (found)
+				break;
 		}
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
 		if (found && HasOverlappedIoCompleted(transfer_priv->pollable_fd.overlapped)) {
 			io_result = (DWORD)transfer_priv->pollable_fd.overlapped->Internal;
@@ -980,6 +985,8 @@ const struct usbi_os_backend wince_backend = {
 	NULL,				/* hotplug_poll */
         wince_open,
         wince_close,
+	NULL,				/* device_from_fd() */
+	NULL,				/* open_fd() */
 
         wince_get_device_descriptor,
         wince_get_active_config_descriptor,
@@ -994,18 +1001,28 @@ const struct usbi_os_backend wince_backend = {
         wince_set_interface_altsetting,
         wince_clear_halt,
         wince_reset_device,
+        NULL,				/* alloc_streams() */
+        NULL,				/* free_streams() */
+        NULL,				/* set_raw_io() */
 
         wince_kernel_driver_active,
         wince_detach_kernel_driver,
         wince_attach_kernel_driver,
+        NULL,				/* dev_mem_alloc() */
+        NULL,				/* dev_mem_free() */
+        NULL,				/* get_frame_number() */
+        NULL,				/* sync_control_transfer() */
+        NULL,				/* sync_bulk_transfer() */
 
         wince_destroy_device,
 
         wince_submit_transfer,
         wince_cancel_transfer,
         wince_clear_transfer_priv,
+        NULL,				/* free_transfer_priv() */
 
         wince_handle_events,
+        NULL,				/* handle_fd_event() */
 
         wince_clock_gettime,
         sizeof(struct wince_device_priv),
@@ -46,6 +46,7 @@
 static int windows_get_active_config_descriptor(struct libusb_device *dev, unsigned char *buffer, size_t len, int *host_endian);
 static int windows_clock_gettime(int clk_id, struct timespec *tp);
 unsigned __stdcall windows_clock_gettime_threaded(void* param);
+unsigned __stdcall windows_completion_thread(void* param);
 // Common calls
 static int common_configure_endpoints(int sub_api, struct libusb_device_handle *dev_handle, int iface);
 
@@ -60,6 +61,7 @@ static int winusbx_release_interface(int sub_api, struct libusb_device_handle *d
 static int winusbx_submit_control_transfer(int sub_api, struct usbi_transfer *itransfer);
 static int winusbx_set_interface_altsetting(int sub_api, struct libusb_device_handle *dev_handle, int iface, int altsetting);
 static int winusbx_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer);
+static int winusbx_set_raw_io(struct libusb_device_handle *dev_handle, unsigned char endpoint, int enable);
 static int winusbx_clear_halt(int sub_api, struct libusb_device_handle *dev_handle, unsigned char endpoint);
 static int winusbx_abort_transfers(int sub_api, struct usbi_transfer *itransfer);
 static int winusbx_abort_control(int sub_api, struct usbi_transfer *itransfer);
@@ -112,6 +114,18 @@ struct timespec timer_tp;
 volatile LONG request_count[2] = {0, 1};	// last one must be > 0
 HANDLE timer_request[2] = { NULL, NULL };
 HANDLE timer_response = NULL;
+// Completion port thread
+// All the device file handles we issue overlapped I/O on are associated with a
+// single completion port, which a dedicated thread drains into per-handle lists
+#define COMPLETION_BATCH_SIZE	64
+#define COMPLETION_KEY_EXIT	((ULONG_PTR)-1)
+static HANDLE completion_port = NULL;
+static HANDLE completion_thread = NULL;
+// Transfers with requests the completion port has yet to return. WinUSB and HID
+// may issue I/O of their own on the handles we associate, so only packets that
+// belong to one of these are handed over
+static struct list_head inflight_transfers;
+static usbi_mutex_t inflight_lock;
 // API globals
 #define CHECK_WINUSBX_AVAILABLE(sub_api) do { if (sub_api == SUB_API_NOTSET) sub_api = priv->sub_api; \
 	if (!WinUSBX[sub_api].initialized) return LIBUSB_ERROR_ACCESS; } while(0)
@@ -242,6 +256,8 @@ static int init_dlls(void)
 	DLL_LOAD_PREFIXED(SetupAPI.dll, p, SetupDiOpenDeviceInterfaceRegKey, TRUE);
 	DLL_LOAD_PREFIXED(AdvAPI32.dll, p, RegQueryValueExW, TRUE);
 	DLL_LOAD_PREFIXED(AdvAPI32.dll, p, RegCloseKey, TRUE);
+	// Only used to dequeue completions in batches, XP falls back to one at a time
+	DLL_LOAD_PREFIXED(Kernel32.dll, p, GetQueuedCompletionStatusEx, FALSE);
 	return LIBUSB_SUCCESS;
 }
 
@@ -886,6 +902,20 @@ static int windows_init(struct libusb_context *ctx)
 		}
 		SetThreadAffinityMask(timer_thread, 0);
 
+		// Transfer completions are delivered through an I/O completion port
+		list_init(&inflight_transfers);
+		usbi_mutex_init(&inflight_lock, NULL);
+		completion_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+		if (completion_port == NULL) {
+			usbi_err(ctx, "could not create completion port: %s - aborting", windows_error_str(0));
+			goto init_exit;
+		}
+		completion_thread = (HANDLE)_beginthreadex(NULL, 0, windows_completion_thread, NULL, 0, NULL);
+		if (completion_thread == NULL) {
+			usbi_err(ctx, "Unable to create completion thread - aborting");
+			goto init_exit;
+		}
+
 		// Create a hash table to store session ids. Second parameter is better if prime
 		htab_create(ctx, HTAB_SIZE);
 	}
@@ -904,6 +934,19 @@ init_exit: // Holds semaphore here.
 			CloseHandle(timer_thread);
 			timer_thread = NULL;
 		}
+		if (completion_thread) {
+			PostQueuedCompletionStatus(completion_port, 0, COMPLETION_KEY_EXIT, NULL);
+			if (WAIT_OBJECT_0 != WaitForSingleObject(completion_thread, INFINITE)) {
+				usbi_warn(ctx, "could not wait for completion thread to quit");
+				TerminateThread(completion_thread, 1);
+			}
+			CloseHandle(completion_thread);
+			completion_thread = NULL;
+		}
+		if (completion_port) {
+			CloseHandle(completion_port);
+			completion_port = NULL;
+		}
 		for (i = 0; i < 2; i++) {
 			if (timer_request[i]) {
 				CloseHandle(timer_request[i]);
@@ -1709,6 +1752,19 @@ static void windows_exit(void)
 			CloseHandle(timer_thread);
 			timer_thread = NULL;
 		}
+		if (completion_thread) {
+			PostQueuedCompletionStatus(completion_port, 0, COMPLETION_KEY_EXIT, NULL);
+			if (WAIT_OBJECT_0 != WaitForSingleObject(completion_thread, INFINITE)) {
+				usbi_dbg("could not wait for completion thread to quit");
+				TerminateThread(completion_thread, 1);
+			}
+			CloseHandle(completion_thread);
+			completion_thread = NULL;
+		}
+		if (completion_port) {
+			CloseHandle(completion_port);
+			completion_port = NULL;
+		}
 		for (i = 0; i < 2; i++) {
 			if (timer_request[i]) {
 				CloseHandle(timer_request[i]);
@@ -1779,21 +1835,97 @@ static int windows_get_active_config_descriptor(struct libusb_device *dev, unsig
 static int windows_open(struct libusb_device_handle *dev_handle)
 {
 	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
+	struct windows_device_handle_priv *handle_priv = _device_handle_priv(dev_handle);
 	struct libusb_context *ctx = DEVICE_CTX(dev_handle->dev);
+	int r;
 
 	if (priv->apib == NULL) {
 		usbi_err(ctx, "program assertion failed - device is not initialized");
 		return LIBUSB_ERROR_NO_DEVICE;
 	}
 
-	return priv->apib->open(SUB_API_NOTSET, dev_handle);
+	list_init(&handle_priv->completed_transfers);
+	usbi_mutex_init(&handle_priv->completion_lock, NULL);
+	if (usbi_pipe(handle_priv->completion_pipe) < 0) {
+		usbi_err(ctx, "could not create completion pipe");
+		usbi_mutex_destroy(&handle_priv->completion_lock);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	r = priv->apib->open(SUB_API_NOTSET, dev_handle);
+	if (r != LIBUSB_SUCCESS) {
+		usbi_close(handle_priv->completion_pipe[0]);
+		usbi_close(handle_priv->completion_pipe[1]);
+		usbi_mutex_destroy(&handle_priv->completion_lock);
+		return r;
+	}
+
+	// One pollable fd per device handle, whatever the number of transfers in flight
+	usbi_add_pollfd(ctx, handle_priv->completion_pipe[0], POLLIN);
+	return LIBUSB_SUCCESS;
 }
 
 static void windows_close(struct libusb_device_handle *dev_handle)
 {
 	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
+	struct windows_device_handle_priv *handle_priv = _device_handle_priv(dev_handle);
+	struct libusb_context *ctx = DEVICE_CTX(dev_handle->dev);
 
 	priv->apib->close(SUB_API_NOTSET, dev_handle);
+
+	usbi_remove_pollfd(ctx, handle_priv->completion_pipe[0]);
+	usbi_close(handle_priv->completion_pipe[0]);
+	usbi_close(handle_priv->completion_pipe[1]);
+	usbi_mutex_destroy(&handle_priv->completion_lock);
+}
+
+/*
+ * Associate a device file handle with the completion port, so that all the
+ * overlapped I/O issued on it completes through windows_completion_thread()
+ */
+static int windows_associate_handle(struct libusb_device_handle *dev_handle, HANDLE handle)
+{
+	if (CreateIoCompletionPort(handle, completion_port, (ULONG_PTR)dev_handle, 0) == NULL) {
+		usbi_err(HANDLE_CTX(dev_handle), "could not associate handle with completion port: %s",
+			windows_error_str(0));
+		return LIBUSB_ERROR_IO;
+	}
+	return LIBUSB_SUCCESS;
+}
+
+/*
+ * Get the transfer's OVERLAPPED ready for an I/O issued on handle
+ */
+static OVERLAPPED *windows_prepare_overlapped(struct usbi_transfer *itransfer, HANDLE handle)
+{
+	struct windows_transfer_priv *transfer_priv = usbi_transfer_get_os_priv(itransfer);
+
+	memset(&transfer_priv->req, 0, sizeof(transfer_priv->req));
+	transfer_priv->req.transfer_priv = transfer_priv;
+	transfer_priv->pending_reqs = 1;
+	transfer_priv->split_error = NO_ERROR;
+	transfer_priv->handle = handle;
+	transfer_priv->itransfer = itransfer;
+	return &transfer_priv->req.overlapped;
+}
+
+/*
+ * Complete a transfer for which no overlapped I/O was issued. Requests that were
+ * issued and returned TRUE must NOT come through here, as the I/O manager already
+ * queued a completion packet for them.
+ */
+static int windows_force_sync_completion(struct usbi_transfer *itransfer, ULONG size)
+{
+	struct windows_transfer_priv *transfer_priv = usbi_transfer_get_os_priv(itransfer);
+
+	transfer_priv->req.overlapped.Internal = STATUS_COMPLETED_SYNCHRONOUSLY;
+	transfer_priv->req.overlapped.InternalHigh = size;
+	if (!PostQueuedCompletionStatus(completion_port, size, 0, &transfer_priv->req.overlapped)) {
+		usbi_err(ITRANSFER_CTX(itransfer), "could not post synchronous completion: %s",
+			windows_error_str(0));
+		return LIBUSB_ERROR_OTHER;
+	}
+	return LIBUSB_SUCCESS;
 }
 
 static int windows_get_configuration(struct libusb_device_handle *dev_handle, int *config)
@@ -1914,8 +2046,9 @@ static void windows_clear_transfer_priv(struct usbi_transfer *itransfer)
 {
 	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv*)usbi_transfer_get_os_priv(itransfer);
 
-	usbi_free_fd(&transfer_priv->pollable_fd);
 	safe_free(transfer_priv->hid_buffer);
+	safe_free(transfer_priv->reqs);
+	transfer_priv->nb_reqs = 0;
 	// When auto claim is in use, attempt to release the auto-claimed interface
 	auto_release(itransfer);
 }
@@ -1923,82 +2056,75 @@ static void windows_clear_transfer_priv(struct usbi_transfer *itransfer)
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct libusb_context *ctx = DEVICE_CTX(transfer->dev_handle->dev);
-	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv*)usbi_transfer_get_os_priv(itransfer);
 	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
-	int r;
 
-	r = priv->apib->submit_bulk_transfer(SUB_API_NOTSET, itransfer);
-	if (r != LIBUSB_SUCCESS) {
-		return r;
-	}
-
-	usbi_add_pollfd(ctx, transfer_priv->pollable_fd.fd,
-		(short)(IS_XFERIN(transfer) ? POLLIN : POLLOUT));
-
-	itransfer->flags |= USBI_TRANSFER_UPDATED_FDS;
-	return LIBUSB_SUCCESS;
+	// The completion is reported through the device handle's completion pipe
+	return priv->apib->submit_bulk_transfer(SUB_API_NOTSET, itransfer);
 }
 
 static int submit_iso_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct libusb_context *ctx = DEVICE_CTX(transfer->dev_handle->dev);
-	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv*)usbi_transfer_get_os_priv(itransfer);
 	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
-	int r;
 
-	r = priv->apib->submit_iso_transfer(SUB_API_NOTSET, itransfer);
-	if (r != LIBUSB_SUCCESS) {
-		return r;
-	}
-
-	usbi_add_pollfd(ctx, transfer_priv->pollable_fd.fd,
-		(short)(IS_XFERIN(transfer) ? POLLIN : POLLOUT));
-
-	itransfer->flags |= USBI_TRANSFER_UPDATED_FDS;
-	return LIBUSB_SUCCESS;
+	// The completion is reported through the device handle's completion pipe
+	return priv->apib->submit_iso_transfer(SUB_API_NOTSET, itransfer);
 }
 
 static int submit_control_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct libusb_context *ctx = DEVICE_CTX(transfer->dev_handle->dev);
-	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv*)usbi_transfer_get_os_priv(itransfer);
 	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
-	int r;
-
-	r = priv->apib->submit_control_transfer(SUB_API_NOTSET, itransfer);
-	if (r != LIBUSB_SUCCESS) {
-		return r;
-	}
-
-	usbi_add_pollfd(ctx, transfer_priv->pollable_fd.fd, POLLIN);
-
-	itransfer->flags |= USBI_TRANSFER_UPDATED_FDS;
-	return LIBUSB_SUCCESS;
 
+	// The completion is reported through the device handle's completion pipe
+	return priv->apib->submit_control_transfer(SUB_API_NOTSET, itransfer);
 }
 
 static int windows_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct windows_transfer_priv *transfer_priv = usbi_transfer_get_os_priv(itransfer);
+	int r;
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
-		return submit_control_transfer(itransfer);
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		break;
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
 		if (IS_XFEROUT(transfer) &&
 		    transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)
 			return LIBUSB_ERROR_NOT_SUPPORTED;
-		return submit_bulk_transfer(itransfer);
-	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-		return submit_iso_transfer(itransfer);
+		break;
 	default:
 		usbi_err(TRANSFER_CTX(transfer), "unknown endpoint type %d", transfer->type);
 		return LIBUSB_ERROR_INVALID_PARAM;
 	}
+
+	// Registered before any request is issued, as it may complete right away
+	usbi_mutex_lock(&inflight_lock);
+	list_add_tail(&transfer_priv->inflight_list, &inflight_transfers);
+	usbi_mutex_unlock(&inflight_lock);
+
+	switch (transfer->type) {
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		r = submit_control_transfer(itransfer);
+		break;
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		r = submit_iso_transfer(itransfer);
+		break;
+	default:
+		r = submit_bulk_transfer(itransfer);
+		break;
+	}
+
+	// Nothing was issued on failure
+	if (r != LIBUSB_SUCCESS) {
+		usbi_mutex_lock(&inflight_lock);
+		list_del(&transfer_priv->inflight_list);
+		usbi_mutex_unlock(&inflight_lock);
+	}
+	return r;
 }
 
 static int windows_abort_control(struct usbi_transfer *itransfer)
@@ -2092,15 +2218,69 @@ static void windows_handle_callback (struct usbi_transfer *itransfer, uint32_t i
 	}
 }
 
+static DWORD windows_get_request_result(struct windows_transfer_priv *transfer_priv,
+	struct windows_overlapped *req, DWORD *io_size)
+{
+	// Handle requests that never reached the driver first
+	if (HasOverlappedIoCompletedSync(&req->overlapped)) {
+		*io_size = (DWORD)req->overlapped.InternalHigh;
+		return NO_ERROR;
+	}
+	// Regular async overlapped
+	if (GetOverlappedResult(transfer_priv->handle, &req->overlapped, io_size, false)) {
+		return NO_ERROR;
+	}
+	*io_size = 0;
+	return GetLastError();
+}
+
+/*
+ * Combine the results of the requests of a split bulk transfer. The transferred
+ * size only accounts for the data up to the first short request, since anything
+ * the following requests may have read is not contiguous with it.
+ */
+static DWORD windows_get_split_result(struct windows_transfer_priv *transfer_priv, DWORD *io_size)
+{
+	DWORD req_result, req_size, io_result = NO_ERROR;
+	bool short_request = false;
+	int i;
+
+	*io_size = 0;
+	for (i = 0; i < transfer_priv->nb_reqs; i++) {
+		if (transfer_priv->reqs[i].requested == 0) {
+			break;	// this request and the following ones were never issued
+		}
+		req_result = windows_get_request_result(transfer_priv, &transfer_priv->reqs[i], &req_size);
+		if ((io_result == NO_ERROR) && (req_result != NO_ERROR)) {
+			io_result = req_result;
+		}
+		if (short_request) {
+			if (req_size != 0) {
+				usbi_warn(ITRANSFER_CTX(transfer_priv->itransfer),
+					"discarding %u bytes received after a short packet", (unsigned int)req_size);
+			}
+			continue;
+		}
+		*io_size += req_size;
+		short_request = (req_size < transfer_priv->reqs[i].requested);
+	}
+	if (transfer_priv->split_error != NO_ERROR) {
+		io_result = transfer_priv->split_error;
+	}
+	return io_result;
+}
+
 static int windows_handle_events(struct libusb_context *ctx, struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
 {
-	struct windows_transfer_priv* transfer_priv = NULL;
+	struct windows_transfer_priv *transfer_priv, *tmp;
+	struct windows_device_handle_priv *handle_priv = NULL;
 	POLL_NFDS_TYPE i = 0;
-	bool found = false;
-	struct usbi_transfer *transfer;
+	bool found;
+	struct libusb_device_handle *handle;
+	struct list_head completed;
 	DWORD io_size, io_result;
+	unsigned char dummy;
 
-	usbi_mutex_lock(&ctx->open_devs_lock);
 	for (i = 0; i < nfds && num_ready > 0; i++) {
 
 		usbi_dbg("checking fd %d with revents = %04x", fds[i].fd, fds[i].revents);
@@ -2111,45 +2291,151 @@ static int windows_handle_events(struct libusb_context *ctx, struct pollfd *fds,
 
 		num_ready--;
 
-		// Because a Windows OVERLAPPED is used for poll emulation,
-		// a pollable fd is created and stored with each transfer
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-			transfer_priv = usbi_transfer_get_os_priv(transfer);
-			if (transfer_priv->pollable_fd.fd == fds[i].fd) {
+		// Each open device handle has a single pollable fd, signalled by the
+		// completion thread whenever its list of completed transfers fills up
+		found = false;
+		usbi_mutex_lock(&ctx->open_devs_lock);
+		list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
+			handle_priv = _device_handle_priv(handle);
+			if (handle_priv->completion_pipe[0] == fds[i].fd) {
 				found = true;
 				break;
 			}
 		}
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-
-		if (found) {
-			// Handle async requests that completed synchronously first
-			if (HasOverlappedIoCompletedSync(transfer_priv->pollable_fd.overlapped)) {
-				io_result = NO_ERROR;
-				io_size = (DWORD)transfer_priv->pollable_fd.overlapped->InternalHigh;
-			// Regular async overlapped
-			} else if (GetOverlappedResult(transfer_priv->pollable_fd.handle,
-				transfer_priv->pollable_fd.overlapped, &io_size, false)) {
-				io_result = NO_ERROR;
+		usbi_mutex_unlock(&ctx->open_devs_lock);
+
+		if (!found) {
+			usbi_err(ctx, "could not find a matching device handle for fd %x", fds[i]);
+			return LIBUSB_ERROR_NOT_FOUND;
+		}
+
+		// Take the whole list in one go. The completion thread only writes to the
+		// pipe when the list goes from empty to non-empty, so one read balances it.
+		list_init(&completed);
+		usbi_mutex_lock(&handle_priv->completion_lock);
+		if (!list_empty(&handle_priv->completed_transfers)) {
+			completed.next = handle_priv->completed_transfers.next;
+			completed.prev = handle_priv->completed_transfers.prev;
+			completed.next->prev = &completed;
+			completed.prev->next = &completed;
+			list_init(&handle_priv->completed_transfers);
+			usbi_read(handle_priv->completion_pipe[0], &dummy, sizeof(dummy));
+		}
+		usbi_mutex_unlock(&handle_priv->completion_lock);
+
+		list_for_each_entry_safe(transfer_priv, tmp, &completed, completed_list, struct windows_transfer_priv) {
+			list_del(&transfer_priv->completed_list);
+			if (transfer_priv->reqs != NULL) {
+				io_result = windows_get_split_result(transfer_priv, &io_size);
 			} else {
-				io_result = GetLastError();
+				io_result = windows_get_request_result(transfer_priv, &transfer_priv->req, &io_size);
 			}
-			usbi_remove_pollfd(ctx, transfer_priv->pollable_fd.fd);
-			// let handle_callback free the event using the transfer wfd
-			// If you don't use the transfer wfd, you run a risk of trying to free a
-			// newly allocated wfd that took the place of the one from the transfer.
-			windows_handle_callback(transfer, io_result, io_size);
-		} else {
-			usbi_err(ctx, "could not find a matching transfer for fd %x", fds[i]);
-			return LIBUSB_ERROR_NOT_FOUND;
+			windows_handle_callback(transfer_priv->itransfer, io_result, io_size);
 		}
 	}
 
-	usbi_mutex_unlock(&ctx->open_devs_lock);
 	return LIBUSB_SUCCESS;
 }
 
+/*
+ * Find the in flight transfer an OVERLAPPED belongs to, and account for its
+ * return. Returns the transfer once all its requests are back, in which case
+ * it is no longer in flight, or NULL.
+ */
+static struct windows_transfer_priv *windows_inflight_return(OVERLAPPED *overlapped, bool *found)
+{
+	struct windows_overlapped *req = (struct windows_overlapped *)overlapped;
+	struct windows_transfer_priv *transfer_priv;
+
+	*found = false;
+	usbi_mutex_lock(&inflight_lock);
+	list_for_each_entry(transfer_priv, &inflight_transfers, inflight_list, struct windows_transfer_priv) {
+		if ( (req == &transfer_priv->req) || ((transfer_priv->reqs != NULL)
+		  && (req >= transfer_priv->reqs) && (req < transfer_priv->reqs + transfer_priv->nb_reqs)) ) {
+			*found = true;
+			break;
+		}
+	}
+	if (!*found) {
+		usbi_mutex_unlock(&inflight_lock);
+		return NULL;
+	}
+	// Split transfers are only handed over once all their requests are back
+	if (InterlockedDecrement(&transfer_priv->pending_reqs) != 0) {
+		usbi_mutex_unlock(&inflight_lock);
+		return NULL;
+	}
+	list_del(&transfer_priv->inflight_list);
+	usbi_mutex_unlock(&inflight_lock);
+	return transfer_priv;
+}
+
+/*
+ * Completion port thread: dequeue completion packets in batches and hand the
+ * transfers over to the event handling thread of their device handle
+ */
+unsigned __stdcall windows_completion_thread(void* param)
+{
+	struct completion_entry entries[COMPLETION_BATCH_SIZE];
+	struct windows_transfer_priv *transfer_priv;
+	struct windows_device_handle_priv *handle_priv;
+	struct libusb_transfer *transfer;
+	ULONG i, nb_entries;
+	bool was_empty, found;
+	unsigned char dummy = 1;
+	UNUSED(param);
+
+	while (1) {
+		if (pGetQueuedCompletionStatusEx != NULL) {
+			if (!pGetQueuedCompletionStatusEx(completion_port, entries, COMPLETION_BATCH_SIZE,
+				&nb_entries, INFINITE, FALSE)) {
+				usbi_err(NULL, "GetQueuedCompletionStatusEx failed: %s", windows_error_str(0));
+				break;
+			}
+		} else {
+			// XP: one failed I/O still dequeues a packet, with a non NULL overlapped
+			if (!GetQueuedCompletionStatus(completion_port, &entries[0].size, &entries[0].key,
+				&entries[0].overlapped, INFINITE) && (entries[0].overlapped == NULL)) {
+				usbi_err(NULL, "GetQueuedCompletionStatus failed: %s", windows_error_str(0));
+				break;
+			}
+			nb_entries = 1;
+		}
+
+		for (i = 0; i < nb_entries; i++) {
+			if (entries[i].key == COMPLETION_KEY_EXIT) {
+				usbi_dbg("completion thread quitting");
+				return 0;
+			}
+			if (entries[i].overlapped == NULL) {
+				continue;
+			}
+			// The OVERLAPPED is the first member of our request structure, if
+			// it is ours at all
+			transfer_priv = windows_inflight_return(entries[i].overlapped, &found);
+			if (!found) {
+				usbi_dbg("dropping completion packet for unknown overlapped %p (key %p)",
+					entries[i].overlapped, (void *)entries[i].key);
+				continue;
+			}
+			if (transfer_priv == NULL) {
+				continue;
+			}
+			transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer_priv->itransfer);
+			handle_priv = _device_handle_priv(transfer->dev_handle);
+
+			usbi_mutex_lock(&handle_priv->completion_lock);
+			was_empty = list_empty(&handle_priv->completed_transfers);
+			list_add_tail(&transfer_priv->completed_list, &handle_priv->completed_transfers);
+			if (was_empty) {
+				usbi_write(handle_priv->completion_pipe[1], &dummy, sizeof(dummy));
+			}
+			usbi_mutex_unlock(&handle_priv->completion_lock);
+		}
+	}
+	return 1;
+}
+
 /*
  * Monotonic and real time functions
  */
@@ -2273,6 +2559,8 @@ const struct usbi_os_backend windows_backend = {
 	NULL,				/* hotplug_poll */
 	windows_open,
 	windows_close,
+	NULL,				/* device_from_fd() */
+	NULL,				/* open_fd() */
 
 	windows_get_device_descriptor,
 	windows_get_active_config_descriptor,
@@ -2287,18 +2575,28 @@ const struct usbi_os_backend windows_backend = {
 	windows_set_interface_altsetting,
 	windows_clear_halt,
 	windows_reset_device,
+	NULL,				/* alloc_streams() */
+	NULL,				/* free_streams() */
+	winusbx_set_raw_io,
 
 	windows_kernel_driver_active,
 	windows_detach_kernel_driver,
 	windows_attach_kernel_driver,
+	NULL,				/* dev_mem_alloc() */
+	NULL,				/* dev_mem_free() */
+	NULL,				/* get_frame_number() */
+	NULL,				/* sync_control_transfer() */
+	NULL,				/* sync_bulk_transfer() */
 
 	windows_destroy_device,
 
 	windows_submit_transfer,
 	windows_cancel_transfer,
 	windows_clear_transfer_priv,
+	NULL,				/* free_transfer_priv() */
 
 	windows_handle_events,
+	NULL,				/* handle_fd_event() */
 
 	windows_clock_gettime,
 #if defined(USBI_TIMERFD_AVAILABLE)
@@ -2596,6 +2894,9 @@ static int winusbx_open(int sub_api, struct libusb_device_handle *dev_handle)
 				}
 			}
 			handle_priv->interface_handle[i].dev_handle = file_handle;
+			if (windows_associate_handle(dev_handle, file_handle) != LIBUSB_SUCCESS) {
+				return LIBUSB_ERROR_IO;
+			}
 		}
 	}
 
@@ -2630,7 +2931,7 @@ static int winusbx_configure_endpoints(int sub_api, struct libusb_device_handle
 	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
 	HANDLE winusb_handle = handle_priv->interface_handle[iface].api_handle;
 	UCHAR policy;
-	ULONG timeout = 0;
+	ULONG timeout = 0, max_size, size;
 	uint8_t endpoint_address;
 	int i;
 
@@ -2667,8 +2968,63 @@ static int winusbx_configure_endpoints(int sub_api, struct libusb_device_handle
 			AUTO_CLEAR_STALL, sizeof(UCHAR), &policy)) {
 			usbi_dbg("failed to enable AUTO_CLEAR_STALL for endpoint %02X", endpoint_address);
 		}
+		// RAW_IO only applies to IN pipes and is opt-in, see libusb_set_raw_io()
+		if (IS_EPIN(endpoint_address) && handle_priv->raw_io[USBI_EP_INDEX(endpoint_address)]) {
+			if (!WinUSBX[sub_api].SetPipePolicy(winusb_handle, endpoint_address,
+				RAW_IO, sizeof(UCHAR), &policy)) {
+				usbi_dbg("failed to enable RAW_IO for endpoint %02X", endpoint_address);
+				handle_priv->raw_io[USBI_EP_INDEX(endpoint_address)] = false;
+			}
+		}
+		// Larger transfers are split, see winusbx_submit_bulk_transfer()
+		max_size = 0;
+		size = sizeof(max_size);
+		if ( (WinUSBX[sub_api].GetPipePolicy == NULL)
+		  || (!WinUSBX[sub_api].GetPipePolicy(winusb_handle, endpoint_address,
+			MAXIMUM_TRANSFER_SIZE, &size, &max_size)) ) {
+			usbi_dbg("failed to read MAXIMUM_TRANSFER_SIZE for endpoint %02X", endpoint_address);
+			max_size = 0;
+		}
+		handle_priv->max_transfer_size[USBI_EP_INDEX(endpoint_address)] = max_size;
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+static int winusbx_set_raw_io(struct libusb_device_handle *dev_handle, unsigned char endpoint, int enable)
+{
+	struct windows_device_handle_priv *handle_priv = _device_handle_priv(dev_handle);
+	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
+	HANDLE winusb_handle;
+	UCHAR policy = (enable != 0);
+	int sub_api, current_interface;
+
+	if (!IS_EPIN(endpoint)) {
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	current_interface = interface_by_endpoint(priv, handle_priv, endpoint);
+	if (current_interface < 0) {
+		usbi_err(HANDLE_CTX(dev_handle), "unable to match endpoint to an open interface");
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	if (priv->usb_interface[current_interface].apib->id != USB_API_WINUSBX) {
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+	sub_api = priv->usb_interface[current_interface].sub_api;
+	CHECK_WINUSBX_AVAILABLE(sub_api);
+	if (sub_api == SUB_API_LIBUSB0) {
+		return LIBUSB_ERROR_NOT_SUPPORTED;
 	}
 
+	winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
+	if (!WinUSBX[sub_api].SetPipePolicy(winusb_handle, endpoint, RAW_IO, sizeof(UCHAR), &policy)) {
+		usbi_err(HANDLE_CTX(dev_handle), "failed to %s RAW_IO for endpoint %02X: %s",
+			enable ? "enable" : "disable", endpoint, windows_error_str(0));
+		return LIBUSB_ERROR_IO;
+	}
+	handle_priv->raw_io[USBI_EP_INDEX(endpoint)] = (policy != 0);
+
 	return LIBUSB_SUCCESS;
 }
 
@@ -2729,6 +3085,13 @@ static int winusbx_claim_interface(int sub_api, struct libusb_device_handle *dev
 							if (!WinUSBX[sub_api].Initialize(file_handle, &winusb_handle)) {
 								continue;
 							}
+							if (windows_associate_handle(dev_handle, file_handle) != LIBUSB_SUCCESS) {
+								WinUSBX[sub_api].Free(winusb_handle);
+								CloseHandle(file_handle);
+								safe_free(dev_interface_details);
+								safe_free(dev_path_no_guid);
+								return LIBUSB_ERROR_IO;
+							}
 							found_filter = true;
 							break;
 						}
@@ -2857,12 +3220,11 @@ static int winusbx_submit_control_transfer(int sub_api, struct usbi_transfer *it
 	WINUSB_SETUP_PACKET *setup = (WINUSB_SETUP_PACKET *) transfer->buffer;
 	ULONG size;
 	HANDLE winusb_handle;
+	OVERLAPPED *overlapped;
 	int current_interface;
-	struct winfd wfd;
 
 	CHECK_WINUSBX_AVAILABLE(sub_api);
 
-	transfer_priv->pollable_fd = INVALID_WINFD;
 	size = transfer->length - LIBUSB_CONTROL_SETUP_SIZE;
 
 	if (size > MAX_CTRL_BUFFER_LENGTH)
@@ -2878,38 +3240,27 @@ static int winusbx_submit_control_transfer(int sub_api, struct usbi_transfer *it
 	usbi_dbg("will use interface %d", current_interface);
 	winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
 
-	wfd = usbi_create_fd(winusb_handle, RW_READ, NULL, NULL);
-	// Always use the handle returned from usbi_create_fd (wfd.handle)
-	if (wfd.fd < 0) {
-		return LIBUSB_ERROR_NO_MEM;
-	}
+	// Must be set before the I/O is issued, as it may complete right away
+	transfer_priv->interface_number = (uint8_t)current_interface;
+	overlapped = windows_prepare_overlapped(itransfer, winusb_handle);
 
 	// Sending of set configuration control requests from WinUSB creates issues
 	if ( ((setup->request_type & (0x03 << 5)) == LIBUSB_REQUEST_TYPE_STANDARD)
 	  && (setup->request == LIBUSB_REQUEST_SET_CONFIGURATION) ) {
 		if (setup->value != priv->active_config) {
 			usbi_warn(ctx, "cannot set configuration other than the default one");
-			usbi_free_fd(&wfd);
 			return LIBUSB_ERROR_INVALID_PARAM;
 		}
-		wfd.overlapped->Internal = STATUS_COMPLETED_SYNCHRONOUSLY;
-		wfd.overlapped->InternalHigh = 0;
-	} else {
-		if (!WinUSBX[sub_api].ControlTransfer(wfd.handle, *setup, transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, size, NULL, wfd.overlapped)) {
-			if(GetLastError() != ERROR_IO_PENDING) {
-				usbi_warn(ctx, "ControlTransfer failed: %s", windows_error_str(0));
-				usbi_free_fd(&wfd);
-				return LIBUSB_ERROR_IO;
-			}
-		} else {
-			wfd.overlapped->Internal = STATUS_COMPLETED_SYNCHRONOUSLY;
-			wfd.overlapped->InternalHigh = (DWORD)size;
-		}
+		return windows_force_sync_completion(itransfer, 0);
 	}
 
-	// Use priv_transfer to store data needed for async polling
-	transfer_priv->pollable_fd = wfd;
-	transfer_priv->interface_number = (uint8_t)current_interface;
+	// Even when it succeeds right away, the completion is queued on the port
+	if (!WinUSBX[sub_api].ControlTransfer(winusb_handle, *setup, transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, size, NULL, overlapped)) {
+		if(GetLastError() != ERROR_IO_PENDING) {
+			usbi_warn(ctx, "ControlTransfer failed: %s", windows_error_str(0));
+			return LIBUSB_ERROR_IO;
+		}
+	}
 
 	return LIBUSB_SUCCESS;
 }
@@ -2941,6 +3292,20 @@ static int winusbx_set_interface_altsetting(int sub_api, struct libusb_device_ha
 	return LIBUSB_SUCCESS;
 }
 
+static BOOL winusbx_pipe_io(int sub_api, HANDLE winusb_handle, struct libusb_transfer *transfer,
+	unsigned char *buffer, ULONG length, OVERLAPPED *overlapped)
+{
+	BOOL ret;
+
+	if (IS_XFERIN(transfer)) {
+		ret = WinUSBX[sub_api].ReadPipe(winusb_handle, transfer->endpoint, buffer, length, NULL, overlapped);
+	} else {
+		ret = WinUSBX[sub_api].WritePipe(winusb_handle, transfer->endpoint, buffer, length, NULL, overlapped);
+	}
+	// Even when it succeeds right away, the completion is queued on the port
+	return ret || (GetLastError() == ERROR_IO_PENDING);
+}
+
 static int winusbx_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
@@ -2948,15 +3313,14 @@ static int winusbx_submit_bulk_transfer(int sub_api, struct usbi_transfer *itran
 	struct windows_transfer_priv *transfer_priv = (struct windows_transfer_priv*)usbi_transfer_get_os_priv(itransfer);
 	struct windows_device_handle_priv *handle_priv = _device_handle_priv(transfer->dev_handle);
 	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
+	struct windows_overlapped *req;
 	HANDLE winusb_handle;
-	bool ret;
-	int current_interface;
-	struct winfd wfd;
+	OVERLAPPED *overlapped;
+	ULONG max_size, offset;
+	int current_interface, i, nb_reqs;
 
 	CHECK_WINUSBX_AVAILABLE(sub_api);
 
-	transfer_priv->pollable_fd = INVALID_WINFD;
-
 	current_interface = interface_by_endpoint(priv, handle_priv, transfer->endpoint);
 	if (current_interface < 0) {
 		usbi_err(ctx, "unable to match endpoint to an open interface - cancelling transfer");
@@ -2967,32 +3331,57 @@ static int winusbx_submit_bulk_transfer(int sub_api, struct usbi_transfer *itran
 
 	winusb_handle = handle_priv->interface_handle[current_interface].api_handle;
 
-	wfd = usbi_create_fd(winusb_handle, IS_XFERIN(transfer) ? RW_READ : RW_WRITE, NULL, NULL);
-	// Always use the handle returned from usbi_create_fd (wfd.handle)
-	if (wfd.fd < 0) {
-		return LIBUSB_ERROR_NO_MEM;
-	}
+	transfer_priv->interface_number = (uint8_t)current_interface;
+	overlapped = windows_prepare_overlapped(itransfer, winusb_handle);
 
-	if (IS_XFERIN(transfer)) {
-		usbi_dbg("reading %d bytes", transfer->length);
-		ret = WinUSBX[sub_api].ReadPipe(wfd.handle, transfer->endpoint, transfer->buffer, transfer->length, NULL, wfd.overlapped);
-	} else {
-		usbi_dbg("writing %d bytes", transfer->length);
-		ret = WinUSBX[sub_api].WritePipe(wfd.handle, transfer->endpoint, transfer->buffer, transfer->length, NULL, wfd.overlapped);
-	}
-	if (!ret) {
-		if(GetLastError() != ERROR_IO_PENDING) {
+	max_size = handle_priv->max_transfer_size[USBI_EP_INDEX(transfer->endpoint)];
+	if ((max_size == 0) || ((ULONG)transfer->length <= max_size)) {
+		usbi_dbg("%s %d bytes", IS_XFERIN(transfer) ? "reading" : "writing", transfer->length);
+		if (!winusbx_pipe_io(sub_api, winusb_handle, transfer, transfer->buffer, transfer->length, overlapped)) {
 			usbi_err(ctx, "ReadPipe/WritePipe failed: %s", windows_error_str(0));
-			usbi_free_fd(&wfd);
 			return LIBUSB_ERROR_IO;
 		}
-	} else {
-		wfd.overlapped->Internal = STATUS_COMPLETED_SYNCHRONOUSLY;
-		wfd.overlapped->InternalHigh = (DWORD)transfer->length;
+		return LIBUSB_SUCCESS;
 	}
 
-	transfer_priv->pollable_fd = wfd;
-	transfer_priv->interface_number = (uint8_t)current_interface;
+	// The pipe does not accept requests that large (e.g. with RAW_IO), so queue
+	// the transfer as several overlapped requests, all kept in flight at once
+	nb_reqs = (int)((transfer->length + max_size - 1) / max_size);
+	transfer_priv->reqs = (struct windows_overlapped*)calloc(nb_reqs, sizeof(struct windows_overlapped));
+	if (transfer_priv->reqs == NULL) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	transfer_priv->nb_reqs = nb_reqs;
+	transfer_priv->pending_reqs = nb_reqs;
+	for (i = 0; i < nb_reqs; i++) {
+		transfer_priv->reqs[i].transfer_priv = transfer_priv;
+	}
+
+	usbi_dbg("%s %d bytes as %d requests of up to %u bytes", IS_XFERIN(transfer) ? "reading" : "writing",
+		transfer->length, nb_reqs, (unsigned int)max_size);
+	for (i = 0, offset = 0; i < nb_reqs; i++, offset += max_size) {
+		req = &transfer_priv->reqs[i];
+		req->requested = MIN(max_size, (ULONG)transfer->length - offset);
+		if (winusbx_pipe_io(sub_api, winusb_handle, transfer, transfer->buffer + offset,
+			req->requested, &req->overlapped)) {
+			continue;
+		}
+		transfer_priv->split_error = GetLastError();
+		usbi_err(ctx, "ReadPipe/WritePipe failed: %s", windows_error_str(transfer_priv->split_error));
+		req->requested = 0;
+		if (i == 0) {
+			safe_free(transfer_priv->reqs);
+			transfer_priv->nb_reqs = 0;
+			return LIBUSB_ERROR_IO;
+		}
+		// Earlier requests are in flight, so the transfer can only fail once they
+		// are back. Post this request in place of all the ones left unissued.
+		InterlockedExchangeAdd(&transfer_priv->pending_reqs, -(LONG)(nb_reqs - i - 1));
+		if (!PostQueuedCompletionStatus(completion_port, 0, 0, &req->overlapped)) {
+			usbi_err(ctx, "could not post split transfer error: %s", windows_error_str(0));
+		}
+		break;
+	}
 
 	return LIBUSB_SUCCESS;
 }
@@ -3079,23 +3468,15 @@ static int winusbx_reset_device(int sub_api, struct libusb_device_handle *dev_ha
 	struct libusb_context *ctx = DEVICE_CTX(dev_handle->dev);
 	struct windows_device_handle_priv *handle_priv = _device_handle_priv(dev_handle);
 	struct windows_device_priv *priv = _device_priv(dev_handle->dev);
-	struct winfd wfd;
 	HANDLE winusb_handle;
 	int i, j;
 
 	CHECK_WINUSBX_AVAILABLE(sub_api);
 
 	// Reset any available pipe (except control)
+	// Pending I/O is cancelled by AbortPipe and completes through the port
 	for (i=0; i<USB_MAXINTERFACES; i++) {
 		winusb_handle = handle_priv->interface_handle[i].api_handle;
-		for (wfd = handle_to_winfd(winusb_handle); wfd.fd > 0;)
-		{
-			// Cancel any pollable I/O
-			usbi_remove_pollfd(ctx, wfd.fd);
-			usbi_free_fd(&wfd);
-			wfd = handle_to_winfd(winusb_handle);
-		}
-
 		if ( (winusb_handle != 0) && (winusb_handle != INVALID_HANDLE_VALUE)) {
 			for (j=0; j<priv->usb_interface[i].nb_endpoints; j++) {
 				usbi_dbg("resetting ep %02X", priv->usb_interface[i].endpoint[j]);
@@ -3426,7 +3807,6 @@ static int _hid_get_report(struct hid_device_priv* dev, HANDLE hid_handle, int i
 {
 	uint8_t *buf;
 	DWORD ioctl_code, read_size, expected_size = (DWORD)*size;
-	int r = LIBUSB_SUCCESS;
 
 	if (tp->hid_buffer != NULL) {
 		usbi_dbg("program assertion failed: hid_buffer is not NULL");
@@ -3461,6 +3841,8 @@ static int _hid_get_report(struct hid_device_priv* dev, HANDLE hid_handle, int i
 	read_size = expected_size;
 
 	// NB: The size returned by DeviceIoControl doesn't include report IDs when not in use (0)
+	// Even when it succeeds right away, the completion is queued on the port and
+	// the data is copied by hid_copy_transfer_data()
 	if (!DeviceIoControl(hid_handle, ioctl_code, buf, expected_size+1,
 		buf, expected_size+1, &read_size, overlapped)) {
 		if (GetLastError() != ERROR_IO_PENDING) {
@@ -3468,37 +3850,11 @@ static int _hid_get_report(struct hid_device_priv* dev, HANDLE hid_handle, int i
 			safe_free(buf);
 			return LIBUSB_ERROR_IO;
 		}
-		// Asynchronous wait
-		tp->hid_buffer = buf;
-		tp->hid_dest = (uint8_t*)data; // copy dest, as not necessarily the start of the transfer buffer
-		return LIBUSB_SUCCESS;
 	}
 
-	// Transfer completed synchronously => copy and discard extra buffer
-	if (read_size == 0) {
-		usbi_warn(NULL, "program assertion failed - read completed synchronously, but no data was read");
-		*size = 0;
-	} else {
-		if (buf[0] != id) {
-			usbi_warn(NULL, "mismatched report ID (data is %02X, parameter is %02X)", buf[0], id);
-		}
-		if ((size_t)read_size > expected_size) {
-			r = LIBUSB_ERROR_OVERFLOW;
-			usbi_dbg("OVERFLOW!");
-		} else {
-			r = LIBUSB_COMPLETED;
-		}
-
-		*size = MIN((size_t)read_size, *size);
-		if (id == 0) {
-			// Discard report ID
-			memcpy(data, buf+1, *size);
-		} else {
-			memcpy(data, buf, *size);
-		}
-	}
-	safe_free(buf);
-	return r;
+	tp->hid_buffer = buf;
+	tp->hid_dest = (uint8_t*)data; // copy dest, as not necessarily the start of the transfer buffer
+	return LIBUSB_SUCCESS;
 }
 
 static int _hid_set_report(struct hid_device_priv* dev, HANDLE hid_handle, int id, void *data,
@@ -3552,6 +3908,7 @@ static int _hid_set_report(struct hid_device_priv* dev, HANDLE hid_handle, int i
 	}
 
 	// NB: The size returned by DeviceIoControl doesn't include report IDs when not in use (0)
+	// Even when it succeeds right away, the completion is queued on the port
 	if (!DeviceIoControl(hid_handle, ioctl_code, buf, write_size,
 		buf, write_size, &write_size, overlapped)) {
 		if (GetLastError() != ERROR_IO_PENDING) {
@@ -3559,18 +3916,11 @@ static int _hid_set_report(struct hid_device_priv* dev, HANDLE hid_handle, int i
 			safe_free(buf);
 			return LIBUSB_ERROR_IO;
 		}
-		tp->hid_buffer = buf;
-		tp->hid_dest = NULL;
-		return LIBUSB_SUCCESS;
 	}
 
-	// Transfer completed synchronously
-	*size = write_size;
-	if (write_size == 0) {
-		usbi_dbg("program assertion failed - write completed synchronously, but no data was written");
-	}
-	safe_free(buf);
-	return LIBUSB_COMPLETED;
+	tp->hid_buffer = buf;
+	tp->hid_dest = NULL;
+	return LIBUSB_SUCCESS;
 }
 
 static int _hid_class_request(struct hid_device_priv* dev, HANDLE hid_handle, int request_type,
@@ -3682,6 +4032,9 @@ static int hid_open(int sub_api, struct libusb_device_handle *dev_handle)
 				priv->usb_interface[i].restricted_functionality = true;
 			}
 			handle_priv->interface_handle[i].api_handle = hid_handle;
+			if (windows_associate_handle(dev_handle, hid_handle) != LIBUSB_SUCCESS) {
+				return LIBUSB_ERROR_IO;
+			}
 		}
 	}
 
@@ -3873,14 +4226,13 @@ static int hid_submit_control_transfer(int sub_api, struct usbi_transfer *itrans
 	struct libusb_context *ctx = DEVICE_CTX(transfer->dev_handle->dev);
 	WINUSB_SETUP_PACKET *setup = (WINUSB_SETUP_PACKET *) transfer->buffer;
 	HANDLE hid_handle;
-	struct winfd wfd;
+	OVERLAPPED *overlapped;
 	int current_interface, config;
 	size_t size;
 	int r = LIBUSB_ERROR_INVALID_PARAM;
 
 	CHECK_HID_AVAILABLE;
 
-	transfer_priv->pollable_fd = INVALID_WINFD;
 	safe_free(transfer_priv->hid_buffer);
 	transfer_priv->hid_dest = NULL;
 	size = transfer->length - LIBUSB_CONTROL_SETUP_SIZE;
@@ -3898,17 +4250,14 @@ static int hid_submit_control_transfer(int sub_api, struct usbi_transfer *itrans
 
 	usbi_dbg("will use interface %d", current_interface);
 	hid_handle = handle_priv->interface_handle[current_interface].api_handle;
-	// Always use the handle returned from usbi_create_fd (wfd.handle)
-	wfd = usbi_create_fd(hid_handle, RW_READ, NULL, NULL);
-	if (wfd.fd < 0) {
-		return LIBUSB_ERROR_NOT_FOUND;
-	}
+	transfer_priv->interface_number = (uint8_t)current_interface;
+	overlapped = windows_prepare_overlapped(itransfer, hid_handle);
 
 	switch(LIBUSB_REQ_TYPE(setup->request_type)) {
 	case LIBUSB_REQUEST_TYPE_STANDARD:
 		switch(setup->request) {
 		case LIBUSB_REQUEST_GET_DESCRIPTOR:
-			r = _hid_get_descriptor(priv->hid, wfd.handle, LIBUSB_REQ_RECIPIENT(setup->request_type),
+			r = _hid_get_descriptor(priv->hid, hid_handle, LIBUSB_REQ_RECIPIENT(setup->request_type),
 				(setup->value >> 8) & 0xFF, setup->value & 0xFF, transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, &size);
 			break;
 		case LIBUSB_REQUEST_GET_CONFIGURATION:
@@ -3945,9 +4294,9 @@ static int hid_submit_control_transfer(int sub_api, struct usbi_transfer *itrans
 		}
 		break;
 	case LIBUSB_REQUEST_TYPE_CLASS:
-		r =_hid_class_request(priv->hid, wfd.handle, setup->request_type, setup->request, setup->value,
+		r =_hid_class_request(priv->hid, hid_handle, setup->request_type, setup->request, setup->value,
 			setup->index, transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, transfer_priv,
-			&size, wfd.overlapped);
+			&size, overlapped);
 		break;
 	default:
 		usbi_warn(ctx, "unsupported HID control request");
@@ -3956,20 +4305,9 @@ static int hid_submit_control_transfer(int sub_api, struct usbi_transfer *itrans
 	}
 
 	if (r == LIBUSB_COMPLETED) {
-		// Force request to be completed synchronously. Transferred size has been set by previous call
-		wfd.overlapped->Internal = STATUS_COMPLETED_SYNCHRONOUSLY;
-		// http://msdn.microsoft.com/en-us/library/ms684342%28VS.85%29.aspx
-		// set InternalHigh to the number of bytes transferred
-		wfd.overlapped->InternalHigh = (DWORD)size;
-		r = LIBUSB_SUCCESS;
-	}
-
-	if (r == LIBUSB_SUCCESS) {
-		// Use priv_transfer to store data needed for async polling
-		transfer_priv->pollable_fd = wfd;
-		transfer_priv->interface_number = (uint8_t)current_interface;
-	} else {
-		usbi_free_fd(&wfd);
+		// No overlapped I/O was issued for the request, so post its completion
+		// ourselves. Transferred size has been set by previous call
+		r = windows_force_sync_completion(itransfer, (ULONG)size);
 	}
 
 	return r;
@@ -3981,16 +4319,14 @@ static int hid_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer
 	struct libusb_context *ctx = DEVICE_CTX(transfer->dev_handle->dev);
 	struct windows_device_handle_priv *handle_priv = _device_handle_priv(transfer->dev_handle);
 	struct windows_device_priv *priv = _device_priv(transfer->dev_handle->dev);
-	struct winfd wfd;
 	HANDLE hid_handle;
+	OVERLAPPED *overlapped;
 	bool direction_in, ret;
 	int current_interface, length;
 	DWORD size;
-	int r = LIBUSB_SUCCESS;
 
 	CHECK_HID_AVAILABLE;
 
-	transfer_priv->pollable_fd = INVALID_WINFD;
 	transfer_priv->hid_dest = NULL;
 	safe_free(transfer_priv->hid_buffer);
 
@@ -4005,12 +4341,6 @@ static int hid_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer
 	hid_handle = handle_priv->interface_handle[current_interface].api_handle;
 	direction_in = transfer->endpoint & LIBUSB_ENDPOINT_IN;
 
-	wfd = usbi_create_fd(hid_handle, direction_in?RW_READ:RW_WRITE, NULL, NULL);
-	// Always use the handle returned from usbi_create_fd (wfd.handle)
-	if (wfd.fd < 0) {
-		return LIBUSB_ERROR_NO_MEM;
-	}
-
 	// If report IDs are not in use, an extra prefix byte must be added
 	if ( ((direction_in) && (!priv->hid->uses_report_ids[0]))
 	  || ((!direction_in) && (!priv->hid->uses_report_ids[1])) ) {
@@ -4024,11 +4354,13 @@ static int hid_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer
 		return LIBUSB_ERROR_NO_MEM;
 	}
 	transfer_priv->hid_expected_size = length;
+	transfer_priv->interface_number = (uint8_t)current_interface;
+	overlapped = windows_prepare_overlapped(itransfer, hid_handle);
 
 	if (direction_in) {
 		transfer_priv->hid_dest = transfer->buffer;
 		usbi_dbg("reading %d bytes (report ID: 0x00)", length);
-		ret = ReadFile(wfd.handle, transfer_priv->hid_buffer, length+1, &size, wfd.overlapped);
+		ret = ReadFile(hid_handle, transfer_priv->hid_buffer, length+1, &size, overlapped);
 	} else {
 		if (!priv->hid->uses_report_ids[1]) {
 			memcpy(transfer_priv->hid_buffer+1, transfer->buffer, transfer->length);
@@ -4037,37 +4369,19 @@ static int hid_submit_bulk_transfer(int sub_api, struct usbi_transfer *itransfer
 			memcpy(transfer_priv->hid_buffer, transfer->buffer, transfer->length);
 		}
 		usbi_dbg("writing %d bytes (report ID: 0x%02X)", length, transfer_priv->hid_buffer[0]);
-		ret = WriteFile(wfd.handle, transfer_priv->hid_buffer, length, &size, wfd.overlapped);
+		ret = WriteFile(hid_handle, transfer_priv->hid_buffer, length, &size, overlapped);
 	}
+	// Even when it succeeds right away, the completion is queued on the port, and
+	// copy_transfer_data() takes care of hid_buffer (including overflow detection)
 	if (!ret) {
 		if (GetLastError() != ERROR_IO_PENDING) {
 			usbi_err(ctx, "HID transfer failed: %s", windows_error_str(0));
-			usbi_free_fd(&wfd);
 			safe_free(transfer_priv->hid_buffer);
 			return LIBUSB_ERROR_IO;
 		}
-	} else {
-		// Only write operations that completed synchronously need to free up
-		// hid_buffer. For reads, copy_transfer_data() handles that process.
-		if (!direction_in) {
-			safe_free(transfer_priv->hid_buffer);
-		}
-		if (size == 0) {
-			usbi_err(ctx, "program assertion failed - no data was transferred");
-			size = 1;
-		}
-		if (size > (size_t)length) {
-			usbi_err(ctx, "OVERFLOW!");
-			r = LIBUSB_ERROR_OVERFLOW;
-		}
-		wfd.overlapped->Internal = STATUS_COMPLETED_SYNCHRONOUSLY;
-		wfd.overlapped->InternalHigh = size;
 	}
 
-	transfer_priv->pollable_fd = wfd;
-	transfer_priv->interface_number = (uint8_t)current_interface;
-
-	return r;
+	return LIBUSB_SUCCESS;
 }
 
 static int hid_abort_transfers(int sub_api, struct usbi_transfer *itransfer)
@@ -278,6 +278,14 @@ struct windows_device_handle_priv {
 	int active_interface;
 	struct interface_handle_t interface_handle[USB_MAXINTERFACES];
 	int autoclaim_count[USB_MAXINTERFACES]; // For auto-release
+	// Transfers dequeued from the completion port, waiting to be reaped by
+	// the event thread. completion_pipe[0] is this handle's pollable fd.
+	struct list_head completed_transfers;
+	usbi_mutex_t completion_lock;
+	int completion_pipe[2];
+	// WinUSB pipe settings, indexed with USBI_EP_INDEX()
+	ULONG max_transfer_size[USBI_MAX_ENDPOINTS]; // 0 if unknown
+	bool raw_io[USBI_MAX_ENDPOINTS];
 };
 
 static inline struct windows_device_handle_priv *_device_handle_priv(
@@ -286,9 +294,24 @@ static inline struct windows_device_handle_priv *_device_handle_priv(
 	return (struct windows_device_handle_priv *) handle->os_priv;
 }
 
+// one overlapped request, a bulk transfer may be split into several
+struct windows_overlapped {
+	OVERLAPPED overlapped;          // must be first, see windows_completion_thread()
+	struct windows_transfer_priv *transfer_priv;
+	DWORD requested;                // size of this request
+};
+
 // used for async polling functions
 struct windows_transfer_priv {
-	struct winfd pollable_fd;
+	struct windows_overlapped req;  // used when the transfer is not split
+	struct windows_overlapped *reqs; // split requests, in buffer order, or NULL
+	int nb_reqs;
+	volatile LONG pending_reqs;     // requests the completion port has yet to return
+	DWORD split_error;              // set if a split request could not be issued
+	HANDLE handle;                  // file handle the I/O was issued on
+	struct usbi_transfer *itransfer;
+	struct list_head completed_list;
+	struct list_head inflight_list;  // see windows_completion_thread()
 	uint8_t interface_number;
 	uint8_t *hid_buffer; // 1 byte extended data buffer, required for HID
 	uint8_t *hid_dest;   // transfer buffer destination, required for HID
@@ -320,6 +343,17 @@ DLL_DECLARE_PREFIXED(WINAPI, HKEY, p, SetupDiOpenDeviceInterfaceRegKey, (HDEVINF
 DLL_DECLARE_PREFIXED(WINAPI, LONG, p, RegQueryValueExW, (HKEY, LPCWSTR, LPDWORD, LPDWORD, LPBYTE, LPDWORD));
 DLL_DECLARE_PREFIXED(WINAPI, LONG, p, RegCloseKey, (HKEY));
 
+/* Kernel32 dependencies (Vista and later) */
+// Same layout as OVERLAPPED_ENTRY, which older MinGW headers do not provide
+struct completion_entry {
+	ULONG_PTR key;
+	LPOVERLAPPED overlapped;
+	ULONG_PTR internal;
+	DWORD size;
+};
+DLL_DECLARE_PREFIXED(WINAPI, BOOL, p, GetQueuedCompletionStatusEx, (HANDLE, struct completion_entry*,
+			ULONG, PULONG, DWORD, BOOL));
+
 /*
  * Windows DDK API definitions. Most of it copied from MinGW's includes
  */
@@ -0,0 +1,469 @@
+/*
+ * Managed streaming I/O functions for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusbi.h"
+
+/**
+ * @defgroup stream Streaming device I/O
+ *
+ * This page documents libusbx's managed streaming API, for applications that
+ * want to continuously read from a bulk or interrupt IN endpoint.
+ *
+ * Applications doing this with the \ref asyncio "asynchronous I/O API" all
+ * end up with the same code: allocate a number of transfers, resubmit each
+ * of them from its callback, and copy the data into a ring buffer which is
+ * drained by another part of the application. A libusb_stream does all of
+ * this internally. It owns a fixed number of transfers whose buffers are
+ * consecutive slots of a single ring buffer, keeps them in flight, and lets
+ * the reader take filled slots out of the ring in order:
+ *
+\code
+libusb_stream *stream;
+unsigned char *data;
+int length;
+
+r = libusb_stream_open(handle, 0x81, LIBUSB_TRANSFER_TYPE_BULK, 16, 16384,
+	&stream);
+...
+while (running) {
+	libusb_handle_events(ctx);
+	while ((r = libusb_stream_acquire(stream, &data, &length)) != 1) {
+		if (!data) {
+			fprintf(stderr, "stream stopped: %s\n",
+				libusb_error_name(r));
+			running = 0;
+			break;
+		}
+		if (r == 0)
+			process(data, length);
+		libusb_stream_release(stream);
+	}
+}
+libusb_stream_close(stream);
+\endcode
+ *
+ * A slot is resubmitted as soon as the reader releases it, without a round
+ * trip through an application callback, so the endpoint stays busy for as
+ * long as the reader keeps up. The ring buffer is allocated with
+ * libusb_dev_mem_alloc(), so it is DMA-capable memory on platforms which
+ * support that, and with malloc() elsewhere.
+ *
+ * Events still have to be handled as usual, either by the thread reading
+ * the stream or by a dedicated event handling thread; see \ref mtasync.
+ * libusb_stream_acquire() and libusb_stream_release() may be called from any
+ * thread, but only one thread should read a given stream.
+ */
+
+enum stream_slot_state {
+	/* the slot's transfer is submitted and owned by the device */
+	STREAM_SLOT_IN_FLIGHT,
+
+	/* the transfer has completed and the data awaits the reader */
+	STREAM_SLOT_FILLED,
+
+	/* the reader has acquired the data and not released it yet */
+	STREAM_SLOT_ACQUIRED,
+
+	/* the transfer is not submitted, and will not be resubmitted */
+	STREAM_SLOT_IDLE,
+};
+
+struct stream_slot {
+	struct libusb_stream *stream;
+	struct libusb_transfer *transfer;
+	enum stream_slot_state state;
+
+	/* 0, or the error to report to the reader for this slot */
+	int result;
+};
+
+struct libusb_stream {
+	struct libusb_device_handle *dev_handle;
+
+	/* the ring buffer, carved into num_slots slots of slot_size bytes.
+	 * buffer_dev_mem is set if it came from libusb_dev_mem_alloc() rather
+	 * than malloc() */
+	unsigned char *buffer;
+	size_t buffer_size;
+	int buffer_dev_mem;
+	int slot_size;
+
+	struct stream_slot *slots;
+	int num_slots;
+
+	/* protects everything below this point, which is updated by both the
+	 * reader and the transfer callbacks */
+	usbi_mutex_t lock;
+
+	/* next slot to hand out to the reader, and the oldest slot the reader
+	 * has not released yet. slots are acquired and released in ring order */
+	int head;
+	int tail;
+	int num_acquired;
+
+	int num_in_flight;
+	int closing;
+
+	/* 0, or the error that stopped the stream for good because a slot
+	 * could not be resubmitted, such as after the device was disconnected */
+	int error;
+
+	/* set once closing and all transfers have come back */
+	int stopped;
+};
+
+static void LIBUSB_CALL stream_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct stream_slot *slot = transfer->user_data;
+	struct libusb_stream *stream = slot->stream;
+
+	usbi_mutex_lock(&stream->lock);
+	stream->num_in_flight--;
+	if (stream->closing || stream->error) {
+		slot->state = STREAM_SLOT_IDLE;
+		if (!stream->num_in_flight)
+			stream->stopped = 1;
+	} else {
+		slot->state = STREAM_SLOT_FILLED;
+		slot->result = usbi_transfer_status_to_error(transfer->status);
+	}
+	usbi_mutex_unlock(&stream->lock);
+}
+
+/* cancel the transfers in flight. no slot becomes in flight once the
+ * stream is closing or has stopped, and a transfer that completes between
+ * the check and the cancellation is simply not found.
+ * Callers of this function must not hold the stream lock. */
+static void cancel_slots(struct libusb_stream *stream)
+{
+	int in_flight;
+	int i;
+
+	for (i = 0; i < stream->num_slots; i++) {
+		usbi_mutex_lock(&stream->lock);
+		in_flight = stream->slots[i].state == STREAM_SLOT_IN_FLIGHT;
+		usbi_mutex_unlock(&stream->lock);
+		if (in_flight)
+			libusb_cancel_transfer(stream->slots[i].transfer);
+	}
+}
+
+/* submit the transfer of a slot, which the caller has marked in flight
+ * under the stream lock. if that fails, the stream stops for good: the
+ * error is reported by every later call to libusb_stream_acquire(), and the
+ * other transfers are cancelled.
+ * Callers of this function must not hold the stream lock. */
+static int submit_slot(struct libusb_stream *stream, struct stream_slot *slot)
+{
+	int closing;
+	int r;
+
+	r = libusb_submit_transfer(slot->transfer);
+
+	usbi_mutex_lock(&stream->lock);
+	if (r < 0) {
+		stream->num_in_flight--;
+		slot->state = STREAM_SLOT_IDLE;
+		if (!stream->error)
+			stream->error = r;
+		if (stream->closing && !stream->num_in_flight)
+			stream->stopped = 1;
+	}
+	closing = stream->closing;
+	usbi_mutex_unlock(&stream->lock);
+
+	/* libusb_stream_close() may have looked for transfers to cancel before
+	 * this one was submitted */
+	if (r < 0 || closing)
+		cancel_slots(stream);
+	return r;
+}
+
+/* mark a slot in flight ahead of submit_slot().
+ * Callers of this function must hold the stream lock. */
+static void start_slot(struct libusb_stream *stream, struct stream_slot *slot)
+{
+	slot->state = STREAM_SLOT_IN_FLIGHT;
+	slot->result = 0;
+	stream->num_in_flight++;
+}
+
+static void free_stream(struct libusb_stream *stream)
+{
+	int i;
+
+	for (i = 0; i < stream->num_slots; i++)
+		libusb_free_transfer(stream->slots[i].transfer);
+	free(stream->slots);
+	if (stream->buffer_dev_mem)
+		libusb_dev_mem_free(stream->dev_handle, stream->buffer,
+			stream->buffer_size);
+	else
+		free(stream->buffer);
+	usbi_mutex_destroy(&stream->lock);
+	free(stream);
+}
+
+/** \ingroup stream
+ * Open a stream on an IN endpoint and start reading from it.
+ *
+ * This allocates a ring buffer of num_transfers * transfer_size bytes and
+ * submits num_transfers transfers of transfer_size bytes each to fill it.
+ * The transfers have no timeout.
+ *
+ * \param dev_handle a handle for the device to read from
+ * \param endpoint the address of a valid IN endpoint
+ * \param type the endpoint type, either \ref
+ * libusb_transfer_type::LIBUSB_TRANSFER_TYPE_BULK "LIBUSB_TRANSFER_TYPE_BULK"
+ * or \ref libusb_transfer_type::LIBUSB_TRANSFER_TYPE_INTERRUPT
+ * "LIBUSB_TRANSFER_TYPE_INTERRUPT"
+ * \param num_transfers number of transfers to keep in flight, which is also
+ * the number of slots of the ring buffer
+ * \param transfer_size size of each transfer and ring buffer slot in bytes
+ * \param stream output location for the new stream. Only populated if the
+ * return code is 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint is not an IN endpoint,
+ * the type is not supported or a size or count is not positive
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code if the transfers could not be submitted
+ */
+int API_EXPORTED libusb_stream_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char type, int num_transfers,
+	int transfer_size, libusb_stream **stream)
+{
+	struct libusb_stream *_stream;
+	int r = 0;
+	int i;
+
+	if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_IN)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (type != LIBUSB_TRANSFER_TYPE_BULK
+			&& type != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (num_transfers <= 0 || transfer_size <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_stream = calloc(1, sizeof(*_stream));
+	if (!_stream)
+		return LIBUSB_ERROR_NO_MEM;
+	usbi_mutex_init(&_stream->lock, NULL);
+	_stream->dev_handle = dev_handle;
+	_stream->slot_size = transfer_size;
+
+	_stream->slots = calloc(num_transfers, sizeof(*_stream->slots));
+	if (!_stream->slots) {
+		free_stream(_stream);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	_stream->buffer_size = (size_t)num_transfers * transfer_size;
+	_stream->buffer = libusb_dev_mem_alloc(dev_handle, _stream->buffer_size);
+	if (_stream->buffer)
+		_stream->buffer_dev_mem = 1;
+	else
+		_stream->buffer = malloc(_stream->buffer_size);
+	if (!_stream->buffer) {
+		free_stream(_stream);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < num_transfers; i++) {
+		struct stream_slot *slot = &_stream->slots[i];
+
+		slot->transfer = libusb_alloc_transfer(0);
+		if (!slot->transfer) {
+			free_stream(_stream);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		_stream->num_slots++;
+		slot->stream = _stream;
+		slot->state = STREAM_SLOT_IDLE;
+		libusb_fill_bulk_transfer(slot->transfer, dev_handle, endpoint,
+			_stream->buffer + (size_t)i * transfer_size, transfer_size,
+			stream_transfer_cb, slot, 0);
+		slot->transfer->type = type;
+	}
+
+	for (i = 0; i < num_transfers; i++) {
+		struct stream_slot *slot = &_stream->slots[i];
+
+		usbi_mutex_lock(&_stream->lock);
+		start_slot(_stream, slot);
+		usbi_mutex_unlock(&_stream->lock);
+		r = submit_slot(_stream, slot);
+		if (r < 0)
+			break;
+	}
+
+	if (r < 0) {
+		usbi_err(HANDLE_CTX(dev_handle), "failed to start stream: %s",
+			libusb_error_name(r));
+		libusb_stream_close(_stream);
+		return r;
+	}
+
+	*stream = _stream;
+	return 0;
+}
+
+/** \ingroup stream
+ * Take the next filled slot out of the stream's ring buffer.
+ *
+ * Slots are handed out in the order in which their data was received. The
+ * data remains valid until the slot is given back with
+ * libusb_stream_release(). Several slots may be acquired before releasing
+ * them, and they are released in the same order.
+ *
+ * This function does not handle events, nor does it block: it returns 1 if
+ * no data has arrived since the last call.
+ *
+ * If the transfer for a slot failed, the error is returned and the slot is
+ * acquired all the same, with whatever data was received before the
+ * failure. It has to be released like any other slot; releasing it
+ * resubmits the transfer.
+ *
+ * If a transfer could not be resubmitted, for instance because the device
+ * was disconnected, the stream stops for good and this function returns
+ * the error from then on, without acquiring a slot and with data set to
+ * NULL. Slots acquired before still have to be released, and the stream
+ * closed.
+ *
+ * \param stream the stream to read from
+ * \param data output location for the start of the slot's data
+ * \param length output location for the number of bytes received in the slot
+ * \returns 0 if a slot was acquired
+ * \returns 1 if no filled slot is available
+ * \returns LIBUSB_ERROR_NO_DEVICE if a slot was acquired and the device was
+ * disconnected
+ * \returns another LIBUSB_ERROR code if a slot was acquired and its
+ * transfer failed
+ * \returns the LIBUSB_ERROR code that stopped the stream, if it has stopped
+ */
+int API_EXPORTED libusb_stream_acquire(libusb_stream *stream,
+	unsigned char **data, int *length)
+{
+	struct stream_slot *slot;
+	int r;
+
+	usbi_mutex_lock(&stream->lock);
+	if (stream->error) {
+		r = stream->error;
+		usbi_mutex_unlock(&stream->lock);
+		*data = NULL;
+		*length = 0;
+		return r;
+	}
+
+	slot = &stream->slots[stream->head];
+	if (slot->state != STREAM_SLOT_FILLED) {
+		usbi_mutex_unlock(&stream->lock);
+		return 1;
+	}
+
+	slot->state = STREAM_SLOT_ACQUIRED;
+	stream->head = (stream->head + 1) % stream->num_slots;
+	stream->num_acquired++;
+	r = slot->result;
+	usbi_mutex_unlock(&stream->lock);
+
+	*data = slot->transfer->buffer;
+	*length = slot->transfer->actual_length;
+	return r;
+}
+
+/** \ingroup stream
+ * Give the oldest acquired slot back to the stream, which resubmits its
+ * transfer to receive more data.
+ *
+ * \param stream the stream the slot was acquired from
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if no slot is acquired
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code if the transfer could not be
+ * resubmitted. The stream has then stopped, and libusb_stream_acquire()
+ * reports the error from then on.
+ */
+int API_EXPORTED libusb_stream_release(libusb_stream *stream)
+{
+	struct stream_slot *slot;
+	int r = 0;
+
+	usbi_mutex_lock(&stream->lock);
+	if (!stream->num_acquired) {
+		usbi_mutex_unlock(&stream->lock);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	slot = &stream->slots[stream->tail];
+	stream->tail = (stream->tail + 1) % stream->num_slots;
+	stream->num_acquired--;
+	if (stream->closing || stream->error) {
+		slot->state = STREAM_SLOT_IDLE;
+		r = stream->error;
+		usbi_mutex_unlock(&stream->lock);
+		return r;
+	}
+
+	start_slot(stream, slot);
+	usbi_mutex_unlock(&stream->lock);
+
+	return submit_slot(stream, slot);
+}
+
+/** \ingroup stream
+ * Stop a stream and free it, along with its ring buffer. The transfers in
+ * flight are cancelled and this function handles events until all of them
+ * have been returned, so it must not be called from an event handling
+ * callback. Data in acquired slots is invalid once this function returns.
+ *
+ * \param stream the stream to close. If NULL, this function does nothing.
+ */
+void API_EXPORTED libusb_stream_close(libusb_stream *stream)
+{
+	struct libusb_context *ctx;
+	int r;
+
+	if (!stream)
+		return;
+	ctx = HANDLE_CTX(stream->dev_handle);
+
+	usbi_mutex_lock(&stream->lock);
+	stream->closing = 1;
+	if (!stream->num_in_flight)
+		stream->stopped = 1;
+	usbi_mutex_unlock(&stream->lock);
+
+	cancel_slots(stream);
+
+	while (!stream->stopped) {
+		r = libusb_handle_events_completed(ctx, &stream->stopped);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_err(ctx, "libusb_handle_events failed: %s, retrying",
+				libusb_error_name(r));
+	}
+
+	free_stream(stream);
+}
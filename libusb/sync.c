@@ -35,30 +35,193 @@
 
 static void LIBUSB_CALL sync_transfer_cb(struct libusb_transfer *transfer)
 {
-	int *completed = transfer->user_data;
-	*completed = 1;
 	usbi_dbg("actual_length=%d", transfer->actual_length);
+	usbi_sync_waiter_complete(TRANSFER_CTX(transfer), transfer->user_data);
 	/* caller interprets result and frees transfer */
 }
 
-static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
+/* wait until a waiter is completed by the callback of the transfers it was
+ * set up for, cancelling them if event handling fails */
+static void sync_wait_for_completion(struct libusb_device_handle *dev_handle,
+	struct usbi_sync_waiter *waiter, struct libusb_transfer **transfers,
+	int num_transfers)
 {
-	int r, *completed = transfer->user_data;
-	struct libusb_context *ctx = HANDLE_CTX(transfer->dev_handle);
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	int i, r;
 
-	while (!*completed) {
-		r = libusb_handle_events_completed(ctx, completed);
+	while (!usbi_sync_waiter_completed(ctx, waiter)) {
+		if (dev_handle->shard_pollfd) {
+			struct timeval tv;
+			tv.tv_sec = 60;
+			tv.tv_usec = 0;
+			r = libusb_handle_shard_events(dev_handle, &tv,
+				&waiter->completed);
+			if (r == LIBUSB_ERROR_NOT_FOUND)
+				continue;	/* sharding was just turned off */
+		} else {
+			r = usbi_handle_events_sync(ctx, waiter);
+		}
 		if (r < 0) {
 			if (r == LIBUSB_ERROR_INTERRUPTED)
 				continue;
 			usbi_err(ctx, "libusb_handle_events failed: %s, cancelling transfer and retrying",
 				 libusb_error_name(r));
-			libusb_cancel_transfer(transfer);
+			for (i = 0; i < num_transfers; i++)
+				libusb_cancel_transfer(transfers[i]);
 			continue;
 		}
 	}
 }
 
+static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
+{
+	sync_wait_for_completion(transfer->dev_handle, transfer->user_data,
+		&transfer, 1);
+}
+
+/* take the idle transfer cached by a handle along with its buffer, or
+ * allocate a new transfer if another thread is using the cached one */
+static struct libusb_transfer *get_sync_transfer(
+	struct libusb_device_handle *dev_handle, unsigned char **buffer,
+	int *buffer_size)
+{
+	struct libusb_transfer *transfer;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	transfer = dev_handle->sync_transfer;
+	*buffer = dev_handle->sync_buffer;
+	*buffer_size = dev_handle->sync_buffer_size;
+	dev_handle->sync_transfer = NULL;
+	dev_handle->sync_buffer = NULL;
+	dev_handle->sync_buffer_size = 0;
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	if (!transfer) {
+		transfer = libusb_alloc_transfer(0);
+		if (!transfer)
+			return NULL;
+		/* the waiter relies on the event handler running
+		 * sync_transfer_cb() */
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->inline_callback = 1;
+	}
+	transfer->flags = 0;
+	return transfer;
+}
+
+/* give a transfer obtained from get_sync_transfer() back to the handle */
+static void put_sync_transfer(struct libusb_device_handle *dev_handle,
+	struct libusb_transfer *transfer, unsigned char *buffer, int buffer_size)
+{
+	usbi_mutex_lock(&dev_handle->lock);
+	if (!dev_handle->sync_transfer) {
+		dev_handle->sync_transfer = transfer;
+		transfer = NULL;
+	}
+	if (!dev_handle->sync_buffer) {
+		dev_handle->sync_buffer = buffer;
+		dev_handle->sync_buffer_size = buffer_size;
+		buffer = NULL;
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	if (transfer)
+		libusb_free_transfer(transfer);
+	free(buffer);
+}
+
+/* account a transfer that took the backend's synchronous fast path in the
+ * context statistics, as the asynchronous path would have */
+static void update_fast_path_stats(struct libusb_context *ctx,
+	uint8_t type, int in, int r, int transferred)
+{
+	usbi_stats_inc(ctx, transfers_submitted[type]);
+	if (r >= 0)
+		usbi_stats_inc(ctx, transfers_completed[type]);
+	else if (r == LIBUSB_ERROR_TIMEOUT)
+		usbi_stats_inc(ctx, transfers_timed_out[type]);
+	else
+		usbi_stats_inc(ctx, transfers_failed[type]);
+	if (transferred > 0) {
+		if (in)
+			usbi_stats_add(ctx, bytes_in, transferred);
+		else
+			usbi_stats_add(ctx, bytes_out, transferred);
+	}
+}
+
+/* the wMaxPacketSize of an endpoint, looked up once per configuration and
+ * alternate setting. returns a negative value if it is unknown */
+static int sync_max_packet_size(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint)
+{
+	struct usbi_endpoint_info info;
+
+	if (usbi_get_endpoint_info(dev_handle, endpoint, &info) < 0)
+		return -1;
+	return info.wMaxPacketSize & 0x07ff;
+}
+
+/* a set of transfers submitted together by usbi_sync_transfer_batch().
+ * pending is protected by the context's event_waiters_lock */
+struct sync_batch {
+	struct usbi_sync_waiter waiter;
+	int pending;
+};
+
+/* drop a count from a batch, completing its waiter on the last one. the
+ * count is checked and the waiter signalled under the lock, because the
+ * batch lives on the stack of the waiting thread, which can only leave once
+ * it has seen the waiter completed under that lock */
+static void sync_batch_put(struct libusb_context *ctx, struct sync_batch *batch)
+{
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	if (--batch->pending == 0)
+		usbi_sync_waiter_complete_locked(&batch->waiter);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+}
+
+static void LIBUSB_CALL sync_batch_cb(struct libusb_transfer *transfer)
+{
+	sync_batch_put(TRANSFER_CTX(transfer), transfer->user_data);
+}
+
+/* submit a number of transfers for the same handle back to back and wait
+ * until all of them have completed, so that they are pipelined instead of
+ * paying for a full round trip each. the callback and user_data of the
+ * transfers are overwritten. returns the number of transfers submitted; if a
+ * submission fails, the transfers after it are not submitted */
+int usbi_sync_transfer_batch(struct libusb_device_handle *dev_handle,
+	struct libusb_transfer **transfers, int num_transfers)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct sync_batch batch;
+	int i;
+
+	usbi_sync_waiter_init(&batch.waiter);
+	/* one extra count keeps the batch from completing before all
+	 * transfers are submitted */
+	batch.pending = 1;
+	for (i = 0; i < num_transfers; i++) {
+		struct libusb_transfer *transfer = transfers[i];
+
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->inline_callback = 1;
+		transfer->callback = sync_batch_cb;
+		transfer->user_data = &batch;
+		usbi_mutex_lock(&ctx->event_waiters_lock);
+		batch.pending++;
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+		if (libusb_submit_transfer(transfer) < 0) {
+			sync_batch_put(ctx, &batch);
+			break;
+		}
+	}
+	sync_batch_put(ctx, &batch);
+
+	sync_wait_for_completion(dev_handle, &batch.waiter, transfers, i);
+	usbi_sync_waiter_destroy(ctx, &batch.waiter);
+	return i;
+}
+
 /** \ingroup syncio
  * Perform a USB control transfer.
  *
@@ -91,17 +254,36 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
 	unsigned char *data, uint16_t wLength, unsigned int timeout)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	struct libusb_transfer *transfer;
 	unsigned char *buffer;
-	int completed = 0;
+	int buffer_size;
+	struct usbi_sync_waiter waiter;
 	int r;
 
-	if (!transfer)
+	if (usbi_backend->sync_control_transfer) {
+		r = usbi_backend->sync_control_transfer(dev_handle, bmRequestType,
+			bRequest, wValue, wIndex, data, wLength, timeout);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED) {
+			update_fast_path_stats(HANDLE_CTX(dev_handle),
+				LIBUSB_TRANSFER_TYPE_CONTROL,
+				IS_EPIN(bmRequestType), r, r);
+			return r;
+		}
+	}
+
+	transfer = get_sync_transfer(dev_handle, &buffer, &buffer_size);
+	if (!transfer) {
+		free(buffer);
 		return LIBUSB_ERROR_NO_MEM;
+	}
 
-	buffer = (unsigned char*) malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
+	if (buffer_size < LIBUSB_CONTROL_SETUP_SIZE + wLength) {
+		free(buffer);
+		buffer_size = LIBUSB_CONTROL_SETUP_SIZE + wLength;
+		buffer = (unsigned char*) malloc(buffer_size);
+	}
 	if (!buffer) {
-		libusb_free_transfer(transfer);
+		put_sync_transfer(dev_handle, transfer, NULL, 0);
 		return LIBUSB_ERROR_NO_MEM;
 	}
 
@@ -111,15 +293,17 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
 
 	libusb_fill_control_transfer(transfer, dev_handle, buffer,
-		sync_transfer_cb, &completed, timeout);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		sync_transfer_cb, &waiter, timeout);
+	usbi_sync_waiter_init(&waiter);
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		usbi_sync_waiter_destroy(HANDLE_CTX(dev_handle), &waiter);
+		put_sync_transfer(dev_handle, transfer, buffer, buffer_size);
 		return r;
 	}
 
 	sync_transfer_wait_for_completion(transfer);
+	usbi_sync_waiter_destroy(HANDLE_CTX(dev_handle), &waiter);
 
 	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
 		memcpy(data, libusb_control_transfer_get_data(transfer),
@@ -151,7 +335,7 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 		r = LIBUSB_ERROR_OTHER;
 	}
 
-	libusb_free_transfer(transfer);
+	put_sync_transfer(dev_handle, transfer, buffer, buffer_size);
 	return r;
 }
 
@@ -159,24 +343,47 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *buffer, int length,
 	int *transferred, unsigned int timeout, unsigned char type)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-	int completed = 0;
+	struct libusb_transfer *transfer;
+	unsigned char *cached_buffer;
+	int cached_buffer_size;
+	struct usbi_sync_waiter waiter;
 	int r;
 
-	if (!transfer)
+	/* a transfer which fits in one packet either happens or it doesn't, so
+	 * the fast path cannot lose a partial transfer on timeout */
+	if (usbi_backend->sync_bulk_transfer
+			&& length <= sync_max_packet_size(dev_handle, endpoint)) {
+		r = usbi_backend->sync_bulk_transfer(dev_handle, endpoint, buffer,
+			length, transferred, timeout);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED) {
+			update_fast_path_stats(HANDLE_CTX(dev_handle), type,
+				IS_EPIN(endpoint), r, *transferred);
+			return r;
+		}
+	}
+
+	transfer = get_sync_transfer(dev_handle, &cached_buffer,
+		&cached_buffer_size);
+	if (!transfer) {
+		free(cached_buffer);
 		return LIBUSB_ERROR_NO_MEM;
+	}
 
 	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer, length,
-		sync_transfer_cb, &completed, timeout);
+		sync_transfer_cb, &waiter, timeout);
 	transfer->type = type;
+	usbi_sync_waiter_init(&waiter);
 
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		usbi_sync_waiter_destroy(HANDLE_CTX(dev_handle), &waiter);
+		put_sync_transfer(dev_handle, transfer, cached_buffer,
+			cached_buffer_size);
 		return r;
 	}
 
 	sync_transfer_wait_for_completion(transfer);
+	usbi_sync_waiter_destroy(HANDLE_CTX(dev_handle), &waiter);
 
 	*transferred = transfer->actual_length;
 	switch (transfer->status) {
@@ -205,7 +412,7 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 		r = LIBUSB_ERROR_OTHER;
 	}
 
-	libusb_free_transfer(transfer);
+	put_sync_transfer(dev_handle, transfer, cached_buffer, cached_buffer_size);
 	return r;
 }
 
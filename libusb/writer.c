@@ -0,0 +1,603 @@
+/*
+ * Coalescing bulk writer functions for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusbi.h"
+
+/**
+ * @defgroup writer Coalescing bulk writes
+ *
+ * This page documents libusbx's coalescing writer API, for applications
+ * whose protocol sends many small messages to a bulk OUT endpoint.
+ *
+ * Sending each such message as its own transfer costs a full round trip
+ * through the library, the kernel and the host controller for a handful of
+ * bytes, and the bus spends most of its time on transaction overhead. A
+ * libusb_writer instead copies the messages into a buffer and sends many of
+ * them as a single transfer, while still reporting the completion of every
+ * message to its own callback:
+ *
+\code
+static void LIBUSB_CALL message_sent(libusb_writer *writer, int status,
+	void *user_data)
+{
+	struct message *msg = user_data;
+
+	if (status)
+		fprintf(stderr, "message %d: %s\n", msg->id,
+			libusb_error_name(status));
+	free(msg);
+}
+
+libusb_writer *writer;
+
+r = libusb_writer_open(handle, 0x02, 4, 4096, 2, 0, &writer);
+...
+while (running) {
+	while ((msg = next_message()) != NULL) {
+		r = libusb_writer_write(writer, msg->data, msg->length,
+			message_sent, msg);
+		if (r == LIBUSB_ERROR_BUSY)
+			break;
+		...
+	}
+	libusb_handle_events(ctx);
+}
+libusb_writer_close(writer);
+\endcode
+ *
+ * The writer owns a fixed number of transfers, each with a buffer of the
+ * size given when the writer is opened, rounded down to a multiple of the
+ * endpoint's maximum packet size so that full buffers are sent as full
+ * packets. The buffers are allocated with libusb_dev_mem_alloc(), so they
+ * are DMA-capable memory on platforms which support that, and with malloc()
+ * elsewhere.
+ *
+ * Messages are gathered into the buffer being filled, which is submitted:
+ * - as soon as it is full, or the next message does not fit in it;
+ * - on the first message written while none of the writer's transfers is
+ *   in flight, as there is nothing to coalesce the message behind;
+ * - as soon as the last transfer in flight completes, so that data is
+ *   never held back while the endpoint is idle;
+ * - once its oldest message has waited for longer than the delay given
+ *   when the writer was opened, which is checked whenever a message is
+ *   written or a transfer completes;
+ * - when libusb_writer_flush() is called.
+ *
+ * Coalescing does change how the data is framed on the bus: several
+ * messages may be sent in the same packet. Protocols that rely on short
+ * packets to delimit transfers can ask for each buffer to be terminated by
+ * a zero-length packet when its length is a multiple of the maximum packet
+ * size, with \ref libusb_writer_flags::LIBUSB_WRITER_ZERO_PACKET
+ * "LIBUSB_WRITER_ZERO_PACKET".
+ *
+ * Events have to be handled as usual for the transfers to complete, either
+ * by the writing thread or by a dedicated event handling thread; see
+ * \ref mtasync. libusb_writer_write() and libusb_writer_flush() may be called
+ * from any thread, including from the writer's callbacks, but messages are
+ * only sent in the order they were written if they are written by a single
+ * thread at a time.
+ */
+
+enum writer_slot_state {
+	/* the slot's buffer is empty and its transfer is not submitted */
+	WRITER_SLOT_FREE,
+
+	/* messages are being gathered into the slot's buffer */
+	WRITER_SLOT_FILLING,
+
+	/* the slot's transfer is submitted and owned by the device */
+	WRITER_SLOT_IN_FLIGHT,
+
+	/* the transfer is back and the callbacks of its messages are being
+	 * invoked, without the writer lock held */
+	WRITER_SLOT_COMPLETING,
+};
+
+/* a message gathered into a slot, and the callback for its completion */
+struct writer_message {
+	libusb_writer_cb_fn callback;
+	void *user_data;
+	int length;
+};
+
+struct writer_slot {
+	struct libusb_writer *writer;
+	struct libusb_transfer *transfer;
+	enum writer_slot_state state;
+
+	/* the messages in the slot's buffer, in the order they were written */
+	struct writer_message *messages;
+	int num_messages;
+	int messages_size;
+
+	/* time at which the first message was gathered into the slot */
+	struct timespec first_write;
+};
+
+struct libusb_writer {
+	struct libusb_device_handle *dev_handle;
+
+	/* the transfer buffers, carved into num_slots slots of slot_size bytes.
+	 * buffer_dev_mem is set if they came from libusb_dev_mem_alloc() rather
+	 * than malloc() */
+	unsigned char *buffer;
+	size_t buffer_size;
+	int buffer_dev_mem;
+	int slot_size;
+
+	/* longest time in milliseconds a message may wait in a slot that is
+	 * not full while other transfers are in flight, or 0 for no limit */
+	unsigned int max_delay;
+
+	struct writer_slot *slots;
+	int num_slots;
+
+	/* protects everything below this point, which is updated by both the
+	 * writers and the transfer callbacks */
+	usbi_mutex_t lock;
+
+	/* the slot messages are being gathered into, or NULL */
+	struct writer_slot *filling;
+
+	/* index at which to start looking for a free slot. slots are used in
+	 * ring order, which keeps the buffers in flight in address order */
+	int next_free;
+
+	int num_in_flight;
+
+	/* number of slots in flight or completing */
+	int num_busy;
+	int closing;
+
+	/* set once closing and all slots have come back */
+	int stopped;
+};
+
+/* whether the oldest message of the filling slot has waited for longer than
+ * the writer allows. Callers of this function must hold the writer lock. */
+static int filling_expired(struct libusb_writer *writer)
+{
+	struct writer_slot *slot = writer->filling;
+	struct timespec now;
+	long elapsed;
+
+	if (!writer->max_delay)
+		return 0;
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now) < 0)
+		return 1;
+
+	elapsed = (long)(now.tv_sec - slot->first_write.tv_sec) * 1000
+		+ (now.tv_nsec - slot->first_write.tv_nsec) / 1000000;
+	return elapsed >= (long)writer->max_delay;
+}
+
+/* submit the filling slot. if that fails, the slot is marked completing and
+ * returned through failed, and the caller must complete its messages with
+ * the error once it has dropped the lock.
+ * Callers of this function must hold the writer lock. */
+static int submit_filling(struct libusb_writer *writer,
+	struct writer_slot **failed)
+{
+	struct writer_slot *slot = writer->filling;
+	int r;
+
+	writer->filling = NULL;
+	slot->state = WRITER_SLOT_IN_FLIGHT;
+	writer->num_in_flight++;
+	writer->num_busy++;
+	r = libusb_submit_transfer(slot->transfer);
+	if (r < 0) {
+		usbi_dbg("failed to submit %d messages: %s", slot->num_messages,
+			libusb_error_name(r));
+		writer->num_in_flight--;
+		slot->state = WRITER_SLOT_COMPLETING;
+		slot->transfer->actual_length = 0;
+		*failed = slot;
+	}
+	return r;
+}
+
+/* invoke the callbacks of a slot's messages and make the slot available
+ * again. messages that were entirely sent before the transfer ended get a
+ * status of 0, the others get the error the transfer ended with.
+ * Callers of this function must not hold the writer lock. */
+static void complete_slot(struct libusb_writer *writer,
+	struct writer_slot *slot, int error)
+{
+	struct libusb_transfer *transfer = slot->transfer;
+	int offset = 0;
+	int i;
+
+	if (!error)
+		error = LIBUSB_ERROR_IO;
+	for (i = 0; i < slot->num_messages; i++) {
+		struct writer_message *msg = &slot->messages[i];
+
+		offset += msg->length;
+		if (msg->callback)
+			msg->callback(writer,
+				offset <= transfer->actual_length ? 0 : error,
+				msg->user_data);
+	}
+
+	usbi_mutex_lock(&writer->lock);
+	slot->num_messages = 0;
+	transfer->length = 0;
+	slot->state = WRITER_SLOT_FREE;
+	writer->num_busy--;
+	if (writer->closing && !writer->num_busy)
+		writer->stopped = 1;
+	usbi_mutex_unlock(&writer->lock);
+}
+
+static void LIBUSB_CALL writer_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct writer_slot *slot = transfer->user_data;
+	struct libusb_writer *writer = slot->writer;
+	struct writer_slot *failed = NULL;
+	int r = 0;
+
+	usbi_mutex_lock(&writer->lock);
+	writer->num_in_flight--;
+	slot->state = WRITER_SLOT_COMPLETING;
+	if (writer->filling && !writer->closing
+			&& (!writer->num_in_flight || filling_expired(writer)))
+		r = submit_filling(writer, &failed);
+	usbi_mutex_unlock(&writer->lock);
+
+	complete_slot(writer, slot,
+		usbi_transfer_status_to_error(transfer->status));
+	if (failed)
+		complete_slot(writer, failed, r);
+}
+
+/* take a free slot to gather messages into, in ring order.
+ * Callers of this function must hold the writer lock. */
+static struct writer_slot *get_free_slot(struct libusb_writer *writer)
+{
+	int i;
+
+	for (i = 0; i < writer->num_slots; i++) {
+		struct writer_slot *slot;
+
+		slot = &writer->slots[(writer->next_free + i) % writer->num_slots];
+		if (slot->state != WRITER_SLOT_FREE)
+			continue;
+
+		writer->next_free = (writer->next_free + i + 1) % writer->num_slots;
+		slot->state = WRITER_SLOT_FILLING;
+		if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC,
+				&slot->first_write) < 0)
+			memset(&slot->first_write, 0, sizeof(slot->first_write));
+		writer->filling = slot;
+		return slot;
+	}
+
+	return NULL;
+}
+
+static void free_writer(struct libusb_writer *writer)
+{
+	int i;
+
+	for (i = 0; i < writer->num_slots; i++) {
+		libusb_free_transfer(writer->slots[i].transfer);
+		free(writer->slots[i].messages);
+	}
+	free(writer->slots);
+	if (writer->buffer_dev_mem)
+		libusb_dev_mem_free(writer->dev_handle, writer->buffer,
+			writer->buffer_size);
+	else
+		free(writer->buffer);
+	usbi_mutex_destroy(&writer->lock);
+	free(writer);
+}
+
+/** \ingroup writer
+ * Open a coalescing writer on a bulk OUT endpoint.
+ *
+ * This allocates num_transfers transfers, each with a buffer of
+ * transfer_size bytes. If transfer_size is at least the maximum packet size
+ * of the endpoint, it is rounded down to a multiple of it. Nothing is
+ * submitted until data is written. The transfers have no timeout.
+ *
+ * \param dev_handle a handle for the device to write to
+ * \param endpoint the address of a valid bulk OUT endpoint
+ * \param num_transfers the maximum number of transfers to keep in flight
+ * \param transfer_size the size of each transfer's buffer in bytes, which is
+ * also the length of the longest message that can be written
+ * \param max_delay the longest time (in milliseconds) a message may be held
+ * back in a buffer that is not full while other transfers are in flight.
+ * For no limit other than the size of the buffer, use value 0.
+ * \param flags a bitwise OR of \ref libusb_writer_flags values
+ * \param writer output location for the new writer. Only populated if the
+ * return code is 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint is not a bulk OUT
+ * endpoint of the active configuration or a size or count is not positive
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if \ref
+ * libusb_writer_flags::LIBUSB_WRITER_ZERO_PACKET "LIBUSB_WRITER_ZERO_PACKET"
+ * is requested on a platform that can't send zero length packets
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code if the active configuration could not be
+ * retrieved
+ */
+int API_EXPORTED libusb_writer_open(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int num_transfers, int transfer_size,
+	unsigned int max_delay, int flags, libusb_writer **writer)
+{
+	struct libusb_writer *_writer;
+	struct usbi_endpoint_info info;
+	int max_packet_size;
+	int i, r;
+
+	if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_OUT)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (num_transfers <= 0 || transfer_size <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if ((flags & LIBUSB_WRITER_ZERO_PACKET)
+			&& !(usbi_backend->caps & USBI_CAP_SUPPORTS_ZERO_PACKET))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = usbi_get_endpoint_info(dev_handle, endpoint, &info);
+	if (r == LIBUSB_ERROR_NOT_FOUND)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (r < 0)
+		return r;
+	if ((info.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+			!= LIBUSB_TRANSFER_TYPE_BULK)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	max_packet_size = info.wMaxPacketSize & 0x07ff;
+	if (max_packet_size > 0 && transfer_size >= max_packet_size)
+		transfer_size -= transfer_size % max_packet_size;
+
+	_writer = calloc(1, sizeof(*_writer));
+	if (!_writer)
+		return LIBUSB_ERROR_NO_MEM;
+	usbi_mutex_init(&_writer->lock, NULL);
+	_writer->dev_handle = dev_handle;
+	_writer->slot_size = transfer_size;
+	_writer->max_delay = max_delay;
+
+	_writer->slots = calloc(num_transfers, sizeof(*_writer->slots));
+	if (!_writer->slots) {
+		free_writer(_writer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	_writer->buffer_size = (size_t)num_transfers * transfer_size;
+	_writer->buffer = libusb_dev_mem_alloc(dev_handle, _writer->buffer_size);
+	if (_writer->buffer)
+		_writer->buffer_dev_mem = 1;
+	else
+		_writer->buffer = malloc(_writer->buffer_size);
+	if (!_writer->buffer) {
+		free_writer(_writer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < num_transfers; i++) {
+		struct writer_slot *slot = &_writer->slots[i];
+
+		slot->transfer = libusb_alloc_transfer(0);
+		if (!slot->transfer) {
+			free_writer(_writer);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		_writer->num_slots++;
+		slot->writer = _writer;
+		slot->state = WRITER_SLOT_FREE;
+		libusb_fill_bulk_transfer(slot->transfer, dev_handle, endpoint,
+			_writer->buffer + (size_t)i * transfer_size, 0,
+			writer_transfer_cb, slot, 0);
+		if (flags & LIBUSB_WRITER_ZERO_PACKET)
+			slot->transfer->flags |= LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+	}
+
+	*writer = _writer;
+	return 0;
+}
+
+/** \ingroup writer
+ * Write a message through a coalescing writer.
+ *
+ * The data is copied into the writer's buffer being filled, so it only has
+ * to remain valid for the duration of the call, and may be submitted before
+ * this function returns as described in \ref writer. This function does not
+ * handle events, nor does it block.
+ *
+ * If this function returns 0, the callback will be invoked exactly once,
+ * from event handling, with a status of 0 once the message has been sent,
+ * or with a LIBUSB_ERROR code if it could not be. If it returns an error,
+ * the message was not accepted and its callback will not be invoked.
+ * Callbacks of earlier messages may be invoked from within this function if
+ * the buffer holding them could not be submitted.
+ *
+ * \param writer the writer to write through
+ * \param data the message to send
+ * \param length the length of the message, which must not exceed the size
+ * of the writer's buffers
+ * \param callback the function to invoke once the message has been sent,
+ * or NULL
+ * \param user_data user data to pass to the callback
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the message is empty or does not
+ * fit in a buffer
+ * \returns LIBUSB_ERROR_BUSY if all of the writer's buffers are in flight.
+ * Events have to be handled for one of them to come back before retrying.
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code if the buffer could not be submitted
+ */
+int API_EXPORTED libusb_writer_write(libusb_writer *writer,
+	const unsigned char *data, int length, libusb_writer_cb_fn callback,
+	void *user_data)
+{
+	struct writer_slot *failed = NULL;
+	struct writer_slot *slot;
+	struct writer_message *msg;
+	int r = 0;
+
+	if (length <= 0 || length > writer->slot_size)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&writer->lock);
+	slot = writer->filling;
+	if (slot && slot->transfer->length + length > writer->slot_size) {
+		r = submit_filling(writer, &failed);
+		if (r < 0)
+			goto out;
+		slot = NULL;
+	}
+
+	if (!slot) {
+		slot = get_free_slot(writer);
+		if (!slot) {
+			r = LIBUSB_ERROR_BUSY;
+			goto out;
+		}
+	}
+
+	if (slot->num_messages == slot->messages_size) {
+		int size = slot->messages_size ? 2 * slot->messages_size : 16;
+		struct writer_message *messages;
+
+		messages = realloc(slot->messages, size * sizeof(*messages));
+		if (!messages) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		slot->messages = messages;
+		slot->messages_size = size;
+	}
+
+	memcpy(slot->transfer->buffer + slot->transfer->length, data, length);
+	slot->transfer->length += length;
+	msg = &slot->messages[slot->num_messages++];
+	msg->callback = callback;
+	msg->user_data = user_data;
+	msg->length = length;
+
+	if (slot->transfer->length == writer->slot_size || !writer->num_in_flight
+			|| filling_expired(writer)) {
+		r = submit_filling(writer, &failed);
+		if (r < 0)
+			slot->num_messages--;
+	}
+
+out:
+	/* a slot the last call to get_free_slot() left empty is given back */
+	if (writer->filling && !writer->filling->num_messages) {
+		writer->filling->state = WRITER_SLOT_FREE;
+		writer->filling = NULL;
+	}
+	usbi_mutex_unlock(&writer->lock);
+
+	if (failed)
+		complete_slot(writer, failed, r);
+	return r;
+}
+
+/** \ingroup writer
+ * Submit the messages gathered so far without waiting for the buffer to
+ * fill up. This function does not handle events; the callbacks of the
+ * messages are invoked once they have been sent, as usual.
+ *
+ * \param writer the writer to flush
+ * \returns 0 on success, or if there was nothing to send
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code if the buffer could not be submitted.
+ * The callbacks of its messages are invoked with the error before this
+ * function returns.
+ */
+int API_EXPORTED libusb_writer_flush(libusb_writer *writer)
+{
+	struct writer_slot *failed = NULL;
+	int r = 0;
+
+	usbi_mutex_lock(&writer->lock);
+	if (writer->filling)
+		r = submit_filling(writer, &failed);
+	usbi_mutex_unlock(&writer->lock);
+
+	if (failed)
+		complete_slot(writer, failed, r);
+	return r;
+}
+
+/** \ingroup writer
+ * Stop a writer and free it, along with its buffers. Messages that have not
+ * been submitted yet are discarded, and the transfers in flight are
+ * cancelled. The callbacks of all of these messages are invoked with
+ * LIBUSB_ERROR_INTERRUPTED, unless they were sent before the cancellation
+ * took effect. Call libusb_writer_flush() and handle events until the last
+ * callback has been invoked to send all the messages instead.
+ *
+ * This function handles events until all transfers have been returned, so
+ * it must not be called from an event handling callback.
+ *
+ * \param writer the writer to close. If NULL, this function does nothing.
+ */
+void API_EXPORTED libusb_writer_close(libusb_writer *writer)
+{
+	struct libusb_context *ctx;
+	struct writer_slot *discarded;
+	int r;
+	int i;
+
+	if (!writer)
+		return;
+	ctx = HANDLE_CTX(writer->dev_handle);
+
+	usbi_mutex_lock(&writer->lock);
+	writer->closing = 1;
+	discarded = writer->filling;
+	if (discarded) {
+		writer->filling = NULL;
+		discarded->state = WRITER_SLOT_COMPLETING;
+		discarded->transfer->actual_length = 0;
+		writer->num_busy++;
+	}
+	if (!writer->num_busy)
+		writer->stopped = 1;
+	for (i = 0; i < writer->num_slots; i++) {
+		if (writer->slots[i].state == WRITER_SLOT_IN_FLIGHT)
+			libusb_cancel_transfer(writer->slots[i].transfer);
+	}
+	usbi_mutex_unlock(&writer->lock);
+
+	if (discarded)
+		complete_slot(writer, discarded, LIBUSB_ERROR_INTERRUPTED);
+
+	while (!writer->stopped) {
+		r = libusb_handle_events_completed(ctx, &writer->stopped);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_err(ctx, "libusb_handle_events failed: %s, retrying",
+				libusb_error_name(r));
+	}
+
+	free_writer(writer);
+}
@@ -25,6 +25,9 @@
 /* Uncomment to start with debug message logging enabled */
 // #define ENABLE_DEBUG_LOGGING 1
 
+/* Most verbose level of the messages compiled in, 1 (error) to 4 (debug) */
+#define USBI_MAX_LOG_LEVEL 4
+
 /* type of second poll() argument */
 #define POLL_NFDS_TYPE unsigned int
 
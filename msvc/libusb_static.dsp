@@ -115,6 +115,22 @@ SOURCE=..\libusb\sync.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\libusb\writer.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\libusb\ctrlqueue.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\libusb\capture.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\libusb\stream.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\libusb\os\threads_windows.c
 # End Source File
 # Begin Source File
@@ -0,0 +1,762 @@
+/*
+ * libusbx benchmark program measuring throughput and latency against a
+ * source/sink or loopback test device
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Every combination of API (sync, async), transfer type, endpoint, transfer
+ * size and queue depth runs for a fixed time, and produces one CSV line on
+ * stdout with the throughput and the latency percentiles of the transfers,
+ * from submission to completion. Lines starting with '#' describe the setup.
+ * Progress and errors go to stderr, so that stdout can be collected as is to
+ * compare library releases, kernels or host controllers.
+ *
+ * The device is expected to run test firmware that endlessly sources IN
+ * data and sinks OUT data, such as the Atmel SAM3U benchmark firmware (see
+ * examples/sam3u_benchmark.c). With -l, OUT and IN endpoints of the same
+ * type are instead driven together, for firmware that loops data back like
+ * the Cypress FX2 bulkloop example.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <time.h>
+#endif
+
+#include "libusb.h"
+
+#define MAX_LIST		16
+#define TRANSFER_TIMEOUT	1000	/* ms */
+#define DRAIN_TIMEOUT_US	2000000
+
+/* test firmware that is looked for when no device is given */
+static const struct {
+	uint16_t vid;
+	uint16_t pid;
+	const char *name;
+} known_devices[] = {
+	{ 0x16c0, 0x0763, "Atmel SAM3U benchmark" },
+	{ 0x04b4, 0x1004, "Cypress FX2 bulkloop" },
+};
+
+static const char * const type_names[] = {
+	"control", "iso", "bulk", "interrupt"
+};
+
+struct bench_options {
+	int vid, pid;
+	int types[4];
+	int sizes[MAX_LIST];
+	int num_sizes;
+	int depths[MAX_LIST];
+	int num_depths;
+	int seconds;
+	int sync;
+	int async;
+	int loopback;
+};
+
+/* the first IN and OUT endpoint of each transfer type */
+struct bench_endpoint {
+	int valid;
+	unsigned char address;
+	int type;
+	int iface;
+	int altsetting;
+	int packet_size;
+};
+
+struct bench_stats {
+	uint32_t *latencies;
+	size_t num_latencies;
+	size_t max_latencies;
+	unsigned long transfers;
+	unsigned long errors;
+	uint64_t bytes;
+	uint64_t first_us;
+	uint64_t last_us;
+};
+
+/* the transfers kept in flight on one endpoint by an async run */
+struct bench_stream {
+	struct bench_endpoint *ep;
+	struct bench_stats stats;
+	struct libusb_transfer **transfers;
+	uint64_t *submit_us;
+	int num_transfers;
+	int in_flight;
+};
+
+static libusb_context *ctx = NULL;
+static libusb_device_handle *devh = NULL;
+static uint64_t deadline_us;
+
+static uint64_t now_us(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 +
+		(uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static void stats_reset(struct bench_stats *stats)
+{
+	free(stats->latencies);
+	memset(stats, 0, sizeof(*stats));
+}
+
+static void stats_add(struct bench_stats *stats, uint64_t submit_us,
+	uint64_t done_us, int bytes, int ok)
+{
+	if (stats->num_latencies == stats->max_latencies) {
+		size_t max = stats->max_latencies ? stats->max_latencies * 2 : 4096;
+		uint32_t *latencies = realloc(stats->latencies,
+			max * sizeof(*latencies));
+
+		if (!latencies) {
+			stats->errors++;
+			return;
+		}
+		stats->latencies = latencies;
+		stats->max_latencies = max;
+	}
+
+	if (!stats->transfers)
+		stats->first_us = submit_us;
+	stats->last_us = done_us;
+	stats->latencies[stats->num_latencies++] = (uint32_t)(done_us - submit_us);
+	stats->transfers++;
+	stats->bytes += bytes;
+	if (!ok)
+		stats->errors++;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+	uint32_t la = *(const uint32_t *)a, lb = *(const uint32_t *)b;
+
+	return la < lb ? -1 : la > lb;
+}
+
+static uint32_t percentile(const struct bench_stats *stats, int p)
+{
+	if (!stats->num_latencies)
+		return 0;
+	return stats->latencies[(stats->num_latencies - 1) * p / 100];
+}
+
+static void print_header(void)
+{
+	printf("api,type,direction,endpoint,size,depth,transfers,bytes,seconds,"
+		"mb_per_s,errors,lat_p50_us,lat_p90_us,lat_p99_us,lat_max_us\n");
+}
+
+static void print_result(const char *api, const struct bench_endpoint *ep,
+	int size, int depth, struct bench_stats *stats)
+{
+	double seconds = (stats->last_us - stats->first_us) / 1e6;
+
+	qsort(stats->latencies, stats->num_latencies, sizeof(uint32_t),
+		compare_latencies);
+	printf("%s,%s,%s,0x%02x,%d,%d,%lu,%llu,%.3f,%.3f,%lu,%u,%u,%u,%u\n",
+		api, type_names[ep->type],
+		(ep->address & LIBUSB_ENDPOINT_IN) ? "in" : "out", ep->address,
+		size, depth, stats->transfers, (unsigned long long)stats->bytes,
+		seconds, seconds > 0 ? stats->bytes / seconds / 1e6 : 0.0,
+		stats->errors, percentile(stats, 50), percentile(stats, 90),
+		percentile(stats, 99), percentile(stats, 100));
+	fflush(stdout);
+}
+
+/* the number of packets of an iso transfer of about size bytes */
+static int iso_packets(const struct bench_endpoint *ep, int size)
+{
+	int num_packets = size / ep->packet_size;
+
+	return num_packets > 0 ? num_packets : 1;
+}
+
+/* the length of the configuration descriptor, read by control transfers */
+static int config_length(void)
+{
+	struct libusb_config_descriptor *config;
+	int length;
+
+	if (libusb_get_active_config_descriptor(libusb_get_device(devh),
+			&config) < 0)
+		return LIBUSB_DT_CONFIG_SIZE;
+	length = config->wTotalLength;
+	libusb_free_config_descriptor(config);
+	return length;
+}
+
+static void fill_transfer(struct libusb_transfer *transfer,
+	const struct bench_endpoint *ep, unsigned char *buffer, int size,
+	libusb_transfer_cb_fn callback, void *user_data)
+{
+	switch (ep->type) {
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		libusb_fill_control_setup(buffer,
+			LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD |
+			LIBUSB_RECIPIENT_DEVICE, LIBUSB_REQUEST_GET_DESCRIPTOR,
+			LIBUSB_DT_CONFIG << 8, 0, (uint16_t)size);
+		libusb_fill_control_transfer(transfer, devh, buffer, callback,
+			user_data, TRANSFER_TIMEOUT);
+		break;
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		libusb_fill_iso_transfer(transfer, devh, ep->address, buffer, size,
+			iso_packets(ep, size), callback, user_data, TRANSFER_TIMEOUT);
+		libusb_set_iso_packet_lengths(transfer, ep->packet_size);
+		break;
+	case LIBUSB_TRANSFER_TYPE_BULK:
+		libusb_fill_bulk_transfer(transfer, devh, ep->address, buffer, size,
+			callback, user_data, TRANSFER_TIMEOUT);
+		break;
+	default:
+		libusb_fill_interrupt_transfer(transfer, devh, ep->address, buffer,
+			size, callback, user_data, TRANSFER_TIMEOUT);
+		break;
+	}
+}
+
+static void LIBUSB_CALL async_callback(struct libusb_transfer *transfer)
+{
+	struct bench_stream *stream = transfer->user_data;
+	uint64_t done_us = now_us();
+	int i, ok, bytes = 0;
+
+	for (i = 0; i < stream->num_transfers; i++)
+		if (stream->transfers[i] == transfer)
+			break;
+
+	ok = transfer->status == LIBUSB_TRANSFER_COMPLETED;
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		int j;
+
+		for (j = 0; j < transfer->num_iso_packets; j++) {
+			bytes += transfer->iso_packet_desc[j].actual_length;
+			if (transfer->iso_packet_desc[j].status !=
+					LIBUSB_TRANSFER_COMPLETED)
+				ok = 0;
+		}
+	} else {
+		bytes = transfer->actual_length;
+	}
+	stats_add(&stream->stats, stream->submit_us[i], done_us, bytes, ok);
+
+	if (done_us < deadline_us && transfer->status != LIBUSB_TRANSFER_NO_DEVICE) {
+		stream->submit_us[i] = now_us();
+		if (libusb_submit_transfer(transfer) == 0)
+			return;
+		stream->stats.errors++;
+	}
+	stream->in_flight--;
+}
+
+static void free_stream(struct bench_stream *stream)
+{
+	int i;
+
+	for (i = 0; i < stream->num_transfers; i++) {
+		if (!stream->transfers[i])
+			continue;
+		free(stream->transfers[i]->buffer);
+		libusb_free_transfer(stream->transfers[i]);
+	}
+	free(stream->transfers);
+	free(stream->submit_us);
+	stream->transfers = NULL;
+	stream->submit_us = NULL;
+	stream->num_transfers = 0;
+	stats_reset(&stream->stats);
+}
+
+static int alloc_stream(struct bench_stream *stream, struct bench_endpoint *ep,
+	int size, int depth)
+{
+	int buffer_size = size;
+	int num_packets = 0;
+	int i;
+
+	memset(stream, 0, sizeof(*stream));
+	stream->ep = ep;
+	stream->transfers = calloc(depth, sizeof(*stream->transfers));
+	stream->submit_us = calloc(depth, sizeof(*stream->submit_us));
+	if (!stream->transfers || !stream->submit_us)
+		goto error;
+	stream->num_transfers = depth;
+
+	if (ep->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		buffer_size += LIBUSB_CONTROL_SETUP_SIZE;
+	else if (ep->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+		num_packets = iso_packets(ep, size);
+
+	for (i = 0; i < depth; i++) {
+		unsigned char *buffer = calloc(1, buffer_size);
+
+		stream->transfers[i] = libusb_alloc_transfer(num_packets);
+		if (!stream->transfers[i] || !buffer) {
+			free(buffer);
+			goto error;
+		}
+		fill_transfer(stream->transfers[i], ep, buffer, size,
+			async_callback, stream);
+	}
+	return 0;
+
+error:
+	free_stream(stream);
+	return LIBUSB_ERROR_NO_MEM;
+}
+
+static void run_async(struct bench_endpoint **eps, int num_eps, int size,
+	int depth, int seconds)
+{
+	struct bench_stream streams[2];
+	uint64_t drain_us;
+	int in_flight = 0;
+	int i, j, r;
+
+	for (i = 0; i < num_eps; i++) {
+		if (alloc_stream(&streams[i], eps[i], size, depth) < 0) {
+			fprintf(stderr, "out of memory\n");
+			while (i--)
+				free_stream(&streams[i]);
+			return;
+		}
+	}
+
+	deadline_us = now_us() + (uint64_t)seconds * 1000000;
+	for (i = 0; i < num_eps; i++) {
+		for (j = 0; j < depth; j++) {
+			streams[i].submit_us[j] = now_us();
+			r = libusb_submit_transfer(streams[i].transfers[j]);
+			if (r < 0) {
+				fprintf(stderr, "submitting to endpoint 0x%02x failed: %s\n",
+					eps[i]->address, libusb_error_name(r));
+				break;
+			}
+			streams[i].in_flight++;
+		}
+		in_flight += streams[i].in_flight;
+	}
+
+	/* once the time is up, transfers are not resubmitted. whatever is still
+	 * stuck after a while is cancelled */
+	drain_us = deadline_us + DRAIN_TIMEOUT_US;
+	while (in_flight) {
+		struct timeval tv = { 0, 100000 };
+
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+		if (drain_us && now_us() > drain_us) {
+			libusb_cancel_all_transfers(devh, NULL, NULL);
+			drain_us = 0;
+		}
+		for (i = 0, in_flight = 0; i < num_eps; i++)
+			in_flight += streams[i].in_flight;
+	}
+
+	for (i = 0; i < num_eps; i++) {
+		print_result("async", eps[i], size, depth, &streams[i].stats);
+		free_stream(&streams[i]);
+	}
+}
+
+static int sync_transfer(struct bench_endpoint *ep, unsigned char *buffer,
+	int size, int *transferred)
+{
+	int r;
+
+	switch (ep->type) {
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		r = libusb_control_transfer(devh, LIBUSB_ENDPOINT_IN |
+			LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_DEVICE,
+			LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_CONFIG << 8, 0, buffer,
+			(uint16_t)size, TRANSFER_TIMEOUT);
+		*transferred = r > 0 ? r : 0;
+		return r < 0 ? r : 0;
+	case LIBUSB_TRANSFER_TYPE_BULK:
+		return libusb_bulk_transfer(devh, ep->address, buffer, size,
+			transferred, TRANSFER_TIMEOUT);
+	default:
+		return libusb_interrupt_transfer(devh, ep->address, buffer, size,
+			transferred, TRANSFER_TIMEOUT);
+	}
+}
+
+static void run_sync(struct bench_endpoint **eps, int num_eps, int size,
+	int seconds)
+{
+	struct bench_stats stats[2];
+	unsigned char *buffer;
+	int i, r;
+
+	buffer = calloc(1, size);
+	if (!buffer) {
+		fprintf(stderr, "out of memory\n");
+		return;
+	}
+	memset(stats, 0, sizeof(stats));
+
+	/* with loopback, the OUT transfer comes first and the IN transfer
+	 * reads back what it sent */
+	deadline_us = now_us() + (uint64_t)seconds * 1000000;
+	while (now_us() < deadline_us) {
+		for (i = 0; i < num_eps; i++) {
+			uint64_t submit_us = now_us();
+			int transferred = 0;
+
+			r = sync_transfer(eps[i], buffer, size, &transferred);
+			stats_add(&stats[i], submit_us, now_us(), transferred, r == 0);
+			if (r == LIBUSB_ERROR_NO_DEVICE)
+				deadline_us = 0;
+		}
+	}
+
+	for (i = 0; i < num_eps; i++) {
+		print_result("sync", eps[i], size, 1, &stats[i]);
+		stats_reset(&stats[i]);
+	}
+	free(buffer);
+}
+
+static void run_type(const struct bench_options *opts,
+	struct bench_endpoint table[4][2], int type)
+{
+	struct bench_endpoint *eps[2];
+	int pass, num_passes, num_eps;
+	int i, j, size, last_size, max_control;
+
+	/* on their own, each endpoint gets a pass. looped back, both together */
+	num_passes = opts->loopback ? 1 : 2;
+	for (pass = 0; pass < num_passes; pass++) {
+		num_eps = 0;
+		if (opts->loopback || pass == 0)
+			if (table[type][1].valid)
+				eps[num_eps++] = &table[type][1];
+		if (opts->loopback || pass == 1)
+			if (table[type][0].valid)
+				eps[num_eps++] = &table[type][0];
+		if (!num_eps)
+			continue;
+		if (opts->loopback && num_eps == 2) {
+			/* OUT first */
+			struct bench_endpoint *tmp = eps[0];
+			eps[0] = eps[1];
+			eps[1] = tmp;
+		}
+
+		if (eps[0]->altsetting && libusb_set_interface_alt_setting(devh,
+				eps[0]->iface, eps[0]->altsetting) < 0) {
+			fprintf(stderr, "could not select alternate setting %d of "
+				"interface %d\n", eps[0]->altsetting, eps[0]->iface);
+			continue;
+		}
+
+		max_control = config_length();
+		for (i = 0, last_size = 0; i < opts->num_sizes; i++) {
+			size = opts->sizes[i];
+			if (type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+				/* a control read can't return more than the descriptor */
+				if (size > max_control)
+					size = max_control;
+				if (size == last_size)
+					continue;
+				last_size = size;
+			} else if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+				size = iso_packets(eps[0], size) * eps[0]->packet_size;
+			}
+
+			fprintf(stderr, "%s %d bytes\n", type_names[type], size);
+			if (opts->sync && type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+				run_sync(eps, num_eps, size, opts->seconds);
+			if (opts->async)
+				for (j = 0; j < opts->num_depths; j++)
+					run_async(eps, num_eps, size, opts->depths[j],
+						opts->seconds);
+		}
+
+		if (eps[0]->altsetting)
+			libusb_set_interface_alt_setting(devh, eps[0]->iface, 0);
+	}
+}
+
+/* pick the first IN and OUT endpoint of each type, in any alternate setting,
+ * and claim the interfaces they are on */
+static void find_endpoints(struct bench_endpoint table[4][2])
+{
+	libusb_device *dev = libusb_get_device(devh);
+	struct libusb_config_descriptor *config;
+	int i, j, k;
+
+	memset(table, 0, 4 * 2 * sizeof(table[0][0]));
+
+	/* control transfers read the configuration descriptor */
+	table[LIBUSB_TRANSFER_TYPE_CONTROL][1].valid = 1;
+	table[LIBUSB_TRANSFER_TYPE_CONTROL][1].address = LIBUSB_ENDPOINT_IN;
+	table[LIBUSB_TRANSFER_TYPE_CONTROL][1].type = LIBUSB_TRANSFER_TYPE_CONTROL;
+
+	if (libusb_get_active_config_descriptor(dev, &config) < 0)
+		return;
+
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+		int claimed = 0;
+
+		for (j = 0; j < iface->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *alt =
+				&iface->altsetting[j];
+
+			for (k = 0; k < alt->bNumEndpoints; k++) {
+				const struct libusb_endpoint_descriptor *epd =
+					&alt->endpoint[k];
+				int type = epd->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+				int dir = (epd->bEndpointAddress & LIBUSB_ENDPOINT_IN) ? 1 : 0;
+				struct bench_endpoint *ep = &table[type][dir];
+				int mps = epd->wMaxPacketSize;
+
+				if (ep->valid)
+					continue;
+				if (!claimed && libusb_claim_interface(devh,
+						alt->bInterfaceNumber) < 0) {
+					fprintf(stderr, "could not claim interface %d\n",
+						alt->bInterfaceNumber);
+					break;
+				}
+				claimed = 1;
+
+				ep->valid = 1;
+				ep->address = epd->bEndpointAddress;
+				ep->type = type;
+				ep->iface = alt->bInterfaceNumber;
+				ep->altsetting = alt->bAlternateSetting;
+				/* high-bandwidth endpoints move several packets per
+				 * microframe */
+				ep->packet_size = (mps & 0x7ff) * (1 + ((mps >> 11) & 3));
+			}
+		}
+	}
+	libusb_free_config_descriptor(config);
+}
+
+static int parse_list(const char *arg, int *list)
+{
+	int n = 0;
+
+	while (*arg && n < MAX_LIST) {
+		char *end;
+		long value = strtol(arg, &end, 0);
+
+		if (end == arg || value <= 0)
+			return -1;
+		list[n++] = (int)value;
+		arg = *end == ',' ? end + 1 : end;
+	}
+	return n;
+}
+
+static int parse_types(const char *arg, int *types)
+{
+	int i;
+
+	memset(types, 0, 4 * sizeof(*types));
+	while (*arg) {
+		size_t len = strcspn(arg, ",");
+
+		for (i = 0; i < 4; i++)
+			if (strlen(type_names[i]) == len &&
+			    !strncmp(arg, type_names[i], len))
+				break;
+		if (i == 4)
+			return -1;
+		types[i] = 1;
+		arg += len;
+		if (*arg == ',')
+			arg++;
+	}
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -d vid:pid   device to use, default: known test firmware\n"
+		"  -t types     transfer types, default: control,bulk,interrupt,iso\n"
+		"  -s sizes     transfer sizes in bytes,"
+		" default: 64,512,4096,16384,65536,262144\n"
+		"  -q depths    async queue depths, default: 1,2,8,32\n"
+		"  -T seconds   duration of each measurement, default: 1\n"
+		"  -l           loopback firmware: drive OUT and IN together\n"
+		"  -S           synchronous API only\n"
+		"  -A           asynchronous API only\n", name);
+}
+
+static int parse_options(int argc, char **argv, struct bench_options *opts)
+{
+	static const int sizes[] = { 64, 512, 4096, 16384, 65536, 262144 };
+	static const int depths[] = { 1, 2, 8, 32 };
+	int i;
+
+	memset(opts, 0, sizeof(*opts));
+	for (i = 0; i < 4; i++)
+		opts->types[i] = 1;
+	memcpy(opts->sizes, sizes, sizeof(sizes));
+	opts->num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+	memcpy(opts->depths, depths, sizeof(depths));
+	opts->num_depths = sizeof(depths) / sizeof(depths[0]);
+	opts->seconds = 1;
+	opts->sync = opts->async = 1;
+
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (arg[0] != '-' || !arg[1] || arg[2])
+			return -1;
+
+		switch (arg[1]) {
+		case 'l':
+			opts->loopback = 1;
+			continue;
+		case 'S':
+			opts->async = 0;
+			continue;
+		case 'A':
+			opts->sync = 0;
+			continue;
+		}
+
+		if (!value)
+			return -1;
+		i++;
+
+		switch (arg[1]) {
+		case 'd':
+			if (sscanf(value, "%x:%x", &opts->vid, &opts->pid) != 2)
+				return -1;
+			break;
+		case 't':
+			if (parse_types(value, opts->types) < 0)
+				return -1;
+			break;
+		case 's':
+			opts->num_sizes = parse_list(value, opts->sizes);
+			if (opts->num_sizes <= 0)
+				return -1;
+			break;
+		case 'q':
+			opts->num_depths = parse_list(value, opts->depths);
+			if (opts->num_depths <= 0)
+				return -1;
+			break;
+		case 'T':
+			opts->seconds = atoi(value);
+			if (opts->seconds <= 0)
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const int type_order[] = {
+		LIBUSB_TRANSFER_TYPE_CONTROL, LIBUSB_TRANSFER_TYPE_BULK,
+		LIBUSB_TRANSFER_TYPE_INTERRUPT, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
+	};
+	struct bench_endpoint table[4][2];
+	struct bench_options opts;
+	const struct libusb_version *version;
+	struct libusb_device_descriptor desc;
+	const char *name = "";
+	size_t i;
+	int r;
+
+	if (parse_options(argc, argv, &opts) < 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "libusb_init failed: %s\n", libusb_error_name(r));
+		return 1;
+	}
+
+	if (opts.vid || opts.pid) {
+		devh = libusb_open_device_with_vid_pid(ctx, (uint16_t)opts.vid,
+			(uint16_t)opts.pid);
+	} else {
+		for (i = 0; !devh && i < sizeof(known_devices) / sizeof(known_devices[0]); i++) {
+			devh = libusb_open_device_with_vid_pid(ctx, known_devices[i].vid,
+				known_devices[i].pid);
+			name = known_devices[i].name;
+		}
+	}
+	if (!devh) {
+		fprintf(stderr, "no test device found\n");
+		libusb_exit(ctx);
+		return 1;
+	}
+
+	libusb_set_auto_detach_kernel_driver(devh, 1);
+	libusb_get_device_descriptor(libusb_get_device(devh), &desc);
+	find_endpoints(table);
+
+	version = libusb_get_version();
+	printf("# libusbx %u.%u.%u.%u\n", version->major, version->minor,
+		version->micro, version->nano);
+	printf("# device %04x:%04x %s, speed %d\n", desc.idVendor,
+		desc.idProduct, name, libusb_get_device_speed(libusb_get_device(devh)));
+	printf("# %d s per measurement%s\n", opts.seconds,
+		opts.loopback ? ", loopback" : "");
+	print_header();
+
+	for (i = 0; i < sizeof(type_order) / sizeof(type_order[0]); i++)
+		if (opts.types[type_order[i]])
+			run_type(&opts, table, type_order[i]);
+
+	libusb_close(devh);
+	libusb_exit(ctx);
+	return 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * libusbx microbenchmark comparing the descriptor decoders against
+ * usbi_parse_descriptor()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * A synthetic configuration descriptor is walked with a descriptor iterator
+ * many times over. Each pass either only walks the descriptors, decodes them
+ * with the libusb_get_iterator_*() functions (the fixed-layout decoders used
+ * by descriptor.c) or decodes them with usbi_parse_descriptor() and the
+ * format strings the decoders replaced. One CSV line is printed per method
+ * with the time per descriptor; the walk-only line is the cost shared by the
+ * two others.
+ *
+ * usbi_parse_descriptor() is internal, so this program is linked against
+ * the static library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <time.h>
+#endif
+
+#include "libusb.h"
+
+#define NUM_INTERFACES		4
+#define NUM_ENDPOINTS		2
+#define DEFAULT_PASSES		200000
+
+/* from libusbi.h */
+int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
+	void *dest, int host_endian);
+
+static unsigned char config[LIBUSB_DT_CONFIG_SIZE + NUM_INTERFACES *
+	(LIBUSB_DT_INTERFACE_SIZE + NUM_ENDPOINTS *
+	(LIBUSB_DT_ENDPOINT_SIZE + LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE))];
+static int config_length;
+static int num_descriptors;
+
+/* keeps the decoded fields alive */
+static volatile unsigned int sink;
+
+static uint64_t now_us(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 +
+		(uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static unsigned char *add_descriptor(int length, int type)
+{
+	unsigned char *p = config + config_length;
+
+	memset(p, 0, length);
+	p[0] = (unsigned char)length;
+	p[1] = (unsigned char)type;
+	config_length += length;
+	num_descriptors++;
+	return p;
+}
+
+/* a SuperSpeed bulk function with NUM_INTERFACES interfaces, each with an
+ * IN and an OUT endpoint */
+static void build_config(void)
+{
+	unsigned char *p;
+	int i, j;
+
+	p = add_descriptor(LIBUSB_DT_CONFIG_SIZE, LIBUSB_DT_CONFIG);
+	p[4] = NUM_INTERFACES;
+	p[5] = 1;
+	p[7] = 0x80;
+	p[8] = 10;
+	for (i = 0; i < NUM_INTERFACES; i++) {
+		p = add_descriptor(LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE);
+		p[2] = (unsigned char)i;
+		p[4] = NUM_ENDPOINTS;
+		p[5] = LIBUSB_CLASS_VENDOR_SPEC;
+		for (j = 0; j < NUM_ENDPOINTS; j++) {
+			p = add_descriptor(LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT);
+			p[2] = (unsigned char)((j ? LIBUSB_ENDPOINT_IN : 0) | (i + 1));
+			p[3] = LIBUSB_TRANSFER_TYPE_BULK;
+			p[4] = 0x00;
+			p[5] = 0x04;
+			p = add_descriptor(LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE,
+				LIBUSB_DT_SS_ENDPOINT_COMPANION);
+			p[2] = 15;
+		}
+	}
+	config[2] = (unsigned char)(config_length & 0xff);
+	config[3] = (unsigned char)(config_length >> 8);
+}
+
+static unsigned int walk(void)
+{
+	struct libusb_descriptor_iterator iter;
+	unsigned int sum = 0;
+	int type;
+
+	libusb_init_descriptor_iterator(&iter, config, config_length);
+	while ((type = libusb_next_descriptor(&iter)) > 0)
+		sum += iter.descriptor[0];
+	return sum;
+}
+
+static unsigned int decode(void)
+{
+	struct libusb_descriptor_iterator iter;
+	struct libusb_config_descriptor cfg;
+	struct libusb_interface_descriptor altsetting;
+	struct libusb_endpoint_descriptor endpoint;
+	struct libusb_ss_endpoint_companion_descriptor ep_comp;
+	unsigned int sum = 0;
+	int type;
+
+	libusb_init_descriptor_iterator(&iter, config, config_length);
+	while ((type = libusb_next_descriptor(&iter)) > 0) {
+		switch (type) {
+		case LIBUSB_DT_CONFIG:
+			libusb_get_iterator_config_descriptor(&iter, &cfg);
+			sum += cfg.wTotalLength;
+			break;
+		case LIBUSB_DT_INTERFACE:
+			libusb_get_iterator_interface_descriptor(&iter, &altsetting);
+			sum += altsetting.bInterfaceNumber;
+			break;
+		case LIBUSB_DT_ENDPOINT:
+			libusb_get_iterator_endpoint_descriptor(&iter, &endpoint);
+			sum += endpoint.wMaxPacketSize;
+			break;
+		case LIBUSB_DT_SS_ENDPOINT_COMPANION:
+			libusb_get_iterator_ss_endpoint_companion_descriptor(&iter,
+				&ep_comp);
+			sum += ep_comp.bMaxBurst;
+			break;
+		}
+	}
+	return sum;
+}
+
+static unsigned int parse(void)
+{
+	struct libusb_descriptor_iterator iter;
+	struct libusb_config_descriptor cfg;
+	struct libusb_interface_descriptor altsetting;
+	struct libusb_endpoint_descriptor endpoint;
+	struct libusb_ss_endpoint_companion_descriptor ep_comp;
+	unsigned int sum = 0;
+	int type;
+
+	libusb_init_descriptor_iterator(&iter, config, config_length);
+	while ((type = libusb_next_descriptor(&iter)) > 0) {
+		switch (type) {
+		case LIBUSB_DT_CONFIG:
+			usbi_parse_descriptor(iter.descriptor, "bbwbbbbb", &cfg, 0);
+			sum += cfg.wTotalLength;
+			break;
+		case LIBUSB_DT_INTERFACE:
+			usbi_parse_descriptor(iter.descriptor, "bbbbbbbbb",
+				&altsetting, 0);
+			sum += altsetting.bInterfaceNumber;
+			break;
+		case LIBUSB_DT_ENDPOINT:
+			usbi_parse_descriptor(iter.descriptor, "bbbbwb", &endpoint, 0);
+			sum += endpoint.wMaxPacketSize;
+			break;
+		case LIBUSB_DT_SS_ENDPOINT_COMPANION:
+			usbi_parse_descriptor(iter.descriptor, "bbbbw", &ep_comp, 0);
+			sum += ep_comp.bMaxBurst;
+			break;
+		}
+	}
+	return sum;
+}
+
+static const struct {
+	const char *name;
+	unsigned int (*run)(void);
+} methods[] = {
+	{ "walk", walk },
+	{ "decode", decode },
+	{ "parse", parse },
+};
+
+int main(int argc, char **argv)
+{
+	long passes = DEFAULT_PASSES;
+	uint64_t start, elapsed;
+	unsigned int i;
+	long j;
+
+	if (argc > 2 || (argc == 2 && (passes = atol(argv[1])) <= 0)) {
+		fprintf(stderr, "usage: %s [passes]\n", argv[0]);
+		return 1;
+	}
+
+	build_config();
+	if (decode() != parse()) {
+		fprintf(stderr, "decoders and usbi_parse_descriptor() disagree\n");
+		return 1;
+	}
+
+	printf("# %d descriptors, %d bytes, %ld passes\n", num_descriptors,
+		config_length, passes);
+	printf("method,descriptors,ns_per_descriptor\n");
+	for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+		start = now_us();
+		for (j = 0; j < passes; j++)
+			sink += methods[i].run();
+		elapsed = now_us() - start;
+		printf("%s,%ld,%.2f\n", methods[i].name, passes * num_descriptors,
+			(double)elapsed * 1000 / ((double)passes * num_descriptors));
+	}
+	return 0;
+}
@@ -19,10 +19,25 @@
 
 #include <stdio.h>
 #include <memory.h>
+#if defined(_WIN32)
+#include <windows.h>
+#define msleep(ms) Sleep(ms)
+#else
+#include <unistd.h>
+#define msleep(ms) usleep((ms) * 1000)
+#endif
 
 #include "libusb.h"
 #include "libusbx_testlib.h"
 
+/* the loopback device made up by the null backend (--enable-null-backend).
+ * the tests that need it are skipped when it can't be found */
+#define NULL_VID 0xffff
+#define NULL_PID 0x0100
+#define NULL_EP_OUT 0x01
+#define NULL_EP_IN 0x81
+#define NULL_EP_INT_OUT 0x02
+
 /** Test that creates and destroys a single concurrent context
  * 10000 times. */
 static libusbx_testlib_result test_init_and_exit(libusbx_testlib_ctx * tctx)
@@ -144,12 +159,627 @@ static libusbx_testlib_result test_default_context_change(libusbx_testlib_ctx *
 	return TEST_STATUS_SUCCESS;
 }
 
+/** Tests that transfers taken from a pool are recycled and come back
+ * looking freshly allocated. */
+static libusbx_testlib_result test_transfer_pool(libusbx_testlib_ctx * tctx)
+{
+#define POOL_SIZE 16
+	struct libusb_transfer * transfers[POOL_SIZE + 1];
+	libusb_transfer_pool * pool;
+	int i, j;
+
+	pool = libusb_alloc_transfer_pool(POOL_SIZE, 8);
+	if (!pool) {
+		libusbx_testlib_logf(tctx, "Failed to allocate transfer pool");
+		return TEST_STATUS_FAILURE;
+	}
+
+	for (i = 0; i < 1000; ++i) {
+		/* take one more than the pool holds, so that it has to grow */
+		for (j = 0; j < POOL_SIZE + 1; ++j) {
+			transfers[j] = libusb_pool_get_transfer(pool);
+			if (!transfers[j]) {
+				libusbx_testlib_logf(tctx,
+					"Failed to get transfer %d on iteration %d", j, i);
+				return TEST_STATUS_FAILURE;
+			}
+			if (transfers[j]->length != 0 || transfers[j]->num_iso_packets != 0
+					|| transfers[j]->iso_packet_desc[7].length != 0) {
+				libusbx_testlib_logf(tctx,
+					"Transfer %d not reset on iteration %d", j, i);
+				return TEST_STATUS_FAILURE;
+			}
+			transfers[j]->length = 64;
+			transfers[j]->num_iso_packets = 8;
+			transfers[j]->iso_packet_desc[7].length = 64;
+		}
+		for (j = 0; j < POOL_SIZE + 1; ++j)
+			libusb_free_transfer(transfers[j]);
+	}
+
+	/* the pool must outlive transfers that are still handed out */
+	transfers[0] = libusb_pool_get_transfer(pool);
+	libusb_free_transfer_pool(pool);
+	libusb_free_transfer(transfers[0]);
+
+	return TEST_STATUS_SUCCESS;
+#undef POOL_SIZE
+}
+
+/* open the null backend's device on a new context */
+static libusbx_testlib_result open_null_device(libusbx_testlib_ctx * tctx,
+	libusb_context ** ctx, libusb_device_handle ** handle)
+{
+	int r = libusb_init(ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_SKIP;
+	}
+	*handle = libusb_open_device_with_vid_pid(*ctx, NULL_VID, NULL_PID);
+	if (!*handle) {
+		libusbx_testlib_logf(tctx, "No null backend device");
+		libusb_exit(*ctx);
+		return TEST_STATUS_SKIP;
+	}
+	return TEST_STATUS_SUCCESS;
+}
+
+static void close_null_device(libusb_context * ctx,
+	libusb_device_handle * handle)
+{
+	libusb_close(handle);
+	libusb_exit(ctx);
+}
+
+static void LIBUSB_CALL count_transfer_cb(struct libusb_transfer * transfer)
+{
+	int * completed = transfer->user_data;
+	++*completed;
+}
+
+/* submit num_transfers bulk IN transfers counting into completed */
+static int submit_counted_transfers(libusb_device_handle * handle,
+	struct libusb_transfer ** transfers, int num_transfers,
+	unsigned char * buffer, int * completed)
+{
+	int i, r;
+	for (i = 0; i < num_transfers; ++i) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i])
+			return LIBUSB_ERROR_NO_MEM;
+		libusb_fill_bulk_transfer(transfers[i], handle, NULL_EP_IN,
+			buffer, 8, count_transfer_cb, completed, 0);
+		r = libusb_submit_transfer(transfers[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_free_transfer(transfers[i]);
+			transfers[i] = NULL;
+			return r;
+		}
+	}
+	return 0;
+}
+
+static void free_transfers(struct libusb_transfer ** transfers,
+	int num_transfers)
+{
+	int i;
+	for (i = 0; i < num_transfers; ++i)
+		libusb_free_transfer(transfers[i]);
+}
+
+/** Tests that a single thread can queue far more transfers on one handle
+ * than the backend's completion pipe holds before handling events. */
+static libusbx_testlib_result test_null_deep_queue(libusbx_testlib_ctx * tctx)
+{
+#define QUEUE_DEPTH 20000
+	static struct libusb_transfer * transfers[QUEUE_DEPTH];
+	unsigned char buffer[8];
+	libusb_context * ctx;
+	libusb_device_handle * handle;
+	libusbx_testlib_result result;
+	int completed = 0;
+	int r;
+
+	result = open_null_device(tctx, &ctx, &handle);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+	memset(transfers, 0, sizeof(transfers));
+
+	r = submit_counted_transfers(handle, transfers, QUEUE_DEPTH, buffer,
+		&completed);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to submit transfers: %d", r);
+		result = TEST_STATUS_FAILURE;
+	}
+	while (completed < QUEUE_DEPTH && result == TEST_STATUS_SUCCESS) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Failed to handle events: %d", r);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+	free_transfers(transfers, QUEUE_DEPTH);
+	close_null_device(ctx, handle);
+	return result;
+#undef QUEUE_DEPTH
+}
+
+/** Tests that libusb_handle_events_budget() stops early, that the
+ * transfers it leaves behind are completed by later calls, and that it
+ * reports every completion it handled. */
+static libusbx_testlib_result test_null_event_budget(libusbx_testlib_ctx * tctx)
+{
+#define NUM_TRANSFERS 200
+	struct libusb_transfer * transfers[NUM_TRANSFERS];
+	unsigned char buffer[8];
+	struct timeval tv = { 1, 0 };
+	libusb_context * ctx;
+	libusb_device_handle * handle;
+	libusbx_testlib_result result;
+	int completed = 0;
+	int reported = 0;
+	int passes = 0;
+	int r;
+
+	result = open_null_device(tctx, &ctx, &handle);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+	memset(transfers, 0, sizeof(transfers));
+
+	r = libusb_handle_events_budget(ctx, &tv, -1, NULL);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusbx_testlib_logf(tctx, "Negative budget returned %d", r);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	if (result == TEST_STATUS_SUCCESS) {
+		r = submit_counted_transfers(handle, transfers, NUM_TRANSFERS, buffer,
+			&completed);
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Failed to submit transfers: %d", r);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+	while (completed < NUM_TRANSFERS && result == TEST_STATUS_SUCCESS) {
+		r = libusb_handle_events_budget(ctx, &tv, 1, NULL);
+		if (r < 0) {
+			libusbx_testlib_logf(tctx, "Failed to handle events: %d", r);
+			result = TEST_STATUS_FAILURE;
+		}
+		reported += r;
+		++passes;
+	}
+	if (result == TEST_STATUS_SUCCESS && passes < 2) {
+		libusbx_testlib_logf(tctx, "Budget of 1 completed %d transfers in one pass",
+			completed);
+		result = TEST_STATUS_FAILURE;
+	}
+	if (result == TEST_STATUS_SUCCESS && reported != completed) {
+		libusbx_testlib_logf(tctx, "%d completions reported, %d completed",
+			reported, completed);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	free_transfers(transfers, NUM_TRANSFERS);
+	close_null_device(ctx, handle);
+	return result;
+#undef NUM_TRANSFERS
+}
+
+static void LIBUSB_CALL count_cancel_cb(libusb_device_handle * dev_handle,
+	int num_transfers, void * user_data)
+{
+	int * calls = user_data;
+	++*calls;
+}
+
+/** Tests that libusb_cancel_all_transfers() counts the transfers it cancels
+ * and reports back once, after every transfer has completed, and that it
+ * does nothing once none is left. */
+static libusbx_testlib_result test_null_cancel_all(libusbx_testlib_ctx * tctx)
+{
+#define NUM_TRANSFERS 64
+	struct libusb_transfer * transfers[NUM_TRANSFERS];
+	unsigned char buffer[8];
+	libusb_context * ctx;
+	libusb_device_handle * handle;
+	libusbx_testlib_result result;
+	struct timeval zero_tv = { 0, 0 };
+	int completed = 0;
+	int cancel_calls = 0;
+	int r;
+
+	result = open_null_device(tctx, &ctx, &handle);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+	memset(transfers, 0, sizeof(transfers));
+
+	r = submit_counted_transfers(handle, transfers, NUM_TRANSFERS, buffer,
+		&completed);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_cancel_all_transfers(handle, count_cancel_cb,
+			&cancel_calls);
+	if (r != NUM_TRANSFERS) {
+		libusbx_testlib_logf(tctx, "Failed to cancel transfers: %d", r);
+		result = TEST_STATUS_FAILURE;
+	}
+	while ((completed < NUM_TRANSFERS || !cancel_calls)
+			&& result == TEST_STATUS_SUCCESS) {
+		r = libusb_handle_events(ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Failed to handle events: %d", r);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+	if (result == TEST_STATUS_SUCCESS && cancel_calls != 1) {
+		libusbx_testlib_logf(tctx, "Cancel callback called %d times",
+			cancel_calls);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	if (result == TEST_STATUS_SUCCESS) {
+		r = libusb_cancel_all_transfers(handle, count_cancel_cb,
+			&cancel_calls);
+		libusb_handle_events_timeout(ctx, &zero_tv);
+		if (r != 0 || cancel_calls != 1) {
+			libusbx_testlib_logf(tctx, "Idle cancel returned %d, callback called %d times",
+				r, cancel_calls);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+	free_transfers(transfers, NUM_TRANSFERS);
+	close_null_device(ctx, handle);
+	return result;
+#undef NUM_TRANSFERS
+}
+
+/** Tests that transfers complete with only the event thread handling
+ * events, and that a context only gets one event thread. */
+static libusbx_testlib_result test_null_event_thread(libusbx_testlib_ctx * tctx)
+{
+#define NUM_TRANSFERS 1000
+	static struct libusb_transfer * transfers[NUM_TRANSFERS];
+	unsigned char buffer[8];
+	libusb_context * ctx;
+	libusb_device_handle * handle;
+	libusbx_testlib_result result;
+	volatile int completed = 0;
+	int waited;
+	int r;
+
+	result = open_null_device(tctx, &ctx, &handle);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+	memset(transfers, 0, sizeof(transfers));
+
+	r = libusb_start_event_thread(ctx, NULL);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to start event thread: %d", r);
+		close_null_device(ctx, handle);
+		return TEST_STATUS_FAILURE;
+	}
+	r = libusb_start_event_thread(ctx, NULL);
+	if (r != LIBUSB_ERROR_BUSY) {
+		libusbx_testlib_logf(tctx, "Second event thread returned %d", r);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	if (result == TEST_STATUS_SUCCESS)
+		r = submit_counted_transfers(handle, transfers, NUM_TRANSFERS, buffer,
+			(int *)&completed);
+	if (result == TEST_STATUS_SUCCESS && r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to submit transfers: %d", r);
+		result = TEST_STATUS_FAILURE;
+	}
+	for (waited = 0; result == TEST_STATUS_SUCCESS
+			&& completed < NUM_TRANSFERS && waited < 10000; waited += 10)
+		msleep(10);
+	if (result == TEST_STATUS_SUCCESS && completed < NUM_TRANSFERS) {
+		libusbx_testlib_logf(tctx, "Only %d transfers completed", completed);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	/* stopping the thread waits for the transfers still in flight */
+	libusb_stop_event_thread(ctx);
+	free_transfers(transfers, NUM_TRANSFERS);
+	close_null_device(ctx, handle);
+	return result;
+#undef NUM_TRANSFERS
+}
+
+/** Tests that a control queue runs its requests in order, by reading back
+ * each vendor request's data right after writing it, and that requests
+ * longer than the queue allows are rejected. */
+static libusbx_testlib_result test_null_control_queue(libusbx_testlib_ctx * tctx)
+{
+#define NUM_REQUESTS 256
+	struct libusb_control_request requests[NUM_REQUESTS];
+	unsigned char data[NUM_REQUESTS][4];
+	libusb_control_queue * queue;
+	libusb_context * ctx;
+	libusb_device_handle * handle;
+	libusbx_testlib_result result;
+	int i, r;
+
+	result = open_null_device(tctx, &ctx, &handle);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	r = libusb_control_queue_open(handle, 0, 4, &queue);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusbx_testlib_logf(tctx, "Queue of depth 0 returned %d", r);
+		close_null_device(ctx, handle);
+		return TEST_STATUS_FAILURE;
+	}
+	r = libusb_control_queue_open(handle, 8, 4, &queue);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to open control queue: %d", r);
+		close_null_device(ctx, handle);
+		return TEST_STATUS_FAILURE;
+	}
+
+	for (i = 0; i < NUM_REQUESTS; ++i) {
+		requests[i].bmRequestType = LIBUSB_REQUEST_TYPE_VENDOR
+			| LIBUSB_RECIPIENT_DEVICE
+			| (i % 2 ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT);
+		requests[i].bRequest = 0;
+		requests[i].wValue = 0;
+		requests[i].wIndex = 0;
+		requests[i].wLength = sizeof(data[i]);
+		requests[i].data = data[i];
+		memset(data[i], i % 2 ? 0 : i / 2, sizeof(data[i]));
+	}
+
+	requests[0].wLength = sizeof(data[0]) + 1;
+	r = libusb_control_queue_run(queue, requests, NUM_REQUESTS, 0, 1000);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusbx_testlib_logf(tctx, "Oversized request returned %d", r);
+		result = TEST_STATUS_FAILURE;
+	}
+	requests[0].wLength = sizeof(data[0]);
+
+	if (result == TEST_STATUS_SUCCESS)
+		r = libusb_control_queue_run(queue, requests, NUM_REQUESTS, 0, 1000);
+	if (result == TEST_STATUS_SUCCESS && r != NUM_REQUESTS) {
+		libusbx_testlib_logf(tctx, "Request %d failed: %d", r,
+			r >= 0 && r < NUM_REQUESTS ? requests[r].status : r);
+		result = TEST_STATUS_FAILURE;
+	}
+	for (i = 1; i < NUM_REQUESTS && result == TEST_STATUS_SUCCESS; i += 2) {
+		if (requests[i].actual_length != (int)sizeof(data[i])
+				|| memcmp(data[i], data[i - 1], sizeof(data[i])) != 0) {
+			libusbx_testlib_logf(tctx, "Request %d read back the wrong data",
+				i);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+	libusb_control_queue_close(queue);
+	close_null_device(ctx, handle);
+	return result;
+#undef NUM_REQUESTS
+}
+
+static void LIBUSB_CALL count_write_cb(libusb_writer * writer, int status,
+	void * user_data)
+{
+	int * counts = user_data;
+	++counts[status == 0 ? 0 : 1];
+}
+
+/** Tests that a coalescing writer reports every message written, that the
+ * loopback endpoint receives their data in order, and that the endpoints,
+ * flags and messages it can't handle are rejected. */
+static libusbx_testlib_result test_null_writer(libusbx_testlib_ctx * tctx)
+{
+#define NUM_MESSAGES 2000
+#define MAX_MESSAGE 64
+	static unsigned char sent[NUM_MESSAGES * MAX_MESSAGE];
+	static unsigned char received[NUM_MESSAGES * MAX_MESSAGE];
+	libusb_writer * writer;
+	libusb_context * ctx;
+	libusb_device_handle * handle;
+	libusbx_testlib_result result;
+	int counts[2] = { 0, 0 };
+	int total = 0;
+	int length = 0;
+	int transferred;
+	int i, r;
+
+	result = open_null_device(tctx, &ctx, &handle);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	/* only bulk OUT endpoints, and no zero packets on this backend */
+	r = libusb_writer_open(handle, NULL_EP_INT_OUT, 4, 4096, 0, 0, &writer);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusbx_testlib_logf(tctx, "Writer opened on interrupt endpoint: %d", r);
+		close_null_device(ctx, handle);
+		return TEST_STATUS_FAILURE;
+	}
+	r = libusb_writer_open(handle, NULL_EP_OUT, 4, 4096, 0,
+		LIBUSB_WRITER_ZERO_PACKET, &writer);
+	if (r != LIBUSB_ERROR_NOT_SUPPORTED) {
+		libusbx_testlib_logf(tctx, "Writer opened with zero packets: %d", r);
+		close_null_device(ctx, handle);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_writer_open(handle, NULL_EP_OUT, 4, 4096, 0, 0, &writer);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to open writer: %d", r);
+		close_null_device(ctx, handle);
+		return TEST_STATUS_FAILURE;
+	}
+	r = libusb_writer_write(writer, sent, 0, count_write_cb, counts);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusbx_testlib_logf(tctx, "Empty message returned %d", r);
+		result = TEST_STATUS_FAILURE;
+	}
+	r = libusb_writer_write(writer, sent, 4097, count_write_cb, counts);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusbx_testlib_logf(tctx, "Oversized message returned %d", r);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	for (i = 0; i < NUM_MESSAGES && result == TEST_STATUS_SUCCESS; ) {
+		int size = 1 + i % MAX_MESSAGE;
+		memset(sent + total, i & 0xff, size);
+		r = libusb_writer_write(writer, sent + total, size, count_write_cb,
+			counts);
+		if (r == LIBUSB_ERROR_BUSY) {
+			libusb_handle_events(ctx);
+			continue;
+		} else if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Failed to write message %d: %d", i, r);
+			result = TEST_STATUS_FAILURE;
+		}
+		total += size;
+		++i;
+	}
+	if (result == TEST_STATUS_SUCCESS)
+		r = libusb_writer_flush(writer);
+	while (result == TEST_STATUS_SUCCESS && counts[0] + counts[1] < i)
+		libusb_handle_events(ctx);
+	libusb_writer_close(writer);
+	if (result == TEST_STATUS_SUCCESS && counts[0] != NUM_MESSAGES) {
+		libusbx_testlib_logf(tctx, "%d messages sent, %d failed", counts[0],
+			counts[1]);
+		result = TEST_STATUS_FAILURE;
+	}
+
+	while (result == TEST_STATUS_SUCCESS && length < total) {
+		r = libusb_bulk_transfer(handle, NULL_EP_IN, received + length,
+			total - length, &transferred, 1000);
+		if (r != LIBUSB_SUCCESS || !transferred) {
+			libusbx_testlib_logf(tctx, "Failed to read back data: %d", r);
+			result = TEST_STATUS_FAILURE;
+		}
+		length += transferred;
+	}
+	if (result == TEST_STATUS_SUCCESS && memcmp(sent, received, total) != 0) {
+		libusbx_testlib_logf(tctx, "Data read back does not match");
+		result = TEST_STATUS_FAILURE;
+	}
+
+	close_null_device(ctx, handle);
+	return result;
+#undef MAX_MESSAGE
+#undef NUM_MESSAGES
+}
+
+static void LIBUSB_CALL slow_transfer_cb(struct libusb_transfer * transfer)
+{
+	volatile int * completed = transfer->user_data;
+	msleep(2);
+	++*completed;
+}
+
+static void LIBUSB_CALL closing_transfer_cb(struct libusb_transfer * transfer)
+{
+	volatile int * closed = transfer->user_data;
+	libusb_close(transfer->dev_handle);
+	*closed = 1;
+}
+
+/** Tests that closing a handle delivers the completions still queued on
+ * the completion workers first, and that a callback running on a worker
+ * can close its own handle. */
+static libusbx_testlib_result test_null_close_with_workers(
+	libusbx_testlib_ctx * tctx)
+{
+#define NUM_TRANSFERS 64
+	struct libusb_transfer * transfers[NUM_TRANSFERS];
+	struct libusb_transfer * transfer;
+	unsigned char buffer[8];
+	struct timeval tv = { 0, 10000 };
+	libusb_context * ctx;
+	libusb_device_handle * handle;
+	libusbx_testlib_result result;
+	volatile int completed = 0;
+	volatile int closed;
+	int i, r;
+
+	result = open_null_device(tctx, &ctx, &handle);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+	libusb_set_latency_tracking(ctx, 1);
+	r = libusb_set_completion_workers(ctx, 2);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to start workers: %d", r);
+		close_null_device(ctx, handle);
+		return TEST_STATUS_FAILURE;
+	}
+
+	for (i = 0; i < NUM_TRANSFERS && result == TEST_STATUS_SUCCESS; ++i) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], handle, NULL_EP_IN,
+			buffer, 8, slow_transfer_cb, (void *)&completed, 0);
+		r = libusb_submit_transfer(transfers[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Failed to submit transfer %d: %d",
+				i, r);
+			libusb_free_transfer(transfers[i]);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+	/* reap everything, the workers take much longer to deliver it */
+	for (r = 0; r < 3; ++r)
+		libusb_handle_events_timeout(ctx, &tv);
+	libusb_close(handle);
+	if (result == TEST_STATUS_SUCCESS && completed != NUM_TRANSFERS) {
+		libusbx_testlib_logf(tctx, "Only %d transfers delivered at close",
+			completed);
+		result = TEST_STATUS_FAILURE;
+	}
+	free_transfers(transfers, i);
+
+	for (i = 0; i < 100 && result == TEST_STATUS_SUCCESS; ++i) {
+		handle = libusb_open_device_with_vid_pid(ctx, NULL_VID, NULL_PID);
+		transfer = libusb_alloc_transfer(0);
+		if (!handle || !transfer) {
+			libusbx_testlib_logf(tctx, "Failed to reopen the device");
+			libusb_free_transfer(transfer);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+		closed = 0;
+		libusb_fill_bulk_transfer(transfer, handle, NULL_EP_IN, buffer, 8,
+			closing_transfer_cb, (void *)&closed, 0);
+		transfer->flags = LIBUSB_TRANSFER_FREE_TRANSFER;
+		r = libusb_submit_transfer(transfer);
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Failed to submit transfer: %d", r);
+			libusb_free_transfer(transfer);
+			libusb_close(handle);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+		while (!closed)
+			libusb_handle_events_timeout(ctx, &tv);
+	}
+
+	libusb_exit(ctx);
+	return result;
+#undef NUM_TRANSFERS
+}
+
 /* Fill in the list of tests. */
 static const libusbx_testlib_test tests[] = {
 	{"init_and_exit", &test_init_and_exit},
 	{"get_device_list", &test_get_device_list},
 	{"many_device_lists", &test_many_device_lists},
 	{"default_context_change", &test_default_context_change},
+	{"transfer_pool", &test_transfer_pool},
+	{"null_deep_queue", &test_null_deep_queue},
+	{"null_event_budget", &test_null_event_budget},
+	{"null_cancel_all", &test_null_cancel_all},
+	{"null_event_thread", &test_null_event_thread},
+	{"null_control_queue", &test_null_control_queue},
+	{"null_writer", &test_null_writer},
+	{"null_close_with_workers", &test_null_close_with_workers},
 	LIBUSBX_NULL_TEST
 };
 